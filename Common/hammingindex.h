@@ -0,0 +1,163 @@
+#ifndef HAMMINGINDEX_H
+#define HAMMINGINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+/*
+	Hamming-radius search over 64-bit hashes (multi-index hashing)
+
+	Two keys within r bits of each other differ in at most r / 4 bits in at least one of their four 16-bit chunks. The
+	index keeps one table per chunk from each 16-bit value to the keys that have it there, so a query only visits the
+	values within r / 4 bits of its own chunks and checks the full distance of the keys it finds there: a few hundred
+	buckets for small r instead of every key. When there would be more buckets to visit than keys, the query scans the
+	keys instead.
+
+	The tables are rebuilt from the keys in two passes per chunk, which is fast enough that only the keys need to be
+	stored. ConsoleTesting uses it for near-duplicate tiles; the DLL for Omzy hashes that miss the exact lookup.
+*/
+
+namespace TextureHash
+{
+
+// bits set in x; SWAR, because the POPCNT instruction is not on every CPU the game runs on
+inline int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline int hamming_distance(uint64_t a, uint64_t b)
+{
+	return popcount64(a ^ b);
+}
+
+class HammingIndex
+{
+public:
+	static const int CHUNKS = 4;
+	static const int CHUNK_BITS = 16;
+	static const uint32_t CHUNK_VALUES = 1u << CHUNK_BITS;
+
+private:
+	std::vector<uint64_t>	keys;
+	std::vector<uint32_t>	starts[CHUNKS];		// keys with value v in chunk c are ids[c][starts[c][v]] .. ids[c][starts[c][v + 1] - 1]
+	std::vector<uint32_t>	ids[CHUNKS];		// ascending within a value
+
+	static uint32_t chunk(uint64_t key, int c)
+	{
+		return (uint32_t)(key >> (c * CHUNK_BITS)) & (CHUNK_VALUES - 1);
+	}
+
+	// every 16-bit mask, fewest bits first
+	static const std::vector<uint16_t>& masks()
+	{
+		static const std::vector<uint16_t> sorted = [] {
+			std::vector<uint16_t> all(CHUNK_VALUES);
+			for (uint32_t v = 0; v < CHUNK_VALUES; v++) all[v] = (uint16_t)v;
+			std::stable_sort(all.begin(), all.end(), [](uint16_t a, uint16_t b) { return popcount64(a) < popcount64(b); });
+			return all;
+		}();
+		return sorted;
+	}
+
+	// masks of at most bits bits: the sum of C(CHUNK_BITS, k) for k <= bits
+	static size_t masks_within(int bits)
+	{
+		size_t total = 0, binomial = 1;
+		for (int k = 0; k <= bits && k <= CHUNK_BITS; k++) {
+			total += binomial;
+			binomial = binomial * (CHUNK_BITS - k) / (k + 1);
+		}
+		return total;
+	}
+
+public:
+	/* build: indexes keys; key i gets id i
+	*/
+	void build(const uint64_t* first, size_t count)
+	{
+		keys.assign(first, first + count);
+		for (int c = 0; c < CHUNKS; c++) {
+			starts[c].assign(CHUNK_VALUES + 1, 0);
+			for (size_t id = 0; id < count; id++) starts[c][chunk(keys[id], c) + 1]++;
+			for (uint32_t v = 0; v < CHUNK_VALUES; v++) starts[c][v + 1] += starts[c][v];
+			ids[c].resize(count);
+			std::vector<uint32_t> fill(starts[c].begin(), starts[c].end() - 1);
+			for (size_t id = 0; id < count; id++) ids[c][fill[chunk(keys[id], c)]++] = (uint32_t)id;
+		}
+	}
+
+	void clear()
+	{
+		keys.clear();
+		for (int c = 0; c < CHUNKS; c++) {
+			starts[c].clear();
+			ids[c].clear();
+		}
+	}
+
+	size_t size() const { return keys.size(); }
+	uint64_t key(uint32_t id) const { return keys[id]; }
+
+	/* query: the ids of the keys within radius bits of key
+	   returns: the number of ids, which out receives in ascending order
+	*/
+	size_t query(uint64_t key, int radius, std::vector<uint32_t>& out) const
+	{
+		out.clear();
+		if (keys.empty() || radius < 0) return 0;
+		if (radius > 64) radius = 64;
+
+		size_t probes = masks_within(radius / CHUNKS);
+		if (probes * CHUNKS >= keys.size()) {
+			for (size_t id = 0; id < keys.size(); id++)
+				if (hamming_distance(keys[id], key) <= radius) out.push_back((uint32_t)id);
+			return out.size();
+		}
+
+		const std::vector<uint16_t>& flips = masks();
+		for (int c = 0; c < CHUNKS; c++) {
+			uint32_t value = chunk(key, c);
+			for (size_t m = 0; m < probes; m++) {
+				uint32_t probe = value ^ flips[m];
+				for (uint32_t i = starts[c][probe]; i < starts[c][probe + 1]; i++)
+					if (hamming_distance(keys[ids[c][i]], key) <= radius) out.push_back(ids[c][i]);
+			}
+		}
+		std::sort(out.begin(), out.end());											// a key close in several chunks is found once per chunk
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+		return out.size();
+	}
+
+	/* nearest: the key closest to key within radius bits, ties to the lowest id
+	   returns: true if there is one, else false
+	*/
+	bool nearest(uint64_t key, int radius, uint32_t& id, int& distance) const
+	{
+		std::vector<uint32_t> found;
+		if (query(key, radius, found) == 0) return false;
+		id = found[0];
+		distance = hamming_distance(keys[id], key);
+		for (size_t i = 1; i < found.size() && distance > 0; i++) {
+			int d = hamming_distance(keys[found[i]], key);
+			if (d < distance) {
+				id = found[i];
+				distance = d;
+			}
+		}
+		return true;
+	}
+};
+
+}
+
+#endif // HAMMINGINDEX_H
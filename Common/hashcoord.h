@@ -46,6 +46,7 @@ public:
 		case 0: ss << ", r"; break;
 		case 1: ss << ", g"; break;
 		case 2: ss << ", b"; break;
+		default: break;
 		}
 		ss << ")";
 		return ss.str();
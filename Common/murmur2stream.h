@@ -0,0 +1,188 @@
+#ifndef MURMUR2STREAM_H
+#define MURMUR2STREAM_H
+
+#include "hashcoord.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	Streaming Murmur2 texture hasher
+
+	Computes the combined, upper, and lower hashes of a texture in one gather pass, without allocating and without I/O.
+	Each is MurmurHash64B over 2 * len * 3 bytes: the rgb of every coordinate in the upper half, then the rgb of every
+	coordinate in the lower half (the same coordinates offset by half rows). The upper hash zeroes the lower bytes and the
+	lower hash zeroes the upper bytes. Coordinates outside the texture read as black. These are the hashes
+	Murmur2_Hash_Combined_Naive computes from three full buffers.
+
+	Pixels are read in memory order, so a D3DFMT_A8R8G8B8 texture (b, g, r, a) and a cv::Mat loaded by imread (b, g, r)
+	hash alike.
+*/
+
+namespace TextureHash
+{
+
+namespace Murmur2
+{
+	const uint64_t MURMUR2_SEED = 0x6d6176697269636b;
+	const uint32_t m = 0x5bd1e995;
+	const int r = 24;
+
+	/* Murmur2State: the two lanes of MurmurHash64B; full words alternate between h1 and h2, the last partial word goes to h2
+	*/
+	struct Murmur2State
+	{
+		uint32_t h1;
+		uint32_t h2;
+
+		Murmur2State(uint32_t len, uint64_t seed = MURMUR2_SEED) : h1(uint32_t(seed) ^ len), h2(uint32_t(seed >> 32)) {}
+
+		inline void mix(uint32_t k, bool second)
+		{
+			k *= m; k ^= k >> r; k *= m;
+			if (second) {
+				h2 *= m; h2 ^= k;
+			} else {
+				h1 *= m; h1 ^= k;
+			}
+		}
+
+		inline void tail(uint32_t k)		// the 1-3 bytes left over, little-endian
+		{
+			h2 ^= k;
+			h2 *= m;
+		}
+
+		inline uint64_t finish()
+		{
+			h1 ^= h2 >> 18; h1 *= m;
+			h2 ^= h1 >> 22; h2 *= m;
+			h1 ^= h2 >> 17; h1 *= m;
+			h2 ^= h1 >> 19; h2 *= m;
+			return (uint64_t(h1) << 32) | h2;
+		}
+	};
+
+	/* Murmur2Combined: the combined, upper, and lower states over one stream of two halves of half_bytes each
+	*/
+	struct Murmur2Combined
+	{
+		Murmur2State combined, upper, lower;
+		size_t half_bytes;					// bytes of the upper half
+		size_t pos;							// bytes mixed so far
+
+		Murmur2Combined(size_t half_bytes) : combined(uint32_t(half_bytes * 2)), upper(uint32_t(half_bytes * 2)), lower(uint32_t(half_bytes * 2)), half_bytes(half_bytes), pos(0) {}
+
+		/* mix: mixes the whole words of the next bytes of the stream; a word may straddle the halves
+		   returns: the number of bytes mixed (count rounded down to a multiple of 4)
+		*/
+		inline size_t mix(const unsigned char* bytes, size_t count)
+		{
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4, pos += 4) {
+				uint32_t k;
+				memcpy(&k, bytes + i, 4);
+				bool second = (pos & 4) != 0;					// odd words go to h2
+				combined.mix(k, second);
+				if (pos + 4 <= half_bytes) {
+					upper.mix(k, second);
+					lower.mix(0, second);
+				} else if (pos >= half_bytes) {
+					upper.mix(0, second);
+					lower.mix(k, second);
+				} else {
+					uint32_t upper_mask = 0xFFFFFFFF >> (8 * (4 - (half_bytes - pos)));
+					upper.mix(k & upper_mask, second);
+					lower.mix(k & ~upper_mask, second);
+				}
+			}
+			return i;
+		}
+
+		/* finish: mixes the last 0-3 bytes of the stream
+		   returns: the combined hash
+		*/
+		inline uint64_t finish(const unsigned char* tail, size_t count, uint64_t& hash_upper, uint64_t& hash_lower)
+		{
+			if (count > 0) {									// the last partial word is always in the lower half
+				uint32_t k = 0;
+				memcpy(&k, tail, count);
+				combined.tail(k);
+				upper.tail(0);
+				lower.tail(k);
+			}
+
+			hash_upper = upper.finish();
+			hash_lower = lower.finish();
+			return combined.finish();
+		}
+	};
+
+	const size_t MURMUR2_CHUNK = 64;		// coordinates gathered onto the stack at a time
+
+	/* Murmur2_Hash_Texture: combined, upper, and lower hashes of a texture in memory
+	   returns: the combined hash
+	*/
+	inline uint64_t Murmur2_Hash_Texture(const unsigned char* data,		// first row of the texture
+										 size_t pitch,					// bytes per row
+										 size_t pixel_size,				// bytes per pixel (4 for A8R8G8B8, 3 for CV_8UC3)
+										 int width, int height,			// size of the texture
+										 int half,						// rows in the upper half (VRAM_DIM / 2)
+										 const HashCoord* coords,		// coordinates to sample in each half
+										 size_t len,					// number of coordinates
+										 uint64_t& hash_upper,			// receives the hash with the lower half zeroed
+										 uint64_t& hash_lower			// receives the hash with the upper half zeroed
+		)
+	{
+		Murmur2Combined hash(len * 3);
+		unsigned char buf[MURMUR2_CHUNK * 3 + 4];
+		size_t filled = 0;									// bytes in buf, including up to 3 carried over
+
+		for (int part = 0; part < 2; part++) {
+			int y_offset = part * half;
+			for (size_t first = 0; first < len; first += MURMUR2_CHUNK) {
+				size_t last = (len - first < MURMUR2_CHUNK) ? len : first + MURMUR2_CHUNK;
+
+				// gather
+				for (const HashCoord* coord = coords + first; coord != coords + last; coord++) {
+					int y = coord->y + y_offset;
+					if (coord->x < width && y < height) {
+						const unsigned char* pixel = data + y * pitch + coord->x * pixel_size;
+						buf[filled++] = pixel[0];
+						buf[filled++] = pixel[1];
+						buf[filled++] = pixel[2];
+					} else {
+						buf[filled++] = 0;
+						buf[filled++] = 0;
+						buf[filled++] = 0;
+					}
+				}
+
+				// carry the partial word into the next chunk
+				size_t mixed = hash.mix(buf, filled);
+				memmove(buf, buf + mixed, filled - mixed);
+				filled -= mixed;
+			}
+		}
+
+		return hash.finish(buf, filled, hash_upper, hash_lower);
+	}
+
+	/* Murmur2_Hash_Gathered: the hashes of Murmur2_Hash_Texture, from the samples of a SamplingPlan with lower_offset = half
+	   returns: the combined hash
+	*/
+	inline uint64_t Murmur2_Hash_Gathered(const unsigned char* rgb,		// 2 * len * 3 bytes from SamplingPlan::gather
+										  size_t len,					// number of coordinates
+										  uint64_t& hash_upper,
+										  uint64_t& hash_lower
+		)
+	{
+		Murmur2Combined hash(len * 3);
+		size_t mixed = hash.mix(rgb, len * 6);
+		return hash.finish(rgb + mixed, len * 6 - mixed, hash_upper, hash_lower);
+	}
+}
+
+}
+
+#endif // MURMUR2STREAM_H
@@ -0,0 +1,63 @@
+#ifndef OMZYHASH_H
+#define OMZYHASH_H
+
+#include "hashcoord.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	Omzy's perceptual texture hash
+
+	Hash_Algorithm_1 samples the luma ((b + g + r) / 3) at the 64 hash1 coordinates and sets one bit per sample that
+	is at least as bright as the one before it, plus a wrap-around comparison of the last sample with the first. Textures
+	that differ by a palette tweak or dithering keep most of their bits, so the hash is compared by Hamming distance
+	(see hammingindex.h) rather than for equality.
+
+	Omzy_Hash_Texture computes it from a texture in memory, without opencv; texturehash.h has the cv::Mat versions.
+*/
+
+namespace TextureHash
+{
+
+namespace Omzy
+{
+	const int BLOCKSIZE = 16;
+	//int hash1_x[64] = { 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16 };
+	//int hash1_y[64] = { 0, 0, 0, 0, 0, 0, 0, 0, 16, 16, 16, 16, 16, 16, 16, 16, 32, 32, 32, 32, 32, 32, 32, 32, 48, 48, 48, 48, 48, 48, 48, 48, 64, 64, 80, 80, 80, 80, 96, 96, 112, 112, 128, 128, 128, 128, 144, 144, 160, 160, 176, 176, 176, 176, 192, 192, 208, 208, 224, 224, 224, 224, 240, 240 };
+	const HashCoord hash1[64] = { HashCoord(0, 0), HashCoord(16, 0), HashCoord(32, 0), HashCoord(48, 0), HashCoord(64, 0), HashCoord(80, 0), HashCoord(96, 0), HashCoord(112, 0), HashCoord(0, 16), HashCoord(16, 16), HashCoord(32, 16), HashCoord(48, 16), HashCoord(64, 16), HashCoord(80, 16), HashCoord(96, 16), HashCoord(112, 16), HashCoord(0, 32), HashCoord(16, 32), HashCoord(32, 32), HashCoord(48, 32), HashCoord(64, 32), HashCoord(80, 32), HashCoord(96, 32), HashCoord(112, 32), HashCoord(0, 48), HashCoord(16, 48), HashCoord(32, 48), HashCoord(48, 48), HashCoord(64, 48), HashCoord(80, 48), HashCoord(96, 48), HashCoord(112, 48), HashCoord(0, 64), HashCoord(16, 64), HashCoord(0, 80), HashCoord(16, 80), HashCoord(48, 80), HashCoord(96, 80), HashCoord(0, 96), HashCoord(16, 96), HashCoord(0, 112), HashCoord(16, 112), HashCoord(0, 128), HashCoord(16, 128), HashCoord(48, 128), HashCoord(96, 128), HashCoord(0, 144), HashCoord(16, 144), HashCoord(0, 160), HashCoord(16, 160), HashCoord(0, 176), HashCoord(16, 176), HashCoord(48, 176), HashCoord(96, 176), HashCoord(0, 192), HashCoord(16, 192), HashCoord(0, 208), HashCoord(16, 208), HashCoord(0, 224), HashCoord(16, 224), HashCoord(48, 224), HashCoord(96, 224), HashCoord(0, 240), HashCoord(16, 240) };
+
+	/* Omzy_Hash_Texture: Hash_Algorithm_1 of a texture in memory; samples outside it are black
+	*/
+	inline uint64_t Omzy_Hash_Texture(const uint8_t* bits,		// first row
+									  size_t pitch,				// bytes per row
+									  size_t pixel_bytes,		// 4 for A8R8G8B8 (b, g, r, a in memory), 3 for an imread cv::Mat
+									  uint32_t width,
+									  uint32_t height
+		)
+	{
+		uint64_t hash = 0;
+		int first_val = 0, val = 0, last_val = 0;
+		for (int i = 0; i < 64; i++) {
+			const HashCoord& coord = hash1[i];
+			val = 0;
+			if ((uint32_t)coord.x < width && (uint32_t)coord.y < height) {
+				const uint8_t* pixel = bits + coord.y * pitch + coord.x * pixel_bytes;
+				val = (pixel[0] + pixel[1] + pixel[2]) / 3;
+			}
+			if (i == 0) first_val = last_val = val;
+
+			// compare to last value for hash
+			hash <<= 1;
+			if (val >= last_val) hash |= 1;
+			last_val = val;
+		}
+
+		// do wrap-around comparison
+		if (first_val >= val) hash |= 0x8000000000000000ULL;
+		return hash;
+	}
+}
+
+}
+
+#endif // OMZYHASH_H
@@ -0,0 +1,240 @@
+#ifndef POLICYHASH_H
+#define POLICYHASH_H
+
+#include "murmur2stream.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <vector>
+
+/*
+	Policy-based texture hashers
+
+	TextureHasher<Mixer, Channels, N> hashes the samples of a SamplingPlan (see samplingplan.h):
+		Mixer		how bytes are mixed and how the upper/lower hashes are derived: FNVMixer<uint32_t or uint64_t>, Murmur2Mixer
+		Channels	which bytes each half contributes: RGBChannels (b, g, r of every sample), LumaChannels (one average per
+					sample), or LumaAverageChannels (one average per sample, then the rounded channel averages of the half)
+		N			the number of coordinates, so the loops have constant bounds and the factors are constants; 0 takes the
+					count at run time
+
+	The instantiations used by texturehash.cpp and ConsoleTesting are compiled once in texturehash.cpp.
+*/
+
+namespace TextureHash
+{
+
+namespace Policy
+{
+	// base^exp modulo the width of T
+	template <typename T>
+	constexpr T ipow(T base, size_t exp)
+	{
+		T result = 1;
+		for (size_t i = 0; i < exp; i++)
+			result *= base;
+		return result;
+	}
+
+	/**********************************
+	*
+	*	Channels
+	*
+	**********************************/
+
+	struct RGBChannels
+	{
+		static constexpr size_t half_bytes(size_t len) { return len * 3; }
+
+		// returns: the bytes of one half; samples are used as they are, so the lower half follows the upper as it does in scratch
+		static inline const unsigned char* bytes(const unsigned char* rgb, size_t, unsigned char*) { return rgb; }
+	};
+
+	struct LumaChannels
+	{
+		static constexpr size_t half_bytes(size_t len) { return len; }
+
+		static inline const unsigned char* bytes(const unsigned char* rgb, size_t len, unsigned char* scratch)
+		{
+			for (size_t i = 0; i < len; i++, rgb += 3)
+				scratch[i] = (unsigned char)((rgb[0] + rgb[1] + rgb[2]) / 3);
+			return scratch;
+		}
+	};
+
+	struct LumaAverageChannels
+	{
+		static constexpr size_t half_bytes(size_t len) { return len + 3; }
+
+		static inline const unsigned char* bytes(const unsigned char* rgb, size_t len, unsigned char* scratch)
+		{
+			uint32_t red = 0, green = 0, blue = 0;			// integer sums vectorize; below 65793 samples they equal the float sums FNV_Hash_Combined used
+			for (size_t i = 0; i < len; i++, rgb += 3) {
+				scratch[i] = (unsigned char)((rgb[0] + rgb[1] + rgb[2]) / 3);
+				red += rgb[0];
+				green += rgb[1];
+				blue += rgb[2];
+			}
+			scratch[len] = (unsigned char)round((float)red / len);
+			scratch[len + 1] = (unsigned char)round((float)green / len);
+			scratch[len + 2] = (unsigned char)round((float)blue / len);
+			return scratch;
+		}
+	};
+
+	/**********************************
+	*
+	*	Mixers
+	*
+	**********************************/
+
+	template <typename T> struct FNVConstants;
+	template <> struct FNVConstants<uint32_t>
+	{
+		static constexpr uint32_t basis = 2166136261u;
+		static constexpr uint32_t prime = 16777619u;
+	};
+	template <> struct FNVConstants<uint64_t>
+	{
+		static constexpr uint64_t basis = 14695981039346656037ull;
+		static constexpr uint64_t prime = 1099511628211ull;
+	};
+
+	/* FNVMixer: FNV-1a over the bytes of each half. hash_upper continues over zeros for the lower half and hash_lower
+				 starts from zeros for the upper half; both are a multiplication by prime^half_bytes (nolower). A texture
+				 without a lower half has hash_lower = 0 and hash_upper = combined = the upper half alone.
+	*/
+	template <typename T>
+	struct FNVMixer
+	{
+		typedef T hash_t;
+		static constexpr T basis = FNVConstants<T>::basis;
+		static constexpr T prime = FNVConstants<T>::prime;
+
+		static constexpr T nolower(size_t half_bytes) { return ipow<T>(prime, half_bytes); }
+
+		static inline T single(const unsigned char* bytes, size_t count)
+		{
+			T hash = basis;
+			for (size_t i = 0; i < count; i++) {
+				hash ^= bytes[i];
+				hash *= prime;
+			}
+			return hash;
+		}
+
+		static inline T combined(const unsigned char* bytes, size_t count, T nolower_factor, bool has_lower, T& hash_upper, T& hash_lower)
+		{
+			T hash = single(bytes, count);
+			hash_upper = hash;
+			if (!has_lower) {
+				hash_lower = 0;
+				return hash;
+			}
+
+			hash_upper *= nolower_factor;
+			hash_lower = basis * nolower_factor;
+			for (size_t i = count; i < count * 2; i++) {
+				hash ^= bytes[i];
+				hash *= prime;
+				hash_lower ^= bytes[i];
+				hash_lower *= prime;
+			}
+			return hash;
+		}
+	};
+
+	/* Murmur2Mixer: MurmurHash64B over both halves, the missing half zeroed (see murmur2stream.h); a texture without a
+					 lower half hashes a black one
+	*/
+	struct Murmur2Mixer
+	{
+		typedef uint64_t hash_t;
+
+		static constexpr uint64_t nolower(size_t) { return 0; }						// unused
+
+		static inline uint64_t single(const unsigned char* bytes, size_t count)
+		{
+			Murmur2::Murmur2State state((uint32_t)count);
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4) {
+				uint32_t k;
+				memcpy(&k, bytes + i, 4);
+				state.mix(k, (i & 4) != 0);
+			}
+			if (i < count) {
+				uint32_t k = 0;
+				memcpy(&k, bytes + i, count - i);
+				state.tail(k);
+			}
+			return state.finish();
+		}
+
+		static inline uint64_t combined(const unsigned char* bytes, size_t count, uint64_t, bool, uint64_t& hash_upper, uint64_t& hash_lower)
+		{
+			Murmur2::Murmur2Combined hash(count);
+			size_t mixed = hash.mix(bytes, count * 2);
+			return hash.finish(bytes + mixed, count * 2 - mixed, hash_upper, hash_lower);
+		}
+	};
+
+	/**********************************
+	*
+	*	Hasher
+	*
+	**********************************/
+
+	template <typename Mixer, typename Channels, size_t N>
+	struct TextureHasher
+	{
+		typedef typename Mixer::hash_t hash_t;
+
+		static constexpr size_t HALF_BYTES = Channels::half_bytes(N);
+		static constexpr hash_t NOLOWER = Mixer::nolower(HALF_BYTES);					// only meaningful when N > 0
+
+		/* hash: the hash of the upper half alone (as FNV_Hash and Murmur2_Hash)
+		*/
+		static hash_t hash(const unsigned char* rgb,	// samples from SamplingPlan::gather
+						   size_t len = N				// number of coordinates; ignored unless N is 0
+			)
+		{
+			size_t count = N ? N : len;
+			unsigned char scratch[N ? HALF_BYTES : 1];
+			std::vector<unsigned char> dynamic;
+			unsigned char* buf = N ? scratch : scratch_for(dynamic, count);
+			return Mixer::single(Channels::bytes(rgb, count, buf), Channels::half_bytes(count));
+		}
+
+		/* hash_combined: the combined, upper, and lower hashes
+		   returns: the combined hash
+		*/
+		static hash_t hash_combined(const unsigned char* rgb,		// samples from SamplingPlan::gather
+									bool has_lower,					// whether the texture has a lower half
+									hash_t& hash_upper,
+									hash_t& hash_lower,
+									size_t len = N					// number of coordinates; ignored unless N is 0
+			)
+		{
+			size_t count = N ? N : len;
+			size_t half_bytes = Channels::half_bytes(count);
+			hash_t nolower = N ? NOLOWER : Mixer::nolower(half_bytes);
+
+			unsigned char scratch[N ? 2 * HALF_BYTES : 1];
+			std::vector<unsigned char> dynamic;
+			unsigned char* buf = N ? scratch : scratch_for(dynamic, count);
+			const unsigned char* bytes = Channels::bytes(rgb, count, buf);
+			Channels::bytes(rgb + count * 3, count, buf + half_bytes);						// lower half right after the upper
+			return Mixer::combined(bytes, half_bytes, nolower, has_lower, hash_upper, hash_lower);
+		}
+
+	private:
+		static unsigned char* scratch_for(std::vector<unsigned char>& dynamic, size_t count)
+		{
+			dynamic.resize(Channels::half_bytes(count) * 2);
+			return &dynamic[0];
+		}
+	};
+}
+
+}
+
+#endif // POLICYHASH_H
@@ -0,0 +1,148 @@
+#ifndef SAMPLINGPLAN_H
+#define SAMPLINGPLAN_H
+
+#include "hashcoord.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+
+/*
+	Sampling plans
+
+	A plan turns a coordinate table into byte offsets for one texture layout (size, pitch, pixel size), so sampling a
+	texture is a single branch-free loop: no bounds checks and no row arithmetic per coordinate. Coordinates outside the
+	texture keep offset 0 and a zero mask, so they read as black like they do in the hash functions.
+
+	A plan samples every coordinate twice: once in the upper half, then offset by lower_offset rows for the lower half.
+	gather() writes the b, g, r bytes (memory order) of all 2 * len samples to one buffer, upper half first; every
+	*_Gathered hash in texturehash.h and murmur2stream.h reads that buffer, so several hashes of a texture cost one
+	gather. SamplingPlanCache::gather keeps that buffer aligned to SAMPLE_ALIGNMENT and reuses it between textures.
+*/
+
+namespace TextureHash
+{
+
+const size_t SAMPLE_ALIGNMENT = 32;		// of the buffer SamplingPlanCache::gather returns: one AVX2 load
+
+class SamplingPlan
+{
+private:
+	const HashCoord*		coords;
+	size_t					len;
+	int						width;
+	int						height;
+	size_t					pitch;
+	size_t					pixel_size;
+	int						lower_offset;
+	std::vector<uint32_t>	offsets;		// byte offset of each sample
+	std::vector<uint8_t>	masks;			// 0xFF if the sample is inside the texture, else 0
+	bool					any_valid;		// false if no sample is inside the texture (offset 0 may not exist)
+
+public:
+	SamplingPlan(const HashCoord* coords,	// coordinate table; must outlive the plan
+				 size_t len,				// number of coordinates
+				 int width, int height,		// size of the texture
+				 size_t pitch,				// bytes per row
+				 size_t pixel_size,			// bytes per pixel (4 for A8R8G8B8, 3 for CV_8UC3)
+				 int lower_offset			// rows between a coordinate and its lower-half sample
+		) : coords(coords), len(len), width(width), height(height), pitch(pitch), pixel_size(pixel_size), lower_offset(lower_offset),
+			offsets(len * 2, 0), masks(len * 2, 0), any_valid(false)
+	{
+		for (size_t part = 0; part < 2; part++) {
+			int y_offset = (int)part * lower_offset;
+			for (size_t i = 0; i < len; i++) {
+				int x = coords[i].x, y = coords[i].y + y_offset;
+				if (x < 0 || x >= width || y < 0 || y >= height) continue;
+				offsets[part * len + i] = (uint32_t)(y * pitch + x * pixel_size);
+				masks[part * len + i] = 0xFF;
+				any_valid = true;
+			}
+		}
+	}
+
+	/* matches: whether the plan was built for this table and layout
+	*/
+	bool matches(const HashCoord* coords, size_t len, int width, int height, size_t pitch, size_t pixel_size, int lower_offset) const
+	{
+		return this->coords == coords && this->len == len && this->width == width && this->height == height &&
+			   this->pitch == pitch && this->pixel_size == pixel_size && this->lower_offset == lower_offset;
+	}
+
+	size_t coord_count() const { return len; }
+
+	/* gather_size: bytes gather writes (2 * len * 3)
+	*/
+	size_t gather_size() const { return len * 6; }
+
+	/* gather: samples a texture with this plan's layout
+	*/
+	void gather(const unsigned char* data,		// first row of the texture
+				unsigned char* out				// receives gather_size() bytes
+		) const
+	{
+		size_t count = len * 2;
+		if (!any_valid) {
+			memset(out, 0, count * 3);
+			return;
+		}
+
+		const uint32_t* offset = count ? &offsets[0] : NULL;
+		const uint8_t* mask = count ? &masks[0] : NULL;
+		for (size_t i = 0; i < count; i++, out += 3) {
+			const unsigned char* pixel = data + offset[i];
+			uint8_t m = mask[i];
+			out[0] = pixel[0] & m;
+			out[1] = pixel[1] & m;
+			out[2] = pixel[2] & m;
+		}
+	}
+};
+
+/* SamplingPlanCache: the plans of the last few layouts seen; textures come in a handful of sizes, so a short list
+   searched front to back is enough. Not thread-safe.
+*/
+class SamplingPlanCache
+{
+private:
+	std::deque<SamplingPlan>	plans;		// most recently built last
+	size_t						max_size;
+	std::vector<unsigned char>	storage;	// the samples of the last gather, from the first SAMPLE_ALIGNMENT boundary in it
+
+public:
+	SamplingPlanCache(size_t max_size = 16) : max_size(max_size) {}
+
+	/* get: the plan of a layout, built on first use
+	   returns: a plan valid until the next call
+	*/
+	const SamplingPlan& get(const HashCoord* coords, size_t len, int width, int height, size_t pitch, size_t pixel_size, int lower_offset)
+	{
+		for (std::deque<SamplingPlan>::reverse_iterator iter = plans.rbegin(); iter != plans.rend(); iter++)
+			if (iter->matches(coords, len, width, height, pitch, pixel_size, lower_offset)) return *iter;
+
+		if (plans.size() >= max_size) plans.pop_front();
+		plans.push_back(SamplingPlan(coords, len, width, height, pitch, pixel_size, lower_offset));
+		return plans.back();
+	}
+
+	/* gather: samples a texture with the plan of its layout
+	   returns: the 2 * len * 3 sampled bytes, aligned to SAMPLE_ALIGNMENT; valid until the next call
+	*/
+	const unsigned char* gather(const HashCoord* coords, size_t len, int width, int height, size_t pitch, size_t pixel_size, int lower_offset,
+								const unsigned char* data	// first row of the texture
+		)
+	{
+		const SamplingPlan& plan = get(coords, len, width, height, pitch, pixel_size, lower_offset);
+		storage.resize(plan.gather_size() + SAMPLE_ALIGNMENT - 1);
+		unsigned char* out = (unsigned char*)(((uintptr_t)&storage[0] + SAMPLE_ALIGNMENT - 1) & ~(uintptr_t)(SAMPLE_ALIGNMENT - 1));
+		plan.gather(data, out);
+		return out;
+	}
+
+	size_t size() const { return plans.size(); }
+};
+
+}
+
+#endif // SAMPLINGPLAN_H
@@ -85,6 +85,30 @@ namespace TextureHash
 
 			return hashval;
 		}
+
+		uint64 Hash_Algorithm_1_Gathered(const unsigned char* rgb)
+		{
+			uint64 hash = 0;
+			float first_val, val = 0, last_val = 0;
+
+			first_val = last_val = (rgb[0] + rgb[1] + rgb[2]) / 3;
+
+			const unsigned char* pixel = rgb;
+			for (int i = 0; i < 64; i++, pixel += 3) {
+				val = (pixel[0] + pixel[1] + pixel[2]) / 3;				// samples outside the texture are black
+
+				// compare to last value for hash
+				hash <<= 1;
+				if (val >= last_val) hash |= 1;
+
+				last_val = val;
+			}
+
+			// do wrap-around comparison
+			if (first_val >= val) hash |= 0x8000000000000000;
+
+			return hash;
+		}
 	}
 
 	namespace FNV
@@ -111,39 +135,31 @@ namespace TextureHash
 			return hash;
 		}
 
-		uint64 FNV_Hash(const cv::Mat& img, const HashCoord* coords, const size_t len, bool use_RGB)
+		// samples img as SamplingPlan::gather does, the lower half lower_offset rows down; one image is not worth a plan
+		static void fnv_gather(const cv::Mat& img, const HashCoord* coords, const size_t len, int lower_offset, std::vector<unsigned char>& rgb)
 		{
-			uint64 hash = FNV_OFFSET_BASIS_64;
-
-			size_t coord_count = 0;
-			const HashCoord* coord = coords;
-			for (int i = 0; i < len; i++, coord++) {
-				uchar val = 0, red = 0, green = 0, blue = 0;
-				if (coord->x < img.cols && coord->y < img.rows) {
-					cv::Vec3b pixel = img.at<cv::Vec3b>(coord->y, coord->x);
-					if (use_RGB) {
-						red = pixel[0];
-						green = pixel[1];
-						blue = pixel[2];
-					} else {
-						val = round((pixel[0] + pixel[1] + pixel[2]) / 3);
+			rgb.resize(len * 6);
+			unsigned char* out = rgb.empty() ? NULL : &rgb[0];
+			for (int part = 0; part < 2; part++) {
+				for (size_t i = 0; i < len; i++, out += 3) {
+					int x = coords[i].x, y = coords[i].y + part * lower_offset;
+					if (x < 0 || x >= img.cols || y < 0 || y >= img.rows) {
+						out[0] = out[1] = out[2] = 0;
+						continue;
 					}
-				}
-
-				if (use_RGB) {																// hash each R,G,B individually
-					hash ^= (uchar)red;
-					hash *= FNV_OFFSET_PRIME_64;
-					hash ^= (uchar)green;
-					hash *= FNV_OFFSET_PRIME_64;
-					hash ^= (uchar)blue;
-					hash *= FNV_OFFSET_PRIME_64;
-				} else {																	// hash RGB average
-					hash ^= val;
-					hash *= FNV_OFFSET_PRIME_64;
+					const unsigned char* pixel = img.data + y * img.step + x * img.elemSize();
+					out[0] = pixel[0];
+					out[1] = pixel[1];
+					out[2] = pixel[2];
 				}
 			}
+		}
 
-			return hash;
+		uint64 FNV_Hash(const cv::Mat& img, const HashCoord* coords, const size_t len, bool use_RGB)
+		{
+			std::vector<unsigned char> rgb;
+			fnv_gather(img, coords, len, 0, rgb);
+			return FNV_Hash_Gathered(rgb.empty() ? NULL : &rgb[0], len, use_RGB);
 		}
 
 
@@ -191,236 +207,58 @@ namespace TextureHash
 			return FNV_Hash(img, COORDS, COORDS_LEN, use_RGB);
 		}
 
-		uint64 uint64pow(uint64 base, int exp)
+		// hash upper, lower, and combined separately 
+		uint64 FNV_Hash_Combined_64(cv::Mat img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const int len, bool use_RGB)
 		{
-			uint64 result = 1;
-			for (int i = 0; i < exp; i++)
-				result *= base;
-
-			return result;
+			std::vector<unsigned char> rgb;
+			fnv_gather(img, coords, len, FNV_Lower_Offset(img.rows), rgb);
+			return FNV_Hash_Combined_64_Gathered(rgb.empty() ? NULL : &rgb[0], img.rows, hash_upper, hash_lower, len, use_RGB);
 		}
 
 		// hash upper, lower, and combined separately 
-		uint64 FNV_Hash_Combined_64(cv::Mat img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const int len, bool use_RGB)
+		uint32 FNV_Hash_Combined_32(cv::Mat img, uint32& hash_upper, uint32& hash_lower, const HashCoord* coords, const size_t len, bool use_RGB)
 		{
-			hash_lower = (img.rows > VRAM_DIM / 2) ? (use_RGB) ? FNV_NOUPPER_RGB_BASIS_64 : FNV_NOUPPER_BASIS_64 : 0;
-
-			uint64 hash = FNV_OFFSET_BASIS_64;
-
-			float red = 0, green = 0, blue = 0;
-			size_t coord_count = 0;
-			for (int i = 0; i < len; i++) {
-				HashCoord coord = coords[i];
-				unsigned char val = 0;
-				if (coord.x < img.cols && coord.y < img.rows) {
-					cv::Vec3b pixel = img.at<cv::Vec3b>(coord.y, coord.x);
-					val = round((pixel[0] + pixel[1] + pixel[2]) / 3);
-
-					// keep track of RGB sums of pixels
-					if (use_RGB) {
-						red += pixel[0];
-						green += pixel[1];
-						blue += pixel[2];
-					}
-				}
-
-				hash ^= val;
-				hash *= FNV_OFFSET_PRIME_64;
-				coord_count++;
-			}
-
-			// factor RGB averages into hash
-			if (use_RGB) {
-				red /= coord_count;
-				green /= coord_count;
-				blue /= coord_count;
-
-				hash ^= (uchar)round(red);
-				hash *= FNV_OFFSET_PRIME_64;
-				hash ^= (uchar)round(green);
-				hash *= FNV_OFFSET_PRIME_64;
-				hash ^= (uchar)round(blue);
-				hash *= FNV_OFFSET_PRIME_64;
-			}
-
-			// set hash_upper equal to hash thus far
-			hash_upper = hash;
-
-			if (hash_lower) {																// make sure texture is big enough to hash lower
-				// adjust hash_upper to include lower blank object
-				hash_upper *= (use_RGB) ? FNV_NOLOWER_RGB_FACTOR_64 : FNV_NOLOWER_FACTOR_64;
-
-				// adjust img for lower hashing
-				int half_dim = VRAM_DIM / 2;
-				int last_obj_start = img.rows - half_dim;
-				cv::Mat limg = img.rowRange(std::min(last_obj_start, half_dim), img.rows);	// coord limg at last place where a full 128x128 object could be hashed but limit it to object directly under upper
-
-				// hash lower and continue hashing combined
-				red = 0, green = 0, blue = 0;
-				coord_count = 0;
-				for (int i = 0; i < len; i++) {
-					HashCoord coord = coords[i];
-					unsigned char val = 0;
-					if (coord.x < limg.cols && coord.y < limg.rows) {
-						cv::Vec3b pixel = limg.at<cv::Vec3b>(coord.y, coord.x);
-						val = round((pixel[0] + pixel[1] + pixel[2]) / 3);
-
-						// keep track of RGB sums of pixels
-						if (use_RGB) {
-							red += pixel[0];
-							green += pixel[1];
-							blue += pixel[2];
-						}
-					}
-
-					hash_lower ^= val;
-					hash_lower *= FNV_OFFSET_PRIME_64;
-
-					hash ^= val;
-					hash *= FNV_OFFSET_PRIME_64;
-
-					coord_count++;
-				}
-
-				// factor RGB averages into hash
-				if (use_RGB) {
-					red /= coord_count;
-					green /= coord_count;
-					blue /= coord_count;
-
-					hash_lower ^= (uchar)round(red);
-					hash_lower *= FNV_OFFSET_PRIME_64;
-					hash_lower ^= (uchar)round(green);
-					hash_lower *= FNV_OFFSET_PRIME_64;
-					hash_lower ^= (uchar)round(blue);
-					hash_lower *= FNV_OFFSET_PRIME_64;
-
-					hash ^= (uchar)round(red);
-					hash *= FNV_OFFSET_PRIME_64;
-					hash ^= (uchar)round(green);
-					hash *= FNV_OFFSET_PRIME_64;
-					hash ^= (uchar)round(blue);
-					hash *= FNV_OFFSET_PRIME_64;
-				}
-			}
-
-			return hash;
+			std::vector<unsigned char> rgb;
+			fnv_gather(img, coords, len, FNV_Lower_Offset(img.rows), rgb);
+			return FNV_Hash_Combined_32_Gathered(rgb.empty() ? NULL : &rgb[0], img.rows, hash_upper, hash_lower, len, use_RGB);
 		}
 
-		uint64 uint32pow(uint32 base, int exp)
+		int FNV_Lower_Offset(int rows)
 		{
-			uint64 result = 1;
-			for (int i = 0; i < exp; i++)
-				result *= base;
-
-			return result;
+			return std::min(rows - VRAM_DIM / 2, VRAM_DIM / 2);								// last place a full 128x128 object fits, but no further than directly under the upper
 		}
 
-		// hash upper, lower, and combined separately 
-		uint32 FNV_Hash_Combined_32(cv::Mat img, uint32& hash_upper, uint32& hash_lower, const HashCoord* coords, const size_t len, bool use_RGB)
+		uint64 FNV_Hash_Gathered(const unsigned char* rgb, const size_t len, bool use_RGB)
 		{
-			hash_lower = (img.rows > VRAM_DIM / 2) ? (use_RGB) ? FNV_NOUPPER_RGB_BASIS_32 : FNV_NOUPPER_BASIS_32 : 0;
-
-			uint32 hash = FNV_OFFSET_BASIS_32;
-
-			float red = 0, green = 0, blue = 0;
-			size_t coord_count = 0;
-			for (int i = 0; i < len; i++) {
-				HashCoord coord = coords[i];
-				unsigned char val = 0;
-				if (coord.x < img.cols && coord.y < img.rows) {
-					cv::Vec3b pixel = img.at<cv::Vec3b>(coord.y, coord.x);
-					val = round((pixel[0] + pixel[1] + pixel[2]) / 3);
-
-					// keep track of RGB sums of pixels
-					if (use_RGB) {
-						red += pixel[0];
-						green += pixel[1];
-						blue += pixel[2];
-					}
-				}
+			if (use_RGB)																	// hash each R,G,B individually
+				return (len == COORDS_LEN) ? FNV64_RGB_Hasher::hash(rgb) : Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, 0>::hash(rgb, len);
+			else																			// hash RGB average
+				return (len == COORDS_LEN) ? FNV64_Luma_Hasher::hash(rgb) : Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, 0>::hash(rgb, len);
+		}
 
-				hash ^= val;
-				hash *= FNV_OFFSET_PRIME_32;
-				coord_count++;
-			}
+		// the luma hasher, or (use_RGB) the luma and channel averages hasher, of FNVMixer<T>; compile-time counts for COORDS_LEN
+		template <typename T>
+		static T fnv_combined_gathered(const unsigned char* rgb, int rows, T& hash_upper, T& hash_lower, const size_t len, bool use_RGB)
+		{
+			using namespace Policy;
+			bool has_lower = rows > VRAM_DIM / 2;											// make sure texture is big enough to hash lower
 
-			// factor RGB averages into hash
 			if (use_RGB) {
-				red /= coord_count;
-				green /= coord_count;
-				blue /= coord_count;
-
-				hash ^= (uchar)round(red);
-				hash *= FNV_OFFSET_PRIME_32;
-				hash ^= (uchar)round(green);
-				hash *= FNV_OFFSET_PRIME_32;
-				hash ^= (uchar)round(blue);
-				hash *= FNV_OFFSET_PRIME_32;
+				if (len == COORDS_LEN) return TextureHasher<FNVMixer<T>, LumaAverageChannels, COORDS_LEN>::hash_combined(rgb, has_lower, hash_upper, hash_lower);
+				return TextureHasher<FNVMixer<T>, LumaAverageChannels, 0>::hash_combined(rgb, has_lower, hash_upper, hash_lower, len);
 			}
+			if (len == COORDS_LEN) return TextureHasher<FNVMixer<T>, LumaChannels, COORDS_LEN>::hash_combined(rgb, has_lower, hash_upper, hash_lower);
+			return TextureHasher<FNVMixer<T>, LumaChannels, 0>::hash_combined(rgb, has_lower, hash_upper, hash_lower, len);
+		}
 
-			// set hash_upper equal to hash thus far
-			hash_upper = hash;
-
-			if (hash_lower) {																// make sure texture is big enough to hash lower
-				// adjust hash_upper to include lower blank object
-				hash_upper *= (use_RGB) ? FNV_NOLOWER_RGB_FACTOR_32 : FNV_NOLOWER_FACTOR_32;
-
-				// adjust img for lower hashing
-				int half_dim = VRAM_DIM / 2;
-				int last_obj_start = img.rows - half_dim;
-				cv::Mat limg = img.rowRange(std::min(last_obj_start, half_dim), img.rows);	// coord limg at last place where a full 128x128 object could be hashed but limit it to object directly under upper
-
-				// hash lower and continue hashing combined
-				red = 0, green = 0, blue = 0;
-				coord_count = 0;
-				for (int i = 0; i < len; i++) {
-					HashCoord coord = coords[i];
-					unsigned char val = 0;
-					if (coord.x < limg.cols && coord.y < limg.rows) {
-						cv::Vec3b pixel = limg.at<cv::Vec3b>(coord.y, coord.x);
-						val = round((pixel[0] + pixel[1] + pixel[2]) / 3);
-
-						// keep track of RGB sums of pixels
-						if (use_RGB) {
-							red += pixel[0];
-							green += pixel[1];
-							blue += pixel[2];
-						}
-					}
-
-					hash_lower ^= val;
-					hash_lower *= FNV_OFFSET_PRIME_32;
-
-					hash ^= val;
-					hash *= FNV_OFFSET_PRIME_32;
-
-					coord_count++;
-				}
-
-				// factor RGB averages into hash
-				if (use_RGB) {
-					red /= coord_count;
-					green /= coord_count;
-					blue /= coord_count;
-
-					hash_lower ^= (uchar)round(red);
-					hash_lower *= FNV_OFFSET_PRIME_32;
-					hash_lower ^= (uchar)round(green);
-					hash_lower *= FNV_OFFSET_PRIME_32;
-					hash_lower ^= (uchar)round(blue);
-					hash_lower *= FNV_OFFSET_PRIME_32;
-
-					hash ^= (uchar)round(red);
-					hash *= FNV_OFFSET_PRIME_32;
-					hash ^= (uchar)round(green);
-					hash *= FNV_OFFSET_PRIME_32;
-					hash ^= (uchar)round(blue);
-					hash *= FNV_OFFSET_PRIME_32;
-				}
-			}
+		uint64 FNV_Hash_Combined_64_Gathered(const unsigned char* rgb, int rows, uint64& hash_upper, uint64& hash_lower, const size_t len, bool use_RGB)
+		{
+			return fnv_combined_gathered<uint64>(rgb, rows, hash_upper, hash_lower, len, use_RGB);
+		}
 
-			return hash;
+		uint32 FNV_Hash_Combined_32_Gathered(const unsigned char* rgb, int rows, uint32& hash_upper, uint32& hash_lower, const size_t len, bool use_RGB)
+		{
+			return fnv_combined_gathered<uint32>(rgb, rows, hash_upper, hash_lower, len, use_RGB);
 		}
 	}
 
@@ -458,7 +296,7 @@ namespace TextureHash
 				k1 *= m; k1 ^= k1 >> r; k1 *= m;
 				h1 *= m; h1 ^= k1;
 
-				len -= 4; std::cout << "k1 = " << k1 << ";" << std::endl;
+				len -= 4;
 				//std::cout << "Rem = " << len << "; h1 = " << h1 << "; h2 = " << h2 << std::endl;
 			}
 
@@ -582,380 +420,42 @@ namespace TextureHash
 				buf_lower[index++] = 0;
 			}
 
-			if (img.rows > (VRAM_DIM / 2)) {		// there is a lower half to hash
-				coord = coords;
-				for (int i = 0; i < len; i++, coord++) {
-					uchar red = 0, green = 0, blue = 0;
-					if (coord->x < img.cols && (coord->y + (VRAM_DIM / 2)) < img.rows) {
-						cv::Vec3b pixel = img.at<cv::Vec3b>(coord->y + (VRAM_DIM / 2), coord->x);
-						red = pixel[0];
-						green = pixel[1];
-						blue = pixel[2];
-					}
-					buf_upper[index] = 0;
-					buf_combined[index] = buf_lower[index++] = red;
-					buf_upper[index] = 0;
-					buf_combined[index] = buf_lower[index++] = green;
-					buf_upper[index] = 0;
-					buf_combined[index] = buf_lower[index++] = blue;
+			coord = coords;												// the lower half is black if the texture has none
+			for (int i = 0; i < len; i++, coord++) {
+				uchar red = 0, green = 0, blue = 0;
+				if (coord->x < img.cols && (coord->y + (VRAM_DIM / 2)) < img.rows) {
+					cv::Vec3b pixel = img.at<cv::Vec3b>(coord->y + (VRAM_DIM / 2), coord->x);
+					red = pixel[0];
+					green = pixel[1];
+					blue = pixel[2];
 				}
+				buf_upper[index] = 0;
+				buf_combined[index] = buf_lower[index] = red;
+				index++;
+				buf_upper[index] = 0;
+				buf_combined[index] = buf_lower[index] = green;
+				index++;
+				buf_upper[index] = 0;
+				buf_combined[index] = buf_lower[index] = blue;
+				index++;
 			}
 
 			hash_upper = TextureHash::Murmur2::MurmurHash64B(buf_upper, buflen * 2, TextureHash::Murmur2::MURMUR2_SEED);
 			hash_lower = TextureHash::Murmur2::MurmurHash64B(buf_lower, buflen * 2, TextureHash::Murmur2::MURMUR2_SEED);
-			return TextureHash::Murmur2::MurmurHash64B(buf_combined, buflen * 2, TextureHash::Murmur2::MURMUR2_SEED);
-		}
-
-		inline cv::Vec3b get_correct_pixel(int rem, cv::Mat & img, const HashCoord* coords, const size_t len, bool use_mod = true)
-		{
-			int mod = (VRAM_DIM / 2);
-			const HashCoord* coord;
-			if (rem > len) {
-				coord = coords + len * 2 - rem;
-				return img.at<cv::Vec3b>(coord->y, coord->x);
-			}
-			coord = coords + len - rem;
-			return (use_mod) ? img.at<cv::Vec3b>(coord->y + mod, coord->x) : img.at<cv::Vec3b>(coord->y, coord->x);
-		}
-
-		inline void murmur2_rem4(uint32& h1, uint32& h2, uint32& rem, cv::Mat& img, const HashCoord* coords, const size_t len, bool use_mod = true)
-		{
-			cv::Vec3b pixel1, pixel2;
-			uint32 k;
-
-			// k1, pixel 1rgb + 2r; reverse endianness: 2r | 1b | 1g | 1r
-			k = 0;
-
-			pixel1 = get_correct_pixel(rem--, img, coords, len, use_mod);
-			pixel2 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-			k |= pixel2[0] << 24 | pixel1[2] << 16 | pixel1[1] << 8 | pixel1[0];
-
-			k *= m; k ^= k >> r; k *= m;
-			h1 *= m; h1 ^= k;
-
-			//std::cout << "k1 = " << k << "; ";
-
-			// k2, pixel 2gb + 3rg; reverse endianness: 3g | 3r | 2b | 2g
-			k = 0;
-
-			pixel1 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-			k |= pixel1[1] << 24 | pixel1[0] << 16 | pixel2[2] << 8 | pixel2[1];
-
-			k *= m; k ^= k >> r; k *= m;
-			h2 *= m; h2 ^= k;
-
-			//std::cout << "k2 = " << k << std::endl;
-
-			//std::cout << "Rem = " << rem * 3 + 2 << "; h1 = " << h1 << "; h2 = " << h2 << std::endl;
-
-			// k1, pixel 3b + 4rgb; reverse endianness: 4b | 4g | 4r | 3b
-			k = 0;
-
-			pixel2 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-			k |= pixel2[2] << 24 | pixel2[1] << 16 | pixel2[0] << 8 | pixel1[2];
-
-			k *= m; k ^= k >> r; k *= m;
-			h1 *= m; h1 ^= k;
-
-			//std::cout << "k1 = " << k << ";";
-		}
-
-		inline void murmur2_rem32(cv::Vec3b& pixel1, cv::Vec3b& pixel2, bool swap, uint32& h1, uint32& h2, uint32 rem, cv::Mat& img, const HashCoord* coords, const size_t len, bool use_mod = true)
-		{
-			switch (rem) {
-			case 3:
-				uint32 k;
-
-				// k1, pixel 1rgb + 2r; reverse endianness: 2r | 1b | 1g | 1r
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len, use_mod);
-				pixel2 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-				k |= pixel2[0] << 24 | pixel1[2] << 16 | pixel1[1] << 8 | pixel1[0];
-
-				k *= m; k ^= k >> r; k *= m;
-
-				if (swap) {
-					h2 *= m; h2 ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				} else {
-					h1 *= m; h1 ^= k;
-					//std::cout << "k1 = " << k << "; ";
-				}
-
-
-				// k2, pixel 2gb + 3rg; reverse endianness: 3g | 3r | 2b | 2g
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-				k |= pixel1[1] << 24 | pixel1[0] << 16 | pixel2[2] << 8 | pixel2[1];
-
-				k *= m; k ^= k >> r; k *= m;
-
-				if (swap) {
-					h1 *= m; h1 ^= k;
-					//std::cout << "k1 = " << k << ";" << std::endl;
-				} else {
-					h2 *= m; h2 ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				}
-				break;
-			case 2:
-				// k1, pixel 1rgb + 2r; reverse endianness: 2r | 1b | 1g | 1r
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len, use_mod);
-				pixel2 = get_correct_pixel(rem--, img, coords, len, use_mod);
-
-				k |= pixel2[0] << 24 | pixel1[2] << 16 | pixel1[1] << 8 | pixel1[0];
-
-				k *= m; k ^= k >> r; k *= m;
-
-				if (swap) {
-					h2 *= m; h2 ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				} else {
-					h1 *= m; h1 ^= k;
-					//std::cout << "k1 = " << k << ";" << std::endl;
-				}
-
-				// k2, only pixel 2gb remaining
-				h2 ^= pixel2[1] << 8;
-				h2 ^= pixel2[2];
-				h2 *= m;
-				break;
-			}
-		}
-
-		inline void murmur2_finish(uint32& h1, uint32& h2, uint32 rem, cv::Mat& img, const HashCoord* coords, const size_t len)
-		{
-			cv::Vec3b pixel1, pixel2;
-
-			bool swap = false;
-			if (rem >= 4) {
-				swap = true;
-				murmur2_rem4(h1, h2, rem, img, coords, len);
-			}
-
-			if (rem > 1) murmur2_rem32(pixel1, pixel2, swap, h1, h2, rem, img, coords, len);
-
-			switch (rem) {
-			case 3:
-				// k2, only pixel 3b remaining
-				rem -= 3;
-				h2 ^= pixel1[2];
-				h2 *= m;
-				break;
-			case 2:
-				// k2, only pixel 2gb remaining
-				rem -= 2;
-				h2 ^= pixel2[1] << 8;
-				h2 ^= pixel2[2];
-				h2 *= m;
-				break;
-			case 1:
-				// k2, only pixel 1rgb remaining
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-
-				h2 ^= pixel1[0] << 16;
-				h2 ^= pixel1[1] << 8;
-				h2 ^= pixel1[2];
-			}
-
-			h1 ^= h2 >> 18; h1 *= m;
-			h2 ^= h1 >> 22; h2 *= m;
-			h1 ^= h2 >> 17; h1 *= m;
-			h2 ^= h1 >> 19; h2 *= m;
+			uint64 hash = TextureHash::Murmur2::MurmurHash64B(buf_combined, buflen * 2, TextureHash::Murmur2::MURMUR2_SEED);
+			delete[] buf_upper;
+			delete[] buf_lower;
+			delete[] buf_combined;
+			return hash;
 		}
 
 		uint64 Murmur2_Hash_Combined(cv::Mat& img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const size_t len)
 		{
-			uint32 h1_u;
-			uint32 h2_u;
-
-			uint32 h1_l = uint32(TextureHash::Murmur2::MURMUR2_SEED) ^ (len * 3 * 2);
-			uint32 h2_l = uint32(TextureHash::Murmur2::MURMUR2_SEED >> 32);
-
-			uint32 h1_c = uint32(TextureHash::Murmur2::MURMUR2_SEED) ^ (len * 3 * 2);
-			uint32 h2_c = uint32(TextureHash::Murmur2::MURMUR2_SEED >> 32);
-
-			const HashCoord* coord = coords;
-			uint32 rem = len * 2;
-			//std::cout << "Rem = " << rem * 3 << "; h1 = " << h1_u << "; h2 = " << h2_u << std::endl;
-
-			cv::Vec3b pixel1, pixel2;
-			while (rem >= 8) {
-				// save hash_upper progress
-				if ((rem - len) < 8) (h1_u = h1_c) && (h2_u = h2_c);
-				uint32 k;
-
-				// k1, pixel 1rgb + 2r; reverse endianness: 2r | 1b | 1g | 1r
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-				pixel2 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel2[0] << 24 | pixel1[2] << 16 | pixel1[1] << 8 | pixel1[0];
-
-				k *= m; k ^= k >> r; k *= m;
-				h1_c *= m; h1_c ^= k;
-
-				//std::cout << "k1 = " << k << "; ";
-
-				// k2, pixel 2gb + 3rg; reverse endianness: 3g | 3r | 2b | 2g
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel1[1] << 24 | pixel1[0] << 16 | pixel2[2] << 8 | pixel2[1];
-
-				k *= m; k ^= k >> r; k *= m;
-				h2_c *= m; h2_c ^= k;
-
-				//std::cout << "k2 = " << k << std::endl;
-
-				//std::cout << "Rem = " << rem * 3 + 2 << "; h1 = " << h1_c << "; h2 = " << h2_c << std::endl;
-
-				// k1, pixel 3b + 4rgb; reverse endianness: 4b | 4g | 4r | 3b
-				k = 0;
-
-				pixel2 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel2[2] << 24 | pixel2[1] << 16 | pixel2[0] << 8 | pixel1[2];
-
-				k *= m; k ^= k >> r; k *= m;
-				h1_c *= m; h1_c ^= k;
-
-				//std::cout << "k1 = " << k << "; ";
-
-				// k2, pixel 5rgb + 6r; reverse endianness: 6r | 5b | 5g | 5r
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-				pixel2 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel2[0] << 24 | pixel1[2] << 16 | pixel1[1] << 8 | pixel1[0];
-
-				k *= m; k ^= k >> r; k *= m;
-				h2_c *= m; h2_c ^= k;
-
-				//std::cout << "k2 = " << k << std::endl;
-
-				//std::cout << "Rem = " << rem * 3 << "; h1 = " << h1_c << "; h2 = " << h2_c << std::endl;
-
-				// k1, pixel 6gb + 7rg; reverse endianness: 7g | 7r | 6b | 6g
-				k = 0;
-
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel1[1] << 24 | pixel1[0] << 16 | pixel2[2] << 8 | pixel2[1];
-
-				k *= m; k ^= k >> r; k *= m;
-				h1_c *= m; h1_c ^= k;
-
-				//std::cout << "k1 = " << k << "; ";
-
-				// k2, pixel 7b + 8rgb; reverse endianness: 8b | 8g | 8r | 7b
-				k = 0;
-
-				pixel2 = get_correct_pixel(rem--, img, coords, len);
-
-				k |= pixel2[2] << 24 | pixel2[1] << 16 | pixel2[0] << 8 | pixel1[2];
-
-				k *= m; k ^= k >> r; k *= m;
-				h2_c *= m; h2_c ^= k;
-
-				//std::cout << "k2 = " << k << std::endl;
-
-				//std::cout << "Rem = " << rem * 3 << "; h1 = " << h1_c << "; h2 = " << h2_c << std::endl;
-
-				//std::cout << "After " << (len - rem) << " - h1 = " << h1_c << "; h2 = " << h2_c << std::endl;
-			}
-
-			// finish hash_combined
-			murmur2_finish(h1_c, h2_c, rem, img, coords, len);
-
-			// finish hash_upper
-			rem = len % 8;
-			bool swap = false;
-			if (rem >= 4) {
-				swap = true;
-				murmur2_rem4(h1_u, h2_u, rem, img, coords, len, false);
-			}
-			if (rem > 1) murmur2_rem32(pixel1, pixel2, swap, h1_u, h2_u, rem, img, coords, len, false);
-			switch (rem) {
-			case 3:
-				uint32 k;
-				// k1, only pixel 3b remaining; reverse endianness: 0 | 0 | 0 | 3b
-				k = pixel1[2];
-
-				k *= m; k ^= k >> r; k *= m;
-
-				if (swap) {
-					h2_u *= m; h2_u ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				} else {
-					h1_u *= m; h1_u ^= k;
-					//std::cout << "k1 = " << k << "; ";
-				}
-
-				break;
-			case 2:
-				// k2, only pixel 2gb remaining; reverse enianness: 0 | 0 | 2b | 2g
-				k = pixel2[2] << 8 | pixel2[1];
-				
-				k *= m; k ^= k >> r; k *= m;
-
-				if (swap) {
-					h1_u *= m; h1_u ^= k;
-					//std::cout << "k1 = " << k << "; ";
-				} else {
-					h2_u *= m; h2_u ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				}
-
-				break;
-			case 1:
-				// only pixel 1rgb remaining; reverse endianness: 0 | 1b | 1g | 1r
-				pixel1 = get_correct_pixel(rem--, img, coords, len);
-
-				k = pixel1[2] << 24 | pixel1[1] << 16 | pixel1[0];
-
-				if (swap) {
-					h2_u *= m; h2_u ^= m;
-					//std::cout << "k2 = " << k << std::endl;
-				} else {
-					h1_u *= m; h1_u ^= k;
-					//std::cout << "k1 = " << k << "; ";
-				}
-
-				break;
-			case 0:
-				// need to do all |len| pixels worth of 0s
-				for (int i = 0; i < len * 3 - 8; i += 8) {
-					h1_u *= m;
-					h2_u *= m;
-				}
-
-				if (swap) {				// means rem = 4
-					h2_u *= m;
-				}
-			}
-
-			h1_u ^= h2_u >> 18; h1_u *= m;
-			h2_u ^= h1_u >> 22; h2_u *= m;
-			h1_u ^= h2_u >> 17; h1_u *= m;
-			h2_u ^= h1_u >> 19; h2_u *= m;
-
-			hash_upper = uint64(h1_u) << 32 | h2_u;
-
-			return uint64(h1_c) << 32 | h2_c;
-			//if (height > VRAM_DIM / 2) rem += len;		// there is a lower portion to hash
+			uint64_t upper, lower;
+			uint64 hash = Murmur2_Hash_Texture(img.data, img.step, img.elemSize(), img.cols, img.rows, VRAM_DIM / 2, coords, len, upper, lower);
+			hash_upper = upper;
+			hash_lower = lower;
+			return hash;
 		}
 
 		//void Murmur2_Combined(char* pData, UINT pitch, int width, int height, const HashCoord* coords, const int len, uint64_t & hash_combined, uint64_t hash_upper, uint64_t hash_lower)
@@ -1173,4 +673,17 @@ namespace TextureHash
 		//	if (height > VRAM_DIM / 2) rem += len;		// there is a lower portion to hash
 		//}
 	}
+
+	// the hashers declared extern in texturehash.h
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaAverageChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaAverageChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::Murmur2Mixer, Policy::RGBChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, 0>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, 0>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaAverageChannels, 0>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaAverageChannels, 0>;
+	template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaChannels, 0>;
 }
\ No newline at end of file
@@ -2,6 +2,10 @@
 #define TEXTUREHASH_H
 
 #include "hashcoord.h"
+#include "murmur2stream.h"
+#include "omzyhash.h"
+#include "samplingplan.h"
+#include "policyhash.h"
 #include <opencv2/opencv.hpp>
 
 typedef unsigned __int32 uint32;
@@ -9,13 +13,6 @@ typedef unsigned __int32 uint32;
 namespace TextureHash
 {
 
-namespace Omzy {
-	const int BLOCKSIZE = 16;
-	//int hash1_x[64] = { 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 32, 48, 64, 80, 96, 112, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16, 0, 16, 0, 16, 48, 96, 0, 16 };
-	//int hash1_y[64] = { 0, 0, 0, 0, 0, 0, 0, 0, 16, 16, 16, 16, 16, 16, 16, 16, 32, 32, 32, 32, 32, 32, 32, 32, 48, 48, 48, 48, 48, 48, 48, 48, 64, 64, 80, 80, 80, 80, 96, 96, 112, 112, 128, 128, 128, 128, 144, 144, 160, 160, 176, 176, 176, 176, 192, 192, 208, 208, 224, 224, 224, 224, 240, 240 };
-	const HashCoord hash1[64] = { HashCoord(0, 0), HashCoord(16, 0), HashCoord(32, 0), HashCoord(48, 0), HashCoord(64, 0), HashCoord(80, 0), HashCoord(96, 0), HashCoord(112, 0), HashCoord(0, 16), HashCoord(16, 16), HashCoord(32, 16), HashCoord(48, 16), HashCoord(64, 16), HashCoord(80, 16), HashCoord(96, 16), HashCoord(112, 16), HashCoord(0, 32), HashCoord(16, 32), HashCoord(32, 32), HashCoord(48, 32), HashCoord(64, 32), HashCoord(80, 32), HashCoord(96, 32), HashCoord(112, 32), HashCoord(0, 48), HashCoord(16, 48), HashCoord(32, 48), HashCoord(48, 48), HashCoord(64, 48), HashCoord(80, 48), HashCoord(96, 48), HashCoord(112, 48), HashCoord(0, 64), HashCoord(16, 64), HashCoord(0, 80), HashCoord(16, 80), HashCoord(48, 80), HashCoord(96, 80), HashCoord(0, 96), HashCoord(16, 96), HashCoord(0, 112), HashCoord(16, 112), HashCoord(0, 128), HashCoord(16, 128), HashCoord(48, 128), HashCoord(96, 128), HashCoord(0, 144), HashCoord(16, 144), HashCoord(0, 160), HashCoord(16, 160), HashCoord(0, 176), HashCoord(16, 176), HashCoord(48, 176), HashCoord(96, 176), HashCoord(0, 192), HashCoord(16, 192), HashCoord(0, 208), HashCoord(16, 208), HashCoord(0, 224), HashCoord(16, 224), HashCoord(48, 224), HashCoord(96, 224), HashCoord(0, 240), HashCoord(16, 240) };
-}
-
 namespace FNV_Murmur2_Shared
 {
 	const int VRAM_DIM = 256;
@@ -50,6 +47,9 @@ namespace Omzy {
 
 	uint64 Hash_Algorithm_1(const cv::Mat& img);
 	uint64 Old_Hash_Algorithm_1(const cv::Mat& img);
+
+	// Hash_Algorithm_1 from the samples of a SamplingPlan of hash1 (64 coordinates)
+	uint64 Hash_Algorithm_1_Gathered(const unsigned char* rgb);
 }
 
 namespace FNV {
@@ -70,32 +70,40 @@ namespace FNV {
 	uint64 FNV_Hash(const cv::Mat& img, std::deque<HashCoord> coords, bool use_RGB = true);
 	uint64 FNV_Hash(const cv::Mat& img, bool use_RGB = true);
 
-	// hash upper, lower, and combined separately 
-	uint64 uint64pow(uint64 base, int exp);
-	const uint64 FNV_NOLOWER_FACTOR_64 = uint64pow(FNV_OFFSET_PRIME_64, COORDS_LEN);
-	const uint64 FNV_NOLOWER_RGB_FACTOR_64 = FNV_NOLOWER_FACTOR_64 * uint64pow(FNV_OFFSET_PRIME_64, 3);
+	// hash upper, lower, and combined separately; luma (use_RGB = false) or luma and channel averages (use_RGB = true)
+	// the factors are prime^(bytes in a half) for COORDS_LEN coordinates, computed at compile time
+	const uint64 FNV_NOLOWER_FACTOR_64 = Policy::ipow<uint64>(FNV_OFFSET_PRIME_64, COORDS_LEN);
+	const uint64 FNV_NOLOWER_RGB_FACTOR_64 = Policy::ipow<uint64>(FNV_OFFSET_PRIME_64, COORDS_LEN + 3);
 	const uint64 FNV_NOUPPER_BASIS_64 = FNV_OFFSET_BASIS_64 * FNV_NOLOWER_FACTOR_64;
 	const uint64 FNV_NOUPPER_RGB_BASIS_64 = FNV_OFFSET_BASIS_64 * FNV_NOLOWER_RGB_FACTOR_64;
 	uint64 FNV_Hash_Combined_64(cv::Mat img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const int len, bool use_RGB = true);
 
-	// hash upper, lower, and combined separately
-	uint64 uint32pow(uint32 base, int exp);
-	const uint32 FNV_NOLOWER_FACTOR_32 = uint32pow(FNV_OFFSET_PRIME_32, COORDS_LEN);
-	const uint32 FNV_NOLOWER_RGB_FACTOR_32 = FNV_NOLOWER_FACTOR_32 * uint32pow(FNV_OFFSET_PRIME_32, 3);
+	const uint32 FNV_NOLOWER_FACTOR_32 = Policy::ipow<uint32>(FNV_OFFSET_PRIME_32, COORDS_LEN);
+	const uint32 FNV_NOLOWER_RGB_FACTOR_32 = Policy::ipow<uint32>(FNV_OFFSET_PRIME_32, COORDS_LEN + 3);
 	const uint32 FNV_NOUPPER_BASIS_32 = FNV_OFFSET_BASIS_32 * FNV_NOLOWER_FACTOR_32;
 	const uint32 FNV_NOUPPER_RGB_BASIS_32 = FNV_OFFSET_BASIS_32 * FNV_NOLOWER_RGB_FACTOR_32;
 	uint32 FNV_Hash_Combined_32(cv::Mat img, uint32& hash_upper, uint32& hash_lower, const HashCoord* coords, const size_t len, bool use_RGB = true);
 
+	// the same hashes from the samples of a SamplingPlan (see samplingplan.h)
+	// FNV_Hash reads the upper half; the combined hashes need a plan with lower_offset = FNV_Lower_Offset(rows)
+	int FNV_Lower_Offset(int rows);
+	uint64 FNV_Hash_Gathered(const unsigned char* rgb, const size_t len, bool use_RGB = true);
+	uint64 FNV_Hash_Combined_64_Gathered(const unsigned char* rgb, int rows, uint64& hash_upper, uint64& hash_lower, const size_t len, bool use_RGB = true);
+	uint32 FNV_Hash_Combined_32_Gathered(const unsigned char* rgb, int rows, uint32& hash_upper, uint32& hash_lower, const size_t len, bool use_RGB = true);
+
+	// the hashers behind the functions above for COORDS_LEN coordinates (see policyhash.h); other lengths use N = 0
+	typedef Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, COORDS_LEN> FNV64_RGB_Hasher;
+	typedef Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, COORDS_LEN> FNV64_Luma_Hasher;
+	typedef Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaAverageChannels, COORDS_LEN> FNV64_LumaAverage_Hasher;
+	typedef Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaChannels, COORDS_LEN> FNV32_Luma_Hasher;
+	typedef Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaAverageChannels, COORDS_LEN> FNV32_LumaAverage_Hasher;
 }
 
 namespace Murmur2
 {
 	using namespace FNV_Murmur2_Shared;
 
-	const uint64 MURMUR2_SEED = 0x6d6176697269636b;
-	const uint32 m = 0x5bd1e995;
-	const int r = 24;
-
+	// MURMUR2_SEED, m, r, and Murmur2_Hash_Texture are in murmur2stream.h
 	uint64 MurmurHash64B(const void * key, int len, uint64 seed = MURMUR2_SEED);
 
 	uint64 Murmur2_Full(const cv::Mat& img);
@@ -105,7 +113,23 @@ namespace Murmur2
 
 	uint64 Murmur2_Hash_Combined(cv::Mat& img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const size_t len);
 	uint64 Murmur2_Hash_Combined_Naive(cv::Mat& img, uint64& hash_upper, uint64& hash_lower, const HashCoord* coords, const size_t len);
+
+	// Murmur2_Hash of a SamplingPlan's samples is MurmurHash64B(rgb, len * 3); Murmur2_Hash_Gathered is in murmur2stream.h
+	typedef Policy::TextureHasher<Policy::Murmur2Mixer, Policy::RGBChannels, COORDS_LEN> Murmur2_RGB_Hasher;
 }
+
+// compiled once, in texturehash.cpp
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaAverageChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaAverageChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::Murmur2Mixer, Policy::RGBChannels, FNV_Murmur2_Shared::COORDS_LEN>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::RGBChannels, 0>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaChannels, 0>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint64_t>, Policy::LumaAverageChannels, 0>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaAverageChannels, 0>;
+extern template struct Policy::TextureHasher<Policy::FNVMixer<uint32_t>, Policy::LumaChannels, 0>;
 }
 
 #endif // TEXTUREHASH_H
\ No newline at end of file
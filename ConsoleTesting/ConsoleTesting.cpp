@@ -3,8 +3,18 @@
 #include "stdafx.h"
 #include "MurmurHash2.h"
 #include "texturehash.h"
+#include "tilecorpus.h"
+#include "coordoptimizer.h"
+#include "similarindex.h"
+#include "hashmanifest.h"
 #include <iostream>
 #include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
 #include <array>
 #include <unordered_set>
 #include <unordered_map>
@@ -34,6 +44,7 @@ using std::list;
 using std::stringstream;
 using std::ifstream;
 
+using TextureHash::SamplingPlanCache;
 using namespace TextureHash::Omzy;
 using namespace TextureHash::FNV;
 using namespace TextureHash::Murmur2;
@@ -68,14 +79,19 @@ struct image
 	fs::path path;
 	cv::Rect rect;
 	uint64 hash;
+	const TileCorpus* corpus;		// holds the decoded tile, or NULL to decode it from path
+	uint32_t tile;
 
-	image(fs::path p, cv::Rect r, uint64 h = 0) : path(p), rect(r), hash(h)
+	image(fs::path p, cv::Rect r, uint64 h = 0) : path(p), rect(r), hash(h), corpus(NULL), tile(0)
 	{
 		//mat = cv::imread(path.string(), CV_LOAD_IMAGE_COLOR);
 	}
 
+	image(const TileCorpus* c, uint32_t t) : path(c->path(t)), rect(c->rect(t)), hash(c->hash(t)), corpus(c), tile(t) {}
+
 	cv::Mat mat()
 	{
+		if (corpus) return corpus->tile(tile);									// read-only view of the mapped corpus
 		cv::Mat in = cv::imread(path.string());
 		try {
 			return in(rect);
@@ -98,8 +114,44 @@ struct image
 	}
 };
 
+// decodes a texture tree into a tile corpus, which get_images (and so every analysis) reads in place of the tree
+bool Build_Corpus(fs::path root, fs::path corpus_file, bool name_is_hash = false)
+{
+	cout << "Building tile corpus of " << root.string() << "..." << endl;
+	TileCorpusBuildStats stats;
+	if (!TileCorpus::build(root, corpus_file, name_is_hash, stats, DIM_X)) {
+		cout << "Could not write " << corpus_file.string() << endl;
+		return false;
+	}
+	cout << stats.files << " images (" << stats.failed << " unreadable) -> " << stats.tiles << " tiles, " << stats.duplicates << " duplicates dropped, in " << stats.seconds << " s (" <<
+		(stats.seconds > 0 ? stats.files / stats.seconds : 0) << " images/s)" << endl;
+	cout << "Wrote " << corpus_file.string() << endl;
+	return true;
+}
+
+// corpora get_images has mapped; they stay open for the life of the tool, like the images that point into them
+TileCorpus* open_corpus(fs::path corpus_file)
+{
+	static map<fs::path, std::unique_ptr<TileCorpus>> corpora;
+	std::unique_ptr<TileCorpus>& corpus = corpora[corpus_file];
+	if (!corpus) {
+		corpus.reset(new TileCorpus());
+		if (!corpus->open(corpus_file)) cout << corpus_file.string() << " is not a valid tile corpus." << endl;
+	}
+	return corpus->is_open() ? corpus.get() : NULL;
+}
+
 void get_images(fs::path analysis, deque<image*>& images, unordered_set<uint64>& image_hashes, bool name_is_hash = false)
 {
+	if (fs::is_regular_file(analysis) && TileCorpus::is_corpus(analysis)) {				// built by ConsoleTesting corpus: nothing to decode
+		TileCorpus* corpus = open_corpus(analysis);
+		if (corpus == NULL) return;
+		for (uint32_t i = 0; i < corpus->size(); i++) {
+			if (name_is_hash || image_hashes.insert(corpus->hash(i)).second)
+				images.push_back(new image(corpus, i));
+		}
+		return;
+	}
 	if (fs::is_regular_file(analysis)) {
 		ifstream in;
 		in.open(analysis.string().c_str());
@@ -179,9 +231,200 @@ void get_images(fs::path analysis, deque<image*>& images, unordered_set<uint64>&
 	}
 }
 
-typedef long long_dim[DIM_X];
-typedef double double_dim[DIM_X];
-typedef long long_count[255];
+/* For_Each_Tile: reads each file of images once, on threads threads, and calls visit(thread, i, tile) for every image i cut from it;
+   tiles of one file go to the same thread, one after another. Tiles of a corpus are not read at all.
+*/
+template <typename Visit>
+void For_Each_Tile(const deque<image*>& images, unsigned threads, Visit visit)
+{
+	// order the images by file, so that one imread serves all quadrants of a file
+	std::vector<size_t> order(images.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return images[a]->path < images[b]->path; });
+	std::vector<size_t> starts;																// first of each file in order
+	for (size_t i = 0; i < order.size(); i++)
+		if (i == 0 || images[order[i]]->path != images[order[i - 1]]->path) starts.push_back(i);
+	starts.push_back(order.size());
+
+	std::atomic<size_t> next_file(0);
+	auto work = [&](unsigned thread) {
+		for (size_t file = next_file++; file + 1 < starts.size(); file = next_file++) {
+			cv::Mat in;
+			if (images[order[starts[file]]]->corpus == NULL) in = cv::imread(images[order[starts[file]]]->path.string());
+			for (size_t i = starts[file]; i < starts[file + 1]; i++) {
+				cv::Mat tile;
+				if (images[order[i]]->corpus) tile = images[order[i]]->mat();
+				else try {
+					tile = in(images[order[i]]->rect);
+				} catch (cv::Exception) {
+					tile = in;
+				}
+				visit(thread, order[i], tile);
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned thread = 1; thread < threads; thread++) workers.push_back(std::thread(work, thread));
+	work(0);
+	for (std::thread& worker : workers) worker.join();
+}
+
+unsigned Tile_Threads()
+{
+	return max(1u, std::thread::hardware_concurrency());
+}
+
+/* Hash_Tiles: hashes every image on all threads into hashmap (hash -> image indices)
+   returns: the average ms spent in hash per image
+*/
+template <typename Hash>
+double Hash_Tiles(const deque<image*>& images, Hash hash, map<uint64, set<int>>& hashmap)
+{
+	unsigned threads = Tile_Threads();
+	std::vector<std::vector<pair<uint64, int>>> hashes(threads);
+	std::vector<long long> hash_ns(threads, 0);
+	For_Each_Tile(images, threads, [&](unsigned thread, size_t i, const cv::Mat& tile) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		uint64 value = hash(tile);
+		hash_ns[thread] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		hashes[thread].push_back(pair<uint64, int>(value, (int)i));
+	});
+
+	hashmap.clear();
+	long long total_ns = 0;
+	for (unsigned thread = 0; thread < threads; thread++) {
+		for (const pair<uint64, int>& entry : hashes[thread]) hashmap[entry.first].insert(entry.second);
+		total_ns += hash_ns[thread];
+	}
+	return images.empty() ? 0 : total_ns / 1e6 / images.size();
+}
+
+// per-pixel statistics of a set of tiles: how often each channel takes each value, and the mean and variance of the luma
+class PixelStats
+{
+public:
+	static const size_t PIXELS = (size_t)DIM_Y * DIM_X;
+	static const size_t BINS = PIXELS * 3 * 256;											// (y, x, channel, value)
+
+	size_t					images;
+	std::vector<uint32_t>	counts;			// BINS counts, or empty if the modes were not counted
+	std::vector<double>		mean;			// luma of each pixel
+	std::vector<double>		m2;				// sum of squared distances of the luma from the mean (Welford)
+
+	PixelStats(bool modes) : images(0), counts(modes ? BINS : 0, 0), mean(PIXELS, 0), m2(PIXELS, 0) {}
+
+	/* mode_count: the most images that share one value of one channel at (x, y)
+	*/
+	uint32_t mode_count(int y, int x) const
+	{
+		if (counts.empty()) return 0;
+		const uint32_t* bins = &counts[((size_t)y * DIM_X + x) * 3 * 256];
+		return *max_element(bins, bins + 3 * 256);
+	}
+
+	double sum(int y, int x) const { return mean[y * DIM_X + x] * images; }
+	double variance(int y, int x) const { return images ? m2[y * DIM_X + x] / images : 0; }
+};
+
+// the statistics of the tiles one thread has seen; counts are 16-bit, so they are flushed into the PixelStats every 65535 tiles
+class PixelStatsWorker
+{
+private:
+	std::vector<uint16_t>	counts;
+	size_t					unflushed;		// tiles in counts
+	size_t					images;
+	std::vector<double>		mean;
+	std::vector<double>		m2;
+
+public:
+	PixelStatsWorker(bool modes) : counts(modes ? PixelStats::BINS : 0, 0), unflushed(0), images(0), mean(PixelStats::PIXELS, 0), m2(PixelStats::PIXELS, 0) {}
+
+	static size_t bytes(bool modes) { return (modes ? PixelStats::BINS * sizeof(uint16_t) : 0) + PixelStats::PIXELS * 2 * sizeof(double); }
+
+	bool full() const { return unflushed == UINT16_MAX; }
+
+	/* add: counts a tile; pixels outside it are black
+	*/
+	void add(const cv::Mat& tile)
+	{
+		images++;
+		if (!counts.empty()) unflushed++;
+		double inverse = 1.0 / images;
+		for (int y = 0; y < DIM_Y; y++) {
+			const cv::Vec3b* row = (y < tile.rows) ? tile.ptr<cv::Vec3b>(y) : NULL;
+			for (int x = 0; x < DIM_X; x++) {
+				cv::Vec3b pixel = (row && x < tile.cols) ? row[x] : cv::Vec3b(0, 0, 0);
+				size_t p = (size_t)y * DIM_X + x;
+				double luma = (pixel[0] + pixel[1] + pixel[2]) / 3;								// as Analyze_Pixels always took it
+				double delta = luma - mean[p];
+				mean[p] += delta * inverse;
+				m2[p] += delta * (luma - mean[p]);
+				if (!counts.empty()) {
+					uint16_t* bins = &counts[p * 3 * 256];
+					bins[pixel[0]]++;
+					bins[256 + pixel[1]]++;
+					bins[512 + pixel[2]]++;
+				}
+			}
+		}
+	}
+
+	/* flush: adds the counts to stats and clears them; the caller serializes access to stats
+	*/
+	void flush(PixelStats& stats)
+	{
+		for (size_t i = 0; i < counts.size(); i++) stats.counts[i] += counts[i];
+		std::fill(counts.begin(), counts.end(), 0);
+		unflushed = 0;
+	}
+
+	/* merge: adds everything to stats (Chan et al.'s pairwise update for the variance)
+	*/
+	void merge(PixelStats& stats)
+	{
+		flush(stats);
+		if (images == 0) return;
+		double n_a = (double)stats.images, n_b = (double)images, n = n_a + n_b;
+		for (size_t p = 0; p < PixelStats::PIXELS; p++) {
+			double delta = mean[p] - stats.mean[p];
+			stats.mean[p] += delta * n_b / n;
+			stats.m2[p] += m2[p] + delta * delta * n_a * n_b / n;
+		}
+		stats.images += images;
+	}
+};
+
+const size_t PIXEL_STATS_BUDGET = (size_t)1 << 30;
+const size_t PIXEL_STATS_FILE_BYTES = (size_t)4 << 20;										// a decoded file, per thread
+
+/* Gather_Pixel_Stats: the statistics of every image, reading each file once on as many threads as fit in memory_budget
+*/
+void Gather_Pixel_Stats(const deque<image*>& images, PixelStats& stats, size_t memory_budget = PIXEL_STATS_BUDGET)
+{
+	bool modes = !stats.counts.empty();
+	size_t shared = stats.counts.size() * sizeof(uint32_t) + PixelStats::PIXELS * 2 * sizeof(double);
+	size_t per_thread = PixelStatsWorker::bytes(modes) + PIXEL_STATS_FILE_BYTES;
+	size_t threads = Tile_Threads();
+	threads = (memory_budget > shared + per_thread) ? min(threads, (memory_budget - shared) / per_thread) : 1;
+
+	std::vector<std::unique_ptr<PixelStatsWorker>> workers;
+	for (size_t thread = 0; thread < threads; thread++) workers.push_back(std::unique_ptr<PixelStatsWorker>(new PixelStatsWorker(modes)));
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::mutex stats_mutex;
+	For_Each_Tile(images, (unsigned)threads, [&](unsigned thread, size_t, const cv::Mat& tile) {
+		PixelStatsWorker& worker = *workers[thread];
+		worker.add(tile);
+		if (worker.full()) {
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			worker.flush(stats);
+		}
+	});
+	for (std::unique_ptr<PixelStatsWorker>& worker : workers) worker->merge(stats);
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	cout << "Pixel statistics of " << stats.images << " images on " << threads << " threads in " << seconds << " s (" << (seconds > 0 ? stats.images / seconds : 0) << " images/s)" << endl;
+}
 
 void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 {
@@ -202,26 +445,13 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 	cout << " found " << images.size() << " images." << endl;
 
 	map<uint64, set<int>> hashmap;
-	clock_t start_time, end_time, total_time = 0;
 	double avg_time;
 	int collisions = 0;
 	int unique_hashes = 0;
 
 	if (DO_OLD_ALGO) {
 		// hash images using old algorithm
-		hashmap.clear();
-		total_time = 0;
-		for (int i = 0; i < images.size(); i++) {
-			cv::Mat img = images[i]->mat();
-			uint64 hash;
-
-			start_time = clock();
-			hash = Old_Hash_Algorithm_1(img);
-			end_time = clock();
-			total_time += end_time - start_time;
-			hashmap[hash].insert(i);
-		}
-		avg_time = ((double)total_time) / images.size();
+		avg_time = Hash_Tiles(images, [](const cv::Mat& img) { return Old_Hash_Algorithm_1(img); }, hashmap);
 
 		// count collisions
 		collisions = 0;
@@ -236,6 +466,11 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 	}
 
 	deque<HashCoord> coords;
+
+	// both passes choose coordinates from the same statistics, gathered in one read of the images
+	PixelStats stats(DO_LOW_MODE);
+	if (DO_HIGH_VAR || DO_LOW_MODE)
+		Gather_Pixel_Stats(images, stats);
 	
 	if (DO_HIGH_VAR) {
 		// get sum, mean, and variance of each pixel value in image set
@@ -243,48 +478,11 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		out.open(dest.string());
 		out << "y,x,sum,mean,var,mode_count" << endl;
 
-
-		long_dim* sum = new long_dim[DIM_Y];
-		double_dim* mean = new double_dim[DIM_Y];
-		double_dim* var = new double_dim[DIM_Y];
-		deque<uchar> pixvals[DIM_Y][DIM_X];
-
-		// init to 0
 		for (int y = 0; y < DIM_Y; y++) {
 			for (int x = 0; x < DIM_X; x++) {
-				sum[y][x] = 0;
-			}
-		}
-
-
-		// get pixvals and sums
-		for (image* img_ptr : images) {
-			cv::Mat img = img_ptr->mat();
-			for (int y = 0; y < DIM_Y; y++) {
-				for (int x = 0; x < DIM_X; x++) {
-					cv::Vec3b pixel = (y < img.rows && x < img.cols) ? img.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
-					uchar pixval = round((pixel[0] + pixel[1] + pixel[2]) / 3);
-					sum[y][x] += pixval;
-					pixvals[y][x].push_back(pixval);
-				}
-			}
-		}
-
-		for (int y = 0; y < DIM_Y; y++) {
-			for (int x = 0; x < DIM_X; x++) {
-				// mean
-				mean[y][x] = ((long double)sum[y][x]) / images.size();
-
-				// variance
-				var[y][x] = 0;
-				for (uchar pixval : pixvals[y][x]) {
-					var[y][x] += pow(pixval - mean[y][x], 2);
-				}
-				var[y][x] /= images.size();
-
-				// max_with_same_pixel
-
-				out << y << "," << x << "," << sum[y][x] << "," << mean[y][x] << "," << var[y][x] << endl;
+				out << y << "," << x << "," << (long long)(stats.sum(y, x) + 0.5) << "," << stats.mean[y * DIM_X + x] << "," << stats.variance(y, x);
+				if (DO_LOW_MODE) out << "," << stats.mode_count(y, x);
+				out << endl;
 			}
 		}
 		out.close();
@@ -303,10 +501,10 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 				double high_var = 0;
 				for (int r = y; r < y + block_height; r++) {
 					for (int c = x; c < x + block_width; c++) {
-						if (var[r][c] > high_var) {
+						if (stats.variance(r, c) > high_var) {
 							best.x = c;
 							best.y = r;
-							high_var = var[r][c];
+							high_var = stats.variance(r, c);
 						}
 					}
 				}
@@ -326,19 +524,7 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		out.close();
 
 		// hash images using high-variance coordinates and store collisions
-		hashmap.clear();
-		total_time = 0;
-		for (int i = 0; i < images.size(); i++) {
-			cv::Mat img = images[i]->mat();
-			uint64 hash;
-
-			start_time = clock();
-			hash = FNV_Hash(img, coords);
-			end_time = clock();
-			total_time += end_time - start_time;
-			hashmap[hash].insert(i);
-		}
-		avg_time = ((double)total_time) / images.size();
+		avg_time = Hash_Tiles(images, [&](const cv::Mat& img) { return FNV_Hash(img, coords); }, hashmap);
 
 		// count collisions
 		collisions = 0;
@@ -350,9 +536,6 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 
 		out << endl;
 		out.close();
-		delete[] sum;
-		delete[] mean;
-		delete[] var;
 	}
 
 	if (DO_LOW_MODE) {
@@ -361,25 +544,6 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		hashmap.clear();
 		deque<int> low_modes;
 
-		// get pixcounts for each possible x,y,RGB
-		unsigned long* pixcounts = new unsigned long[DIM_Y * DIM_X * 3 * 256];
-		for (int y = 0; y < DIM_Y; y++)
-			for (int x = 0; x < DIM_X; x++)
-				for (int c = 0; c < 3; c++)
-					for (int p = 0; p < 256; p++)
-						pixcounts[(y * DIM_X * 3 * 256) + (x * 3 * 256) + (c * 256) + p] = 0;
-
-		for (image* img_ptr : images) {
-			cv::Mat img = img_ptr->mat();
-			for (int y = 0; y < DIM_Y; y++) {
-				for (int x = 0; x < DIM_X; x++) {
-					cv::Vec3b pixel = (y < img.rows && x < img.cols) ? img.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
-					for (int c = 0; c < 3; c++)
-						pixcounts[(y * DIM_X * 3 * 256) + (x * 3 * 256) + (c * 256) + pixel[c]]++;
-				}
-			}
-		}
-
 		// find highest variance in 8x8 blocks - total of (128/9)^2 = 14^2 = 196 coordinates
 		// find highest variance in 6x6 blocks - total of (128/7)^2 = 18^2 = 324 coordinates
 		// generalization: total of (128/(bw+1))*(128/(bh+1)) coordinates
@@ -394,8 +558,7 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 				for (int r = y; r < y + block_height; r++) {
 					for (int c = x; c < x + block_width; c++) {
 						// use overall mode
-						unsigned long mode = *max_element(pixcounts + (r * DIM_X * 3 * 256) + (c * 3 * 256),
-														  pixcounts + (r * DIM_X * 3 * 256) + (c * 3 * 256) + (3 * 256));
+						unsigned long mode = stats.mode_count(r, c);
 						// use RGB mode average
 						//unsigned long mode_red = *max_element(pixcounts + (r * DIM_X * 3 * 256) + (c * 3 * 256),
 						//									  pixcounts + (r * DIM_X * 3 * 256) + (c * 3 * 256) + 256);
@@ -428,19 +591,7 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		for (int i = 0; i < coords.size(); i++)
 			out << coords[i].x << "," << coords[i].y << "," << low_modes[i] << endl;
 
-		hashmap.clear();
-		total_time = 0;
-		for (int i = 0; i < images.size(); i++) {
-			cv::Mat img = images[i]->mat();
-			uint64 hash;
-
-			start_time = clock();
-			hash = Murmur2_Hash(img, coords);
-			end_time = clock();
-			total_time += end_time - start_time;
-			hashmap[hash].insert(i);
-		}
-		avg_time = ((double)total_time) / images.size();
+		avg_time = Hash_Tiles(images, [&](const cv::Mat& img) { return Murmur2_Hash(img, coords); }, hashmap);
 
 		// find the differing coordinates in images with hash collisions
 		ofstream collout;
@@ -465,7 +616,6 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		out << endl;
 		out.close();
 		collout.close();
-		delete[] pixcounts;
 	}
 
 	if (DO_COLANLYZ) {
@@ -531,19 +681,7 @@ void Analyze_Pixels(fs::path analysis, fs::path dest, bool name_is_hash = false)
 		}
 
 		// hash images using frequently-colliding coords
-		hashmap.clear();
-		total_time = 0;
-		for (int i = 0; i < images.size(); i++) {
-			cv::Mat img = images[i]->mat();
-			uint64 hash;
-
-			start_time = clock();
-			hash = FNV_Hash(img, coords);
-			end_time = clock();
-			total_time += end_time - start_time;
-			hashmap[hash].insert(i);
-		}
-		avg_time = ((double)total_time) / images.size();
+		avg_time = Hash_Tiles(images, [&](const cv::Mat& img) { return FNV_Hash(img, coords); }, hashmap);
 
 		// count collisions
 		collisions = 0;
@@ -567,26 +705,15 @@ void Analyze_Collisions(fs::path analysis, fs::path dest)
 	deque<image*> images;
 	unordered_set<uint64> image_hashes;
 	get_images(analysis, images, image_hashes);
+	fs::path root = fs::is_directory(analysis) ? analysis : analysis.parent_path();			// a corpus sits next to the tree it was built from
 
 	cout << " found " << images.size() << " images." << endl;
 
 	map<uint64, set<int>> hashmap;
-	clock_t start_time, end_time, total_time;
 	double avg_time;
 	long collisions = 0;
 
-	total_time = 0;
-	for (int i = 0; i < images.size(); i++) {
-		cv::Mat img = images[i]->mat();
-		uint64 hash;
-
-		start_time = clock();
-		hash = Murmur2_Hash(img);
-		end_time = clock();
-		total_time += end_time - start_time;
-		hashmap[hash].insert(i);
-	}
-	avg_time = ((double)total_time) / images.size();
+	avg_time = Hash_Tiles(images, [](const cv::Mat& img) { return Murmur2_Hash(img); }, hashmap);
 
 	// find the differing coordinates in images with hash collisions
 	ofstream collout;
@@ -603,7 +730,7 @@ void Analyze_Collisions(fs::path analysis, fs::path dest)
 		// write collisions to collout
 		collout << hashset.first;
 		for (int i : hashset.second) {
-			collout << "," << i << " - " << make_relative(analysis, images[i]->path.string()).string() << " (rect " << images[i]->rect.x << ", " << images[i]->rect.y  << " )";
+			collout << "," << i << " - " << make_relative(root, images[i]->path.string()).string() << " (rect " << images[i]->rect.x << ", " << images[i]->rect.y  << " )";
 		}
 		collout << endl;
 
@@ -645,7 +772,7 @@ void Analyze_Collisions(fs::path analysis, fs::path dest)
 						images[*iter2]->path.stem().string() + images[*iter2]->rect_char();
 
 					string name = base_name + ".png";
-					cv::imwrite(((analysis / "collisions") / name).string(), comparison);
+					cv::imwrite(((root / "collisions") / name).string(), comparison);
 
 					// write differing pixels to analysis\collisions
 					cv::Mat differing_pixels(comparison.size(), comparison.type());
@@ -661,7 +788,7 @@ void Analyze_Collisions(fs::path analysis, fs::path dest)
 					}
 
 					name = base_name + "_diff.png";
-					cv::imwrite(((analysis / "collisions") / name).string(), differing_pixels);
+					cv::imwrite(((root / "collisions") / name).string(), differing_pixels);
 				}
 
 				stringstream ss;
@@ -686,31 +813,6 @@ void Analyze_Collisions(fs::path analysis, fs::path dest)
 	cout << "Difference/CollPair: " << ((coll_pairs == 0) ? 0 : (((double)total_difference) / coll_pairs)) << endl;
 }
 
-void Create_Hashmap(fs::path texture_dir, fs::path output_dir, bool append = false)
-{
-	fs::path hashmap_csv(output_dir / (texture_dir.filename().string() + "_hm.csv"));
-	//fs::path collisions_dir(output_dir / (texture_dir.filename().string() + "_coll.csv"));
-
-	ofstream out;
-	unsigned int open_mode = ofstream::out;
-	if (append) open_mode |= ofstream::app;
-	out.open(hashmap_csv.string(), open_mode);
-
-	fs::directory_iterator end;
-	for (fs::directory_iterator iter(texture_dir); iter != end; iter++) {
-		fs::path path = iter->path();
-		if (fs::is_directory(path)) {
-			// recursive
-			Create_Hashmap(path, output_dir, true);
-		} else if (fs::is_regular_file(path) && boost::iequals(path.extension().string(), ".bmp")) {
-			cv::Mat img = cv::imread(path.string(), CV_LOAD_IMAGE_COLOR);
-			uint64 hash_combined, hash_upper, hash_lower;
-			hash_combined = FNV_Hash_Combined_64(img, hash_upper, hash_lower, COORDS, COORDS_LEN, true);
-			out << path.stem().string() << "," << hash_combined << "," << hash_upper << "," << hash_lower << endl;
-		}
-	}
-}
-
 void Get_Blank_Hashes(cv::Mat& img)
 {
 	cv::Mat normal = img(cv::Rect(0, 0, 128, 256));
@@ -1028,6 +1130,68 @@ void Copy_Unique(fs::path root, fs::path dest)
 	cout << " successfully wrote " << successful << " unique images to " << dest.string() << "." << endl;
 }
 
+/* Count_Differing: the pixels in which two tiles differ over DIM_X x DIM_Y (black outside either), counting no further than max_diff + 1
+   returns: the differing pixels; difference receives the sum of their channel differences, diff_coords (if not NULL) where they are
+*/
+unsigned Count_Differing(const cv::Mat& a, const cv::Mat& b, unsigned max_diff, unsigned& difference, deque<HashCoord>* diff_coords = NULL)
+{
+	unsigned differing = 0;
+	difference = 0;
+	for (int y = 0; y < DIM_Y && differing <= max_diff; y++) {
+		for (int x = 0; x < DIM_X && differing <= max_diff; x++) {
+			cv::Vec3b pixela = (y < a.rows && x < a.cols) ? a.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
+			cv::Vec3b pixelb = (y < b.rows && x < b.cols) ? b.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
+			bool diff = false;
+			for (int c = 0; c < 3; c++) {
+				if (pixela[c] != pixelb[c]) {
+					diff = true;
+					difference += abs(pixela[c] - pixelb[c]);
+				}
+			}
+			if (diff) {
+				differing++;
+				if (diff_coords) diff_coords->push_back(HashCoord(x, y));
+			}
+		}
+	}
+	return differing;
+}
+
+/* Load_Similarity_Index: indexes the signatures of images; they are read from <root>.simidx when root is a corpus with an index
+   that is up to date, else computed on all threads (and saved there, when root is a corpus)
+*/
+void Load_Similarity_Index(fs::path root, const deque<image*>& images, SimilarityIndex& index)
+{
+	bool is_corpus = fs::is_regular_file(root) && TileCorpus::is_corpus(root);
+	fs::path index_file(root);
+	index_file += ".simidx";
+	uint64_t corpus_time = 0;
+	if (is_corpus) {
+		boost::system::error_code ec;
+		corpus_time = (uint64_t)fs::last_write_time(root, ec);
+		if (index.read(index_file, DIM_X, images.size(), corpus_time)) {
+			bool matches = true;
+			for (size_t i = 0; i < images.size() && matches; i++) matches = index.signature(i).hash == images[i]->hash;
+			if (matches) {
+				cout << "Read " << index.size() << " signatures from " << index_file.string() << endl;
+				return;
+			}
+		}
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<TileSignature> signatures(images.size());
+	For_Each_Tile(images, Tile_Threads(), [&](unsigned, size_t i, const cv::Mat& tile) {
+		signatures[i] = SimilarityIndex::signature(tile, images[i]->hash, DIM_X);
+	});
+	index.build(signatures, DIM_X);
+	cout << "Computed " << index.size() << " signatures in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << endl;
+	if (is_corpus) {
+		if (index.write(index_file, corpus_time)) cout << "Wrote " << index_file.string() << endl;
+		else cout << "Could not write " << index_file.string() << endl;
+	}
+}
+
 void Find_Similar_Images(image base_img, fs::path root, unsigned max_diff, bool name_is_hash = false)
 {
 	cout << "Reading images...";
@@ -1037,6 +1201,8 @@ void Find_Similar_Images(image base_img, fs::path root, unsigned max_diff, bool
 	get_images(root, images, image_hashes, name_is_hash);
 
 	cout << " found " << images.size() << " images." << endl;
+	SimilarityIndex index;
+	Load_Similarity_Index(root, images, index);
 	cout << "Finding images that differ from " << base_img.path.filename() << " by 0 < x <= " << max_diff << " pixels:" << endl;;
 
 	// create root/../similar
@@ -1055,29 +1221,16 @@ void Find_Similar_Images(image base_img, fs::path root, unsigned max_diff, bool
 	cv::Mat base_mat = base_img.mat();
 	unsigned similar = 0;
 
-	for (image * img : images) {
+	// only the images whose signatures allow it are compared pixel by pixel
+	std::vector<uint32_t> candidates;
+	index.candidates(SimilarityIndex::signature(base_mat, base_img.hash, DIM_X), max_diff, candidates);
+
+	for (uint32_t candidate : candidates) {
+		image * img = images[candidate];
 		cv::Mat mat = img->mat();
 		unsigned difference = 0;
-		unsigned differing = 0;
-
 		deque<HashCoord> diff_coords;
-		for (int y = 0; y < DIM_Y && differing <= max_diff; y++) {
-			for (int x = 0; x < DIM_X && differing <= max_diff; x++) {
-				cv::Vec3b pixela = (y < base_mat.rows && x < base_mat.cols) ? base_mat.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
-				cv::Vec3b pixelb = (y < mat.rows && x < mat.cols) ? mat.at<cv::Vec3b>(y, x) : cv::Vec3b(0, 0, 0);
-				bool diff = false;
-				for (int c = 0; c < 3; c++) {
-					if (pixela[c] != pixelb[c]) {
-						diff = true;
-						difference += abs(pixela[c] - pixelb[c]);
-					}
-				}
-				if (diff) {
-					differing++;
-					diff_coords.push_back(HashCoord(x, y));
-				}
-			}
-		}
+		unsigned differing = Count_Differing(base_mat, mat, max_diff, difference, &diff_coords);
 
 		if (differing > 0 && differing <= max_diff) {
 			similar++;
@@ -1093,7 +1246,124 @@ void Find_Similar_Images(image base_img, fs::path root, unsigned max_diff, bool
 		}
 	}
 
-	cout << "Found " << similar << " similar images." << endl;
+	cout << "Found " << similar << " similar images (" << candidates.size() << " of " << images.size() << " compared)." << endl;
+}
+
+/* Find_All_Similar: finds every pair of images that differ by 0 < x <= max_diff pixels, one index query per image on all threads,
+   and writes the pairs to dest; best on a corpus, where comparing two tiles reads nothing
+*/
+void Find_All_Similar(fs::path root, unsigned max_diff, fs::path dest, bool name_is_hash = false)
+{
+	cout << "Reading images...";
+	deque<image*> images;
+	unordered_set<uint64> image_hashes;
+	get_images(root, images, image_hashes, name_is_hash);
+	cout << " found " << images.size() << " images." << endl;
+
+	SimilarityIndex index;
+	Load_Similarity_Index(root, images, index);
+
+	struct similar_pair_t
+	{
+		uint32_t a, b;
+		unsigned differing, difference;
+	};
+	unsigned threads = Tile_Threads();
+	std::vector<std::vector<similar_pair_t>> found(threads);
+	std::vector<size_t> compared(threads, 0);
+	std::atomic<size_t> next(0);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	auto work = [&](unsigned thread) {
+		std::vector<uint32_t> candidates;
+		for (size_t i = next++; i < images.size(); i = next++) {
+			index.candidates(index.signature(i), max_diff, candidates);
+			cv::Mat mat;
+			for (uint32_t j : candidates) {
+				if (j <= i) continue;															// each pair once
+				if (mat.empty()) mat = images[i]->mat();
+				compared[thread]++;
+				similar_pair_t match;
+				match.differing = Count_Differing(mat, images[j]->mat(), max_diff, match.difference);
+				if (match.differing == 0 || match.differing > max_diff) continue;
+				match.a = (uint32_t)i;
+				match.b = j;
+				found[thread].push_back(match);
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned thread = 1; thread < threads; thread++) workers.push_back(std::thread(work, thread));
+	work(0);
+	for (std::thread& worker : workers) worker.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<similar_pair_t> pairs;
+	size_t total_compared = 0;
+	for (unsigned thread = 0; thread < threads; thread++) {
+		pairs.insert(pairs.end(), found[thread].begin(), found[thread].end());
+		total_compared += compared[thread];
+	}
+	std::sort(pairs.begin(), pairs.end(), [](const similar_pair_t& x, const similar_pair_t& y) { return x.a != y.a ? x.a < y.a : x.b < y.b; });
+
+	ofstream out(dest.string());
+	out << "hash_a,path_a,hash_b,path_b,differing,difference" << endl;
+	for (const similar_pair_t& match : pairs)
+		out << images[match.a]->hash << "," << images[match.a]->path << "," << images[match.b]->hash << "," << images[match.b]->path << "," << match.differing << "," << match.difference << endl;
+	out.close();
+
+	double all_pairs = images.size() * (images.size() - (images.empty() ? 0 : 1)) / 2.0;
+	cout << pairs.size() << " similar pairs; compared " << total_compared << " of " << all_pairs << " pairs in " << seconds << " s (" <<
+		(seconds > 0 ? images.size() / seconds : 0) << " queries/s)" << endl;
+	cout << "Wrote " << dest.string() << endl;
+}
+
+// picks hash coordinates that leave the fewest collisions among the tiles of a corpus (or folder), and compares them with COORDS;
+// writes the coordinates in pick order to dest and as a HashCoord table (for texturehash.h) next to it
+void Optimize_Coords(fs::path analysis, fs::path dest, size_t max_coords = COORDS_LEN, int passes = 0)
+{
+	cout << "Reading images...";
+	deque<image*> images;
+	unordered_set<uint64> image_hashes;
+	get_images(analysis, images, image_hashes);
+	cout << " found " << images.size() << " images." << endl;
+
+	std::vector<cv::Mat> tiles;
+	for (image* img : images) tiles.push_back(img->mat());							// views of the corpus; decoded once otherwise
+	CoordOptimizer optimizer(tiles, DIM_X, DIM_Y);
+	cout << "COORDS (" << COORDS_LEN << "): " << optimizer.collisions(COORDS, COORDS_LEN) << " collisions" << endl;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<CoordStep> steps;
+	size_t collisions = optimizer.greedy(max_coords, steps);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	cout << "Greedy (" << steps.size() << "): " << collisions << " collisions in " << seconds << " s" << endl;
+
+	std::vector<HashCoord> coords;
+	for (const CoordStep& step : steps) coords.push_back(step.coord);
+	if (passes > 0) {
+		start = std::chrono::steady_clock::now();
+		collisions = optimizer.local_search(coords, passes);
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		cout << "Local search (" << coords.size() << "): " << collisions << " collisions in " << seconds << " s" << endl;
+	}
+
+	std::vector<size_t> prefix;
+	if (!coords.empty()) optimizer.collisions(&coords[0], coords.size(), &prefix);
+	ofstream out(dest.string());
+	out << "x,y,collisions" << endl;
+	for (size_t i = 0; i < coords.size(); i++)
+		out << coords[i].x << "," << coords[i].y << "," << prefix[i] << endl;
+	out.close();
+
+	fs::path table(dest);
+	table.replace_extension(".inc");
+	out.open(table.string());
+	out << "const size_t COORDS_LEN = " << coords.size() << ";" << endl << "const HashCoord COORDS[COORDS_LEN] = { ";
+	for (size_t i = 0; i < coords.size(); i++)
+		out << (i ? ", " : "") << "HashCoord(" << coords[i].x << ", " << coords[i].y << ")";
+	out << " };" << endl;
+	out.close();
+	cout << "Wrote " << dest.string() << " and " << table.string() << endl;
 }
 
 void Write_Unique_To_File(fs::path root, fs::path file)
@@ -1116,32 +1386,1138 @@ void Write_Unique_To_File(fs::path root, fs::path file)
 	cout << " done!" << endl;
 }
 
-int _tmain(int argc, _TCHAR* argv[])
+// Murmur2_Hash_Texture must match Murmur2_Hash_Combined_Naive for every size, half, and coordinate count
+bool Test_Murmur2_Combined()
 {
-	// test Murmur2_Combined
-	fs::path test_file("E:/Tonberry/Textures/Magic Animations/7167.bmp");
-	//uint64 hash_ui, hash_li;
-	uint64 hash_cn, hash_ucn, hash_lcn;
-	uint64 hash_c, hash_uc, hash_lc;
+	const int sizes[][2] = { { 1, 1 }, { 50, 64 }, { 127, 128 }, { 128, 129 }, { 256, 200 }, { 256, 256 }, { 300, 300 } };
+	const size_t lens[] = { 1, 2, 3, 4, 5, 7, 64, 65, 323, COORDS_LEN };
+	int failures = 0, tests = 0;
+
+	cv::RNG rng(0x746f6e62);
+	for (auto size : sizes) {
+		cv::Mat img(size[1], size[0], CV_8UC3), img_bgra;
+		rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+		cv::cvtColor(img, img_bgra, CV_BGR2BGRA);										// as the locked rect holds it
+
+		for (size_t len : lens) {
+			uint64 naive_upper, naive_lower, upper, lower;
+			uint64_t upper_bgra, lower_bgra;
+			uint64 naive = Murmur2_Hash_Combined_Naive(img, naive_upper, naive_lower, COORDS, len);
+			uint64 combined = Murmur2_Hash_Combined(img, upper, lower, COORDS, len);
+			uint64_t combined_bgra = Murmur2_Hash_Texture(img_bgra.data, img_bgra.step, 4, img_bgra.cols, img_bgra.rows, VRAM_DIM / 2, COORDS, len, upper_bgra, lower_bgra);
+
+			tests++;
+			if (combined != naive || upper != naive_upper || lower != naive_lower ||
+				combined_bgra != naive || upper_bgra != naive_upper || lower_bgra != naive_lower) {
+				cout << "Mismatch: " << size[0] << "x" << size[1] << ", " << len << " coords" << endl;
+				failures++;
+			}
+		}
+	}
+
+	cout << "Murmur2_Combined: " << (tests - failures) << "/" << tests << " match" << endl;
+	return failures == 0;
+}
+
+// per-texture cost of the three-buffer hash against the streaming one
+void Benchmark_Murmur2_Combined(int iterations = 100000)
+{
+	cv::Mat img(VRAM_DIM, VRAM_DIM, CV_8UC3), img_bgra;
+	cv::randu(img, 0, 256);
+	cv::cvtColor(img, img_bgra, CV_BGR2BGRA);
+
+	uint64 upper, lower, sink = 0;
+	uint64_t upper_bgra, lower_bgra;
+	clock_t start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += Murmur2_Hash_Combined_Naive(img, upper, lower, COORDS, COORDS_LEN) ^ upper ^ lower;
+	double naive_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += Murmur2_Hash_Texture(img_bgra.data, img_bgra.step, 4, img_bgra.cols, img_bgra.rows, VRAM_DIM / 2, COORDS, COORDS_LEN, upper_bgra, lower_bgra) ^ upper_bgra ^ lower_bgra;
+	double stream_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	cout << "Murmur2_Hash_Combined_Naive: " << (naive_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "Murmur2_Hash_Texture:        " << (stream_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "(checksum " << sink << ")" << endl;
+}
 
-	cv::Mat img = cv::imread(test_file.string());
+// every hash must read the same from a SamplingPlan's samples as from the image
+bool Test_Sampling_Plan()
+{
+	const int sizes[][2] = { { 1, 1 }, { 50, 64 }, { 127, 128 }, { 128, 129 }, { 128, 200 }, { 256, 256 }, { 300, 300 } };
+	int failures = 0, tests = 0;
+
+	SamplingPlanCache plans;
+	const unsigned char* rgb = NULL;
+	cv::RNG rng(0x706c616e);
+	for (auto size : sizes) {
+		cv::Mat img(size[1], size[0], CV_8UC3);
+		rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+
+		// one gather for Murmur2 and FNV_Hash
+		rgb = plans.gather(COORDS, COORDS_LEN, img.cols, img.rows, img.step, img.elemSize(), VRAM_DIM / 2, img.data);
+		tests++;
+		if ((uintptr_t)rgb % TextureHash::SAMPLE_ALIGNMENT != 0) {
+			cout << "SamplingPlanCache::gather misaligned: " << size[0] << "x" << size[1] << endl;
+			failures++;
+		}
+		uint64 upper, lower;
+		uint64_t upper_gathered, lower_gathered;
+		uint64 combined = Murmur2_Hash_Combined_Naive(img, upper, lower, COORDS, COORDS_LEN);
+		tests++;
+		if (combined != Murmur2_Hash_Gathered(rgb, COORDS_LEN, upper_gathered, lower_gathered) || upper != upper_gathered || lower != lower_gathered) {
+			cout << "Murmur2_Hash_Gathered mismatch: " << size[0] << "x" << size[1] << endl;
+			failures++;
+		}
+		tests++;
+		if (Murmur2_Hash(img, COORDS, COORDS_LEN) != MurmurHash64B(rgb, COORDS_LEN * 3)) {
+			cout << "Murmur2_Hash mismatch: " << size[0] << "x" << size[1] << endl;
+			failures++;
+		}
+		for (int use_RGB = 0; use_RGB < 2; use_RGB++) {
+			tests++;
+			if (FNV_Hash(img, COORDS, COORDS_LEN, use_RGB != 0) != FNV_Hash_Gathered(rgb, COORDS_LEN, use_RGB != 0)) {
+				cout << "FNV_Hash_Gathered mismatch: " << size[0] << "x" << size[1] << endl;
+				failures++;
+			}
+		}
 
-	//hash_ui = Murmur2_Hash(img, COORDS, COORDS_LEN);
+		// the FNV combined hashes sample the lower half elsewhere
+		if (img.rows > VRAM_DIM / 2)
+			rgb = plans.gather(COORDS, COORDS_LEN, img.cols, img.rows, img.step, img.elemSize(), FNV_Lower_Offset(img.rows), img.data);
+		for (int use_RGB = 0; use_RGB < 2; use_RGB++) {
+			uint64 upper64, lower64, upper64_gathered, lower64_gathered;
+			uint32 upper32, lower32, upper32_gathered, lower32_gathered;
+			uint64 combined64 = FNV_Hash_Combined_64(img, upper64, lower64, COORDS, COORDS_LEN, use_RGB != 0);
+			uint32 combined32 = FNV_Hash_Combined_32(img, upper32, lower32, COORDS, COORDS_LEN, use_RGB != 0);
+			tests++;
+			if (combined64 != FNV_Hash_Combined_64_Gathered(rgb, img.rows, upper64_gathered, lower64_gathered, COORDS_LEN, use_RGB != 0) ||
+				upper64 != upper64_gathered || lower64 != lower64_gathered ||
+				combined32 != FNV_Hash_Combined_32_Gathered(rgb, img.rows, upper32_gathered, lower32_gathered, COORDS_LEN, use_RGB != 0) ||
+				upper32 != upper32_gathered || lower32 != lower32_gathered) {
+				cout << "FNV_Hash_Combined_Gathered mismatch: " << size[0] << "x" << size[1] << endl;
+				failures++;
+			}
+		}
 
-	//cout << "Upper (Individual):\t" << hash_ui << endl;
+		rgb = plans.gather(hash1, 64, img.cols, img.rows, img.step, img.elemSize(), VRAM_DIM / 2, img.data);
+		tests++;
+		if (Hash_Algorithm_1(img) != Hash_Algorithm_1_Gathered(rgb)) {
+			cout << "Hash_Algorithm_1_Gathered mismatch: " << size[0] << "x" << size[1] << endl;
+			failures++;
+		}
+	}
 
-	hash_cn = Murmur2_Hash_Combined_Naive(img, hash_ucn, hash_lcn, COORDS, COORDS_LEN);
+	cout << "SamplingPlan: " << (tests - failures) << "/" << tests << " match" << endl;
+	return failures == 0;
+}
 
-	cout << "Upper (Naive):\t\t" << hash_ucn << endl;
-	cout << "Lower (Naive):\t\t" << hash_lcn << endl;
-	cout << "Combined (Naive):\t" << hash_cn << endl;
+// per-texture cost of the policy hashers with the coordinate count known at compile time against at run time
+void Benchmark_Policy_Hashers(int iterations = 100000)
+{
+	typedef TextureHash::Policy::TextureHasher<TextureHash::Policy::FNVMixer<uint64_t>, TextureHash::Policy::LumaAverageChannels, 0> FNV64_LumaAverage_Runtime;
+	typedef TextureHash::Policy::TextureHasher<TextureHash::Policy::FNVMixer<uint64_t>, TextureHash::Policy::RGBChannels, 0> FNV64_RGB_Runtime;
+
+	cv::Mat img(VRAM_DIM, VRAM_DIM, CV_8UC3);
+	cv::randu(img, 0, 256);
+	SamplingPlanCache plans;
+	const unsigned char* rgb = plans.gather(COORDS, COORDS_LEN, img.cols, img.rows, img.step, img.elemSize(), FNV_Lower_Offset(img.rows), img.data);
+
+	uint64 upper, lower, sink = 0;
+	clock_t start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += FNV_Hash_Combined_64(img, upper, lower, COORDS, COORDS_LEN, true) ^ upper ^ lower;
+	double mat_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += FNV64_LumaAverage_Runtime::hash_combined(rgb, true, upper, lower, COORDS_LEN) ^ upper ^ lower;
+	double runtime_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += FNV64_LumaAverage_Hasher::hash_combined(rgb, true, upper, lower) ^ upper ^ lower;
+	double fixed_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += FNV64_RGB_Runtime::hash(rgb, COORDS_LEN);
+	double rgb_runtime_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	start_time = clock();
+	for (int i = 0; i < iterations; i++)
+		sink += FNV64_RGB_Hasher::hash(rgb);
+	double rgb_fixed_time = double(clock() - start_time) / CLOCKS_PER_SEC;
+
+	cout << "FNV_Hash_Combined_64 (cv::Mat):               " << (mat_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "FNV64 luma+averages combined, N = 0:          " << (runtime_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "FNV64 luma+averages combined, N = COORDS_LEN: " << (fixed_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "FNV64 RGB, N = 0:                             " << (rgb_runtime_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "FNV64 RGB, N = COORDS_LEN:                    " << (rgb_fixed_time * 1e6 / iterations) << " us/texture" << endl;
+	cout << "(checksum " << sink << ")" << endl;
+}
 
-	hash_c = Murmur2_Hash_Combined(img, hash_uc, hash_lc, COORDS, COORDS_LEN);
+// one measurement of Benchmark_Hashes: an algorithm over one corpus shape, in ns per hash
+struct hash_bench_t
+{
+	string		algorithm;
+	string		input;			// "mat" (CV_8UC3, as the tools hash) or "raw" (A8R8G8B8 with a pitch, as the DLL hashes a locked rect)
+	string		corpus;			// "synthetic" or "sampled"
+	int			width;
+	int			height;
+	size_t		images;
+	int			reps;
+	int			batch;			// hashes per repetition
+	double		min_ns;
+	double		median_ns;
+	double		mean_ns;
+	double		stddev_ns;
+	double		p95_ns;
+};
 
-	cout << "Upper:\t\t\t" << hash_uc << endl;
-	cout << "Lower:\t\t\t" << hash_lc << endl;
-	cout << "Combined:\t\t" << hash_c << endl;
-	cout << "Match " << ((hash_c == hash_cn) ? "yes" : "no") << endl;
+// images of one shape, as cv::Mat and as locked rects
+struct hash_corpus_t
+{
+	string								name;
+	int									width;
+	int									height;
+	size_t								pitch;		// bytes per row of the raw images
+	std::vector<cv::Mat>				mats;
+	std::vector<std::vector<uint8_t>>	raws;
+
+	void add(const cv::Mat& img)
+	{
+		cv::Mat bgra;
+		cv::cvtColor(img, bgra, CV_BGR2BGRA);
+		std::vector<uint8_t> raw(pitch * height, 0xCD);									// the padding is not the image's
+		for (int y = 0; y < height; y++)
+			memcpy(&raw[y * pitch], bgra.ptr(y), width * 4);
+		mats.push_back(img);
+		raws.push_back(raw);
+	}
+};
+
+static volatile uint64 hash_bench_sink;
+
+/* Time_Hash: times hash(i) over the images of a corpus; the first pass over the corpus warms the caches and sizes the
+   batch so that one repetition takes at least HASH_BENCH_REP_NS
+*/
+const double HASH_BENCH_REP_NS = 2e6;
+template <typename Hash>
+void Time_Hash(Hash hash, size_t images, int reps, hash_bench_t& result)
+{
+	typedef std::chrono::steady_clock bench_clock;
+	uint64 sink = 0;
+	size_t next = 0;
+	auto run = [&](int count) -> double {
+		bench_clock::time_point start = bench_clock::now();
+		for (int i = 0; i < count; i++) {
+			sink += hash(next);
+			if (++next == images) next = 0;
+		}
+		return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+	};
+
+	run((int)images);
+	int batch = 1;
+	while (run(batch) < HASH_BENCH_REP_NS && batch < (1 << 24)) batch *= 2;
+
+	std::vector<double> samples(reps);
+	for (int r = 0; r < reps; r++) samples[r] = run(batch) / batch;
+	hash_bench_sink += sink;
+
+	std::sort(samples.begin(), samples.end());
+	double sum = 0, squares = 0;
+	for (double sample : samples) sum += sample;
+	result.mean_ns = sum / reps;
+	for (double sample : samples) squares += (sample - result.mean_ns) * (sample - result.mean_ns);
+	result.stddev_ns = reps > 1 ? sqrt(squares / (reps - 1)) : 0;
+	result.min_ns = samples.front();
+	result.median_ns = (reps % 2) ? samples[reps / 2] : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+	result.p95_ns = samples[min((size_t)(0.95 * (reps - 1) + 0.5), samples.size() - 1)];
+	result.images = images;
+	result.reps = reps;
+	result.batch = batch;
+}
+
+template <typename Hash>
+void Bench_Hash(const char* algorithm, const char* input, const hash_corpus_t& corpus, int reps, Hash hash, std::vector<hash_bench_t>& results)
+{
+	hash_bench_t result;
+	result.algorithm = algorithm;
+	result.input = input;
+	result.corpus = corpus.name;
+	result.width = corpus.width;
+	result.height = corpus.height;
+	Time_Hash(hash, corpus.mats.size(), reps, result);
+	results.push_back(result);
+}
+
+// times every texture hash on the cv::Mat and the locked rect of each image; returns the number of images whose two hashes differ
+int Bench_Corpus(hash_corpus_t& corpus, int reps, std::vector<hash_bench_t>& results)
+{
+	SamplingPlanCache plans;
+	const int width = corpus.width, height = corpus.height;
+	const size_t pitch = corpus.pitch;
+	const int fnv_lower = height > VRAM_DIM / 2 ? FNV_Lower_Offset(height) : VRAM_DIM / 2;
+
+	auto omzy_mat = [&](size_t i) { return Hash_Algorithm_1(corpus.mats[i]); };
+	auto omzy_raw = [&](size_t i) {
+		const unsigned char* rgb = plans.gather(hash1, 64, width, height, pitch, 4, VRAM_DIM / 2, &corpus.raws[i][0]);
+		return Hash_Algorithm_1_Gathered(rgb);
+	};
+	auto fnv_mat = [&](size_t i) { return FNV_Hash(corpus.mats[i], COORDS, COORDS_LEN); };
+	auto fnv_raw = [&](size_t i) {
+		const unsigned char* rgb = plans.gather(COORDS, COORDS_LEN, width, height, pitch, 4, VRAM_DIM / 2, &corpus.raws[i][0]);
+		return FNV_Hash_Gathered(rgb, COORDS_LEN);
+	};
+	auto murmur2_mat = [&](size_t i) { return Murmur2_Hash(corpus.mats[i], COORDS, COORDS_LEN); };
+	auto murmur2_raw = [&](size_t i) {
+		const unsigned char* rgb = plans.gather(COORDS, COORDS_LEN, width, height, pitch, 4, VRAM_DIM / 2, &corpus.raws[i][0]);
+		return MurmurHash64B(rgb, COORDS_LEN * 3);
+	};
+	auto murmur2_combined_mat = [&](size_t i) {
+		uint64 upper, lower;
+		return Murmur2_Hash_Combined(corpus.mats[i], upper, lower, COORDS, COORDS_LEN) ^ upper ^ lower;
+	};
+	auto murmur2_combined_raw = [&](size_t i) {
+		uint64_t upper, lower;
+		return Murmur2_Hash_Texture(&corpus.raws[i][0], pitch, 4, width, height, VRAM_DIM / 2, COORDS, COORDS_LEN, upper, lower) ^ upper ^ lower;
+	};
+	auto fnv_combined_mat = [&](size_t i) {
+		uint64 upper, lower;
+		return FNV_Hash_Combined_64(corpus.mats[i], upper, lower, COORDS, COORDS_LEN) ^ upper ^ lower;
+	};
+	auto fnv_combined_raw = [&](size_t i) {
+		uint64 upper, lower;
+		const unsigned char* rgb = plans.gather(COORDS, COORDS_LEN, width, height, pitch, 4, fnv_lower, &corpus.raws[i][0]);
+		return FNV_Hash_Combined_64_Gathered(rgb, height, upper, lower, COORDS_LEN) ^ upper ^ lower;
+	};
+
+	// a raw timing only means something if it hashes the same as the cv::Mat
+	int mismatches = 0;
+	for (size_t i = 0; i < corpus.mats.size(); i++) {
+		if (omzy_mat(i) != omzy_raw(i) || fnv_mat(i) != fnv_raw(i) || murmur2_mat(i) != murmur2_raw(i) ||
+			murmur2_combined_mat(i) != (uint64)murmur2_combined_raw(i) || fnv_combined_mat(i) != fnv_combined_raw(i))
+			mismatches++;
+	}
+
+	Bench_Hash("Hash_Algorithm_1", "mat", corpus, reps, omzy_mat, results);
+	Bench_Hash("Hash_Algorithm_1", "raw", corpus, reps, omzy_raw, results);
+	Bench_Hash("FNV_Hash", "mat", corpus, reps, fnv_mat, results);
+	Bench_Hash("FNV_Hash", "raw", corpus, reps, fnv_raw, results);
+	Bench_Hash("Murmur2_Hash", "mat", corpus, reps, murmur2_mat, results);
+	Bench_Hash("Murmur2_Hash", "raw", corpus, reps, murmur2_raw, results);
+	Bench_Hash("Murmur2_Hash_Combined", "mat", corpus, reps, murmur2_combined_mat, results);
+	Bench_Hash("Murmur2_Hash_Combined", "raw", corpus, reps, murmur2_combined_raw, results);
+	Bench_Hash("FNV_Hash_Combined_64", "mat", corpus, reps, fnv_combined_mat, results);
+	Bench_Hash("FNV_Hash_Combined_64", "raw", corpus, reps, fnv_combined_raw, results);
+	return mismatches;
+}
+
+// the key of a result in a results file
+string Hash_Bench_Key(const string& algorithm, const string& input, const string& corpus, int width, int height)
+{
+	stringstream key;
+	key << algorithm << "," << input << "," << corpus << "," << width << "," << height;
+	return key.str();
+}
+
+/* Benchmark_Hashes: times every texture hash over synthetic images of the shapes the game uploads (and a few odd ones), and
+   optionally over the images of a folder; writes one CSV row per algorithm, input, and shape to results, and compares the
+   medians with those of an earlier results file
+   returns: the number of timings more than HASH_BENCH_TOLERANCE slower than the baseline, or of hashes that differ between inputs
+*/
+const double HASH_BENCH_TOLERANCE = 0.10;
+int Benchmark_Hashes(fs::path results_file,			// CSV to write
+					 fs::path baseline_file,		// CSV of an earlier run, or empty
+					 fs::path images_dir,			// folder of .png/.bmp to sample, or empty
+					 int reps = 31,					// timed repetitions per measurement
+					 size_t images = 16				// images per synthetic shape; most sampled images
+	)
+{
+	const int sizes[][2] = { { 128, 128 }, { 128, 256 }, { 256, 256 }, { 64, 48 }, { 127, 255 }, { 257, 129 } };
+	std::vector<hash_corpus_t> corpora;
+	cv::RNG rng(0x68617368);
+	for (auto size : sizes) {
+		hash_corpus_t corpus;
+		corpus.name = "synthetic";
+		corpus.width = size[0];
+		corpus.height = size[1];
+		corpus.pitch = (size[0] * 4 + 255) & ~(size_t)255;										// rows padded as a driver pads a locked rect
+		for (size_t i = 0; i < images; i++) {
+			cv::Mat img(size[1], size[0], CV_8UC3);
+			rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+			corpus.add(img);
+		}
+		corpora.push_back(corpus);
+	}
+
+	if (!images_dir.empty()) {
+		std::map<pair<int, int>, size_t> shapes;												// index in corpora of each sampled shape
+		size_t sampled = 0;
+		fs::recursive_directory_iterator iter(images_dir), end;
+		for (; iter != end && sampled < images; iter++) {
+			fs::path path = iter->path();
+			if (!fs::is_regular_file(path) || !(boost::iequals(path.extension().string(), ".png") || boost::iequals(path.extension().string(), ".bmp"))) continue;
+			cv::Mat img = cv::imread(path.string(), CV_LOAD_IMAGE_COLOR);
+			if (img.empty()) continue;
+			pair<int, int> shape(img.cols, img.rows);
+			if (shapes.count(shape) == 0) {
+				shapes[shape] = corpora.size();
+				hash_corpus_t corpus;
+				corpus.name = "sampled";
+				corpus.width = img.cols;
+				corpus.height = img.rows;
+				corpus.pitch = (img.cols * 4 + 255) & ~(size_t)255;
+				corpora.push_back(corpus);
+			}
+			corpora[shapes[shape]].add(img);
+			sampled++;
+		}
+		cout << "Sampled " << sampled << " images in " << shapes.size() << " shapes from " << images_dir.string() << endl;
+	}
+
+	std::vector<hash_bench_t> results;
+	int failures = 0;
+	for (hash_corpus_t& corpus : corpora) {
+		int mismatches = Bench_Corpus(corpus, reps, results);
+		if (mismatches > 0) cout << "raw and cv::Mat hashes differ on " << mismatches << " " << corpus.name << " " << corpus.width << "x" << corpus.height << " images" << endl;
+		failures += mismatches;
+	}
+
+	unordered_map<string, double> baseline;														// median_ns of each key
+	if (!baseline_file.empty()) {
+		ifstream in(baseline_file.string());
+		string line;
+		if (!in) cout << "Could not open " << baseline_file.string() << endl;
+		getline(in, line);																		// header
+		while (getline(in, line)) {
+			std::vector<string> fields;
+			stringstream row(line);
+			string field;
+			while (getline(row, field, ',')) fields.push_back(field);
+			if (fields.size() < 13) continue;
+			baseline[Hash_Bench_Key(fields[0], fields[1], fields[2], atoi(fields[3].c_str()), atoi(fields[4].c_str()))] = atof(fields[9].c_str());
+		}
+	}
+
+	FILE* file = fopen(results_file.string().c_str(), "w");
+	if (file == NULL) cout << "Could not write " << results_file.string() << endl;
+	else fprintf(file, "algorithm,input,corpus,width,height,images,reps,batch,min_ns,median_ns,mean_ns,stddev_ns,p95_ns\n");
+	printf("%-22s %-4s %-9s %9s %10s %10s %10s %10s %10s%s\n", "algorithm", "in", "corpus", "shape", "min ns", "median ns", "mean ns", "stddev", "p95 ns",
+		   baseline.empty() ? "" : "   baseline");
+	for (const hash_bench_t& result : results) {
+		if (file) fprintf(file, "%s,%s,%s,%d,%d,%zu,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", result.algorithm.c_str(), result.input.c_str(), result.corpus.c_str(),
+						  result.width, result.height, result.images, result.reps, result.batch, result.min_ns, result.median_ns, result.mean_ns, result.stddev_ns, result.p95_ns);
+		char shape[32];
+		sprintf(shape, "%dx%d", result.width, result.height);
+		printf("%-22s %-4s %-9s %9s %10.1f %10.1f %10.1f %10.1f %10.1f", result.algorithm.c_str(), result.input.c_str(), result.corpus.c_str(), shape,
+			   result.min_ns, result.median_ns, result.mean_ns, result.stddev_ns, result.p95_ns);
+		unordered_map<string, double>::const_iterator base = baseline.find(Hash_Bench_Key(result.algorithm, result.input, result.corpus, result.width, result.height));
+		if (base != baseline.end() && base->second > 0) {
+			double change = result.median_ns / base->second - 1;
+			bool slower = change > HASH_BENCH_TOLERANCE;
+			printf("   %+6.1f%%%s", change * 100, slower ? " SLOWER" : "");
+			if (slower) failures++;
+		}
+		printf("\n");
+	}
+	if (file) fclose(file);
+	cout << "(checksum " << hash_bench_sink << ")" << endl;
+	return failures;
+}
+
+#include "..\D3D9CallbackSC2\src\evictpolicy.h"
+
+// the accesses of a cache_trace.csv written by the texture cache in debug mode; a use without a load is skipped, since its size is unknown
+void Read_Cache_Trace(fs::path trace_csv, std::vector<CacheAccess>& trace)
+{
+	ifstream trace_file(trace_csv.string());
+	unordered_map<uint64_t, CacheAccess> loads;
+	std::vector<uint64_t> uses;
+	string line;
+	while (getline(trace_file, line)) {
+		std::istringstream fields(line);
+		string kind, hash_field, bytes, cost;
+		getline(fields, kind, ',');
+		getline(fields, hash_field, ',');
+		CacheAccess access = { strtoull(hash_field.c_str(), NULL, 10), 0, 0 };
+		if (kind == "a") {
+			uses.push_back(access.hash);
+		} else if (kind == "l" && getline(fields, bytes, ',') && getline(fields, cost)) {
+			access.bytes = strtoull(bytes.c_str(), NULL, 10);
+			access.cost = atof(cost.c_str());
+			loads[access.hash] = access;
+		}
+	}
+
+	for (size_t i = 0; i < uses.size(); i++) {
+		unordered_map<uint64_t, CacheAccess>::iterator load = loads.find(uses[i]);
+		if (load != loads.end()) trace.push_back(load->second);
+	}
+}
+
+// a field revisited over and over, broken up by passes through textures that are used once (a battle, an FMV menu)
+void Synthesize_Cache_Trace(std::vector<CacheAccess>& trace)
+{
+	cv::RNG rng(0x61726321);
+	const int HOT = 160, PASSES = 40, SCAN = 200;
+	uint64_t next_scan = 1000000;
+	for (int pass = 0; pass < PASSES; pass++) {
+		for (int i = 0; i < HOT * 4; i++) {
+			uint64_t hash = (uint64_t)rng.uniform(0, HOT) * rng.uniform(0, HOT) / HOT;			// skewed: low hashes are hot
+			CacheAccess access = { hash, (size_t)(1 + hash % 4) << 20, 0.004 * (1 + hash % 4) };
+			trace.push_back(access);
+		}
+		for (int i = 0; i < SCAN; i++) {
+			CacheAccess access = { next_scan++, (size_t)2 << 20, 0.008 };
+			trace.push_back(access);
+		}
+	}
+}
+
+// hit ratio and load time of each eviction policy over a recorded (or, without one, a synthetic) texture cache trace
+void Replay_Cache_Trace(fs::path trace_csv, size_t budget = (size_t)256 << 20)
+{
+	std::vector<CacheAccess> trace;
+	if (fs::exists(trace_csv)) Read_Cache_Trace(trace_csv, trace);
+	if (trace.empty()) {
+		cout << trace_csv.string() << " not found or empty; replaying a synthetic trace." << endl;
+		Synthesize_Cache_Trace(trace);
+	}
+
+	const char* names[] = { "lru", "gds", "arc" };
+	cout << "Replaying " << trace.size() << " accesses with a " << (budget >> 20) << " MB cache:" << endl;
+	for (const char* name : names) {
+		EvictionPolicy* policy = make_eviction_policy(name, budget, 0);
+		ReplayResult result = replay_trace(*policy, trace, budget);
+		cout << "  " << name << ": hit ratio " << result.hit_ratio() << ", " << (result.bytes_loaded >> 20) << " MB loaded, " << result.cost << " s loading" << endl;
+		delete policy;
+	}
+}
+
+#include "..\D3D9CallbackSC2\src\instrument.h"
+
+// stage latencies and counters of an instrument.csv written by the DLL (instrument_interval in prefs.txt)
+bool Read_Instrument_Snapshot(fs::path snapshot_csv, std::vector<std::pair<string, HistogramSnapshot>>& stages, std::vector<std::pair<string, uint64_t>>& counters, long long& uptime)
+{
+	ifstream snapshot_file(snapshot_csv.string());
+	string line;
+	if (!getline(snapshot_file, line)) return false;
+	std::istringstream header(line);
+	string kind, version, uptime_field;
+	getline(header, kind, ',');
+	getline(header, version, ',');
+	getline(header, uptime_field);
+	if (kind != "instrument" || strtoul(version.c_str(), NULL, 10) != INSTRUMENT_VERSION) return false;
+	uptime = atoll(uptime_field.c_str());
+
+	while (getline(snapshot_file, line)) {
+		std::istringstream fields(line);
+		string name, count, sum, max, buckets;
+		getline(fields, kind, ',');
+		getline(fields, name, ',');
+		if (kind == "counter" && getline(fields, count)) {
+			counters.push_back(std::make_pair(name, strtoull(count.c_str(), NULL, 10)));
+		} else if (kind == "stage" && getline(fields, count, ',') && getline(fields, sum, ',') && getline(fields, max, ',')) {
+			HistogramSnapshot hist;
+			hist.count = strtoull(count.c_str(), NULL, 10);
+			hist.sum = strtoull(sum.c_str(), NULL, 10);
+			hist.max = strtoull(max.c_str(), NULL, 10);
+			getline(fields, buckets);
+			std::istringstream bucket_fields(buckets);
+			string bucket;
+			while (bucket_fields >> bucket) {												// <bucket>:<count>
+				size_t colon = bucket.find(':');
+				int index = atoi(bucket.substr(0, colon).c_str());
+				if (colon != string::npos && index >= 0 && index < HIST_BUCKETS)
+					hist.counts[index] = strtoull(bucket.substr(colon + 1).c_str(), NULL, 10);
+			}
+			stages.push_back(std::make_pair(name, hist));
+		}
+	}
+	return true;
+}
+
+// pretty-prints an instrument.csv: per stage, how often it ran and its p50/p99/max latency
+void Print_Instrument_Snapshot(fs::path snapshot_csv)
+{
+	std::vector<std::pair<string, HistogramSnapshot>> stages;
+	std::vector<std::pair<string, uint64_t>> counters;
+	long long uptime = 0;
+	if (!Read_Instrument_Snapshot(snapshot_csv, stages, counters, uptime)) {
+		cout << snapshot_csv.string() << " not found or not an instrument snapshot." << endl;
+		return;
+	}
+
+	printf("%s after %.1f s:\n", snapshot_csv.string().c_str(), uptime / 1000.0);
+	printf("  %-12s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+	for (size_t i = 0; i < stages.size(); i++) {
+		const HistogramSnapshot& hist = stages[i].second;
+		printf("  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", stages[i].first.c_str(), (unsigned long long)hist.count, hist.mean() / 1000.0,
+			   hist.percentile(0.5) / 1000.0, hist.percentile(0.99) / 1000.0, hist.max / 1000.0);
+	}
+	for (size_t i = 0; i < counters.size(); i++)
+		printf("  %-12s %10llu\n", counters[i].first.c_str(), (unsigned long long)counters[i].second);
+}
+
+#include "..\D3D9CallbackSC2\src\trace.h"
+
+// Decodes a replacement PNG for the replay loader as the DLL's decode_png leaves it: memory order r, g, b, a, rows bottom-up
+bool Decode_Replacement(const string& path, DecodedImage& image)
+{
+	cv::Mat img = cv::imread(path, CV_LOAD_IMAGE_UNCHANGED), bgra;
+	if (img.empty() || img.depth() != CV_8U) return false;
+	if (img.channels() == 4) bgra = img;
+	else cv::cvtColor(img, bgra, img.channels() == 1 ? CV_GRAY2BGRA : CV_BGR2BGRA);
+
+	image.width = bgra.cols;
+	image.height = bgra.rows;
+	image.pixels.resize((size_t)image.width * image.height);
+	uint8_t* out = (uint8_t*)&image.pixels[0];
+	for (int y = 0; y < bgra.rows; y++) {
+		const uint8_t* in = bgra.ptr<uint8_t>(bgra.rows - 1 - y);
+		for (int x = 0; x < bgra.cols; x++, in += 4, out += 4) {
+			out[0] = in[2];
+			out[1] = in[1];
+			out[2] = in[0];
+			out[3] = in[3];
+		}
+	}
+	return true;
+}
+
+// replays a pipeline.trace recorded by the DLL (record_trace in prefs.txt) through the texture pipeline, without a game or a d3d9 device:
+// the hashmap index and the replacement textures are the installed ones, the cache and loader use the DLL's default prefs
+void Replay_Pipeline_Trace(fs::path trace_file, fs::path tonberry, fs::path textures, bool paced)
+{
+	HashIndex index;
+	FieldMap fieldmap;
+	if (!index.open(tonberry / "hashmap.idx", hashmap_stamp(tonberry / "hashmap"))) {
+		cout << (tonberry / "hashmap.idx").string() << " is missing or out of date; start the game once to compile it." << endl;
+		return;
+	}
+	fieldmap.attach(&index);
+
+	SoftwareTextureDevice device;
+	TileCache tiles((size_t)128 << 20);
+	TextureLoader loader(&device, Decode_Replacement, 2, (size_t)64 << 20, NULL, &tiles);		// no disk cache: every replacement is decoded, as on a first run
+	TextureCache cache(&device, (size_t)512 << 20);
+	PipelineConfig config;
+	config.textures_dir = textures;
+	TexturePipeline pipeline(&cache, &fieldmap, &device, &loader, &tiles, NULL, NULL, config);
+
+	Instrument::reset();
+	Instrument::enabled = true;
+	ReplayOptions options;
+	options.paced = paced;
+	ReplayStats stats;
+	string error;
+	if (!replay_trace(trace_file.string(), pipeline, options, stats, error)) {
+		cout << error << endl;
+		return;
+	}
+	if (stats.truncated) cout << "warning: " << error << "; replayed up to there." << endl;
+
+	print_replay(stdout, trace_file.string(), stats, paced, cache.get_stats());
+}
+
+// a tile file for Test_Grid_Compose: its upper tile is green 1, its lower tile green 2, and red = blue, so swizzling leaves it as it is
+bool Decode_Grid_Tile(const string& path, DecodedImage& image)
+{
+	uint32_t shade = path.find("gr_1") != string::npos ? 0x40 : 0x80;
+	image.width = ::VRAM_DIM;
+	image.height = ::VRAM_DIM;
+	image.pixels.resize((size_t)image.width * image.height);
+	for (uint32_t y = 0; y < image.height; y++)										// rows bottom-up: the in-game rows of the page, top-down
+		for (uint32_t x = 0; x < image.width; x++)
+			image.pixels[(size_t)y * image.width + x] = 0xff000000 | (shade << 16) | ((y < image.height / 2 ? 1u : 2u) << 8) | shade;
+	return true;
+}
+
+// a texture wider and taller than a page is composed from a grid of tiles: each tile file lands on its tile, and the rest is upscaled from the texture
+bool Test_Grid_Compose()
+{
+	const uint32_t width = 2 * ::VRAM_DIM, height = 2 * ::VRAM_DIM, columns = 2;
+	cv::Mat img(height, width, CV_8UC4);											// the locked rect
+	cv::RNG rng(0x67726964);
+	rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+
+	std::vector<uint64_t> hashes;
+	uint64_t hash_grid = grid_hashes(img.data, img.step, width, height, hashes);
+	FieldMap fieldmap;
+	fieldmap.insert(hashes[5], "gr_1");												// upper tile of the lower right page
+	fieldmap.insert(hashes[3], "gr_2");												// lower tile of the upper right page
+	fieldmap.build();
+
+	SoftwareTextureDevice device;
+	TextureLoader loader(&device, Decode_Grid_Tile, 1, 0, NULL, NULL);
+	TextureCache cache(&device, (size_t)64 << 20);
+	PipelineConfig config;
+	config.resize_factor = 1;
+	TexturePipeline pipeline(&cache, &fieldmap, &device, &loader, NULL, NULL, NULL, config);
+
+	const HANDLE handles[] = { (HANDLE)1, (HANDLE)2 };
+	pipeline.unlock(handles[0], img.data, img.step, width, height);
+	loader.wait_idle();
+	pipeline.begin_scene();
+	pipeline.unlock(handles[1], img.data, img.step, width, height);				// the same grid again: no second load
+
+	const StagingImage* image = SoftwareTextureDevice::pixels(pipeline.replacement(&handles[0], 1));
+	int failures = 0;
+	if (hashes.size() != 8 || !cache.contains(hash_grid) || image == NULL || pipeline.replacement(&handles[1], 1) != image || device.textures_created() != 1 ||
+		image->width != width || image->height != height) {
+		cout << "Grid_Compose: " << hashes.size() << " tiles, " << device.textures_created() << " textures created" << endl;
+		return false;
+	}
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t* row = (const uint32_t*)img.ptr<uint8_t>(y);
+		for (uint32_t x = 0; x < width; x++) {
+			size_t tile = (y / (::VRAM_DIM / 2)) * columns + x / ::VRAM_DIM;
+			uint32_t expected = (row[x] & 0xff00ff00) | ((row[x] >> 16) & 0xff) | ((row[x] & 0xff) << 16);		// upscaled: red and blue swapped
+			if (tile == 5) expected = 0xff400140;
+			else if (tile == 3) expected = 0xff800280;
+			if (image->pixels[(size_t)(height - 1 - y) * width + x] != expected) failures++;						// the replacement is upside down
+		}
+	}
+
+	cout << "Grid_Compose: " << (width * height - failures) << "/" << width * height << " pixels match" << endl;
+	return failures == 0;
+}
+
+#include "..\D3D9CallbackSC2\src\rowkernels.h"
+
+// the Engine's RGBColor: r, g, b, a in memory
+struct Old_RGBColor
+{
+	uint8_t r, g, b, a;
+
+	Old_RGBColor() {}
+	Old_RGBColor(uint8_t r, uint8_t g, uint8_t b, uint8_t a) : r(r), g(g), b(b), a(a) {}
+};
+
+// a decoded replacement file, as the Engine's Bitmap indexed it: bmp[row][x]
+struct Old_Bitmap
+{
+	const DecodedImage* image;
+
+	UINT Width() const { return image->width; }
+	UINT Height() const { return image->height; }
+	const Old_RGBColor* operator[](UINT row) const { return (const Old_RGBColor*)&image->pixels[(size_t)row * image->width]; }
+};
+
+// the pixel loop of create_newhandle before compose_replacement replaced it, over the same images; the replaced texture's row
+// is y / RESIZE_FACTOR, as its column is, where the original divided by a hard-coded 4 (the default factor)
+static void Create_Newhandle_Pixels(const uint8_t* replaced_pData, UINT replaced_width, UINT replaced_height, UINT replaced_pitch, float RESIZE_FACTOR,
+									const DecodedImage* combined, const DecodedImage* upper, const DecodedImage* lower, std::vector<uint32_t>& newData)
+{
+	bool use_combined = combined != NULL, use_upper = upper != NULL, use_lower = lower != NULL;
+	Old_Bitmap bmp_combined = { combined }, bmp_upper = { upper }, bmp_lower = { lower };
+	int replacement_width = int(RESIZE_FACTOR * (float)replaced_width);
+	int replacement_height = int(RESIZE_FACTOR * (float)replaced_height);
+	newData.assign((size_t)replacement_width * replacement_height, 0);
+
+	for (UINT y = 0; y < (UINT)replacement_height; y++) {
+		Old_RGBColor* CurRow = (Old_RGBColor *)&newData[(size_t)y * replacement_width];
+		Old_RGBColor Color;
+		if (use_combined) {
+			for (UINT x = 0; x < (UINT)replacement_width; x++) {
+				if (x < bmp_combined.Width() && y < bmp_combined.Height()) {				// respect texture sizes
+					Color = bmp_combined[replacement_height - y - 1][x];					// must flip image
+					CurRow[x] = Old_RGBColor(Color.b, Color.g, Color.r, Color.a);
+				}
+			}
+		} else if (y < (UINT)replacement_height / 2) {									// set lower bits (because flipped)
+			if (use_lower) {																// use pixels from bmp_lower
+				for (UINT x = 0; x < (UINT)replacement_width; x++) {
+					if (x < bmp_lower.Width() && y < bmp_lower.Height()) {					// respect texture sizes
+						Color = bmp_lower[bmp_lower.Height() - 1 - y][x];
+						CurRow[x] = Old_RGBColor(Color.b, Color.g, Color.r, Color.a);
+					}
+				}
+			} else {																		// use upscaled pixels from replaced pData
+				for (UINT x = 0; x < (UINT)replacement_width; x++) {
+					const Old_RGBColor* OldRow = (const Old_RGBColor*)(replaced_pData + (replaced_height - 1 - (int)(y / RESIZE_FACTOR)) * replaced_pitch);
+					Color = OldRow[(int)(x / RESIZE_FACTOR)];
+					CurRow[x] = Old_RGBColor(Color.b, Color.g, Color.r, Color.a);
+				}
+			}
+		} else {																			// set upper bits (because flipped)
+			if (use_upper) {																// use pixels from bmp_upper
+				for (UINT x = 0; x < (UINT)replacement_width; x++) {
+					int upper_y = bmp_upper.Height() - 1 - y;
+					if (upper_y < 0) upper_y += bmp_upper.Height();							// if bmp_upper is only half a full replacement texture
+					if (x < bmp_upper.Width() && (UINT)upper_y < bmp_upper.Height()) {		// respect texture sizes
+						Color = bmp_upper[upper_y][x];
+						CurRow[x] = Old_RGBColor(Color.b, Color.g, Color.r, Color.a);
+					}
+				}
+			} else {																		// use upscaled pixels from replaced pData
+				for (UINT x = 0; x < (UINT)replacement_width; x++) {
+					const Old_RGBColor* OldRow = (const Old_RGBColor*)(replaced_pData + (replaced_height - 1 - (int)(y / RESIZE_FACTOR)) * replaced_pitch);
+					Color = OldRow[(int)(x / RESIZE_FACTOR)];
+					CurRow[x] = Old_RGBColor(Color.b, Color.g, Color.r, Color.a);
+				}
+			}
+		}
+	}
+}
+
+// the replacement files of Test_Row_Kernels, by path
+static std::map<string, DecodedImage> row_kernel_files;
+
+bool Decode_Row_Kernel_File(const string& path, DecodedImage& image)
+{
+	std::map<string, DecodedImage>::const_iterator file = row_kernel_files.find(path);
+	if (file == row_kernel_files.end()) return false;
+	image = file->second;
+	return true;
+}
+
+// every row kernel implementation must match the scalar one, and compose_replacement must lay out combined, upper-only,
+// lower-only, and upper and lower replacements as create_newhandle's pixel loop did, with every implementation
+bool Test_Row_Kernels()
+{
+	const char* failure = NULL;
+	if (!check_row_kernels(&failure)) {
+		cout << "Row_Kernels: " << failure << " differs from scalar" << endl;
+		return false;
+	}
+
+	const uint32_t replaced_width = ::VRAM_DIM, replaced_height = ::VRAM_DIM;
+	cv::RNG rng(0x726f7773);
+	std::vector<uint32_t> replaced((size_t)replaced_width * replaced_height);
+	for (uint32_t& pixel : replaced) pixel = (unsigned)rng;
+
+	const float factors[] = { 4.0f, 2.5f };
+	int failures = 0, tests = 0;
+	for (float factor : factors) {
+		int width = int(factor * (float)replaced_width), height = int(factor * (float)replaced_height);
+		const int sizes[][2] = { { width, height }, { width + 7, height + 5 }, { width - 9, height }, { width, height / 2 }, { width - 9, height / 2 } };
+		row_kernel_files.clear();
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			DecodedImage& image = row_kernel_files[std::to_string(i)];
+			image.width = sizes[i][0];
+			image.height = sizes[i][1];
+			image.pixels.resize((size_t)image.width * image.height);
+			for (uint32_t& pixel : image.pixels) pixel = (unsigned)rng;
+		}
+
+		// combined files must cover the replacement's height, or the old loop reads past them
+		struct layout { const char* name; int combined, upper, lower; };
+		const layout layouts[] = {
+			{ "combined", 0, -1, -1 }, { "combined, larger", 1, -1, -1 }, { "combined, narrower", 2, -1, -1 },
+			{ "upper and lower", -1, 0, 0 }, { "upper and lower, half height", -1, 3, 3 }, { "upper and lower, narrower", -1, 4, 2 },
+			{ "upper only", -1, 0, -1 }, { "upper only, half height", -1, 3, -1 }, { "lower only", -1, -1, 0 }, { "lower only, half height", -1, -1, 4 },
+		};
+		for (const layout& layout : layouts) {
+			std::vector<uint32_t> expected;
+			Create_Newhandle_Pixels((const uint8_t*)&replaced[0], replaced_width, replaced_height, replaced_width * sizeof(uint32_t), factor,
+									layout.combined < 0 ? NULL : &row_kernel_files[std::to_string(layout.combined)],
+									layout.upper < 0 ? NULL : &row_kernel_files[std::to_string(layout.upper)],
+									layout.lower < 0 ? NULL : &row_kernel_files[std::to_string(layout.lower)], expected);
+
+			LoadRequest request;
+			request.replaced_width = replaced_width;
+			request.replaced_height = replaced_height;
+			request.resize_factor = factor;
+			request.replaced = replaced;
+			if (layout.combined >= 0)
+				request.path_combined = std::to_string(layout.combined);
+			else
+				add_half_tiles(request, ::VRAM_DIM / 2, 1, layout.upper < 0 ? string() : std::to_string(layout.upper), 2, layout.lower < 0 ? string() : std::to_string(layout.lower));
+
+			for (int level = ROWKERNELS_SCALAR; level <= ROWKERNELS_AVX2; level++) {	// ends on the widest, which is the automatic choice
+				if (!select_row_kernels((RowKernelLevel)level)) continue;
+				StagingImage image;
+				tests++;
+				if (!compose_replacement(request, Decode_Row_Kernel_File, image, NULL, NULL, NULL) ||
+					image.width != (uint32_t)width || image.height != (uint32_t)height || image.pixels != expected) {
+					cout << "Row_Kernels mismatch: " << layout.name << " at " << factor << "x with " << row_kernels().name << endl;
+					failures++;
+				}
+			}
+		}
+	}
+
+	cout << "Row_Kernels: " << (tests - failures) << "/" << tests << " match" << endl;
+	return failures == 0;
+}
+
+// hashes the .bmp files under texture_dir that changed since the last run (<texture_dir>.manifest) on all threads, and writes
+// output_dir\<texture_dir>_hm.csv, the runtime index of every hashmap in output_dir (output_dir\..\hashmap.idx, as the DLL compiles it
+// from tonberry\hashmap), and, if omzy_dir is given, the Omzy hashes the DLL matches fuzzily (fuzzy_bits) to omzy_dir\<texture_dir>_om.csv
+bool Create_Hashmap(fs::path texture_dir, fs::path output_dir, fs::path omzy_dir = fs::path())
+{
+	string name = texture_dir.filename().string();
+	fs::path manifest_file(texture_dir.parent_path() / (name + ".manifest"));
+	fs::path hashmap_csv(output_dir / (name + "_hm.csv"));
+	fs::path index_file(output_dir.parent_path() / "hashmap.idx");
+
+	HashManifest previous, manifest;
+	if (!previous.read(manifest_file)) cout << "No manifest of " << texture_dir.string() << " for these coordinates; hashing every file." << endl;
+	HashManifestBuildStats stats;
+	bool walked = manifest.build(texture_dir, previous, Tile_Threads(), stats);
+	cout << stats.files << " files: " << stats.unchanged << " unchanged, " << stats.touched << " touched but the same, " << stats.hashed << " hashed (" <<
+		stats.failed << " unreadable), " << (stats.bytes_read >> 20) << " MB read in " << stats.seconds << " s (" <<
+		(stats.seconds > 0 ? stats.files / stats.seconds : 0) << " files/s)" << endl;
+	if (!walked) {																			// a partial hashmap would drop the fields of every file not reached
+		cout << "Could not list every file under " << texture_dir.string() << "; nothing written." << endl;
+		return false;
+	}
+
+	// entries are sorted by path, so an unchanged tree writes the same files
+	ofstream out(hashmap_csv.string(), ofstream::out), omzy_out;
+	if (!omzy_dir.empty()) omzy_out.open((omzy_dir / (name + "_om.csv")).string(), ofstream::out);
+	for (size_t i = 0; i < manifest.size(); i++) {
+		const ManifestEntry& entry = manifest.entry(i);
+		if ((entry.flags & MANIFEST_DECODED) == 0) continue;
+		string field = fs::path(manifest.path(i)).stem().string();
+		out << field << "," << entry.combined << "," << entry.upper << "," << entry.lower << endl;
+		if (omzy_out.is_open()) omzy_out << field << "," << entry.omzy << endl;
+	}
+	out.close();
+	omzy_out.close();
+	if (!out || (!omzy_dir.empty() && !omzy_out)) {
+		cout << "Could not write " << hashmap_csv.string() << (omzy_dir.empty() ? "" : " or its Omzy hashes") << endl;
+		return false;
+	}
+	if (!manifest.write(manifest_file)) cout << "Could not write " << manifest_file.string() << "; the next run hashes every file again." << endl;
+
+	// the index covers every hashmap in output_dir, stamped as the DLL checks it
+	FieldMap fieldmap;
+	fs::directory_iterator end;
+	for (fs::directory_iterator iter(output_dir); iter != end; iter++) {
+		if (!fs::is_regular_file(iter->status()) || !boost::iequals(iter->path().extension().string(), ".csv")) continue;
+		std::vector<string> errors;
+		bool well_formed = read_hashmap_csv(iter->path(), fieldmap, errors);
+		for (const string& error : errors) cout << error << endl;
+		if (!well_formed) {
+			cout << "Not compiling " << index_file.string() << " from a bad hashmap." << endl;
+			return false;
+		}
+	}
+	fieldmap.build();
+	if (!fieldmap.write_index(index_file, hashmap_stamp(output_dir))) {
+		cout << "Could not write " << index_file.string() << endl;
+		return false;
+	}
+	cout << "Wrote " << hashmap_csv.string() << " and " << index_file.string() << " (" << fieldmap.size() << " hashes, " << fieldmap.field_count() << " fields)" << endl;
+	return true;
+}
+
+// the fields of a hash, by name, in the order find returns them
+static std::vector<string> Field_Names(const FieldMap& fieldmap, uint64_t hash)
+{
+	std::vector<string> names;
+	FieldSpan span = fieldmap.find(hash);
+	for (const uint32_t* id = span.begin(); id != span.end(); id++) names.push_back(fieldmap.field_name(*id));
+	return names;
+}
+
+// a FieldMap attached to the index it wrote must answer every lookup as the map it was built in memory, and HashIndex::open
+// must reject an index that is stale, truncated, or corrupt
+bool Test_FieldMap_Index()
+{
+	fs::path dir(fs::temp_directory_path() / fs::unique_path("tonberry-%%%%-%%%%"));
+	fs::path hashmap_dir(dir / "hashmap"), index_file(dir / "hashmap.idx");
+	fs::create_directories(hashmap_dir);
+
+	// duplicate combined hashes across fields, a field listed twice, an upper hash shared by every field of a room,
+	// and a 2-item line; the rest are random
+	std::vector<uint64_t> hashes;
+	{
+		ofstream out((hashmap_dir / "test_hm.csv").string(), ofstream::out);
+		out << "aa_1_0,1001,2001,3001" << endl;
+		out << "aa_1_1,1001,2001,3002" << endl;
+		out << "aa_1_2,1002,2001,3003" << endl;
+		out << "aa_1_2,1002,2001,3003" << endl;
+		out << "aa_2_0,1003" << endl;
+		out << "aa_2_1,1003,1001,3001" << endl;
+		hashes.insert(hashes.end(), { 1001, 1002, 1003, 2001, 3001, 3002, 3003 });
+		cv::RNG rng(0x69647831);
+		for (int i = 0; i < 500; i++) {
+			uint64_t combined = ((uint64_t)(unsigned)rng << 32) | (unsigned)rng, upper = 5000 + i % 7, lower = ((uint64_t)(unsigned)rng << 32) | (unsigned)rng;
+			out << "rn_" << i / 10 << "_" << i % 10 << "," << combined << "," << upper << "," << lower << endl;
+			hashes.insert(hashes.end(), { combined, upper, lower });
+		}
+	}
+	const uint64_t misses[] = { 0, 1, 1004, 2002, 4999, 0xffffffffffffffffULL };
+
+	int failures = 0, tests = 0;
+	FieldMap memory;
+	std::vector<string> errors;
+	tests++;
+	if (!read_hashmap_csv(hashmap_dir / "test_hm.csv", memory, errors) || !errors.empty()) {
+		cout << "FieldMap_Index: could not read the test hashmap" << endl;
+		failures++;
+	}
+	memory.build();
+	uint64_t stamp = hashmap_stamp(hashmap_dir);
+
+	HashIndex index;
+	FieldMap attached;
+	tests++;
+	if (!memory.write_index(index_file, stamp) || !index.open(index_file, stamp)) {
+		cout << "FieldMap_Index: could not write and open the index" << endl;
+		fs::remove_all(dir);
+		return false;
+	}
+	attached.attach(&index);
+
+	tests++;
+	if (attached.size() != memory.size() || attached.field_count() != memory.field_count() ||
+		Field_Names(memory, 1001) != std::vector<string>({ "aa_1_0", "aa_1_1", "aa_2_1" }) || Field_Names(memory, 1002) != std::vector<string>({ "aa_1_2" })) {
+		cout << "FieldMap_Index: " << attached.size() << "/" << memory.size() << " hashes, " << attached.field_count() << "/" << memory.field_count() << " fields" << endl;
+		failures++;
+	}
+	for (uint64_t hash : hashes) {
+		const char* memory_first = memory.first_field(hash), *attached_first = attached.first_field(hash);
+		tests++;
+		if (memory_first == NULL || attached_first == NULL || strcmp(memory_first, attached_first) != 0 || Field_Names(memory, hash) != Field_Names(attached, hash)) {
+			cout << "FieldMap_Index mismatch: " << hash << endl;
+			failures++;
+		}
+	}
+	for (uint64_t hash : misses) {
+		std::vector<uint32_t> ids;
+		tests++;
+		if (memory.first_field(hash) != NULL || attached.first_field(hash) != NULL || !attached.find(hash).empty() || attached.get_intersection(hash, 1001, ids)) {
+			cout << "FieldMap_Index: found missing hash " << hash << endl;
+			failures++;
+		}
+	}
+	for (size_t i = 0; i + 1 < hashes.size(); i++) {
+		std::vector<uint32_t> memory_ids, attached_ids;
+		std::vector<string> memory_names, attached_names;
+		bool memory_found = memory.get_intersection(hashes[i], hashes[i + 1], memory_ids);
+		bool attached_found = attached.get_intersection(hashes[i], hashes[i + 1], attached_ids);
+		for (uint32_t id : memory_ids) memory_names.push_back(memory.field_name(id));
+		for (uint32_t id : attached_ids) attached_names.push_back(attached.field_name(id));
+		tests++;
+		if (memory_found != attached_found || memory_names != attached_names) {
+			cout << "FieldMap_Index intersection mismatch: " << hashes[i] << ", " << hashes[i + 1] << endl;
+			failures++;
+		}
+	}
+
+	// nothing to compile from an empty map, and it finds nothing
+	FieldMap empty;
+	std::vector<uint32_t> ids;
+	empty.build();
+	tests++;
+	if (!empty.write_index(dir / "empty.idx", stamp) || fs::exists(dir / "empty.idx") || empty.size() != 0 ||
+		empty.first_field(1001) != NULL || !empty.find(1001).empty() || empty.get_intersection(1001, 1001, ids)) {
+		cout << "FieldMap_Index: empty map" << endl;
+		failures++;
+	}
+	attached.attach(NULL);
+	index.close();
+
+	// stale, truncated, and corrupt copies of the index
+	std::vector<char> bytes;
+	{
+		ifstream in(index_file.string(), ifstream::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	const HashIndexHeader& header = *(const HashIndexHeader*)&bytes[0];
+	size_t slots_at = sizeof(HashIndexHeader), ids_at = slots_at + header.slot_count * sizeof(FieldSlot), offsets_at = ids_at + header.id_count * sizeof(uint32_t);
+	size_t occupied = 0, shared = 0;
+	for (uint32_t i = 0; i < header.slot_count; i++) {
+		const FieldSlot& slot = *(const FieldSlot*)&bytes[slots_at + i * sizeof(FieldSlot)];
+		if (slot.count == 1 && occupied == 0) occupied = slots_at + i * sizeof(FieldSlot);
+		if (slot.count > 1 && shared == 0) shared = slots_at + i * sizeof(FieldSlot);
+	}
+	struct corruption { const char* name; size_t size; size_t at; uint32_t value; };
+	const corruption corruptions[] = {
+		{ "header cut", sizeof(HashIndexHeader) - 1, 0, 0 },
+		{ "slots cut", ids_at - sizeof(FieldSlot) / 2, 0, 0 },
+		{ "names cut", bytes.size() - 1, 0, 0 },
+		{ "magic", bytes.size(), offsetof(HashIndexHeader, magic), 0 },
+		{ "version", bytes.size(), offsetof(HashIndexHeader, version), HASHINDEX_VERSION + 1 },
+		{ "slot count", bytes.size(), offsetof(HashIndexHeader, slot_count), header.slot_count - 1 },
+		{ "key count", bytes.size(), offsetof(HashIndexHeader, key_count), header.key_count + 1 },
+		{ "field count", bytes.size(), offsetof(HashIndexHeader, field_count), header.field_count + 1 },
+		{ "field id", bytes.size(), occupied + offsetof(FieldSlot, value), header.field_count },
+		{ "pooled ids", bytes.size(), shared + offsetof(FieldSlot, value), header.id_count },
+		{ "pool id", bytes.size(), ids_at, header.field_count },
+		{ "name offset", bytes.size(), offsets_at, header.names_size },
+		{ "names end", bytes.size(), bytes.size() - 1, 'x' },
+	};
+	for (const corruption& corrupt : corruptions) {
+		std::vector<char> copy(bytes.begin(), bytes.begin() + corrupt.size);
+		if (corrupt.size == bytes.size() && corrupt.at + sizeof(uint32_t) <= copy.size()) memcpy(&copy[corrupt.at], &corrupt.value, sizeof(uint32_t));
+		else if (corrupt.size == bytes.size()) copy[corrupt.at] = (char)corrupt.value;
+		{
+			ofstream out((dir / "corrupt.idx").string(), ofstream::binary);
+			out.write(&copy[0], copy.size());
+		}
+		tests++;
+		if (index.open(dir / "corrupt.idx", stamp)) {
+			cout << "FieldMap_Index: opened an index with a bad " << corrupt.name << endl;
+			index.close();
+			failures++;
+		}
+	}
+	tests++;
+	if (index.open(index_file, stamp + 1)) {
+		cout << "FieldMap_Index: opened a stale index" << endl;
+		index.close();
+		failures++;
+	}
+
+	fs::remove_all(dir);
+	cout << "FieldMap_Index: " << (tests - failures) << "/" << tests << " match" << endl;
+	return failures == 0;
+}
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+	if (argc > 1 && _tcscmp(argv[1], _T("instrument")) == 0) {						// ConsoleTesting instrument [instrument.csv]
+		Print_Instrument_Snapshot(argc > 2 ? fs::path(argv[2]) : FF8_ROOT / "tonberry\\debug\\instrument.csv");
+		return 0;
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("replay")) == 0) {							// ConsoleTesting replay [pipeline.trace] [paced]
+		Replay_Pipeline_Trace(argc > 2 ? fs::path(argv[2]) : FF8_ROOT / "tonberry\\debug\\pipeline.trace", FF8_ROOT / "tonberry", FF8_ROOT / "textures",
+							  argc > 3 && _tcscmp(argv[3], _T("paced")) == 0);
+		return 0;
+	}
+	if (argc > 2 && _tcscmp(argv[1], _T("corpus")) == 0) {							// ConsoleTesting corpus <images> [tiles.corpus] [hash]
+		fs::path root(argv[2]);
+		fs::path corpus_file = argc > 3 ? fs::path(argv[3]) : root.parent_path() / (root.filename().string() + ".corpus");
+		return Build_Corpus(root, corpus_file, argc > 4 && _tcscmp(argv[4], _T("hash")) == 0) ? 0 : 1;
+	}
+	if (argc > 2 && _tcscmp(argv[1], _T("optimize")) == 0) {						// ConsoleTesting optimize <tiles.corpus> [coords] [passes] [coordinates.csv]
+		Optimize_Coords(fs::path(argv[2]), argc > 5 ? fs::path(argv[5]) : fs::path(argv[2]).parent_path() / "optimized_coordinates.csv",
+						argc > 3 ? (size_t)_ttoi(argv[3]) : COORDS_LEN, argc > 4 ? _ttoi(argv[4]) : 0);
+		return 0;
+	}
+	if (argc > 2 && _tcscmp(argv[1], _T("similar")) == 0) {							// ConsoleTesting similar <tiles.corpus> [max_diff] [similar.csv]
+		Find_All_Similar(fs::path(argv[2]), argc > 3 ? (unsigned)_ttoi(argv[3]) : 10,
+						 argc > 4 ? fs::path(argv[4]) : fs::path(argv[2]).parent_path() / "similar.csv");
+		return 0;
+	}
+	if (argc > 2 && _tcscmp(argv[1], _T("hashmap")) == 0) {							// ConsoleTesting hashmap <textures> [hashmap dir] [omzymap dir]
+		return Create_Hashmap(fs::path(argv[2]), argc > 3 ? fs::path(argv[3]) : FF8_ROOT / "tonberry\\hashmap",
+							  argc > 4 ? fs::path(argv[4]) : fs::path()) ? 0 : 1;
+	}
+	if (argc > 1 && _tcscmp(argv[1], _T("hashbench")) == 0) {						// ConsoleTesting hashbench [results.csv] [baseline.csv|-] [images]
+		fs::path baseline = (argc > 3 && _tcscmp(argv[3], _T("-")) != 0) ? fs::path(argv[3]) : fs::path();
+		return Benchmark_Hashes(argc > 2 ? fs::path(argv[2]) : fs::path("hashbench.csv"), baseline, argc > 4 ? fs::path(argv[4]) : fs::path()) == 0 ? 0 : 1;
+	}
+
+	// test Murmur2_Combined
+	Test_Murmur2_Combined();
+	Test_FieldMap_Index();
+	Test_Sampling_Plan();
+	Test_Grid_Compose();
+	Test_Row_Kernels();
+	Benchmark_Murmur2_Combined();
+	Benchmark_Policy_Hashers();
+	Replay_Cache_Trace(FF8_ROOT / "tonberry\\debug\\cache_trace.csv");
 
 	getchar();
 	return 0;
@@ -0,0 +1,184 @@
+#include "stdafx.h"
+#include "coordoptimizer.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+static const size_t PIXEL_VALUES = (size_t)1 << 24;							// b, g, r
+static const int CANDIDATE_CHUNK = 64;											// candidates a thread takes at a time
+
+CoordOptimizer::CoordOptimizer(const std::vector<cv::Mat>& tiles, int width, int height, unsigned threads) : width(width), height(height), threads(threads)
+{
+	for (const cv::Mat& tile : tiles) {
+		data.push_back(tile.data);
+		steps.push_back(tile.step);
+		widths.push_back(tile.cols);
+		heights.push_back(tile.rows);
+	}
+	if (this->threads == 0) this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void CoordOptimizer::reset(Partition& partition) const
+{
+	partition.order.clear();
+	partition.starts.assign(1, 0);
+	partition.collisions = 0;
+	if (data.size() < 2) return;
+	for (uint32_t tile = 0; tile < data.size(); tile++) partition.order.push_back(tile);
+	partition.starts.push_back((uint32_t)data.size());
+	partition.collisions = data.size() - 1;
+}
+
+void CoordOptimizer::refine(Partition& partition, const HashCoord& coord) const
+{
+	std::vector<uint32_t> order, starts(1, 0);
+	std::vector<uint64_t> keys;
+	size_t collisions = 0;
+	for (size_t group = 0; group + 1 < partition.starts.size(); group++) {
+		keys.clear();
+		for (uint32_t i = partition.starts[group]; i < partition.starts[group + 1]; i++) {
+			uint32_t tile = partition.order[i];
+			keys.push_back(((uint64_t)pixel(tile, coord.x, coord.y) << 32) | tile);
+		}
+		std::sort(keys.begin(), keys.end());
+
+		// tiles with the same pixel stay together; a tile on its own no longer collides
+		for (size_t run = 0, end; run < keys.size(); run = end) {
+			for (end = run + 1; end < keys.size() && (keys[end] >> 32) == (keys[run] >> 32); end++);
+			if (end - run < 2) continue;
+			for (size_t i = run; i < end; i++) order.push_back((uint32_t)keys[i]);
+			starts.push_back((uint32_t)order.size());
+			collisions += end - run - 1;
+		}
+	}
+	partition.order.swap(order);
+	partition.starts.swap(starts);
+	partition.collisions = collisions;
+}
+
+bool CoordOptimizer::best_candidate(const Partition& partition, const std::vector<HashCoord>& exclude, HashCoord& best, size_t& best_collisions) const
+{
+	std::vector<int> candidates;
+	std::vector<bool> excluded((size_t)width * height, false);
+	for (const HashCoord& coord : exclude)
+		if (coord.x >= 0 && coord.x < width && coord.y >= 0 && coord.y < height) excluded[coord.y * width + coord.x] = true;
+	for (int i = 0; i < width * height; i++)
+		if (!excluded[i]) candidates.push_back(i);
+	if (candidates.empty()) return false;
+
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> bound(SIZE_MAX);											// fewest collisions any thread has seen; worse candidates stop early
+	std::mutex best_mutex;
+	size_t found_collisions = SIZE_MAX;
+	int found = -1;
+
+	auto work = [&]() {
+		std::vector<uint64_t> seen(PIXEL_VALUES / 64, 0);							// one bit per pixel value
+		std::vector<uint32_t> values;
+		size_t local_collisions = SIZE_MAX;
+		int local = -1;
+		for (size_t chunk = next.fetch_add(CANDIDATE_CHUNK); chunk < candidates.size(); chunk = next.fetch_add(CANDIDATE_CHUNK)) {
+			for (size_t c = chunk; c < std::min(chunk + CANDIDATE_CHUNK, candidates.size()); c++) {
+				int x = candidates[c] % width, y = candidates[c] / width;
+				size_t collisions = 0, limit = bound.load(std::memory_order_relaxed);
+
+				// collisions only grow group by group, so a candidate can be dropped as soon as it is worse than the best
+				for (size_t group = 0; group + 1 < partition.starts.size() && collisions <= limit; group++) {
+					values.clear();
+					size_t distinct = 0;
+					for (uint32_t i = partition.starts[group]; i < partition.starts[group + 1]; i++) {
+						uint32_t value = pixel(partition.order[i], x, y);
+						uint64_t bit = (uint64_t)1 << (value & 63);
+						if ((seen[value >> 6] & bit) == 0) {
+							seen[value >> 6] |= bit;
+							values.push_back(value);
+							distinct++;
+						}
+					}
+					for (uint32_t value : values) seen[value >> 6] = 0;
+					collisions += (partition.starts[group + 1] - partition.starts[group]) - distinct;
+				}
+				if (collisions > limit) continue;
+
+				if (collisions < local_collisions) {										// candidates come in row order within a chunk
+					local_collisions = collisions;
+					local = candidates[c];
+				}
+				size_t current = bound.load(std::memory_order_relaxed);
+				while (collisions < current && !bound.compare_exchange_weak(current, collisions, std::memory_order_relaxed));
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(best_mutex);
+		if (local >= 0 && (local_collisions < found_collisions || (local_collisions == found_collisions && local < found))) {
+			found_collisions = local_collisions;
+			found = local;
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned thread = 1; thread < threads; thread++) workers.push_back(std::thread(work));
+	work();
+	for (std::thread& worker : workers) worker.join();
+
+	best = HashCoord(found % width, found / width);
+	best_collisions = found_collisions;
+	return true;
+}
+
+size_t CoordOptimizer::collisions(const HashCoord* coords, size_t len, std::vector<size_t>* prefix) const
+{
+	Partition partition;
+	reset(partition);
+	if (prefix) prefix->clear();
+	for (size_t i = 0; i < len; i++) {
+		if (partition.collisions > 0) refine(partition, coords[i]);
+		if (prefix) prefix->push_back(partition.collisions);
+		else if (partition.collisions == 0) break;
+	}
+	return partition.collisions;
+}
+
+size_t CoordOptimizer::greedy(size_t max_coords, std::vector<CoordStep>& steps) const
+{
+	Partition partition;
+	reset(partition);
+	steps.clear();
+	std::vector<HashCoord> chosen;
+	while (chosen.size() < max_coords && partition.collisions > 0) {
+		HashCoord best;
+		size_t best_collisions;
+		if (!best_candidate(partition, chosen, best, best_collisions) || best_collisions >= partition.collisions) break;	// what is left is identical everywhere
+		refine(partition, best);
+		chosen.push_back(best);
+		CoordStep step;
+		step.coord = best;
+		step.collisions = partition.collisions;
+		steps.push_back(step);
+	}
+	return partition.collisions;
+}
+
+size_t CoordOptimizer::local_search(std::vector<HashCoord>& coords, int passes) const
+{
+	size_t current = collisions(coords.empty() ? NULL : &coords[0], coords.size());
+	for (int pass = 0; pass < passes && current > 0; pass++) {
+		bool changed = false;
+		for (size_t i = 0; i < coords.size() && current > 0; i++) {
+			Partition partition;
+			reset(partition);
+			for (size_t j = 0; j < coords.size() && partition.collisions > 0; j++)
+				if (j != i) refine(partition, coords[j]);
+
+			HashCoord best;
+			size_t best_collisions;
+			if (best_candidate(partition, coords, best, best_collisions) && best_collisions < current) {
+				coords[i] = best;
+				current = best_collisions;
+				changed = true;
+			}
+		}
+		if (!changed) break;
+	}
+	return current;
+}
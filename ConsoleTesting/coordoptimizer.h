@@ -0,0 +1,92 @@
+#ifndef _COORDOPTIMIZER_H
+#define _COORDOPTIMIZER_H
+
+#include "hashcoord.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+/*
+	Hash coordinate optimizer
+
+	Two tiles collide under a coordinate table when they agree on the pixel (all three channels, black outside the
+	tile) at every coordinate, which is what the Murmur2 and FNV hashes read. The optimizer keeps the tiles that still
+	collide under the coordinates chosen so far as equivalence classes; adding a coordinate splits each class by the
+	pixel value there, and the collisions left are the tiles minus the classes. Scoring a candidate coordinate is one
+	pass over the tiles that still collide, so it gets cheaper as classes fall apart into single tiles.
+
+	greedy() adds the coordinate that leaves the fewest collisions until none are left or the table is full;
+	local_search() then tries to swap each chosen coordinate for a better one given the others.
+*/
+
+struct CoordStep
+{
+	HashCoord	coord;
+	size_t		collisions;		// collisions left with this and every earlier coordinate
+};
+
+class CoordOptimizer
+{
+private:
+	std::vector<const uint8_t*>	data;		// first row of each tile
+	std::vector<size_t>			steps;		// bytes per row
+	std::vector<int>			widths;
+	std::vector<int>			heights;
+	int							width;		// candidates are every (x, y) in width x height
+	int							height;
+	unsigned					threads;
+
+	// tiles that still collide, grouped: group g is order[starts[g]] .. order[starts[g + 1] - 1]
+	struct Partition
+	{
+		std::vector<uint32_t>	order;
+		std::vector<uint32_t>	starts;
+		size_t					collisions;
+	};
+
+	uint32_t pixel(uint32_t tile, int x, int y) const
+	{
+		if (x >= widths[tile] || y >= heights[tile]) return 0;
+		const uint8_t* p = data[tile] + y * steps[tile] + x * 3;
+		return p[0] | (p[1] << 8) | (p[2] << 16);
+	}
+
+	void reset(Partition& partition) const;
+	void refine(Partition& partition, const HashCoord& coord) const;
+
+	/* best_candidate: the coordinate that leaves the fewest collisions when added to partition, ties to the first in
+	   row order; coordinates in exclude are skipped
+	   returns: false if there is no candidate left
+	*/
+	bool best_candidate(const Partition& partition, const std::vector<HashCoord>& exclude, HashCoord& best, size_t& best_collisions) const;
+
+public:
+	CoordOptimizer(const std::vector<cv::Mat>& tiles,		// CV_8UC3; kept by pointer, so they must outlive the optimizer
+				   int width, int height,					// area to pick coordinates from
+				   unsigned threads = 0						// 0 for one per core
+		);
+
+	/* collisions: the collisions of a coordinate table, e.g. COORDS, over the tiles
+	*/
+	size_t collisions(const HashCoord* coords, size_t len,
+					  std::vector<size_t>* prefix = NULL			// receives the collisions left after each coordinate, if not NULL
+		) const;
+
+	/* greedy: picks coordinates one at a time, each leaving the fewest collisions
+	   returns: the collisions left
+	*/
+	size_t greedy(size_t max_coords,						// stop after this many
+				  std::vector<CoordStep>& steps				// receives the coordinates in the order they were picked
+		) const;
+
+	/* local_search: replaces each coordinate of coords with the one that leaves the fewest collisions given the rest,
+	   while that is fewer than before
+	   returns: the collisions left
+	*/
+	size_t local_search(std::vector<HashCoord>& coords,
+						int passes							// rounds over all of coords; stops early once a round changes nothing
+		) const;
+};
+
+#endif
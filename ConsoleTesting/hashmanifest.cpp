@@ -0,0 +1,257 @@
+#include "stdafx.h"
+#include "hashmanifest.h"
+#include "texturehash.h"
+#include "murmur2stream.h"
+#include "omzyhash.h"
+#include "..\D3D9CallbackSC2\src\pipeline.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace fs = boost::filesystem;
+
+static const char HASHMANIFEST_MAGIC[4] = { 'T', 'B', 'H', 'M' };
+
+// what build did with a file
+enum manifest_outcome_t
+{
+	OUTCOME_UNCHANGED,
+	OUTCOME_TOUCHED,
+	OUTCOME_HASHED,
+	OUTCOME_UNREADABLE
+};
+
+// a .bmp under the tree, as the walk found it
+struct manifest_file_t
+{
+	std::string		path;			// relative, generic form
+	fs::path		full_path;
+	uint64_t		size;
+	int64_t			mtime;
+};
+
+static inline void stamp_ints(uint64_t& stamp, const int* values, size_t count)
+{
+	const unsigned char* bytes = (const unsigned char*)values;
+	for (size_t i = 0; i < count * sizeof(int); i++) {										// FNV-1a
+		stamp ^= bytes[i];
+		stamp *= 1099511628211ULL;
+	}
+}
+
+uint64_t HashManifest::coords_stamp()
+{
+	uint64_t stamp = 14695981039346656037ULL;
+	int sizes[2] = { VRAM_DIM, (int)COORDS_LEN };
+	stamp_ints(stamp, sizes, 2);
+	for (size_t i = 0; i < COORDS_LEN; i++) {
+		int coord[3] = { COORDS[i].x, COORDS[i].y, COORDS[i].c };
+		stamp_ints(stamp, coord, 3);
+	}
+	return stamp;
+}
+
+bool HashManifest::read(const fs::path& manifest_file)
+{
+	entries.clear();
+	paths.clear();
+
+	boost::system::error_code ec;
+	uint64_t file_size = (uint64_t)fs::file_size(manifest_file, ec);
+	if (ec) return false;
+	FILE* file = fopen(manifest_file.string().c_str(), "rb");
+	if (file == NULL) return false;
+	HashManifestHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+			  memcmp(header.magic, HASHMANIFEST_MAGIC, sizeof(HASHMANIFEST_MAGIC)) == 0 &&
+			  header.version == HASHMANIFEST_VERSION &&
+			  header.coords_stamp == coords_stamp() &&
+			  file_size == sizeof(header) + (uint64_t)header.count * sizeof(ManifestEntry) + header.paths_size;		// checked before anything is sized from the header
+	if (ok) {
+		entries.resize(header.count);
+		paths.resize(header.paths_size);
+		ok = (header.count == 0 || fread(&entries[0], sizeof(ManifestEntry), header.count, file) == header.count) &&
+			 (header.paths_size == 0 || fread(&paths[0], header.paths_size, 1, file) == 1);
+	}
+	fclose(file);
+
+	// every path must lie within paths and end there
+	for (size_t i = 0; ok && i < entries.size(); i++)
+		ok = entries[i].path < paths.size() && memchr(&paths[entries[i].path], '\0', paths.size() - entries[i].path) != NULL;
+	if (!ok) {
+		entries.clear();
+		paths.clear();
+	}
+	return ok;
+}
+
+bool HashManifest::write(const fs::path& manifest_file) const
+{
+	fs::path temp_file(manifest_file);
+	temp_file += ".tmp";
+	FILE* out = fopen(temp_file.string().c_str(), "wb");
+	if (out == NULL) return false;
+
+	HashManifestHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HASHMANIFEST_MAGIC, sizeof(HASHMANIFEST_MAGIC));
+	header.version = HASHMANIFEST_VERSION;
+	header.count = (uint32_t)entries.size();
+	header.paths_size = (uint32_t)paths.size();
+	header.coords_stamp = coords_stamp();
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (!entries.empty()) ok = ok && fwrite(&entries[0], sizeof(ManifestEntry), entries.size(), out) == entries.size();
+	if (!paths.empty()) ok = ok && fwrite(&paths[0], paths.size(), 1, out) == 1;
+	ok = (fclose(out) == 0) && ok;
+
+	boost::system::error_code ec;
+	if (ok) fs::rename(temp_file, manifest_file, ec);
+	if (!ok || ec) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+	return true;
+}
+
+const ManifestEntry* HashManifest::find(const std::string& path) const
+{
+	size_t low = 0, high = entries.size();
+	while (low < high) {																	// entries are sorted by path
+		size_t mid = low + (high - low) / 2;
+		int order = strcmp(&paths[entries[mid].path], path.c_str());
+		if (order == 0) return &entries[mid];
+		if (order < 0) low = mid + 1;
+		else high = mid;
+	}
+	return NULL;
+}
+
+// every .bmp under root, sorted by relative path; their sizes and write times are left for the hashing threads to read
+// returns: false if the walk stopped at an error (files holds what was found before it), else true
+static bool find_bitmaps(const fs::path& root, std::vector<manifest_file_t>& files)
+{
+	std::string prefix = root.generic_string();
+	if (!prefix.empty() && prefix[prefix.size() - 1] != '/') prefix += '/';
+
+	boost::system::error_code ec;
+	fs::recursive_directory_iterator iter(root, ec), end;
+	for (; !ec && iter != end; iter.increment(ec)) {
+		const fs::path& path = iter->path();
+		if (!boost::iequals(path.extension().string(), ".bmp")) continue;
+		boost::system::error_code file_ec;
+		if (!fs::is_regular_file(path, file_ec) && !file_ec) continue;						// a file that cannot be checked is kept, and build counts it unreadable
+		manifest_file_t file;
+		file.full_path = path;
+		file.path = path.generic_string().substr(prefix.size());							// the iterator appends to root
+		file.size = 0;
+		file.mtime = 0;
+		files.push_back(file);
+	}
+	std::sort(files.begin(), files.end(), [](const manifest_file_t& a, const manifest_file_t& b) { return strcmp(a.path.c_str(), b.path.c_str()) < 0; });
+	return !ec;
+}
+
+// reads a whole file
+static bool read_file(const fs::path& path, std::vector<unsigned char>& bytes)
+{
+	FILE* file = fopen(path.string().c_str(), "rb");
+	if (file == NULL) return false;
+	bool ok = fseek(file, 0, SEEK_END) == 0;
+	long size = ok ? ftell(file) : -1;
+	ok = size >= 0 && fseek(file, 0, SEEK_SET) == 0;
+	if (ok) {
+		bytes.resize((size_t)size);
+		ok = size == 0 || fread(&bytes[0], (size_t)size, 1, file) == 1;
+	}
+	fclose(file);
+	return ok;
+}
+
+bool HashManifest::build(const fs::path& root, const HashManifest& previous, unsigned threads, HashManifestBuildStats& stats)
+{
+	stats = HashManifestBuildStats();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<manifest_file_t> files;
+	bool walked = find_bitmaps(root, files);
+
+	std::vector<ManifestEntry> found(files.size());
+	std::vector<manifest_outcome_t> outcomes(files.size());
+	std::atomic<uint64_t> bytes_read(0);
+	std::atomic<size_t> next_file(0);
+	auto work = [&]() {
+		std::vector<unsigned char> bytes;
+		for (size_t i = next_file++; i < files.size(); i = next_file++) {
+			manifest_file_t& file = files[i];
+			ManifestEntry& entry = found[i];
+			memset(&entry, 0, sizeof(entry));
+			boost::system::error_code ec;
+			file.size = (uint64_t)fs::file_size(file.full_path, ec);
+			if (!ec) file.mtime = (int64_t)fs::last_write_time(file.full_path, ec);
+			if (ec) {
+				outcomes[i] = OUTCOME_UNREADABLE;
+				continue;
+			}
+			const ManifestEntry* recorded = previous.find(file.path);
+			if (recorded && recorded->size == file.size && recorded->mtime == file.mtime) {
+				entry = *recorded;
+				outcomes[i] = OUTCOME_UNCHANGED;
+				continue;
+			}
+
+			entry.size = file.size;
+			entry.mtime = file.mtime;
+			if (!read_file(file.full_path, bytes)) {
+				outcomes[i] = OUTCOME_UNREADABLE;
+				continue;
+			}
+			bytes_read += bytes.size();
+			entry.size = bytes.size();
+			entry.content = TextureHash::Murmur2::MurmurHash64B(bytes.empty() ? NULL : &bytes[0], (int)bytes.size());
+			if (recorded && recorded->size == entry.size && recorded->content == entry.content) {
+				entry.combined = recorded->combined;
+				entry.upper = recorded->upper;
+				entry.lower = recorded->lower;
+				entry.omzy = recorded->omzy;
+				entry.flags = recorded->flags;
+				outcomes[i] = OUTCOME_TOUCHED;
+				continue;
+			}
+
+			outcomes[i] = OUTCOME_HASHED;
+			cv::Mat img = bytes.empty() ? cv::Mat() : cv::imdecode(cv::Mat(1, (int)bytes.size(), CV_8UC1, &bytes[0]), CV_LOAD_IMAGE_COLOR);
+			if (img.empty()) continue;
+			entry.combined = TextureHash::Murmur2::Murmur2_Hash_Texture(img.data, img.step, 3, img.cols, img.rows, VRAM_DIM / 2, COORDS, COORDS_LEN, entry.upper, entry.lower);
+			entry.omzy = TextureHash::Omzy::Omzy_Hash_Texture(img.data, img.step, 3, img.cols, img.rows);
+			entry.flags = MANIFEST_DECODED;
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned thread = 1; thread < threads; thread++) workers.push_back(std::thread(work));
+	work();
+	for (std::thread& worker : workers) worker.join();
+
+	entries.swap(found);
+	paths.clear();
+	for (size_t i = 0; i < files.size(); i++) {
+		entries[i].path = (uint32_t)paths.size();
+		paths.insert(paths.end(), files[i].path.c_str(), files[i].path.c_str() + files[i].path.size() + 1);
+
+		switch (outcomes[i]) {
+		case OUTCOME_UNCHANGED: stats.unchanged++; break;
+		case OUTCOME_TOUCHED: stats.touched++; break;
+		case OUTCOME_HASHED: stats.hashed++; break;
+		case OUTCOME_UNREADABLE: break;
+		}
+		if ((entries[i].flags & MANIFEST_DECODED) == 0) stats.failed++;
+	}
+	stats.files = files.size();
+	stats.bytes_read = bytes_read;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return walked;
+}
@@ -0,0 +1,107 @@
+#ifndef _HASHMANIFEST_H
+#define _HASHMANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+/*
+	Hashmap build manifest (*.manifest, next to a texture tree)
+
+	Create_Hashmap hashes every original .bmp of a pack, and a pack has tens of thousands of them. The manifest records
+	what each file hashed to, keyed by what identifies its contents, so a rebuild only decodes the files that changed:
+		size, mtime		a file whose size and write time are as recorded is not read at all
+		content			MurmurHash64B of the file's bytes; a file that was touched but not changed is read, not decoded
+	Everything else is decoded and hashed again as the DLL hashes it: Murmur2 over the runtime's COORDS, and Omzy.
+
+	coords_stamp identifies the sampled coordinates; when they change, every file is hashed again.
+
+	layout:
+		HashManifestHeader
+		ManifestEntry	entries[count]					sorted by path
+		char			paths[paths_size]				NUL-terminated paths relative to the tree (generic form, UTF-8)
+*/
+
+const uint32_t HASHMANIFEST_VERSION = 1;
+
+struct HashManifestHeader
+{
+	char		magic[4];		// "TBHM"
+	uint32_t	version;		// HASHMANIFEST_VERSION
+	uint32_t	count;
+	uint32_t	paths_size;
+	uint64_t	coords_stamp;	// HashManifest::coords_stamp() the hashes were computed with
+};
+
+const uint32_t MANIFEST_DECODED = 1;	// the file decoded; else it is left out of the hashmap until it changes
+
+struct ManifestEntry
+{
+	uint64_t	size;			// bytes of the file
+	int64_t		mtime;			// last write time of the file
+	uint64_t	content;		// MurmurHash64B of the file
+	uint64_t	combined;		// the hashes of the decoded texture
+	uint64_t	upper;
+	uint64_t	lower;
+	uint64_t	omzy;			// Omzy_Hash_Texture
+	uint32_t	path;			// offset of the path in paths
+	uint32_t	flags;			// MANIFEST_DECODED
+};
+
+struct HashManifestBuildStats
+{
+	size_t		files;			// .bmp files in the tree
+	size_t		unchanged;		// files not read, because their size and write time were as recorded
+	size_t		touched;		// files read, but not decoded, because their contents were as recorded
+	size_t		hashed;			// files decoded and hashed
+	size_t		failed;			// files that could not be read or decoded
+	uint64_t	bytes_read;
+	double		seconds;
+
+	HashManifestBuildStats() : files(0), unchanged(0), touched(0), hashed(0), failed(0), bytes_read(0), seconds(0) {}
+};
+
+class HashManifest
+{
+private:
+	std::vector<ManifestEntry>	entries;
+	std::vector<char>			paths;
+
+public:
+	/* coords_stamp: fingerprint of the coordinates the runtime samples (COORDS in pipeline.cpp)
+	*/
+	static uint64_t coords_stamp();
+
+	/* read: loads a manifest written by write
+	   returns: true if the file holds a manifest of the current coordinates, else false (and the manifest is empty)
+	*/
+	bool read(const boost::filesystem::path& manifest_file);
+
+	/* write: saves the manifest; the file is written to a temporary and renamed into place
+	   returns: true if the file was written, else false
+	*/
+	bool write(const boost::filesystem::path& manifest_file) const;
+
+	/* build: hashes the .bmp files under root on threads threads, taking the hashes of the files previous recorded
+			  unchanged from it; a file that cannot be read is kept without hashes and counted as failed
+	   returns: false if the tree could not be walked to the end (the manifest covers the files found before that), else true
+	*/
+	bool build(const boost::filesystem::path& root,	// texture tree
+			   const HashManifest& previous,			// the manifest of the last build; may be empty
+			   unsigned threads,
+			   HashManifestBuildStats& stats
+		);
+
+	/* find: the entry of a file
+	   returns: the entry, or NULL if the path is not in the manifest
+	*/
+	const ManifestEntry* find(const std::string& path	// relative to the tree, generic form
+		) const;
+
+	size_t size() const { return entries.size(); }
+	const ManifestEntry& entry(size_t i) const { return entries[i]; }
+	const char* path(size_t i) const { return &paths[entries[i].path]; }
+};
+
+#endif
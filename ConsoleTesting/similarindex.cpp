@@ -0,0 +1,126 @@
+#include "stdafx.h"
+#include "similarindex.h"
+#include "texturehash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace fs = boost::filesystem;
+
+static const char SIMILARINDEX_MAGIC[4] = { 'T', 'B', 'S', 'I' };
+
+TileSignature SimilarityIndex::signature(const cv::Mat& tile, uint64_t hash, uint32_t tile_dim)
+{
+	TileSignature sig;
+	memset(&sig, 0, sizeof(sig));
+	sig.hash = hash;
+
+	// only tile_dim x tile_dim is compared, so only it is hashed; Hash_Algorithm_1 of an empty tile would read past it,
+	// and every sample of one is black
+	int rows = std::min(tile.rows, (int)tile_dim), cols = std::min(tile.cols, (int)tile_dim);
+	sig.omzy = (rows > 0 && cols > 0) ? TextureHash::Omzy::Hash_Algorithm_1(tile(cv::Rect(0, 0, cols, rows))) : ~0ULL;
+
+	for (int y = 0; y < rows; y++) {
+		const uint8_t* pixel = tile.ptr<uint8_t>(y);
+		uint32_t* row = sig.blocks + (y * SIGNATURE_GRID / tile_dim) * SIGNATURE_GRID;
+		for (int x = 0; x < cols; x++, pixel += 3)
+			row[x * SIGNATURE_GRID / tile_dim] += pixel[0] + pixel[1] + pixel[2];
+	}
+	return sig;
+}
+
+int SimilarityIndex::omzy_radius(unsigned max_diff)
+{
+	return max_diff >= 32 ? 64 : (int)max_diff * 2;
+}
+
+void SimilarityIndex::index()
+{
+	std::vector<uint64_t> keys(signatures.size());
+	for (size_t i = 0; i < signatures.size(); i++) keys[i] = signatures[i].omzy;
+	omzy.build(keys.empty() ? NULL : &keys[0], keys.size());
+}
+
+void SimilarityIndex::build(std::vector<TileSignature>& from, uint32_t dim)
+{
+	signatures.swap(from);
+	tile_dim = dim;
+	index();
+}
+
+bool SimilarityIndex::read(const fs::path& index_file, uint32_t dim, size_t count, uint64_t corpus_time)
+{
+	signatures.clear();
+	omzy.clear();
+
+	FILE* file = fopen(index_file.string().c_str(), "rb");
+	if (file == NULL) return false;
+	SimilarityIndexHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+			  memcmp(header.magic, SIMILARINDEX_MAGIC, sizeof(SIMILARINDEX_MAGIC)) == 0 &&
+			  header.version == SIMILARINDEX_VERSION &&
+			  header.tile_dim == dim &&
+			  header.count == count &&
+			  header.corpus_time == corpus_time;
+	if (ok) {
+		signatures.resize(count);
+		ok = count == 0 || fread(&signatures[0], sizeof(TileSignature), count, file) == count;
+	}
+	fclose(file);
+	if (!ok) {
+		signatures.clear();
+		return false;
+	}
+	tile_dim = dim;
+	index();
+	return true;
+}
+
+bool SimilarityIndex::write(const fs::path& index_file, uint64_t corpus_time) const
+{
+	fs::path temp_file(index_file);
+	temp_file += ".tmp";
+	FILE* out = fopen(temp_file.string().c_str(), "wb");
+	if (out == NULL) return false;
+
+	SimilarityIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SIMILARINDEX_MAGIC, sizeof(SIMILARINDEX_MAGIC));
+	header.version = SIMILARINDEX_VERSION;
+	header.tile_dim = tile_dim;
+	header.count = (uint32_t)signatures.size();
+	header.corpus_time = corpus_time;
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (!signatures.empty()) ok = ok && fwrite(&signatures[0], sizeof(TileSignature), signatures.size(), out) == signatures.size();
+	ok = (fclose(out) == 0) && ok;
+
+	boost::system::error_code ec;
+	if (ok) fs::rename(temp_file, index_file, ec);
+	if (!ok || ec) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+	return true;
+}
+
+size_t SimilarityIndex::candidates(const TileSignature& query, unsigned max_diff, std::vector<uint32_t>& out) const
+{
+	omzy.query(query.omzy, omzy_radius(max_diff), out);
+
+	uint64_t max_sum = (uint64_t)SIGNATURE_PIXEL_MAX * max_diff;
+	size_t kept = 0;
+	for (uint32_t id : out) {
+		const uint32_t* blocks = signatures[id].blocks;
+		unsigned differing = 0;
+		uint64_t sum = 0;
+		for (int b = 0; b < SIGNATURE_GRID * SIGNATURE_GRID; b++) {
+			uint32_t d = blocks[b] > query.blocks[b] ? blocks[b] - query.blocks[b] : query.blocks[b] - blocks[b];
+			differing += d != 0;
+			sum += d;
+		}
+		if (differing <= max_diff && sum <= max_sum) out[kept++] = id;
+	}
+	out.resize(kept);
+	return kept;
+}
@@ -0,0 +1,92 @@
+#ifndef _SIMILARINDEX_H
+#define _SIMILARINDEX_H
+
+#include "hammingindex.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <boost/filesystem.hpp>
+
+/*
+	Near-duplicate tile index (*.simidx, next to a corpus)
+
+	Find_Similar_Images looks for tiles that differ from another in at most max_diff pixels. Comparing the pixels of
+	every pair is quadratic, so each tile gets a signature that such a pair cannot fail to share:
+		omzy		Hash_Algorithm_1 (one bit per comparison of neighbouring hash1 samples); a pixel that differs changes at
+					most the two comparisons its sample is in, so the hashes are within 2 * max_diff bits
+		blocks		the b + g + r sums of an 8x8 grid of blocks; a pixel that differs changes one block by at most 765,
+					so at most max_diff blocks differ, by at most 765 * max_diff in all
+	candidates() finds the tiles within the Omzy radius in a HammingIndex and keeps those whose blocks pass; only they
+	are compared pixel by pixel. Nothing similar is ever missed.
+
+	layout:
+		SimilarityIndexHeader
+		TileSignature	signatures[count]		in the order of the tiles they were computed from
+*/
+
+const uint32_t SIMILARINDEX_VERSION = 1;
+const int SIGNATURE_GRID = 8;								// blocks per side
+const uint32_t SIGNATURE_PIXEL_MAX = 3 * 255;				// most a pixel adds to a block
+
+struct SimilarityIndexHeader
+{
+	char		magic[4];		// "TBSI"
+	uint32_t	version;		// SIMILARINDEX_VERSION
+	uint32_t	tile_dim;		// the signatures cover tile_dim x tile_dim, black outside the tile
+	uint32_t	count;
+	uint64_t	corpus_time;	// last write time of the corpus the signatures were computed from
+};
+
+struct TileSignature
+{
+	uint64_t	hash;			// the tile's hash, to match signatures to tiles
+	uint64_t	omzy;			// Hash_Algorithm_1
+	uint32_t	blocks[SIGNATURE_GRID * SIGNATURE_GRID];
+};
+
+class SimilarityIndex
+{
+private:
+	std::vector<TileSignature>	signatures;
+	TextureHash::HammingIndex	omzy;
+	uint32_t					tile_dim;
+
+	void index();
+
+public:
+	SimilarityIndex() : tile_dim(0) {}
+
+	/* signature: the signature of a tile (CV_8UC3) over tile_dim x tile_dim
+	*/
+	static TileSignature signature(const cv::Mat& tile, uint64_t hash, uint32_t tile_dim);
+
+	/* omzy_radius: the most bits the Omzy hashes of two tiles differing in max_diff pixels can differ in
+	*/
+	static int omzy_radius(unsigned max_diff);
+
+	/* build: indexes signatures, which the index takes over
+	*/
+	void build(std::vector<TileSignature>& from, uint32_t tile_dim);
+
+	/* read: loads an index written by write
+	   returns: true if the file holds count signatures over tile_dim computed from a corpus written at corpus_time, else
+	   false (and the index is empty)
+	*/
+	bool read(const boost::filesystem::path& index_file, uint32_t tile_dim, size_t count, uint64_t corpus_time);
+
+	/* write: saves the signatures; the file is written to a temporary and renamed into place
+	   returns: true if the file was written, else false
+	*/
+	bool write(const boost::filesystem::path& index_file, uint64_t corpus_time) const;
+
+	size_t size() const { return signatures.size(); }
+	const TileSignature& signature(size_t i) const { return signatures[i]; }
+
+	/* candidates: the tiles that may differ from query in at most max_diff pixels (query itself included, if indexed)
+	   returns: the number of candidates, which out receives in ascending order
+	*/
+	size_t candidates(const TileSignature& query, unsigned max_diff, std::vector<uint32_t>& out) const;
+};
+
+#endif
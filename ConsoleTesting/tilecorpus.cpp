@@ -0,0 +1,278 @@
+#include "stdafx.h"
+#include "tilecorpus.h"
+#include "texturehash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+static const char TILECORPUS_MAGIC[4] = { 'T', 'B', 'T', 'C' };
+
+TileCorpus::TileCorpus() : header(NULL), entries(NULL), path_offsets(NULL), path_names(NULL), pixels(NULL) {}
+
+bool TileCorpus::is_corpus(const fs::path& corpus_file)
+{
+	FILE* file = fopen(corpus_file.string().c_str(), "rb");
+	if (file == NULL) return false;
+	char magic[4];
+	bool is = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, TILECORPUS_MAGIC, sizeof(magic)) == 0;
+	fclose(file);
+	return is;
+}
+
+bool TileCorpus::open(const fs::path& corpus_file)
+{
+	close();
+
+	boost::system::error_code ec;
+	if (!fs::is_regular_file(corpus_file, ec)) return false;
+
+	try {
+		bip::file_mapping mapping(corpus_file.string().c_str(), bip::read_only);
+		bip::mapped_region mapped(mapping, bip::read_only);
+		file.swap(mapping);
+		region.swap(mapped);
+	} catch (bip::interprocess_exception&) {
+		return false;
+	}
+
+	// validate before trusting any of the offsets
+	uint64_t size = region.get_size();
+	const char* base = (const char*)region.get_address();
+	const TileCorpusHeader* hdr = (const TileCorpusHeader*)base;
+	if (size < TILECORPUS_PIXELS_OFFSET ||
+		memcmp(hdr->magic, TILECORPUS_MAGIC, sizeof(TILECORPUS_MAGIC)) != 0 ||
+		hdr->version != TILECORPUS_VERSION ||
+		hdr->tile_dim == 0) {
+		close();
+		return false;
+	}
+
+	// each term is checked against what is left of the file, so a crafted header cannot overflow the sum; the tables are under 2^37 bytes
+	uint64_t slot_bytes = (uint64_t)hdr->tile_dim * hdr->tile_dim * 3;
+	uint64_t tables_size = (uint64_t)hdr->tile_count * sizeof(TileEntry) +
+						   ((uint64_t)hdr->path_count + 1) * sizeof(uint32_t) +
+						   hdr->paths_size;
+	if (hdr->tile_dim > UINT16_MAX ||																	// slot_bytes fits in 35 bits
+		hdr->tables_offset < TILECORPUS_PIXELS_OFFSET || hdr->tables_offset > size ||
+		hdr->slot_count > (hdr->tables_offset - TILECORPUS_PIXELS_OFFSET) / slot_bytes ||
+		tables_size > size - hdr->tables_offset) {
+		close();
+		return false;
+	}
+
+	// every path starts within paths, after the one before it, and ends in a NUL before the next one starts
+	const TileEntry* tiles = (const TileEntry*)(base + hdr->tables_offset);
+	const uint32_t* offsets = (const uint32_t*)(tiles + hdr->tile_count);
+	const char* names = (const char*)(offsets + hdr->path_count + 1);
+	bool paths_ok = offsets[hdr->path_count] == hdr->paths_size;
+	for (uint32_t i = 0; paths_ok && i < hdr->path_count; i++)
+		paths_ok = offsets[i] < offsets[i + 1] && offsets[i + 1] <= hdr->paths_size && names[offsets[i + 1] - 1] == '\0';
+	if (!paths_ok) {
+		close();
+		return false;
+	}
+	for (uint32_t i = 0; i < hdr->tile_count; i++) {
+		const TileEntry& tile = tiles[i];
+		if (tile.path >= hdr->path_count || tile.slot >= hdr->slot_count || tile.width > hdr->tile_dim || tile.height > hdr->tile_dim) {
+			close();
+			return false;
+		}
+	}
+
+	header = hdr;
+	entries = tiles;
+	path_offsets = offsets;
+	path_names = names;
+	pixels = (const uint8_t*)(base + TILECORPUS_PIXELS_OFFSET);
+	return true;
+}
+
+void TileCorpus::close()
+{
+	header = NULL;
+	entries = NULL;
+	path_offsets = NULL;
+	path_names = NULL;
+	pixels = NULL;
+	bip::mapped_region().swap(region);
+	bip::file_mapping().swap(file);
+}
+
+cv::Mat TileCorpus::tile(uint32_t i) const
+{
+	const TileEntry& tile = entries[i];
+	size_t step = (size_t)header->tile_dim * 3;
+	uint8_t* data = (uint8_t*)pixels + (uint64_t)tile.slot * step * header->tile_dim;	// the mapping is read-only; cv::Mat has no const data
+	return cv::Mat(tile.height, tile.width, CV_8UC3, data, step);
+}
+
+// a tile of one source image, as build found it
+struct corpus_tile_t
+{
+	uint64_t	hash;
+	uint32_t	file;			// index of the source image in sorted order
+	uint32_t	quadrant;		// a, b, c, d
+	uint32_t	slot;
+	cv::Rect	rect;
+};
+
+// every image under root, but not in the collisions folders the analysis writes
+static void find_images(const fs::path& root, std::vector<fs::path>& files)
+{
+	boost::system::error_code ec;
+	fs::recursive_directory_iterator iter(root, ec), end;
+	for (; !ec && iter != end; iter.increment(ec)) {
+		const fs::path& path = iter->path();
+		if (fs::is_directory(path, ec)) {
+			if (path.filename() == "collisions") iter.no_push();
+			continue;
+		}
+		std::string extension = path.extension().string();
+		if (boost::iequals(extension, ".bmp") || boost::iequals(extension, ".png")) files.push_back(path);
+	}
+	std::sort(files.begin(), files.end());														// directory order is not guaranteed
+}
+
+bool TileCorpus::build(const fs::path& root, const fs::path& corpus_file, bool name_is_hash, TileCorpusBuildStats& stats, uint32_t tile_dim)
+{
+	stats = TileCorpusBuildStats();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<fs::path> files;
+	find_images(root, files);
+
+	fs::path temp_file(corpus_file);
+	temp_file += ".tmp";
+	FILE* out = fopen(temp_file.string().c_str(), "wb");
+	if (out == NULL) return false;
+
+	TileCorpusHeader header;
+	memset(&header, 0, sizeof(header));
+	std::vector<char> zeros((size_t)TILECORPUS_PIXELS_OFFSET, 0);								// the header is rewritten at the end
+	bool ok = fwrite(&zeros[0], zeros.size(), 1, out) == 1;
+
+	// threads decode; one at a time appends the new tiles to the pixel slots
+	std::vector<corpus_tile_t> tiles;
+	std::unordered_map<uint64_t, size_t> seen;													// hash -> index in tiles
+	std::vector<uint8_t> slot_pixels((size_t)tile_dim * tile_dim * 3);
+	std::mutex out_mutex;
+	std::atomic<size_t> next_file(0);
+	auto work = [&]() {
+		for (size_t file = next_file++; file < files.size(); file = next_file++) {
+			cv::Mat img = cv::imread(files[file].string(), CV_LOAD_IMAGE_COLOR);
+			std::vector<corpus_tile_t> found;
+			if (!img.empty()) {
+				// store 1-4 objects
+				// 		|_a_|_b_|
+				//		|_c_|_d_|
+				int dim = (int)tile_dim;
+				for (int quadrant = 0; quadrant < (name_is_hash ? 1 : 4); quadrant++) {
+					int x = (quadrant & 1) * dim, y = (quadrant >> 1) * dim;
+					if (x >= img.cols || y >= img.rows) continue;
+					corpus_tile_t tile;
+					tile.file = (uint32_t)file;
+					tile.quadrant = quadrant;
+					tile.rect = cv::Rect(x, y, std::min(img.cols - x, dim), std::min(img.rows - y, dim));
+					tile.hash = name_is_hash ? strtoull(files[file].stem().string().c_str(), NULL, 10) : TextureHash::Murmur2::Murmur2_Full(img(tile.rect));
+					found.push_back(tile);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(out_mutex);
+			stats.files++;
+			if (img.empty()) stats.failed++;
+			for (corpus_tile_t& tile : found) {
+				if (!name_is_hash) {
+					std::unordered_map<uint64_t, size_t>::iterator earlier = seen.find(tile.hash);
+					if (earlier != seen.end()) {
+						// same pixels: keep the slot, name the tile after the first source in sorted order
+						corpus_tile_t& kept = tiles[earlier->second];
+						if (tile.file < kept.file || (tile.file == kept.file && tile.quadrant < kept.quadrant)) {
+							tile.slot = kept.slot;
+							kept = tile;
+						}
+						stats.duplicates++;
+						continue;
+					}
+					seen[tile.hash] = tiles.size();
+				}
+
+				cv::Mat slot(tile_dim, tile_dim, CV_8UC3, &slot_pixels[0]);
+				slot.setTo(cv::Scalar(0, 0, 0));
+				img(tile.rect).copyTo(slot(cv::Rect(0, 0, tile.rect.width, tile.rect.height)));
+				tile.slot = header.slot_count++;
+				ok = ok && fwrite(&slot_pixels[0], slot_pixels.size(), 1, out) == 1;
+				tiles.push_back(tile);
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned thread = 1; thread < threads; thread++) workers.push_back(std::thread(work));
+	work();
+	for (std::thread& worker : workers) worker.join();
+
+	// tables, in the order get_images walks the tree
+	std::sort(tiles.begin(), tiles.end(), [](const corpus_tile_t& a, const corpus_tile_t& b) {
+		return a.file != b.file ? a.file < b.file : a.quadrant < b.quadrant;
+	});
+	std::vector<TileEntry> entries;
+	std::vector<uint32_t> path_offsets;
+	std::string paths;
+	uint32_t last_file = UINT32_MAX;
+	for (const corpus_tile_t& tile : tiles) {
+		if (tile.file != last_file) {
+			path_offsets.push_back((uint32_t)paths.size());
+			paths += files[tile.file].string();
+			paths += '\0';
+			last_file = tile.file;
+		}
+		TileEntry entry;
+		entry.hash = tile.hash;
+		entry.path = (uint32_t)path_offsets.size() - 1;
+		entry.slot = tile.slot;
+		entry.x = (uint16_t)tile.rect.x;
+		entry.y = (uint16_t)tile.rect.y;
+		entry.width = (uint16_t)tile.rect.width;
+		entry.height = (uint16_t)tile.rect.height;
+		entries.push_back(entry);
+	}
+	path_offsets.push_back((uint32_t)paths.size());
+
+	memcpy(header.magic, TILECORPUS_MAGIC, sizeof(TILECORPUS_MAGIC));
+	header.version = TILECORPUS_VERSION;
+	header.tile_dim = tile_dim;
+	header.tile_count = (uint32_t)entries.size();
+	header.path_count = (uint32_t)path_offsets.size() - 1;
+	header.paths_size = (uint32_t)paths.size();
+	header.name_is_hash = name_is_hash ? 1 : 0;
+	header.tables_offset = TILECORPUS_PIXELS_OFFSET + (uint64_t)header.slot_count * slot_pixels.size();
+	if (!entries.empty()) ok = ok && fwrite(&entries[0], sizeof(TileEntry), entries.size(), out) == entries.size();
+	ok = ok && fwrite(&path_offsets[0], sizeof(uint32_t), path_offsets.size(), out) == path_offsets.size();
+	if (!paths.empty()) ok = ok && fwrite(paths.data(), paths.size(), 1, out) == 1;
+	ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+	ok = (fclose(out) == 0) && ok;
+
+	boost::system::error_code ec;
+	if (ok) fs::rename(temp_file, corpus_file, ec);												// replace the old corpus in one step
+	if (!ok || ec) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+
+	stats.tiles = entries.size();
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
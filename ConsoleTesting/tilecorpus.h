@@ -0,0 +1,121 @@
+#ifndef _TILECORPUS_H
+#define _TILECORPUS_H
+
+#include <stdint.h>
+#include <string>
+#include <opencv2/core/core.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/*
+	Decoded tile corpus (*.corpus)
+
+	The analysis tools cut every image of a texture tree into tiles of up to tile_dim x tile_dim (the quadrants a, b, c,
+	d of get_images) and compare them over and over. A corpus decodes the tree once: every distinct tile is stored as
+	raw BGR pixels in a file that is mapped into memory, so a tile is a cv::Mat over the mapped pages and nothing is
+	read or decoded twice.
+
+	layout:
+		TileCorpusHeader
+		(zeros up to TILECORPUS_PIXELS_OFFSET)
+		uint8_t			pixels[slot_count][tile_dim][tile_dim][3]	BGR, the tile in the top left corner of its slot
+		TileEntry		tiles[tile_count]							at tables_offset, sorted by path and quadrant
+		uint32_t		path_offsets[path_count + 1]				offset of each path in paths; the last offset is paths_size
+		char			paths[paths_size]							NUL-terminated source paths (UTF-8)
+
+	Tiles are deduplicated by hash as get_images does (the first path in sorted order wins), except for a folder of
+	<hash>.bmp files, where the name is the hash and every file is kept.
+*/
+
+const uint32_t TILECORPUS_VERSION = 1;
+const uint64_t TILECORPUS_PIXELS_OFFSET = 4096;
+
+struct TileCorpusHeader
+{
+	char		magic[4];		// "TBTC"
+	uint32_t	version;		// TILECORPUS_VERSION
+	uint32_t	tile_dim;		// width and height of a pixel slot
+	uint32_t	tile_count;
+	uint32_t	slot_count;
+	uint32_t	path_count;
+	uint32_t	paths_size;
+	uint32_t	name_is_hash;	// 1 if the hashes are the file names
+	uint64_t	tables_offset;	// offset of tiles[]
+};
+
+struct TileEntry
+{
+	uint64_t	hash;			// Murmur2_Full of the tile, or the file name of a <hash>.bmp
+	uint32_t	path;			// index of the source path
+	uint32_t	slot;			// pixel slot
+	uint16_t	x, y;			// rect of the tile in the source image
+	uint16_t	width, height;
+};
+
+struct TileCorpusBuildStats
+{
+	size_t		files;			// images decoded
+	size_t		failed;			// images that could not be decoded
+	size_t		tiles;			// tiles stored
+	size_t		duplicates;		// tiles dropped because an earlier one had the same hash
+	double		seconds;
+
+	TileCorpusBuildStats() : files(0), failed(0), tiles(0), duplicates(0), seconds(0) {}
+};
+
+class TileCorpus
+{
+private:
+	boost::interprocess::file_mapping	file;
+	boost::interprocess::mapped_region	region;
+
+	const TileCorpusHeader*	header;
+	const TileEntry*		entries;
+	const uint32_t*			path_offsets;
+	const char*				path_names;
+	const uint8_t*			pixels;
+
+public:
+	TileCorpus();
+
+	/* is_corpus: whether a file starts like a corpus
+	*/
+	static bool is_corpus(const boost::filesystem::path& corpus_file);
+
+	/* open: maps a corpus and validates its tables
+	   returns: true if the corpus is mapped, else false (and the corpus stays closed)
+	*/
+	bool open(const boost::filesystem::path& corpus_file);
+
+	/* close: unmaps the corpus; tiles handed out before are invalid
+	*/
+	void close();
+
+	bool is_open() const { return header != NULL; }
+	bool name_is_hash() const { return is_open() && header->name_is_hash != 0; }
+	uint32_t size() const { return is_open() ? header->tile_count : 0; }
+
+	const TileEntry& entry(uint32_t i) const { return entries[i]; }
+	uint64_t hash(uint32_t i) const { return entries[i].hash; }
+	const char* path(uint32_t i) const { return path_names + path_offsets[entries[i].path]; }
+	cv::Rect rect(uint32_t i) const { return cv::Rect(entries[i].x, entries[i].y, entries[i].width, entries[i].height); }
+
+	/* tile: the pixels of a tile, without copying them
+	   returns: a CV_8UC3 view of the mapped file, valid until close(); it is read-only, clone() it to draw on it
+	*/
+	cv::Mat tile(uint32_t i) const;
+
+	/* build: decodes every .bmp/.png under root (skipping collisions folders) on all threads and writes the corpus;
+	   the file is written to a temporary and renamed into place
+	   returns: true if the corpus was written, else false
+	*/
+	static bool build(const boost::filesystem::path& root,				// texture tree
+					  const boost::filesystem::path& corpus_file,		// destination
+					  bool name_is_hash,								// root is a folder of <hash>.bmp: one tile per file, hashed by name
+					  TileCorpusBuildStats& stats,
+					  uint32_t tile_dim = 128
+		);
+};
+
+#endif
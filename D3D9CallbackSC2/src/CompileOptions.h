@@ -11,6 +11,13 @@
 //#define ULTRA_FAST
 #define WRITING_TO_FILES
 
+//
+// TONBERRY_LOG_MAX is the most verbose log level compiled in (see logger.h); ULTRA_FAST keeps only errors.
+//
+#ifdef ULTRA_FAST
+#define TONBERRY_LOG_MAX 0
+#endif
+
 #if !defined(ULTRA_FAST) && defined(WRITING_TO_FILES)
 //
 // When this is enabled asserts will be outputted to g_Context->Files.Assert
@@ -110,85 +110,7 @@
     //Files.Init(Parameters.OutputFileDirectory);
     //Controller.Init();
     //CheckWindowSize();
-/*int comparebits (uint64_t hashval, uint64_t mapval)
-{
-	uint64_t xor = hashval^mapval;	//bitwise XOR to detect differences
-	bitset<64> diff(xor);
-	return diff.count();
-}*/
-
-/*string closesthash (uint64_t hashval)
-{
-	string closest = "NO_MATCH";	//default
-	int mindiff = 64;
-	int threshold = 9;
-	uint64_t closehash = 0;
-	bool longrun = 0;
-
-	//if (beginscene) 
-	{
-		if (comparebits(hashval, lasthashval) < threshold && lasthashname == "NO_MATCH") //same as last but not a match
-		{
-			//skip algorithms
-		} else {
-			//search localmap first if this is same scene, if not, must be a new field
-			for (it = localmap.begin(); it != localmap.end(); ++it)//run short algorithm (cheap, iterates over ~5-13 elements)
-			{
-				int diff = comparebits(hashval, it->second);
-				if (diff < mindiff)
-				{
-					mindiff = diff;
-					if (mindiff < threshold) { closest = it->first; closehash = it->second; }
-				}
-			}
-			if (closest == "NO_MATCH")	//run long algorithm (expensive, iterates over 6245 elements twice), should only be done once per field
-			{
-				longrun = 1;
-				for (it = hashmap.begin(); it != hashmap.end(); ++it)
-				{
-					int diff = comparebits(hashval, it->second);
-					if (diff < mindiff)
-					{
-						mindiff = diff;
-						if (mindiff < threshold) { closest = it->first; closehash = it->second; }
-					}
-				}
-				localmap.clear(); //empty previous field
-				int strloc = closest.find_last_of("_");
-				string field = closest.substr(0, strloc);
-				for (it = hashmap.begin(); it != hashmap.end(); ++it)	//fill localmap with new field
-				{
-					if (it->first.substr(0, field.length()) == field)	//if 
-					{
-						localmap.insert(pair<string, uint64_t>(it->first, it->second));
-					}
-				}
-			}
-		}
-	//} else { //run short algorithm (cheap, iterates over ~5-13 elements)
-		/*if (lastfieldname != "NO_MATCH")
-		{
-			for (it = localmap.begin(); it != localmap.end(); ++it)
-			{
-				int diff = comparebits(hashval, it->second);
-				if (diff < mindiff)
-				{
-					mindiff = diff;
-					if (mindiff < threshold) { closest = it->first; closehash = it->second; }
-				}
-			}
-		}
-	}
-
-	
-	ofstream matchfile;
-	matchfile.open ("matchfile.csv", ofstream::out | ofstream::app);
-	matchfile << longrun << "," << lasthashname << "," << closest << "," << mindiff << "," << hashval << "," << closehash << endl;
-	matchfile.close();
-	lasthashval = hashval;
-	lasthashname = closest;
-	return closest;
-}*/
+// comparebits() and closesthash() scanned the whole hashmap for the nearest Omzy hash; FuzzyMap (fuzzymap.h) indexes the hashes instead
 	//pixvals 0->31
 	/*for (x = 0; x < 8; x++)
 	{
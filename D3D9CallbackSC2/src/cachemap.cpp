@@ -1,5 +1,8 @@
-#include "Main.h"
 #include "cachemap.h"
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <deque>
 
 #define DEBUG 0
 
@@ -7,84 +10,256 @@
 string debug_file = "tonberry\\debug\\texture_cache.log";
 #endif
 
-size_t FieldMap::count(uint64_t hash)
+FieldMap::FieldMap() : slots(NULL), slot_mask(0), slot_shift(64), keys(0), ids(NULL), name_offsets(NULL), fields(0), names(NULL), index(NULL)
 {
-	fieldmap_iter iter = fieldmap.find(hash);
-	
-	return (iter == fieldmap.end()) ? 0 : iter->second.size();
+	offset_vec.push_back(0);
+	point_at_owned();
+}
+
+void FieldMap::point_at_owned()
+{
+	slots			= slot_vec.empty() ? NULL : &slot_vec[0];
+	slot_mask		= slot_vec.empty() ? 0 : (uint32_t)slot_vec.size() - 1;
+	ids				= id_vec.empty() ? NULL : &id_vec[0];
+	name_offsets	= &offset_vec[0];
+	fields			= (uint32_t)offset_vec.size() - 1;
+	names			= name_arena.empty() ? NULL : &name_arena[0];
+
+	slot_shift = 64;
+	for (uint32_t n = (uint32_t)slot_vec.size(); n > 1; n >>= 1) slot_shift--;
+}
+
+void FieldMap::attach(const HashIndex* index)
+{
+	this->index = index;
+
+	// the index replaces whatever was built before
+	vector<FieldSlot>().swap(slot_vec);
+	vector<uint32_t>().swap(id_vec);
+	vector<uint32_t>(1, 0).swap(offset_vec);
+	vector<char>().swap(name_arena);
+	unordered_map<string, uint32_t>().swap(name_ids);
+	pending.clear();
+	keys = 0;
+	point_at_owned();
+
+	if (index == NULL || !index->is_open()) {
+		this->index = NULL;
+		return;
+	}
+
+	slots			= index->slots();
+	slot_mask		= index->slot_count() - 1;
+	keys			= index->key_count();
+	ids				= index->ids();
+	name_offsets	= index->name_offsets();
+	fields			= index->field_count();
+	names			= index->names();
+
+	slot_shift = 64;
+	for (uint32_t n = index->slot_count(); n > 1; n >>= 1) slot_shift--;
+}
+
+void FieldMap::take_ownership()
+{
+	vector<uint32_t>(name_offsets, name_offsets + fields + 1).swap(offset_vec);
+	vector<char>(names, names + name_offsets[fields]).swap(name_arena);
+	for (uint32_t id = 0; id < fields; id++)
+		name_ids[field_name(id)] = id;
+
+	for (uint32_t i = 0; i <= slot_mask && keys > 0; i++) {						// queue the mapped entries so build() re-adds them
+		const FieldSlot& slot = slots[i];
+		if (slot.count == 1)
+			pending.push_back(pending_t(slot.hash, slot.value));
+		else for (uint32_t j = 0; j < slot.count; j++)
+			pending.push_back(pending_t(slot.hash, ids[slot.value + j]));
+	}
+
+	index = NULL;
+	keys = 0;																		// the entries are in pending now
+	point_at_owned();
+}
+
+uint32_t FieldMap::intern(const string& field)
+{
+	unordered_map<string, uint32_t>::iterator iter = name_ids.find(field);
+	if (iter != name_ids.end()) return iter->second;
+
+	uint32_t id = (uint32_t)offset_vec.size() - 1;
+	name_arena.insert(name_arena.end(), field.c_str(), field.c_str() + field.size() + 1);
+	offset_vec.push_back((uint32_t)name_arena.size());
+	name_ids[field] = id;
+	point_at_owned();																// the arena may have moved
+	return id;
 }
 
 void FieldMap::insert(uint64_t hash, const string& field)
 {
-	fieldset_iter ptr_to_field_name = fieldset.insert(field).first;
-	fieldmap[hash].insert(ptr_to_field_name);
+	if (index) take_ownership();
+	pending.push_back(pending_t(hash, intern(field)));
 }
 
-bool FieldMap::get_fields(uint64_t hash, unordered_set<string>& result)
+void FieldMap::build()
 {
-	fieldmap_iter map_iter;
-	if ((map_iter = fieldmap.find(hash)) == fieldmap.end()) return false;
+	if (pending.empty()) return;
+
+	// fold the current table back into the pending entries
+	for (uint32_t i = 0; i < slot_vec.size(); i++) {
+		const FieldSlot& slot = slot_vec[i];
+		if (slot.count == 1)
+			pending.push_back(pending_t(slot.hash, slot.value));
+		else for (uint32_t j = 0; j < slot.count; j++)
+			pending.push_back(pending_t(slot.hash, id_vec[slot.value + j]));
+	}
 
-	fieldset_iter_set_iter match_iter;
-	for (match_iter = map_iter->second.begin(); match_iter != map_iter->second.end(); match_iter++)
-		result.insert(**match_iter);
+	// group by hash and drop duplicates; ids are interned in file order, so the first field read stays first
+	sort(pending.begin(), pending.end());
+	pending.erase(unique(pending.begin(), pending.end()), pending.end());
+
+	size_t key_count = 0;
+	for (size_t i = 0; i < pending.size(); i++)
+		if (i == 0 || pending[i].first != pending[i - 1].first) key_count++;
+
+	size_t capacity = 16;
+	while (capacity < key_count * 2) capacity <<= 1;								// load factor <= 1/2 keeps probes short
+
+	FieldSlot empty = { 0, 0, 0 };
+	vector<FieldSlot>(capacity, empty).swap(slot_vec);
+	id_vec.clear();
+	keys = 0;
+	point_at_owned();																// slot_of() needs the new shift
+
+	for (size_t first = 0, last; first < pending.size(); first = last) {
+		uint64_t hash = pending[first].first;
+		for (last = first + 1; last < pending.size() && pending[last].first == hash; last++);
+
+		FieldSlot slot;
+		slot.hash = hash;
+		slot.count = (uint32_t)(last - first);
+		if (slot.count == 1) {
+			slot.value = pending[first].second;
+		} else {
+			slot.value = (uint32_t)id_vec.size();
+			for (size_t i = first; i < last; i++) id_vec.push_back(pending[i].second);
+		}
 
-	return true;
+		uint32_t i = slot_of(hash);
+		while (slot_vec[i].count != 0) i = (i + 1) & slot_mask;
+		slot_vec[i] = slot;
+		keys++;
+	}
+
+	vector<pending_t>().swap(pending);
+	point_at_owned();
 }
 
-bool FieldMap::get_first_field(uint64_t hash, string& result)
+bool FieldMap::get_first_field(uint64_t hash, string& result) const
 {
-	fieldmap_iter iter;
-	if ((iter = fieldmap.find(hash)) == fieldmap.end()) return false;
+	const char* field = first_field(hash);
+	if (field == NULL) return false;
 
-	result = **(iter->second.begin());
+	result = field;
 
 	return true;
 }
 
-bool FieldMap::get_intersection(uint64_t hash_1, uint64_t hash_2, unordered_set<string>& result)
+const char* FieldMap::first_field(uint64_t hash) const
 {
-	fieldmap_iter iter_1, iter_2;
-	fieldset_iter_set_t intersection;
+	FieldSpan span = find(hash);
+	return span.empty() ? NULL : field_name(span.ids[0]);
+}
 
-	// search for hash_upper
-	if ((iter_1 = fieldmap.find(hash_1)) == fieldmap.end() ||
-		(iter_2 = fieldmap.find(hash_2)) == fieldmap.end())
-		return false;
-	
-	set_intersection(iter_1->second.begin(), iter_1->second.end(),
-					 iter_2->second.begin(), iter_2->second.end(),
-					 inserter(intersection, intersection.end()), fieldset_iter_compare());
+bool FieldMap::get_intersection(uint64_t hash_1, uint64_t hash_2, vector<uint32_t>& result) const
+{
+	FieldSpan span_1 = find(hash_1), span_2 = find(hash_2);
 
-	if (intersection.size() == 0) return false;
+	size_t size_before = result.size();
+	set_intersection(span_1.begin(), span_1.end(), span_2.begin(), span_2.end(), back_inserter(result));	// spans are sorted by id
 
-	fieldset_iter_set_iter iter;
-	for (iter = intersection.begin(); iter != intersection.end(); iter++)
-		result.insert(**iter);
+	return result.size() > size_before;
+}
 
-	return true;
+bool FieldMap::write_index(const boost::filesystem::path& index_file, uint64_t source_stamp) const
+{
+	if (index) return false;														// already compiled
+	if (slot_vec.empty()) return true;												// an empty hashmap has nothing to compile; the folder is read again next start
+
+	return HashIndex::write(index_file, source_stamp, slots, (uint32_t)slot_vec.size(), keys, ids, (uint32_t)id_vec.size(), name_offsets, fields, names);
 }
 
-void FieldMap::writeMap(ofstream& out)
+void FieldMap::writeMap(ostream& out) const
 {
-	fieldmap_iter map_iter;
-	for (map_iter = fieldmap.begin(); map_iter != fieldmap.end(); map_iter++) {
-		out << map_iter->first << ":";
-		fieldset_iter_set_iter field_iter;
-		for (field_iter = map_iter->second.begin(); field_iter != map_iter->second.end(); field_iter++) {
-			out << " " << **field_iter << ";";
-		}
+	out << "(" << keys << " hashes, " << fields << " fields" << (index ? ", from compiled index" : "") << ")" << endl;
+	for (uint32_t i = 0; i <= slot_mask && keys > 0; i++) {
+		if (slots[i].count == 0) continue;
+		out << slots[i].hash << ":";
+		FieldSpan span = find(slots[i].hash);
+		for (const uint32_t* id = span.begin(); id != span.end(); id++)
+			out << " " << field_name(*id) << ";";
 		out << endl;
 	}
 }
 
-TextureCache::TextureCache(unsigned max_size)
+bool read_hashmap_csv(const boost::filesystem::path& csv_file, vector<pair<uint64_t, string>>& entries, vector<string>& errors)
 {
+	ifstream hashfile(csv_file.string(), ifstream::in);
+	if (!hashfile.is_open()) {
+		errors.push_back("Error: could not open " + csv_file.string());
+		return true;
+	}
+
+	string line;
+	while (getline(hashfile, line)) {
+		// split line on ','
+		deque<string> items;
+		stringstream sstream(line);
+		string item;
+		while (getline(sstream, item, ',')) {
+			items.push_back(item);
+		}
+
+		// format is "<field_name>,<hash_combined>{,<hash_upper>,<hash_lower>}"
+		if (!(items.size() == 2 || items.size() == 4)) {
+			errors.push_back("Error: bad hashmap. Format is \"<field_name>,<hash_combined>{,<hash_upper>,<hash_lower>}\": " + csv_file.string());
+			return false;
+		}
+
+		// field names are stored only once; hashes are the combined, upper, and lower ones
+		for (size_t i = 1; i < items.size(); i++) {
+			uint64_t hash;
+			stringstream number(items[i]);
+			if (!(number >> hash)) {
+				errors.push_back("Error: bad hashmap entry. Must be an integer: " + items[i]);
+			} else {
+				entries.push_back(make_pair(hash, items[0]));
+			}
+		}
+	}
+	return true;
+}
+
+bool read_hashmap_csv(const boost::filesystem::path& csv_file, FieldMap& map, vector<string>& errors)
+{
+	vector<pair<uint64_t, string>> entries;
+	bool well_formed = read_hashmap_csv(csv_file, entries, errors);
+	for (size_t i = 0; i < entries.size(); i++) map.insert(entries[i].first, entries[i].second);
+	return well_formed;
+}
+
+TextureCache::TextureCache(TextureDevice* device, size_t budget, unsigned max_size, EvictionPolicy* policy)
+{
+	this->device = device;
+	this->budget = budget;
 	this->max_size = max_size;
+	stats = TextureCacheStats();
+
+	if (policy == NULL) policy = make_eviction_policy("arc", budget, max_size);
+	this->policy = policy;
+	trace = NULL;
 
 #if DEBUG
 	ofstream debug(debug_file, fstream::out | fstream::trunc);
-	debug << "CACHE_SIZE: " << max_size << endl << endl << endl;
+	debug << "CACHE_BUDGET: " << (budget >> 20) << " MB, CACHE_SIZE: " << max_size << ", policy: " << policy->name() << endl << endl << endl;
 	debug.close();
 #endif
 
@@ -96,8 +271,12 @@ TextureCache::TextureCache(unsigned max_size)
 
 TextureCache::~TextureCache()
 {
+	for (nhcache_list_iter item = nh_list->begin(); item != nh_list->end(); item++)
+		if (item->newhandle) device->release_texture(item->newhandle);					// the cache owns every loaded newhandle
 	delete nh_list;
 	delete nh_map;
+	delete policy;
+	delete trace;
 	delete handlecache;
 	delete reverse_handlecache;
 }
@@ -120,7 +299,7 @@ HANDLE TextureCache::at(uint64_t hash)
 
 	if (iter == nh_map->end()) return NULL;
 
-	return iter->second->second;
+	return iter->second->newhandle;
 }
 
 
@@ -140,7 +319,7 @@ HANDLE TextureCache::at(HANDLE replaced)
 		return NULL;
 	}
 
-	return map_iter->second->second;
+	return map_iter->second->newhandle;
 }
 
 
@@ -154,7 +333,7 @@ void TextureCache::map_insert(uint64_t hash, nhcache_list_iter item, HANDLE repl
 	pair<nhcache_map_iter, bool> map_insertion = nh_map->insert(							// returns iterator to nh_map[hash] and boolean success
 		pair<uint64_t, nhcache_list_iter>(hash, item));
 	if (!map_insertion.second)																// if nh_map already contained hash, 
-		map_insertion.first->second = nh_list->begin();										// change nh_map[hash] to nh_list->begin()
+		map_insertion.first->second = item;													// change nh_map[hash] to item
 
 	pair<handlecache_iter, bool> cache_insertion = handlecache->insert(						// returns iterator to handlecache[HANDLE] and boolean success
 		pair<HANDLE, uint64_t>(replaced, hash));
@@ -172,7 +351,9 @@ void TextureCache::map_insert(uint64_t hash, nhcache_list_iter item, HANDLE repl
 		reverse_handlecache_iter backpointer = backpointer_range.first;
 		for (; backpointer != backpointer_range.second && backpointer != reverse_handlecache->end(); backpointer++)
 			if (backpointer->second == replaced) {
+#if DEBUG
 				int size_before = reverse_handlecache->size();
+#endif
 				reverse_handlecache->erase(backpointer);
 #if DEBUG
 				debug << "\tRemoving (" << backpointer->first << ", " << backpointer->second << ") from reverse_handlecache-> ";
@@ -181,22 +362,26 @@ void TextureCache::map_insert(uint64_t hash, nhcache_list_iter item, HANDLE repl
 				break;
 			}
 		cache_insertion.first->second = hash;												// change handlecache entry
+		stats.handles_stale++;
+		release_handle(old_hash);
 #if DEBUG
 		debug << "\tChanging (" << cache_insertion.first->first << ", (" << old_hash << ")) to ";
-		debug << "(" << replaced << ", (" << item->first << ")) in handlecache: ";
-		debug << "nh_map[" << hash << "] = " << nh_map->at(hash)->second << endl;
+		debug << "(" << replaced << ", (" << item->hash << ")) in handlecache: ";
+		debug << "nh_map[" << hash << "] = " << nh_map->at(hash)->newhandle << endl;
 	} else {
 		debug << "\tAdding (" << replaced << ", (" << hash << ")) to handlecache: ";		// actually already did so in if() above
-		debug << "nh_map[" << hash << "] = " << nh_map->at(hash)->second << endl;
+		debug << "nh_map[" << hash << "] = " << nh_map->at(hash)->newhandle << endl;
 	}
 #else
 	}
 #endif
 
 	reverse_handlecache->emplace(nhcache_item_t(hash, replaced));
+	item->handles++;
+	if (cache_insertion.second) stats.handles++;
 
 #if DEBUG
-	debug << "\tAdding (" << item->first << ", (" << replaced << ") to reverse_handlecache:" << endl;
+	debug << "\tAdding (" << item->hash << ", (" << replaced << ") to reverse_handlecache:" << endl;
 	pair<reverse_handlecache_iter, reverse_handlecache_iter> backpointer_range = reverse_handlecache->equal_range(hash);
 	reverse_handlecache_iter backpointer = reverse_handlecache->begin();// backpointer_range.first;
 	for (; /*backpointer != backpointer_range.second &&*/ backpointer != reverse_handlecache->end(); backpointer++)
@@ -212,87 +397,162 @@ void TextureCache::insert(HANDLE replaced, uint64_t hash)
 {
 #if DEBUG
 	ofstream debug(debug_file, ofstream::out | ofstream::app);
-	debug << "Inserting (" << replaced << " :-> nh_map[" << hash << "] = " << nh_map->at(hash)->second << "):" << endl;
+	debug << "Inserting (" << replaced << " :-> nh_map[" << hash << "] = " << nh_map->at(hash)->newhandle << "):" << endl;
 #endif
 
 	nhcache_map_iter updated = nh_map->find(hash);	//really needed?									// this line is needed, we need to access the map item 
 	if (updated == nh_map->end()) return;			//our precondition is to have an existing hash!		// this line... yes, this should never happen, but if for some reason it does
 																										// (bug in GlobalContext, whatever) this will prevent a crash
-	/* UPDATE NH CACHE ACCESS ORDER */
+	/* UPDATE NH CACHE PRIORITY */
 	nhcache_list_iter item = updated->second;
-
-	// move (most-recently-accessed) list item to front of nh_list
-	nh_list->push_front(*item);
-	nh_list->erase(item);
+	stats.hits++;
+	if (trace) *trace << "a," << hash << "\n";
+	if (item->newhandle) policy->touch(hash);												// a pending item is admitted when it is loaded
 
 #if DEBUG
-	debug << "\tMoving (" << item->first << ", " << item->second << ") to front of nh_list: nh_list->begin() = ";
-	debug << "(" << nh_list->begin()->first << ", " << nh_list->begin()->second << ")" << endl;
+	debug << "\tTouching (" << item->hash << ", " << item->newhandle << ")" << endl;
 	debug.close();
 #endif
 
-	map_insert(hash, nh_list->begin(), replaced);
+	map_insert(hash, item, replaced);
 }
 
 
-void TextureCache::insert(HANDLE replaced, uint64_t hash, HANDLE replacement)
+void TextureCache::insert(HANDLE replaced, uint64_t hash, HANDLE replacement, size_t bytes, double cost)
 {
-	nh_list->push_front(nhcache_item_t(hash, replacement));
+	nhcache_entry_t entry = { hash, NULL, 0, 0 };
+	nh_list->push_front(entry);
+	stats.misses++;
+	if (trace) *trace << "a," << hash << "\n";
 
 #if DEBUG
 	ofstream debug(debug_file, ofstream::out | ofstream::app);
 	debug << "Inserting (" << replaced << " :-> (" << hash << ", " << replacement << "):" << endl;
-	debug << "\tInserting (" << hash << ", " << replacement << ") at front of nh_list: nh_list->begin() = ";
-	debug << "(" << nh_list->begin()->first << ", " << nh_list->begin()->second << ")" << endl;
+	debug.close();
 #endif
 
-	/* MAKE SURE NHCACHE IS THE CORRECT SIZE */
-	while (nh_list->size() > max_size) {													// "while" for completeness but this should only ever loop once
-		// get pointer to last (least recent) list item
-		nhcache_list_iter last_elem = nh_list->end();
-		--last_elem;
+	map_insert(hash, nh_list->begin(), replaced);
+	if (replacement) complete(hash, replacement, bytes, cost);
+}
+
+void TextureCache::evict(uint64_t keep)
+{
+	uint64_t victim;
+	while (((budget > 0 && stats.bytes_resident > budget) || (max_size > 0 && stats.entries > max_size)) &&
+		   policy->victim(keep, victim)) {													// the texture just loaded is about to be drawn, so it is kept
+		nhcache_map_iter iter = nh_map->find(victim);
+		if (iter == nh_map->end() || iter->second->newhandle == NULL) {					// this should never happen
+			policy->remove(victim);
+			continue;
+		}
+
+		stats.bytes_evicted += iter->second->bytes;
+		stats.evictions++;
 
 #if DEBUG
-		debug << "\tRemoving (" << last_elem->first << ", " << last_elem->second << ") from back of nh_list." << endl;
+		ofstream debug(debug_file, ofstream::out | ofstream::app);
+		debug << "\tEvicting (" << iter->second->hash << ", " << iter->second->newhandle << "): " << iter->second->bytes << " bytes" << endl;
+		debug.close();
 #endif
 
-		// dispose of texture
-		((IDirect3DTexture9*)last_elem->second)->Release();
-		last_elem->second = NULL;
+		policy->evicted(victim);															// before remove(), so the policy keeps it as a ghost
+		remove(iter->second);
+	}
+}
+
+void TextureCache::remove(nhcache_list_iter item)
+{
+#if DEBUG
+	ofstream debug(debug_file, ofstream::out | ofstream::app);
+#endif
 
-		// if we're going to delete a hash from the nh_map, we need to first remove entries that map to that hash from the handlecache
-		nhcache_map_iter to_delete = nh_map->find(last_elem->first);
-		pair<reverse_handlecache_iter, reverse_handlecache_iter> backpointer_range =
-			reverse_handlecache->equal_range(last_elem->first);
+	// dispose of texture; a pending entry has none yet
+	if (item->newhandle) {
+		device->release_texture(item->newhandle);
+		policy->remove(item->hash);															// keeps what evicted() left
+		stats.bytes_resident -= item->bytes;
+		stats.entries--;
+	}
+	item->newhandle = NULL;
 
-		reverse_handlecache_iter backpointer = backpointer_range.first;
-		for (; backpointer != backpointer_range.second && backpointer != reverse_handlecache->end(); backpointer++) {
+	// if we're going to delete a hash from the nh_map, we need to first remove entries that map to that hash from the handlecache
+	nhcache_map_iter to_delete = nh_map->find(item->hash);
+	pair<reverse_handlecache_iter, reverse_handlecache_iter> backpointer_range =
+		reverse_handlecache->equal_range(item->hash);
+
+	reverse_handlecache_iter backpointer = backpointer_range.first;
+	for (; backpointer != backpointer_range.second && backpointer != reverse_handlecache->end(); backpointer++) {
+#if DEBUG
+		debug << "\t\tRemoving (" << backpointer->second << ", " << backpointer->first << ") from handlecache." << endl;
+#endif
+		handlecache->erase(backpointer->second);											// remove from handlecache; reverse_handlecache will be removed
+	}																						// afterward to preserve iterators in the backpointer_range
 #if DEBUG
-			debug << "\t\tRemoving (" << backpointer->second << ", " << backpointer->first << ") from handlecache." << endl;
+	int size_before = reverse_handlecache->size();
 #endif
-			handlecache->erase(backpointer->second);										// remove from handlecache; reverse_handlecache will be removed
-		}																					// afterward to preserve iterators in the backpointer_range
-		int size_before = reverse_handlecache->size();
-		int num_removed = reverse_handlecache->erase(last_elem->first);
+	int num_removed = reverse_handlecache->erase(item->hash);
+	stats.handles -= num_removed;
 
 #if DEBUG
-		debug << "\t\tRemoved " << num_removed << " entries from reverse_handlecache-> (size: " << size_before << " --> " << reverse_handlecache->size() << ")" << endl;
-		debug << "\tRemoving (" << to_delete->first << ", (" << to_delete->second->first << ", " << to_delete->second->second << ")) from nh_map." << endl;
+	debug << "\t\tRemoved " << num_removed << " entries from reverse_handlecache-> (size: " << size_before << " --> " << reverse_handlecache->size() << ")" << endl;
+	debug << "\tRemoving (" << to_delete->first << ", (" << to_delete->second->hash << ", " << to_delete->second->newhandle << ")) from nh_map." << endl;
+	debug.close();
 #endif
 
-		// remove from map (this is why the nh_list stores pair<hash, handle>)
-		nh_map->erase(to_delete);
+	// remove from map (this is why the nh_list stores the hash)
+	nh_map->erase(to_delete);
 
-		// pop from list
-		nh_list->pop_back();
+	// remove from list
+	nh_list->erase(item);
+}
+
+void TextureCache::record_trace(const string& path)
+{
+	delete trace;
+	trace = new ofstream(path, ofstream::out | ofstream::trunc);
+	if (!trace->is_open()) {
+		delete trace;
+		trace = NULL;
 	}
-	/* END MAKE SURE NHCACHE IS THE CORRECT SIZE */
+}
 
-#if DEBUG
-	debug.close();
-#endif
+bool TextureCache::pending(uint64_t hash)
+{
+	nhcache_map_iter iter = nh_map->find(hash);
+	return iter != nh_map->end() && iter->second->newhandle == NULL;
+}
 
-	map_insert(hash, nh_list->begin(), replaced);
+bool TextureCache::complete(uint64_t hash, HANDLE replacement, size_t bytes, double cost)
+{
+	nhcache_map_iter iter = nh_map->find(hash);
+	if (iter == nh_map->end() || iter->second->newhandle != NULL) return false;			// evicted (or completed) while it was loading
+
+	nhcache_list_iter item = iter->second;
+	item->newhandle = replacement;
+	item->bytes = bytes;
+	policy->admit(hash, bytes, cost);
+	if (item->handles == 0) policy->demote(hash);											// every texture that wanted it was destroyed while it loaded
+	if (trace) *trace << "l," << hash << "," << bytes << "," << cost << endl;			// flushed once per load
+	stats.bytes_resident += item->bytes;
+	stats.entries++;
+
+	evict(hash);
+	return true;
+}
+
+void TextureCache::cancel(uint64_t hash)
+{
+	nhcache_map_iter iter = nh_map->find(hash);
+	if (iter != nh_map->end() && iter->second->newhandle == NULL) remove(iter->second);
+}
+
+bool TextureCache::invalidate(uint64_t hash)
+{
+	nhcache_map_iter iter = nh_map->find(hash);
+	if (iter == nh_map->end()) return false;
+	remove(iter->second);																	// a pending load finds no entry, and its texture is released
+	stats.invalidated++;
+	return true;
 }
 
 void TextureCache::erase(HANDLE replaced)
@@ -303,27 +563,66 @@ void TextureCache::erase(HANDLE replaced)
 #if DEBUG
 		ofstream debug(debug_file, ofstream::out | ofstream::app);
 		debug << "Erasing unused HANDLE " << replaced << ": " << endl;
-		debug << "\tRemoving (" << iter->first << ", " << iter->second << ") from handlecache." << endl;
+		debug.close();
 #endif
 
-		pair<reverse_handlecache_iter, reverse_handlecache_iter> backpointer_range = reverse_handlecache->equal_range(iter->second);
-		reverse_handlecache_iter backpointer = backpointer_range.first;
-		for (; backpointer != backpointer_range.second && backpointer != reverse_handlecache->end(); backpointer++)
-			if (backpointer->second == replaced) {
-				int size_before = reverse_handlecache->size();
-				reverse_handlecache->erase(backpointer);									// remove matching backpointer from reverse_handlecache
-#if DEBUG
-				debug << "\tRemoving (" << backpointer->first << ", " << backpointer->second << ") from reverse_handlecache-> ";
-				debug << "(size: " << size_before << " --> " << reverse_handlecache->size() << ")" << endl;
-#endif
-				break;
-			}
+		unbind(iter);
+	}
+}
 
-		handlecache->erase(iter);															// remove entry from handlecache
+void TextureCache::destroy(HANDLE replaced)
+{
+	handlecache_iter iter;
+	if ((iter = handlecache->find(replaced)) != handlecache->end()) {
 
 #if DEBUG
-		debug << endl;
+		ofstream debug(debug_file, ofstream::out | ofstream::app);
+		debug << "Destroying HANDLE " << replaced << ": " << endl;
 		debug.close();
 #endif
+
+		stats.handles_destroyed++;
+		unbind(iter);
 	}
-}
\ No newline at end of file
+}
+
+void TextureCache::unbind(handlecache_iter iter)
+{
+#if DEBUG
+	ofstream debug(debug_file, ofstream::out | ofstream::app);
+	debug << "\tRemoving (" << iter->first << ", " << iter->second << ") from handlecache." << endl;
+#endif
+
+	HANDLE replaced = iter->first;
+	uint64_t hash = iter->second;
+	pair<reverse_handlecache_iter, reverse_handlecache_iter> backpointer_range = reverse_handlecache->equal_range(hash);
+	reverse_handlecache_iter backpointer = backpointer_range.first;
+	for (; backpointer != backpointer_range.second && backpointer != reverse_handlecache->end(); backpointer++)
+		if (backpointer->second == replaced) {
+#if DEBUG
+			int size_before = reverse_handlecache->size();
+			debug << "\tRemoving (" << backpointer->first << ", " << backpointer->second << ") from reverse_handlecache-> ";
+			debug << "(size: " << size_before << " --> " << size_before - 1 << ")" << endl;
+#endif
+			reverse_handlecache->erase(backpointer);										// remove matching backpointer from reverse_handlecache
+			break;
+		}
+
+	handlecache->erase(iter);																// remove entry from handlecache
+	stats.handles--;
+	release_handle(hash);
+
+#if DEBUG
+	debug << endl;
+	debug.close();
+#endif
+}
+
+void TextureCache::release_handle(uint64_t hash)
+{
+	nhcache_map_iter iter = nh_map->find(hash);
+	if (iter == nh_map->end() || iter->second->handles == 0) return;
+
+	nhcache_list_iter item = iter->second;
+	if (--item->handles == 0 && item->newhandle) policy->demote(hash);					// resident, but nothing draws it now
+}
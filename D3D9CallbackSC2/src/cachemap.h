@@ -1,94 +1,250 @@
 #ifndef _CACHEMAP_H
 #define _CACHEMAP_H
 
-#include "Main.h"
+#include "hashindex.h"
+#include "evictpolicy.h"
+#include "texloader.h"
 #include <stdint.h>
+#include <string>
+#include <list>
+#include <fstream>
+#include <ostream>
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-class FieldMap
+typedef void* HANDLE;		// as windows.h declares it, so the cache builds without it
+
+/*
+	FieldSpan: view of the field ids mapped to one hash; points into the FieldMap (or its attached index) and stays
+	valid until the map is rebuilt or the index is closed
+*/
+struct FieldSpan
 {
-private:
-	typedef set<string> fieldset_t;													// holds field names; ordered so that iterators will not be invalidateds
-	typedef fieldset_t::const_iterator fieldset_iter;								// points to field names
+	const uint32_t*	ids;
+	uint32_t		count;
 
-	fieldset_t fieldset;
+	FieldSpan() : ids(NULL), count(0) {}
+	FieldSpan(const uint32_t* ids, uint32_t count) : ids(ids), count(count) {}
 
-	struct fieldset_iter_hasher
-	{
-		size_t operator()(fieldset_iter iter) const
-		{																			// since fieldset entries are unique, use the pointer of the field to hash fieldset_iter
-			return std::hash<const string*>()(&*iter);
-		}
-	};
+	const uint32_t* begin() const { return ids; }
+	const uint32_t* end() const { return ids + count; }
+	bool empty() const { return count == 0; }
+};
+
+/*
+	FieldMap: maps texture hashes to replacement field names
+
+	Hashes live in one flat open-addressing table of FieldSlots (linear probing, power-of-two size, at most half full).
+	A hash mapped to a single field keeps the field id inline in its slot; collisions point into a shared pool of ids.
+	Field names are interned once in a single arena and referred to by 32-bit id.
 
-	struct fieldset_iter_compare
+	The table is either owned (built from insert() calls by build()) or read in place from a mapped HashIndex;
+	lookups go through the same raw pointers in both cases.
+*/
+class FieldMap
+{
+private:
+	typedef pair<uint64_t, uint32_t> pending_t;										// hash :-> field id, waiting for build()
+
+	// owned storage; empty while an index is attached
+	vector<FieldSlot>				slot_vec;
+	vector<uint32_t>				id_vec;
+	vector<uint32_t>				offset_vec;										// offset of each name in name_arena, plus a trailing end offset
+	vector<char>					name_arena;										// NUL-terminated field names
+	unordered_map<string, uint32_t>	name_ids;										// interning table; only needed while inserting
+	vector<pending_t>				pending;
+
+	// the table that lookups read: points into the owned storage or into the attached index
+	const FieldSlot*	slots;
+	uint32_t			slot_mask;
+	uint32_t			slot_shift;
+	uint32_t			keys;
+	const uint32_t*		ids;
+	const uint32_t*		name_offsets;
+	uint32_t			fields;
+	const char*			names;
+
+	const HashIndex*	index;
+
+	/* slot_of: home slot of a hash; hashes are spread with a Fibonacci multiply so that similar hashes do not cluster
+	*/
+	inline uint32_t slot_of(uint64_t hash) const
 	{
-		bool operator()(const fieldset_iter& lhs, const fieldset_iter& rhs)
-		{
-			return *lhs == *rhs;													// since fieldset entries are unique, use fields to compare fieldset_iters
-		}
-	};
+		return (uint32_t)((hash * 0x9E3779B97F4A7C15ULL) >> slot_shift);
+	}
 
-	typedef unordered_set<fieldset_iter, fieldset_iter_hasher> fieldset_iter_set_t;	// holds sets of fieldset_iter
-	typedef fieldset_iter_set_t::iterator fieldset_iter_set_iter;					// iterates sets of fieldset_iter
+	/* intern: adds a field name to the arena if it is not there yet
+	   returns: the id of the field
+	*/
+	uint32_t intern(const string& field	// field name
+		);
 
-	typedef unordered_map<uint64_t, fieldset_iter_set_t> fieldmap_t;				// maps hashes to a set of matching field names; unordered for O(1) access/insertion, set for collisions
-	typedef fieldmap_t::iterator fieldmap_iter;
+	/* take_ownership: copies the attached index into owned storage so that more hashes can be inserted
+	*/
+	void take_ownership();
 
-	fieldmap_t fieldmap;															// maps original texture hash to replacement texture name
+	/* point_at_owned: makes lookups read the owned storage
+	*/
+	void point_at_owned();
 
 public:
+	FieldMap();
 
-	/* count: count matches for a given hash
-	  returns: size of fieldmap[hash]
+	/* attach: serve lookups from a mapped hashmap index instead of owned storage; any owned entries are dropped
+	   PRECONDITION: index is open and outlives the FieldMap, or is detached with attach(NULL)
 	*/
-	size_t count(uint64_t hash);
+	void attach(const HashIndex* index	// the mapped index, or NULL to detach
+		);
 
-	/* insert: adds hash :-> field to the map
+	/* insert: adds hash :-> field to the map; the entry is visible to lookups after the next build()
 	*/
 	void insert(uint64_t hash,		// map key
 				const string& field	// map value
 		);
 
-	/* get_fields: returns a set of fields mapped to the given hash;
-		   if the hash does not exist in the map, an empty field is returned
-	   returns: true if the given hash is in the map, else false
+	/* build: rebuilds the hash table with every entry inserted so far
 	*/
-	bool get_fields(uint64_t hash,					// the hash key
-					unordered_set<string>& result	// the set in which to put the matches
-		);
+	void build();
+
+	/* find: looks up the fields mapped to a hash
+	   returns: a view of the field ids, empty if the hash is not in the map
+	*/
+	inline FieldSpan find(uint64_t hash) const
+	{
+		if (keys == 0) return FieldSpan();
+		for (uint32_t i = slot_of(hash); ; i = (i + 1) & slot_mask) {				// the table is never full, so an empty slot ends every probe
+			const FieldSlot& slot = slots[i];
+			if (slot.count == 0) return FieldSpan();
+			if (slot.hash == hash)
+				return (slot.count == 1) ? FieldSpan(&slot.value, 1) : FieldSpan(ids + slot.value, slot.count);
+		}
+	}
+
+	/* field_name: name of an interned field
+	   returns: the NUL-terminated name, valid as long as the FieldSpan it came from
+	*/
+	inline const char* field_name(uint32_t id	// field id from a FieldSpan
+		) const
+	{
+		return names + name_offsets[id];
+	}
+
+	/* count: count matches for a given hash
+	  returns: number of fields mapped to hash
+	*/
+	size_t count(uint64_t hash) const { return find(hash).count; }
+
+	/* size: number of distinct hashes in the map
+	*/
+	size_t size() const { return keys; }
+
+	/* field_count: number of distinct field names in the map
+	*/
+	size_t field_count() const { return fields; }
 
 	/* get_first_field: gets the first field mapped to the given hash
 	  returns: true if the given hash is in the map, else false
 	*/
 	bool get_first_field(uint64_t hash,	// the hash key
 						string& result	// the string in which to place the result
-		);
+		) const;
+
+	/* first_field: gets the first field mapped to the given hash without copying it
+	  returns: pointer to the field name, or NULL if the hash is not in the map
+	*/
+	const char* first_field(uint64_t hash	// the hash key
+		) const;
 
-	/* get_intersection: returns the intersection of the sets of fields at the given hashes
+	/* get_intersection: returns the fields mapped to both hashes
 	   returns: true if the intersection is non-empty, else false
 	*/
-	bool get_intersection(uint64_t hash_1,				// the first hash
-						  uint64_t hash_2,				// the second hash
-						  unordered_set<string>& result	// the set in which to put the intersection
-		);
+	bool get_intersection(uint64_t hash_1,			// the first hash
+						  uint64_t hash_2,			// the second hash
+						  vector<uint32_t>& result	// the field ids in both sets
+		) const;
+
+	/* write_index: compiles the map into a hashmap index file (see hashindex.h)
+	   returns: true if the index was written, or the map is empty and there is nothing to compile, else false
+	*/
+	bool write_index(const boost::filesystem::path& index_file,	// destination
+					 uint64_t source_stamp						// hashmap_stamp() of the CSV files the map was loaded from
+		) const;
 
 	/* writeMap: writes entire map to an output steram
 	*/
-	void writeMap(ofstream& out	// output stream to which to write
-		);
+	void writeMap(ostream& out	// output stream to which to write
+		) const;
 };
 
+/* read_hashmap_csv: inserts the "<field_name>,<hash_combined>{,<hash_upper>,<hash_lower>}" lines of a _hm.csv file into a
+   map; a hash that is not an integer is skipped. The entries are visible to lookups after the next build()
+   returns: false if a line has neither 2 nor 4 items (the rest of the file is not read), else true; errors receives a
+   message for every problem, including a file that could not be opened
+*/
+bool read_hashmap_csv(const boost::filesystem::path& csv_file,	// the hashmap file
+					  FieldMap& map,								// receives the entries
+					  vector<string>& errors						// receives the problems found
+	);
+
+/* read_hashmap_csv: reads the entries of a _hm.csv file in file order, as above, without building a map
+   returns: false if a line has neither 2 nor 4 items (entries holds the lines before it), else true
+*/
+bool read_hashmap_csv(const boost::filesystem::path& csv_file,	// the hashmap file
+					  vector<pair<uint64_t, string>>& entries,		// receives hash :-> field for every hash of every line
+					  vector<string>& errors						// receives the problems found
+	);
+
+// counters kept by a TextureCache
+struct TextureCacheStats
+{
+	size_t		entries;			// replacement textures resident; loads still pending are not counted
+	size_t		bytes_resident;		// bytes of the resident textures, mip chains included
+	uint64_t	bytes_evicted;		// bytes released to stay within the budget
+	size_t		evictions;
+	size_t		hits;				// in-game textures given a replacement already in the cache
+	size_t		misses;				// in-game textures whose replacement had to be loaded
+	size_t		handles;			// in-game textures mapped to a hash now
+	size_t		handles_destroyed;	// mappings purged because the game released the texture
+	size_t		handles_stale;		// mappings replaced because their HANDLE turned up with another texture without being destroyed first
+	size_t		invalidated;		// entries dropped because their hashmap entries or replacement files changed (hot_reload)
+
+	/* hit_ratio: hits / (hits + misses)
+	*/
+	double hit_ratio() const { return (hits + misses) ? (double)hits / (hits + misses) : 0.0; }
+};
+
+/*
+	TextureCache: maps in-game textures (handles) to replacement textures (newhandles) by texture hash
+
+	The cache holds at most budget bytes of replacement textures. Once a load completes over budget, the eviction
+	policy (see evictpolicy.h) picks the textures to release; the texture just loaded is never one of them.
+
+	A newhandle that is still loading (pending) holds no memory and is never evicted.
+
+	Every entry counts the in-game textures bound to it. When the game destroys the last of them (destroy), the entry
+	stays resident but is demoted, so the policy evicts it before textures that are still drawn.
+
+	With record_trace, every use of a hash is written as "a,hash" and every completed load as "l,hash,bytes,cost", so
+	ConsoleTesting can replay a play session through each policy (see Replay_Cache_Trace).
+*/
 class TextureCache
 {
 
 private:
 
-	typedef pair<uint64_t, HANDLE>						nhcache_item_t;			// associates hashes with newhandles
-	typedef list<nhcache_item_t>						nhcache_list_t;			// holds hashes and their associated newhandle in least-recently-accessed order
+	struct nhcache_entry_t
+	{
+		uint64_t	hash;
+		HANDLE		newhandle;			// NULL while pending
+		size_t		bytes;				// texture memory, mip chain included; 0 while pending
+		size_t		handles;			// in-game textures mapped to it in the handlecache
+	};
+
+	typedef pair<uint64_t, HANDLE>						nhcache_item_t;			// associates hashes with handles
+	typedef list<nhcache_entry_t>						nhcache_list_t;			// holds hashes and their associated newhandle
 	typedef nhcache_list_t::iterator					nhcache_list_iter;
 	typedef unordered_map<uint64_t, nhcache_list_iter>	nhcache_map_t;			// maps hashes to an entry in the newhandle list
 	typedef nhcache_map_t::iterator						nhcache_map_iter;
@@ -102,13 +258,17 @@ private:
 	// together these make nhcache:
 	nhcache_list_t			*nh_list;
 	nhcache_map_t			*nh_map;
+	EvictionPolicy			*policy;			// orders the loaded entries
+	TextureDevice			*device;			// releases evicted newhandles
 
 	// handlecache:
 	handlecache_t			*handlecache;
 	reverse_handlecache_t	*reverse_handlecache;
 
-	size_t					entries;
-	size_t					max_size;
+	size_t					budget;				// most bytes of resident textures; 0 for no limit
+	size_t					max_size;			// most resident textures; 0 for no limit
+	TextureCacheStats		stats;
+	ofstream				*trace;				// cache_trace.csv while recording, else NULL
 
 	/*map_insert: insert or update nhcache item pointed to by given hash in the nh_map
 	PRECONDITION: item exists in the nh_list
@@ -118,56 +278,125 @@ private:
 					HANDLE replaced				// handlecache key	- will point to the new entry in nh_map
 		);
 
+	/*unbind: removes a handlecache entry and its backpointer, demoting its nhcache item if no other handle maps to it
+	*/
+	void unbind(handlecache_iter iter	// the handlecache entry to remove
+		);
+
+	/*release_handle: counts one fewer handle mapped to an nhcache item; demotes it after the last one
+	*/
+	void release_handle(uint64_t hash	// the nhcache key
+		);
+
+	/*remove: releases an nhcache item's newhandle and removes it and every handlecache entry that points to it
+	*/
+	void remove(nhcache_list_iter item	// the nh_list item to remove
+		);
+
+	/*evict: removes the loaded items the policy picks until the cache is within its budget
+	*/
+	void evict(uint64_t keep	// hash of an item that must stay (the one just loaded)
+		);
+
 public:
-	TextureCache(unsigned);
+	TextureCache(TextureDevice* device,			// created the newhandles; must outlive the cache
+				 size_t budget,					// most bytes of replacement textures to hold; 0 for no limit
+				 unsigned max_size = 0,			// most replacement textures to hold; 0 for no limit
+				 EvictionPolicy* policy = NULL	// owned by the cache; NULL for ARC
+		);
 	~TextureCache();
 
 	/*find: determine whether a hash is in the nhcache
 	  returns: true if hash is in the nh_map, else false
 	*/
-	bool TextureCache::contains(uint64_t hash	// the hash to find
+	bool contains(uint64_t hash	// the hash to find
 		);
 
 	/*find: determine whether a HANDLE is in the handlecache
 	returns: true if HANDLE is in the handlecache map, else false
 	*/
-	bool TextureCache::contains(HANDLE replaced	// the HANDLE to find
+	bool contains(HANDLE replaced	// the HANDLE to find
 		);
 
 	/*at: access an element in the nhcache
 	  returns: a reference to the HANDLE mapped to hash in the nhcache if it exists, or else null
 	*/
-	HANDLE TextureCache::at(uint64_t hash	// the hash key
+	HANDLE at(uint64_t hash	// the hash key
 		);
 	
 	/*at: access an element in the handlecache
 	  returns: a reference to the HANDLE mapped to replaced in the handlecache if it exists, or else null
 	*/
-	HANDLE TextureCache::at(HANDLE replaced	// the HANDLE key
+	HANDLE at(HANDLE replaced	// the HANDLE key
 		);
 
 
-	/*insert: if nh_map[hash] exists, inserts replaced :-> hash into the handlecache cache,
+	/*insert: if nh_map[hash] exists, inserts replaced :-> hash into the handlecache cache and counts a hit,
 			  else does nothing
 	*/
 	void insert(HANDLE replaced,	// the handlecache key
 				uint64_t hash		// the nhcache key
 		);
 
-	/*insert: inserts replaced :-> hash into the cache and hash :-> replacement into the nhcache
+	/*insert: inserts replaced :-> hash into the cache and hash :-> replacement into the nhcache, and counts a miss
+			  if replacement is NULL, the entry is pending: at() returns NULL for it until complete() is called
 	  PRECONDITIONS:
 		- hash is not on the cache
-		- replacement has been created
+		- replacement has been created, or is being loaded
 	*/
-	void insert(HANDLE replaced,	// in-game texture to be replaced by replacement
-				uint64_t hash,		// texture hash
-				HANDLE replacement	// modded texture handle
+	void insert(HANDLE replaced,		// in-game texture to be replaced by replacement
+				uint64_t hash,			// texture hash
+				HANDLE replacement,		// modded texture handle, or NULL while it is loading
+				size_t bytes = 0,		// texture memory of replacement
+				double cost = 0			// seconds it took to load replacement
 	);
 
+	/*pending: determine whether the newhandle of a hash is still loading
+	  returns: true if hash is in the nhcache without a newhandle, else false
+	*/
+	bool pending(uint64_t hash	// the hash to find
+		);
+
+	/*complete: gives a pending entry its newhandle, then evicts other textures until the cache is within its budget
+	  returns: true if the cache took ownership of replacement, else false (the entry was evicted meanwhile, and the caller must release replacement)
+	*/
+	bool complete(uint64_t hash,		// texture hash
+				  HANDLE replacement,	// the loaded modded texture handle
+				  size_t bytes,			// texture memory of replacement, mip chain included
+				  double cost			// seconds it took to load replacement
+		);
+
+	/*cancel: removes a pending entry whose newhandle could not be loaded, along with the handles mapped to it
+	*/
+	void cancel(uint64_t hash	// texture hash
+		);
+
+	/*invalidate: removes an entry, loaded or pending, along with the handles mapped to it, because its replacement changed;
+				  the game's next unlock of those textures matches and loads them again
+	  returns: true if hash was in the nhcache, else false
+	*/
+	bool invalidate(uint64_t hash	// texture hash
+		);
+
 	/*erase: removes HANDLE from the cache
 	*/
 	void erase(HANDLE replaced		// in-game texture to remove from the cache
 		);
+
+	/*destroy: removes HANDLE from the cache because the game released it, so a later texture at the same address cannot
+			   pick up its replacement
+	*/
+	void destroy(HANDLE replaced	// in-game texture the game released
+		);
+
+	TextureCacheStats get_stats() const { return stats; }
+
+	const char* policy_name() const { return policy->name(); }
+
+	/*record_trace: starts writing every access and load to a file, for replaying through other policies
+	*/
+	void record_trace(const string& path	// the trace file; overwritten
+		);
 };
 
 #endif
\ No newline at end of file
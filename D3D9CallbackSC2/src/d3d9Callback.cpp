@@ -1,5 +1,6 @@
 #include "Main.h"
 #include "d3d9Callback.h"
+#include "logger.h"
 
 #pragma data_seg(".HOOKDATA") //Shared data among all instances.
 HHOOK hook = NULL;
@@ -56,6 +57,7 @@ D3D9CALLBACK_API void D3D9CallbackFreeMemory()
         g_Context = NULL;
 		removehook();
 		hook_debug.close();
+		Logger::stop();						// writes out whatever is still queued
     }
 }
 D3D9CALLBACK_API void ReportCreateVertexShader(CONST DWORD* pFunction, HANDLE Shader) {}
@@ -0,0 +1,218 @@
+#include "diskcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+static const char DISKCACHE_MAGIC[4] = { 'T', 'B', 'D', 'C' };
+static const char* DISKCACHE_EXT = ".bgra";
+
+static inline void stamp_bytes(uint64_t& stamp, const void* data, size_t len)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++) {											// FNV-1a
+		stamp ^= bytes[i];
+		stamp *= 1099511628211ULL;
+	}
+}
+
+DiskCache::DiskCache(const fs::path& folder, uint64_t max_bytes) : folder(folder), max_bytes(max_bytes), scanned(false)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool DiskCache::cacheable(const LoadRequest& request)
+{
+	if (!request.path_combined.empty()) return true;
+	for (size_t i = 0; i < request.tiles.size(); i++)
+		if (request.tiles[i].path.empty()) return false;								// filled from the in-game texture, or from a cached tile of unknown origin
+	return !request.tiles.empty();
+}
+
+bool DiskCache::key(const LoadRequest& request, string& name, uint64_t& stamp)
+{
+	vector<const string*> paths(1, &request.path_combined);
+	for (size_t i = 0; i < request.tiles.size(); i++) paths.push_back(&request.tiles[i].path);
+
+	uint64_t name_hash = 14695981039346656037ULL;
+	stamp = 14695981039346656037ULL;
+	for (size_t i = 0; i < paths.size(); i++) {
+		const string& path = *paths[i];
+		stamp_bytes(name_hash, path.c_str(), path.size() + 1);					// the empty slot counts too: tiles name differently from combined
+		if (i > 0) {																// and so does where each tile goes
+			const TileSource& tile = request.tiles[i - 1];
+			const uint32_t rect[] = { tile.x, tile.y, tile.width, tile.height };
+			stamp_bytes(name_hash, rect, sizeof(rect));
+		}
+		if (path.empty()) continue;
+
+		boost::system::error_code ec;
+		uint64_t size = (uint64_t)fs::file_size(path, ec);
+		if (ec) return false;
+		int64_t mtime = (int64_t)fs::last_write_time(path, ec);
+		if (ec) return false;
+		stamp_bytes(stamp, path.c_str(), path.size() + 1);
+		stamp_bytes(stamp, &size, sizeof(size));
+		stamp_bytes(stamp, &mtime, sizeof(mtime));
+	}
+
+	char buf[17];
+	sprintf(buf, "%016llx", (unsigned long long)name_hash);
+	name = string(buf) + DISKCACHE_EXT;
+	return true;
+}
+
+void DiskCache::scan()
+{
+	if (scanned) return;
+	scanned = true;
+
+	boost::system::error_code ec;
+	fs::directory_iterator end_it;
+	for (fs::directory_iterator it(folder, ec); !ec && it != end_it; it.increment(ec)) {
+		if (!fs::is_regular_file(it->status()) || it->path().extension().string() != DISKCACHE_EXT) continue;
+		entry_t entry;
+		entry.bytes = (uint64_t)fs::file_size(it->path(), ec);
+		entry.used = fs::last_write_time(it->path(), ec);
+		if (ec) continue;
+		entries[it->path().filename().string()] = entry;
+		stats.bytes += entry.bytes;
+	}
+}
+
+void DiskCache::trim()
+{
+	if (stats.bytes <= max_bytes) return;
+
+	vector<pair<time_t, string> > by_use;
+	for (unordered_map<string, entry_t>::iterator iter = entries.begin(); iter != entries.end(); iter++)
+		by_use.push_back(make_pair(iter->second.used, iter->first));
+	sort(by_use.begin(), by_use.end());
+
+	uint64_t target = max_bytes - max_bytes / 10;								// trim a little extra so that every store does not trim
+	for (size_t i = 0; i < by_use.size() && stats.bytes > target; i++) {
+		boost::system::error_code ec;
+		fs::remove(folder / by_use[i].second, ec);
+		stats.bytes -= entries[by_use[i].second].bytes;
+		entries.erase(by_use[i].second);
+		stats.trimmed++;
+	}
+}
+
+bool DiskCache::load(const LoadRequest& request, StagingImage& image)
+{
+	string name;
+	uint64_t stamp;
+	if (!cacheable(request) || !key(request, name, stamp)) return false;
+
+	fs::path file = folder / name;
+	ifstream in(file.string(), ifstream::in | ifstream::binary);
+	DiskCacheHeader header;
+	bool hit = in.is_open() &&
+			   in.read((char*)&header, sizeof(header)) &&
+			   memcmp(header.magic, DISKCACHE_MAGIC, sizeof(DISKCACHE_MAGIC)) == 0 &&
+			   header.version == DISKCACHE_VERSION &&
+			   header.source_stamp == stamp &&											// the pack was not updated since
+			   header.width == (uint32_t)(request.resize_factor * (float)request.replaced_width) &&
+			   header.height == (uint32_t)(request.resize_factor * (float)request.replaced_height);
+	if (hit) {
+		image.width = header.width;
+		image.height = header.height;
+		image.pixels.resize((size_t)header.width * header.height);
+		hit = image.pixels.empty() || in.read((char*)&image.pixels[0], image.pixels.size() * sizeof(uint32_t));
+	}
+	in.close();
+
+	lock_guard<mutex> lock(cache_mutex);
+	if (!hit) {
+		stats.misses++;
+		return false;
+	}
+
+	stats.hits++;
+	time_t now = time(NULL);
+	boost::system::error_code ec;
+	fs::last_write_time(file, now, ec);											// remember the use across restarts
+	scan();
+	entries[name].used = now;
+	return true;
+}
+
+void DiskCache::store(const LoadRequest& request, const StagingImage& image)
+{
+	string name;
+	uint64_t stamp;
+	if (!cacheable(request) || image.pixels.empty() || !key(request, name, stamp)) return;
+
+	DiskCacheHeader header;
+	memcpy(header.magic, DISKCACHE_MAGIC, sizeof(DISKCACHE_MAGIC));
+	header.version = DISKCACHE_VERSION;
+	header.source_stamp = stamp;
+	header.width = image.width;
+	header.height = image.height;
+
+	boost::system::error_code ec;
+	fs::create_directories(folder, ec);
+
+	// write to a file of our own, then rename: other loader threads may be reading the old entry
+	fs::path file = folder / name;
+	fs::path temp_file = fs::unique_path(folder / (name + ".%%%%%%.tmp"), ec);
+	if (ec) return;
+	ofstream out(temp_file.string(), ofstream::out | ofstream::binary | ofstream::trunc);
+	if (!out.is_open()) return;
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)&image.pixels[0], image.pixels.size() * sizeof(uint32_t));
+	out.close();
+	if (out.fail()) {
+		fs::remove(temp_file, ec);
+		return;
+	}
+
+	lock_guard<mutex> lock(cache_mutex);
+	scan();
+	fs::rename(temp_file, file, ec);
+	if (ec) {
+		fs::remove(temp_file, ec);
+		return;
+	}
+
+	entry_t entry;
+	entry.bytes = sizeof(header) + image.pixels.size() * sizeof(uint32_t);
+	entry.used = time(NULL);
+	unordered_map<string, entry_t>::iterator iter = entries.find(name);
+	if (iter != entries.end()) stats.bytes -= iter->second.bytes;					// replaces a stale entry
+	entries[name] = entry;
+	stats.bytes += entry.bytes;
+	stats.stores++;
+
+	trim();
+}
+
+bool DiskCache::contains(const string& path)
+{
+	LoadRequest request;
+	request.path_combined = path;
+
+	string name;
+	uint64_t stamp;
+	if (!key(request, name, stamp)) return false;
+
+	ifstream in((folder / name).string(), ifstream::in | ifstream::binary);
+	DiskCacheHeader header;
+	return in.is_open() &&
+		   in.read((char*)&header, sizeof(header)) &&
+		   memcmp(header.magic, DISKCACHE_MAGIC, sizeof(DISKCACHE_MAGIC)) == 0 &&
+		   header.version == DISKCACHE_VERSION &&
+		   header.source_stamp == stamp;
+}
+
+DiskCacheStats DiskCache::get_stats()
+{
+	lock_guard<mutex> lock(cache_mutex);
+	scan();
+	return stats;
+}
@@ -0,0 +1,112 @@
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include "texloader.h"
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <boost/filesystem.hpp>
+
+/*
+	Decoded replacement cache (tonberry\cache)
+
+	Holds composed replacement textures exactly as the locked rect expects them (A8R8G8B8, rows top-down, already at
+	the RESIZE_FACTOR size), so a hit is one sequential read and a row copy instead of inflate, flip, and swizzle.
+
+	Each entry is one file named after the replacement file(s) it was composed from:
+		DiskCacheHeader
+		uint32_t	pixels[width * height]
+
+	source_stamp covers the path, size, and write time of every source file, so an entry whose pack was updated no
+	longer matches and is rebuilt on the next load. The folder is trimmed to its size cap by least recent use; the
+	write time of an entry file records its last use, so the order survives restarts.
+*/
+
+const uint32_t DISKCACHE_VERSION = 1;
+
+struct DiskCacheHeader
+{
+	char		magic[4];		// "TBDC"
+	uint32_t	version;		// DISKCACHE_VERSION
+	uint64_t	source_stamp;	// see DiskCache::key
+	uint32_t	width;
+	uint32_t	height;
+};
+
+struct DiskCacheStats
+{
+	size_t		hits;
+	size_t		misses;			// includes stale entries
+	size_t		stores;
+	size_t		trimmed;		// entries removed to stay under the size cap
+	uint64_t	bytes;			// size of the cache folder
+};
+
+class DiskCache
+{
+private:
+	struct entry_t
+	{
+		uint64_t	bytes;
+		time_t		used;
+	};
+
+	std::mutex								cache_mutex;
+	boost::filesystem::path					folder;
+	uint64_t								max_bytes;
+	bool									scanned;
+	std::unordered_map<std::string, entry_t>	entries;						// entry file name :-> size and last use
+	DiskCacheStats							stats;
+
+	/* key: names the entry of a request and stamps its source files
+	   returns: true if every source file exists, else false
+	*/
+	bool key(const LoadRequest& request,	// the load
+			 std::string& name,				// entry file name
+			 uint64_t& stamp				// source_stamp of the entry
+		);
+
+	/* scan: reads the sizes and last uses of the entries already on disk
+	   PRECONDITION: cache_mutex is held
+	*/
+	void scan();
+
+	/* trim: removes least recently used entries until the cache is under its cap
+	   PRECONDITION: cache_mutex is held
+	*/
+	void trim();
+
+public:
+	DiskCache(const boost::filesystem::path& folder,	// where entries are kept; created on first store
+			  uint64_t max_bytes						// size cap of the folder
+		);
+
+	/* cacheable: whether the result of a request depends only on its replacement files
+	   returns: true for whole-texture replacements and for upper/lower pairs, else false
+	*/
+	static bool cacheable(const LoadRequest& request);
+
+	/* load: reads a replacement composed earlier
+	   returns: true on a hit, else false (missing or stale entry)
+	*/
+	bool load(const LoadRequest& request,	// the load
+			  StagingImage& image			// receives the replacement pixels
+		);
+
+	/* store: writes a composed replacement; called from loader threads
+	*/
+	void store(const LoadRequest& request,	// the load image was composed for
+			   const StagingImage& image	// the replacement pixels
+		);
+
+	/* contains: whether a whole-texture replacement file has an up-to-date entry, at whatever size
+	*/
+	bool contains(const std::string& path	// replacement file
+		);
+
+	DiskCacheStats get_stats();
+};
+
+#endif
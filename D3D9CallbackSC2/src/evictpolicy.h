@@ -0,0 +1,530 @@
+#ifndef _EVICTPOLICY_H
+#define _EVICTPOLICY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+
+/*
+	Eviction policies for TextureCache
+
+	A policy only orders keys; the cache owns the textures and decides when it is over budget. The cache tells the
+	policy about every resident key (admit, touch, demote, remove) and asks it for victims until it fits (victim, evicted).
+
+		LRUPolicy	least recently used first; what TextureCache did before it had a byte budget
+		GDSPolicy	GreedyDual-Size: lowest L + cost / bytes first, L rising to each victim's priority
+		ARCPolicy	Adaptive Replacement Cache: recency (T1) and frequency (T2) lists sized by ghost hits (B1, B2),
+					so one pass through a texture-heavy field cannot flush textures that are used again and again
+
+	Nothing here includes windows.h or d3d9, so ConsoleTesting replays recorded traces through the same code
+	(see replay_trace).
+*/
+
+/*
+	PooledLists: doubly linked lists of keys in one pooled array; links are indices, so nodes are not allocated one at
+	a time and a list move is a few index writes. Every list keeps its node count and total weight.
+*/
+class PooledLists
+{
+public:
+	static const uint32_t NIL = 0xFFFFFFFF;
+
+	struct node_t
+	{
+		uint64_t	key;
+		size_t		weight;
+		uint32_t	prev;
+		uint32_t	next;
+		uint8_t		list;
+	};
+
+private:
+	struct list_t
+	{
+		uint32_t	head;			// most recent
+		uint32_t	tail;			// least recent
+		size_t		count;
+		size_t		weight;
+	};
+
+	std::vector<node_t>		nodes;
+	std::vector<uint32_t>	free_nodes;
+	std::vector<list_t>		lists;
+
+public:
+	PooledLists(size_t list_count) : lists(list_count)
+	{
+		for (size_t i = 0; i < list_count; i++) {
+			lists[i].head = lists[i].tail = NIL;
+			lists[i].count = lists[i].weight = 0;
+		}
+	}
+
+	/* alloc: takes a node from the pool
+	   returns: the index of the node, in no list yet
+	*/
+	uint32_t alloc(uint64_t key, size_t weight)
+	{
+		uint32_t index;
+		if (!free_nodes.empty()) {
+			index = free_nodes.back();
+			free_nodes.pop_back();
+		} else {
+			index = (uint32_t)nodes.size();
+			nodes.push_back(node_t());
+		}
+		node_t& node = nodes[index];
+		node.key = key;
+		node.weight = weight;
+		node.prev = node.next = NIL;
+		node.list = 0xFF;
+		return index;
+	}
+
+	/* release: unlinks a node and returns it to the pool
+	*/
+	void release(uint32_t index)
+	{
+		unlink(index);
+		free_nodes.push_back(index);
+	}
+
+	/* push_front: links a node as the most recent of a list, unlinking it from its list first
+	*/
+	void push_front(uint8_t list, uint32_t index)
+	{
+		unlink(index);
+		node_t& node = nodes[index];
+		list_t& l = lists[list];
+		node.list = list;
+		node.prev = NIL;
+		node.next = l.head;
+		if (l.head != NIL) nodes[l.head].prev = index;
+		else l.tail = index;
+		l.head = index;
+		l.count++;
+		l.weight += node.weight;
+	}
+
+	/* push_back: links a node as the least recent of a list, unlinking it from its list first
+	*/
+	void push_back(uint8_t list, uint32_t index)
+	{
+		unlink(index);
+		node_t& node = nodes[index];
+		list_t& l = lists[list];
+		node.list = list;
+		node.next = NIL;
+		node.prev = l.tail;
+		if (l.tail != NIL) nodes[l.tail].next = index;
+		else l.head = index;
+		l.tail = index;
+		l.count++;
+		l.weight += node.weight;
+	}
+
+	void unlink(uint32_t index)
+	{
+		node_t& node = nodes[index];
+		if (node.list == 0xFF) return;
+		list_t& l = lists[node.list];
+		if (node.prev != NIL) nodes[node.prev].next = node.next;
+		else l.head = node.next;
+		if (node.next != NIL) nodes[node.next].prev = node.prev;
+		else l.tail = node.prev;
+		l.count--;
+		l.weight -= node.weight;
+		node.prev = node.next = NIL;
+		node.list = 0xFF;
+	}
+
+	node_t& operator[](uint32_t index) { return nodes[index]; }
+	uint32_t tail(uint8_t list) const { return lists[list].tail; }
+	uint32_t prev(uint32_t index) const { return nodes[index].prev; }
+	size_t count(uint8_t list) const { return lists[list].count; }
+	size_t weight(uint8_t list) const { return lists[list].weight; }
+};
+
+class EvictionPolicy
+{
+public:
+	virtual ~EvictionPolicy() {}
+
+	virtual const char* name() const = 0;
+
+	/* admit: a key was loaded and is resident now
+	*/
+	virtual void admit(uint64_t key,		// texture hash
+					   size_t bytes,		// texture memory
+					   double cost			// seconds the load took
+		) = 0;
+
+	/* touch: a resident key was used again
+	*/
+	virtual void touch(uint64_t key) = 0;
+
+	/* demote: no game texture is bound to a resident key any more; it should be among the next victims
+	*/
+	virtual void demote(uint64_t key) = 0;
+
+	/* victim: chooses the next resident key to evict
+	   returns: true if there is one other than keep, else false
+	*/
+	virtual bool victim(uint64_t keep,		// a key that must stay (the one just loaded)
+						uint64_t& key		// receives the victim
+		) = 0;
+
+	/* evicted: the cache released a victim
+	*/
+	virtual void evicted(uint64_t key) = 0;
+
+	/* remove: a resident key left the cache for another reason; a policy forgets it entirely. The cache also calls it
+			   after evicted(), where it must not undo what evicted() kept.
+	*/
+	virtual void remove(uint64_t key) = 0;
+};
+
+class LRUPolicy : public EvictionPolicy
+{
+private:
+	PooledLists								lists;
+	std::unordered_map<uint64_t, uint32_t>	index;
+
+public:
+	LRUPolicy() : lists(1) {}
+
+	const char* name() const { return "lru"; }
+
+	void admit(uint64_t key, size_t bytes, double)
+	{
+		if (index.count(key)) return touch(key);
+		uint32_t node = lists.alloc(key, bytes);
+		index[key] = node;
+		lists.push_front(0, node);
+	}
+
+	void touch(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter != index.end()) lists.push_front(0, iter->second);
+	}
+
+	void demote(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter != index.end()) lists.push_back(0, iter->second);
+	}
+
+	bool victim(uint64_t keep, uint64_t& key)
+	{
+		for (uint32_t node = lists.tail(0); node != PooledLists::NIL; node = lists.prev(node))
+			if (lists[node].key != keep) {
+				key = lists[node].key;
+				return true;
+			}
+		return false;
+	}
+
+	void evicted(uint64_t key) { remove(key); }
+
+	void remove(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		lists.release(iter->second);
+		index.erase(iter);
+	}
+};
+
+class GDSPolicy : public EvictionPolicy
+{
+private:
+	struct entry_t
+	{
+		size_t	bytes;
+		double	cost;
+		double	priority;		// H = L + cost / bytes
+	};
+
+	std::unordered_map<uint64_t, entry_t>	entries;
+	std::set<std::pair<double, uint64_t>>	priorities;		// (H, key), lowest H first
+	double									inflation;		// L: the H of the last eviction
+
+	void set_priority(uint64_t key, entry_t& entry)
+	{
+		priorities.erase(std::pair<double, uint64_t>(entry.priority, key));
+		entry.priority = inflation + entry.cost / std::max(entry.bytes, (size_t)1);
+		priorities.insert(std::pair<double, uint64_t>(entry.priority, key));
+	}
+
+public:
+	GDSPolicy() : inflation(0) {}
+
+	const char* name() const { return "gds"; }
+
+	void admit(uint64_t key, size_t bytes, double cost)
+	{
+		entry_t& entry = entries.insert(std::make_pair(key, entry_t())).first->second;	// a new entry_t is not in priorities
+		entry.bytes = bytes;
+		entry.cost = cost;
+		set_priority(key, entry);
+	}
+
+	void touch(uint64_t key)
+	{
+		std::unordered_map<uint64_t, entry_t>::iterator iter = entries.find(key);
+		if (iter != entries.end()) set_priority(key, iter->second);
+	}
+
+	void demote(uint64_t key)
+	{
+		std::unordered_map<uint64_t, entry_t>::iterator iter = entries.find(key);
+		if (iter == entries.end()) return;
+		priorities.erase(std::pair<double, uint64_t>(iter->second.priority, key));
+		iter->second.priority = inflation;												// no resident H is below L
+		priorities.insert(std::pair<double, uint64_t>(iter->second.priority, key));
+	}
+
+	bool victim(uint64_t keep, uint64_t& key)
+	{
+		for (std::set<std::pair<double, uint64_t>>::iterator iter = priorities.begin(); iter != priorities.end(); iter++)
+			if (iter->second != keep) {
+				key = iter->second;
+				return true;
+			}
+		return false;
+	}
+
+	void evicted(uint64_t key)
+	{
+		std::unordered_map<uint64_t, entry_t>::iterator iter = entries.find(key);
+		if (iter != entries.end()) inflation = iter->second.priority;		// L rises to the H of the eviction
+		remove(key);
+	}
+
+	void remove(uint64_t key)
+	{
+		std::unordered_map<uint64_t, entry_t>::iterator iter = entries.find(key);
+		if (iter == entries.end()) return;
+		priorities.erase(std::pair<double, uint64_t>(iter->second.priority, key));
+		entries.erase(iter);
+	}
+};
+
+/*
+	ARCPolicy: ARC (Megiddo and Modha) weighed in bytes, or in textures when the cache has no byte budget
+
+	T1 holds keys used once since they were admitted, T2 keys used at least twice; B1 and B2 remember the keys evicted
+	from each. A key admitted again while it is in B1 means T1 was too small, so the target size p of T1 grows; one in
+	B2 shrinks it. Victims come from T1 while T1 is over p, else from T2. Ghosts are trimmed so T1 + B1 and B1 + B2
+	each stay within the capacity.
+*/
+class ARCPolicy : public EvictionPolicy
+{
+private:
+	enum { T1, T2, B1, B2 };
+
+	PooledLists								lists;
+	std::unordered_map<uint64_t, uint32_t>	index;			// every key in T1, T2, B1, or B2
+	size_t									capacity;		// the cache budget, in the unit of weight()
+	bool									by_bytes;		// weigh by texture memory, else count textures
+	size_t									target;			// p: target weight of T1
+	bool									last_ghost_b2;	// the last admission was a B2 hit (ARC's tie-break in REPLACE)
+
+	size_t weight(size_t bytes) const { return by_bytes ? std::max(bytes, (size_t)1) : 1; }
+
+	void drop(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		lists.release(iter->second);
+		index.erase(iter);
+	}
+
+	// forgets the oldest ghosts once the directory outgrows the capacity
+	void trim_ghosts()
+	{
+		while (lists.count(B1) > 0 && lists.weight(T1) + lists.weight(B1) > capacity)
+			drop(lists[lists.tail(B1)].key);
+		while (lists.count(B2) > 0 && lists.weight(B1) + lists.weight(B2) > capacity)
+			drop(lists[lists.tail(B2)].key);
+	}
+
+	// the least recent key of a list other than keep
+	bool oldest(uint8_t list, uint64_t keep, uint64_t& key)
+	{
+		for (uint32_t node = lists.tail(list); node != PooledLists::NIL; node = lists.prev(node))
+			if (lists[node].key != keep) {
+				key = lists[node].key;
+				return true;
+			}
+		return false;
+	}
+
+public:
+	ARCPolicy(size_t capacity,		// cache budget: bytes if by_bytes, else textures
+			  bool by_bytes			// weigh keys by texture memory
+		) : lists(4), capacity(std::max(capacity, (size_t)1)), by_bytes(by_bytes), target(0), last_ghost_b2(false) {}
+
+	const char* name() const { return "arc"; }
+
+	void admit(uint64_t key, size_t bytes, double)
+	{
+		size_t w = weight(bytes);
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		last_ghost_b2 = false;
+
+		if (iter == index.end()) {															// new: used once
+			uint32_t node = lists.alloc(key, w);
+			index[key] = node;
+			lists.push_front(T1, node);
+		} else {
+			uint32_t node = iter->second;
+			uint8_t list = lists[node].list;
+			if (list == B1) {																// T1 was too small
+				size_t delta = std::max(lists.weight(B2) / std::max(lists.weight(B1), (size_t)1), (size_t)1) * w;
+				target = (capacity - target > delta) ? target + delta : capacity;
+			} else if (list == B2) {														// T2 was too small
+				size_t delta = std::max(lists.weight(B1) / std::max(lists.weight(B2), (size_t)1), (size_t)1) * w;
+				target = (target > delta) ? target - delta : 0;
+				last_ghost_b2 = true;
+			}
+			lists.unlink(node);
+			lists[node].weight = w;
+			lists.push_front(T2, node);														// seen before: frequent
+		}
+		trim_ghosts();
+	}
+
+	void touch(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		uint8_t list = lists[iter->second].list;
+		if (list == T1 || list == T2) lists.push_front(T2, iter->second);					// used again: frequent
+	}
+
+	void demote(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		uint8_t list = lists[iter->second].list;
+		if (list == T1 || list == T2) lists.push_back(list, iter->second);				// its own list, so p is not skewed
+	}
+
+	bool victim(uint64_t keep, uint64_t& key)
+	{
+		size_t t1 = lists.weight(T1);
+		bool from_t1 = t1 > 0 && (t1 > target || (last_ghost_b2 && t1 == target));
+		if (from_t1) return oldest(T1, keep, key) || oldest(T2, keep, key);
+		return oldest(T2, keep, key) || oldest(T1, keep, key);
+	}
+
+	void evicted(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		uint8_t list = lists[iter->second].list;
+		if (list == T1) lists.push_front(B1, iter->second);
+		else if (list == T2) lists.push_front(B2, iter->second);
+		trim_ghosts();
+	}
+
+	void remove(uint64_t key)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator iter = index.find(key);
+		if (iter == index.end()) return;
+		uint8_t list = lists[iter->second].list;
+		if (list == T1 || list == T2) drop(key);											// a ghost stays; evicted() made it one
+	}
+
+	size_t target_weight() const { return target; }
+};
+
+/* make_eviction_policy: the policy named in prefs.txt (cache_policy = arc, gds, or lru)
+   returns: a new policy, or NULL if the name is unknown
+*/
+inline EvictionPolicy* make_eviction_policy(const std::string& name,	// policy name, any case
+											size_t budget,				// cache budget in bytes; 0 for no limit
+											unsigned max_size			// cache budget in textures; 0 for no limit
+	)
+{
+	std::string lower(name);
+	for (size_t i = 0; i < lower.size(); i++) lower[i] = (char)tolower((unsigned char)lower[i]);
+
+	if (lower == "lru") return new LRUPolicy();
+	if (lower == "gds") return new GDSPolicy();
+	if (lower == "arc") return budget ? new ARCPolicy(budget, true) : new ARCPolicy(max_size ? max_size : (size_t)-1, false);
+	return NULL;
+}
+
+/**********************************
+*
+*	Trace replay
+*
+**********************************/
+
+// one use of a replacement texture, as recorded in cache_trace.csv
+struct CacheAccess
+{
+	uint64_t	hash;
+	size_t		bytes;		// texture memory of the replacement
+	double		cost;		// seconds its load took
+};
+
+struct ReplayResult
+{
+	size_t		hits;
+	size_t		misses;
+	uint64_t	bytes_loaded;		// bytes of every miss
+	double		cost;				// seconds spent loading misses
+
+	double hit_ratio() const { return (hits + misses) ? (double)hits / (hits + misses) : 0.0; }
+};
+
+/* replay_trace: runs a trace through a policy with the eviction loop of TextureCache
+   returns: what the cache would have hit and loaded
+*/
+inline ReplayResult replay_trace(EvictionPolicy& policy,					// a fresh policy
+								 const std::vector<CacheAccess>& trace,	// accesses in order
+								 size_t budget,							// cache budget in bytes; 0 for no limit
+								 unsigned max_size = 0					// cache budget in textures; 0 for no limit
+	)
+{
+	ReplayResult result;
+	memset(&result, 0, sizeof(result));
+	std::unordered_map<uint64_t, size_t> resident;
+	size_t bytes_resident = 0;
+
+	for (size_t i = 0; i < trace.size(); i++) {
+		const CacheAccess& access = trace[i];
+		if (resident.count(access.hash)) {
+			result.hits++;
+			policy.touch(access.hash);
+			continue;
+		}
+
+		result.misses++;
+		result.bytes_loaded += access.bytes;
+		result.cost += access.cost;
+		resident[access.hash] = access.bytes;
+		bytes_resident += access.bytes;
+		policy.admit(access.hash, access.bytes, access.cost);
+
+		uint64_t victim;
+		while (((budget > 0 && bytes_resident > budget) || (max_size > 0 && resident.size() > max_size)) && policy.victim(access.hash, victim)) {
+			bytes_resident -= resident[victim];
+			resident.erase(victim);
+			policy.evicted(victim);
+		}
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "filewatcher.h"
+#include <boost/algorithm/string/predicate.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+FileWatcher::FileWatcher(const fs::path& root, const string& extension, bool recursive)
+	: root(root), extension(extension), recursive(recursive), first(true)
+{
+}
+
+void FileWatcher::list(vector<pair<fs::path, file_state_t>>& found) const
+{
+	boost::system::error_code ec;
+	if (!fs::is_directory(root, ec)) return;
+
+	auto add = [&](const fs::path& path) {
+		boost::system::error_code file_ec;
+		if (!fs::is_regular_file(path, file_ec) || !boost::iequals(path.extension().string(), extension)) return;
+		file_state_t state;
+		state.size = (uint64_t)fs::file_size(path, file_ec);
+		state.mtime = (int64_t)fs::last_write_time(path, file_ec);
+		if (file_ec) return;																// removed while listing; the next poll reports it
+		state.reported = false;
+		state.settling = false;
+		found.push_back(make_pair(path, state));
+	};
+
+	if (recursive) {
+		fs::recursive_directory_iterator iter(root, ec), end;
+		for (; !ec && iter != end; iter.increment(ec)) add(iter->path());
+	} else {
+		fs::directory_iterator iter(root, ec), end;
+		for (; !ec && iter != end; iter.increment(ec)) add(iter->path());
+	}
+}
+
+size_t FileWatcher::poll(vector<FileChange>& changes)
+{
+	vector<pair<fs::path, file_state_t>> found;
+	list(found);
+
+	size_t before = changes.size();
+	unordered_map<string, file_state_t> listed;
+	for (size_t i = 0; i < found.size(); i++) {
+		string key = file_key(found[i].first);
+		file_state_t state = found[i].second;
+		unordered_map<string, file_state_t>::iterator known = files.find(key);
+
+		FileChange change;
+		change.path = found[i].first;
+		if (first) {																		// everything is there already: report it, do not wait for it
+			state.reported = true;
+			change.type = FILE_ADDED;
+			changes.push_back(change);
+		} else if (known == files.end() || known->second.size != state.size || known->second.mtime != state.mtime) {
+			state.reported = known != files.end() && known->second.reported;				// new or changed: wait one poll for it to hold still
+			state.settling = true;
+		} else if (known->second.settling) {
+			state.reported = true;
+			change.type = known->second.reported ? FILE_MODIFIED : FILE_ADDED;
+			changes.push_back(change);
+		} else {
+			state = known->second;
+		}
+		listed[key] = state;
+	}
+
+	for (unordered_map<string, file_state_t>::iterator iter = files.begin(); iter != files.end(); iter++) {
+		if (!iter->second.reported || listed.count(iter->first)) continue;					// a file that never settled was never reported
+		FileChange change;
+		change.type = FILE_REMOVED;
+		change.path = iter->first;
+		changes.push_back(change);
+	}
+
+	files.swap(listed);
+	first = false;
+	return changes.size() - before;
+}
@@ -0,0 +1,82 @@
+#ifndef _FILEWATCHER_H
+#define _FILEWATCHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+
+/*
+	File watcher
+
+	Reports the files under a folder that were added, modified, or removed since the last poll. It polls: every poll
+	lists the folder and compares the size and write time of each file with the last listing, so it behaves the same
+	on every platform and file system (network shares and virtual drives included) and needs no handle held open on
+	the folder. A pack folder lists in milliseconds, and HotReload polls it every few seconds.
+
+	A file is reported once its size and write time held for a whole poll interval, so a file that is still being
+	written (an editor saving, an archive extracting) is not read half-written. A file rewritten within the same second
+	at the same size is not noticed; last_write_time has a resolution of one second.
+*/
+
+/* file_key: the form paths are compared in; Windows paths are case-insensitive and take either separator
+*/
+inline std::string file_key(const boost::filesystem::path& path)
+{
+	return boost::to_lower_copy(path.generic_string());
+}
+
+enum FileChangeType
+{
+	FILE_ADDED,
+	FILE_MODIFIED,
+	FILE_REMOVED
+};
+
+struct FileChange
+{
+	FileChangeType				type;
+	boost::filesystem::path		path;			// as listed: the watched folder followed by the path under it; the file_key of a removed file
+};
+
+class FileWatcher
+{
+private:
+	struct file_state_t
+	{
+		uint64_t	size;
+		int64_t		mtime;
+		bool		reported;		// the file was reported (or was there at the first poll); else it is reported as added
+		bool		settling;		// the file changed since the last poll; it is reported once it holds still
+	};
+
+	boost::filesystem::path							root;
+	std::string										extension;
+	bool											recursive;
+	bool											first;					// no poll yet
+	std::unordered_map<std::string, file_state_t>	files;					// file_key :-> state
+
+	/* list: the files under root with the extension, with their size and write time
+	*/
+	void list(std::vector<std::pair<boost::filesystem::path, file_state_t>>& found) const;
+
+public:
+	FileWatcher(const boost::filesystem::path& root,	// folder to watch; it may not exist yet
+				const std::string& extension,			// files to watch, e.g. ".png"; compared ignoring case
+				bool recursive							// watch the subfolders too
+		);
+
+	/* poll: lists the folder and appends what changed since the last poll; the first poll reports every file as added
+	   returns: the number of changes appended
+	*/
+	size_t poll(std::vector<FileChange>& changes);
+
+	/* size: number of files seen by the last poll
+	*/
+	size_t size() const { return files.size(); }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include "fuzzymap.h"
+
+using namespace std;
+
+FuzzyMap::FuzzyMap(int max_bits) : max_bits(max_bits) {}
+
+void FuzzyMap::insert(uint64_t omzy, const string& field)
+{
+	unordered_map<string, uint32_t>::iterator iter = name_ids.find(field);
+	uint32_t id;
+	if (iter != name_ids.end()) {
+		id = iter->second;
+	} else {
+		id = (uint32_t)name_offsets.size();
+		name_offsets.push_back((uint32_t)names.size());
+		names.insert(names.end(), field.c_str(), field.c_str() + field.size() + 1);
+		name_ids[field] = id;
+	}
+	pending.push_back(pending_t(omzy, id));
+}
+
+void FuzzyMap::build()
+{
+	if (pending.empty()) return;
+
+	// fold the indexed entries back in, in the order they were inserted
+	vector<pending_t> entries;
+	entries.reserve(index.size() + pending.size());
+	for (uint32_t i = 0; i < index.size(); i++) entries.push_back(pending_t(index.key(i), key_fields[i]));
+	entries.insert(entries.end(), pending.begin(), pending.end());
+	vector<pending_t>().swap(pending);
+
+	vector<uint64_t> keys(entries.size());
+	key_fields.resize(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		keys[i] = entries[i].first;
+		key_fields[i] = entries[i].second;
+	}
+	index.build(&keys[0], keys.size());
+}
+
+const char* FuzzyMap::nearest(uint64_t omzy, int* distance) const
+{
+	uint32_t id;
+	int bits;
+	if (!index.nearest(omzy, max_bits, id, bits)) return NULL;
+	if (distance) *distance = bits;
+	return &names[name_offsets[key_fields[id]]];
+}
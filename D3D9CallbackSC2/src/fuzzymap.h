@@ -0,0 +1,59 @@
+#ifndef _FUZZYMAP_H
+#define _FUZZYMAP_H
+
+#include "hammingindex.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+	Fuzzy texture matching (tonberry\omzymap\*.csv)
+
+	A texture that differs from its pack original by a palette tweak or dithering gets another Murmur2 hash, so the
+	FieldMap misses it, but its Omzy hash (see omzyhash.h) moves by a few bits only. FuzzyMap holds the Omzy hashes of
+	the pack textures ("<field>,<omzy hash>" per line) in a HammingIndex and finds the nearest one within max_bits with a
+	few hundred bucket probes, where closesthash() in ExtraCode.cpp scanned every entry. The pipeline asks it only when
+	no hash matched.
+*/
+
+class FuzzyMap
+{
+private:
+	typedef std::pair<uint64_t, uint32_t> pending_t;								// Omzy hash :-> field id, waiting for build()
+
+	std::vector<pending_t>						pending;
+	std::vector<uint32_t>						key_fields;						// field id of each key in the index
+	std::vector<uint32_t>						name_offsets;					// offset of each name in names
+	std::vector<char>							names;							// NUL-terminated field names
+	std::unordered_map<std::string, uint32_t>	name_ids;						// interning table; only needed while inserting
+	TextureHash::HammingIndex					index;
+	int											max_bits;
+
+public:
+	FuzzyMap(int max_bits		// most bits an Omzy hash may differ by and still match
+		);
+
+	/* insert: adds omzy :-> field; the entry is visible to lookups after the next build()
+	*/
+	void insert(uint64_t omzy,				// Omzy hash of the pack texture
+				const std::string& field	// its field name
+		);
+
+	/* build: indexes every entry inserted so far
+	*/
+	void build();
+
+	/* nearest: the field whose Omzy hash is closest to omzy, ties to the one inserted first
+	   returns: the NUL-terminated field name, or NULL if none is within max_bits
+	*/
+	const char* nearest(uint64_t omzy,
+						int* distance = NULL		// receives the bits the hashes differ by, if not NULL
+		) const;
+
+	size_t size() const { return index.size(); }
+	int max_distance() const { return max_bits; }
+};
+
+#endif
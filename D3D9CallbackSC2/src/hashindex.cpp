@@ -0,0 +1,184 @@
+#include "hashindex.h"
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <string.h>
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+static const char HASHINDEX_MAGIC[4] = { 'T', 'B', 'H', 'I' };
+
+static inline void stamp_bytes(uint64_t& stamp, const void* data, size_t len)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++) {											// FNV-1a
+		stamp ^= bytes[i];
+		stamp *= 1099511628211ULL;
+	}
+}
+
+uint64_t hashmap_stamp(const fs::path& hashmap_dir)
+{
+	boost::system::error_code ec;
+	if (!fs::is_directory(hashmap_dir, ec)) return 0;
+
+	std::vector<fs::path> csv_files;
+	fs::directory_iterator end_it;
+	for (fs::directory_iterator it(hashmap_dir, ec); !ec && it != end_it; it.increment(ec))
+		if (fs::is_regular_file(it->status()) && boost::iequals(it->path().extension().string(), ".csv"))
+			csv_files.push_back(it->path());
+	std::sort(csv_files.begin(), csv_files.end());								// directory order is not guaranteed
+
+	uint64_t stamp = 14695981039346656037ULL;
+	for (const fs::path& csv : csv_files) {
+		std::string name = csv.filename().string();
+		uint64_t size = (uint64_t)fs::file_size(csv, ec);
+		int64_t mtime = (int64_t)fs::last_write_time(csv, ec);
+		stamp_bytes(stamp, name.c_str(), name.size() + 1);
+		stamp_bytes(stamp, &size, sizeof(size));
+		stamp_bytes(stamp, &mtime, sizeof(mtime));
+	}
+
+	return stamp ? stamp : 1;													// 0 is reserved for "no hashmap folder"
+}
+
+HashIndex::HashIndex() : header(NULL), slot_table(NULL), id_pool(NULL), offsets(NULL), name_table(NULL) {}
+
+bool HashIndex::open(const fs::path& index_file, uint64_t expected_stamp)
+{
+	close();
+
+	boost::system::error_code ec;
+	if (!fs::is_regular_file(index_file, ec)) return false;
+
+	try {
+		bip::file_mapping mapping(index_file.string().c_str(), bip::read_only);
+		bip::mapped_region mapped(mapping, bip::read_only);
+		file.swap(mapping);
+		region.swap(mapped);
+	} catch (bip::interprocess_exception&) {
+		return false;
+	}
+
+	// validate before trusting any of the offsets
+	size_t size = region.get_size();
+	const char* base = (const char*)region.get_address();
+	const HashIndexHeader* hdr = (const HashIndexHeader*)base;
+	if (size < sizeof(HashIndexHeader) ||
+		memcmp(hdr->magic, HASHINDEX_MAGIC, sizeof(HASHINDEX_MAGIC)) != 0 ||
+		hdr->version != HASHINDEX_VERSION ||
+		hdr->source_stamp != expected_stamp ||
+		hdr->slot_count == 0 || (hdr->slot_count & (hdr->slot_count - 1)) != 0) {	// FieldMap probes with a power-of-two mask
+		close();
+		return false;
+	}
+
+	uint64_t expected_size = sizeof(HashIndexHeader) +
+							 (uint64_t)hdr->slot_count * sizeof(FieldSlot) +
+							 (uint64_t)hdr->id_count * sizeof(uint32_t) +
+							 ((uint64_t)hdr->field_count + 1) * sizeof(uint32_t) +
+							 hdr->names_size;
+	if (size < expected_size) {
+		close();
+		return false;
+	}
+
+	header = hdr;
+	slot_table = (const FieldSlot*)(base + sizeof(HashIndexHeader));
+	id_pool = (const uint32_t*)(slot_table + hdr->slot_count);
+	offsets = id_pool + hdr->id_count;
+	name_table = (const char*)(offsets + hdr->field_count + 1);
+
+	if (offsets[hdr->field_count] != hdr->names_size ||							// truncated or corrupt name table
+		(hdr->field_count > 0 && (hdr->names_size == 0 || name_table[hdr->names_size - 1] != '\0'))) {	// the last name must end inside the table
+		close();
+		return false;
+	}
+	for (uint32_t i = 0; i < hdr->field_count; i++) {
+		if (offsets[i] >= hdr->names_size) {											// every name starts inside the table, so it ends at a NUL there
+			close();
+			return false;
+		}
+	}
+
+	// FieldMap::find probes until it meets an empty slot and reads ids and names through the slots, so every slot must
+	// point into the pools and at least one slot must be empty
+	uint32_t occupied = 0;
+	for (uint32_t i = 0; i < hdr->slot_count; i++) {
+		const FieldSlot& slot = slot_table[i];
+		if (slot.count == 0) continue;
+		occupied++;
+		bool valid = (slot.count == 1) ? slot.value < hdr->field_count
+									   : slot.count <= hdr->id_count && slot.value <= hdr->id_count - slot.count;
+		if (!valid) {
+			close();
+			return false;
+		}
+	}
+	bool valid = occupied == hdr->key_count && occupied < hdr->slot_count;
+	for (uint32_t i = 0; valid && i < hdr->id_count; i++) valid = id_pool[i] < hdr->field_count;
+	if (!valid) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void HashIndex::close()
+{
+	bip::mapped_region().swap(region);
+	bip::file_mapping().swap(file);
+	header = NULL;
+	slot_table = NULL;
+	id_pool = NULL;
+	offsets = NULL;
+	name_table = NULL;
+}
+
+bool HashIndex::write(const fs::path& index_file, uint64_t source_stamp,
+					  const FieldSlot* slots, uint32_t slot_count, uint32_t key_count,
+					  const uint32_t* ids, uint32_t id_count,
+					  const uint32_t* name_offsets, uint32_t field_count,
+					  const char* names)
+{
+	HashIndexHeader header;
+	memcpy(header.magic, HASHINDEX_MAGIC, sizeof(HASHINDEX_MAGIC));
+	header.version = HASHINDEX_VERSION;
+	header.source_stamp = source_stamp;
+	header.slot_count = slot_count;
+	header.key_count = key_count;
+	header.id_count = id_count;
+	header.field_count = field_count;
+	header.names_size = name_offsets[field_count];
+	header.reserved = 0;
+
+	fs::path temp_file(index_file);
+	temp_file += ".tmp";
+
+	std::ofstream out(temp_file.string(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+	if (!out.is_open()) return false;
+
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)slots, (std::streamsize)slot_count * sizeof(FieldSlot));
+	out.write((const char*)ids, (std::streamsize)id_count * sizeof(uint32_t));
+	out.write((const char*)name_offsets, ((std::streamsize)field_count + 1) * sizeof(uint32_t));
+	out.write(names, header.names_size);
+	out.close();
+
+	boost::system::error_code ec;
+	if (out.fail()) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+
+	fs::rename(temp_file, index_file, ec);										// replace the old index in one step
+	if (ec) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,105 @@
+#ifndef _HASHINDEX_H
+#define _HASHINDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/*
+	Compiled hashmap index (tonberry\hashmap.idx)
+
+	The index is FieldMap's flat hash table written out as-is, so it can be mapped into memory in one go and
+	probed in place; lookups read straight from the mapped pages.
+
+	layout:
+		HashIndexHeader
+		FieldSlot		slots[slot_count]				open-addressing table (see FieldMap::find)
+		uint32_t		ids[id_count]					field ids of hashes that map to more than one field
+		uint32_t		name_offsets[field_count + 1]	offset of each field name in names; the last offset is names_size
+		char			names[names_size]				NUL-terminated field names
+
+	source_stamp identifies the set of *.csv files the index was compiled from (see hashmap_stamp()). When the stamp
+	on disk does not match the hashmap folder, the index is stale and is rebuilt from the CSV files.
+*/
+
+const uint32_t HASHINDEX_VERSION = 2;
+
+struct HashIndexHeader
+{
+	char		magic[4];		// "TBHI"
+	uint32_t	version;		// HASHINDEX_VERSION
+	uint64_t	source_stamp;	// hashmap_stamp() of the CSV files the index was built from
+	uint32_t	slot_count;		// power of two
+	uint32_t	key_count;		// occupied slots
+	uint32_t	id_count;
+	uint32_t	field_count;
+	uint32_t	names_size;
+	uint32_t	reserved;
+};
+
+// one bucket of FieldMap's open-addressing table
+struct FieldSlot
+{
+	uint64_t	hash;			// texture hash (combined, upper, or lower)
+	uint32_t	value;			// the field id itself when count == 1, else offset of the first field id in the id pool
+	uint32_t	count;			// number of fields mapped to hash; 0 marks an empty slot
+};
+
+/* hashmap_stamp: fingerprint the *.csv files in a hashmap folder using only their names, sizes, and write times
+   returns: the stamp, or 0 if the folder does not exist
+*/
+uint64_t hashmap_stamp(const boost::filesystem::path& hashmap_dir	// folder holding the *_hm.csv files
+	);
+
+class HashIndex
+{
+private:
+	boost::interprocess::file_mapping	file;
+	boost::interprocess::mapped_region	region;
+
+	const HashIndexHeader*	header;
+	const FieldSlot*		slot_table;
+	const uint32_t*			id_pool;
+	const uint32_t*			offsets;
+	const char*				name_table;
+
+public:
+	HashIndex();
+
+	/* open: maps an index file and validates its header against the expected stamp
+	   returns: true if the index is mapped and up to date, else false (and the index stays closed)
+	*/
+	bool open(const boost::filesystem::path& index_file,	// the compiled index
+			  uint64_t expected_stamp						// hashmap_stamp() of the current hashmap folder
+		);
+
+	/* close: unmaps the index
+	*/
+	void close();
+
+	bool is_open() const { return header != NULL; }
+
+	// views of the mapped tables; valid until close()
+	uint32_t slot_count() const { return is_open() ? header->slot_count : 0; }
+	uint32_t key_count() const { return is_open() ? header->key_count : 0; }
+	uint32_t field_count() const { return is_open() ? header->field_count : 0; }
+	const FieldSlot* slots() const { return slot_table; }
+	const uint32_t* ids() const { return id_pool; }
+	const uint32_t* name_offsets() const { return offsets; }
+	const char* names() const { return name_table; }
+
+	/* write: writes a compiled index; the file is written to a temporary and renamed into place
+	   returns: true if the index was written, else false
+	*/
+	static bool write(const boost::filesystem::path& index_file,	// destination
+					  uint64_t source_stamp,						// hashmap_stamp() of the CSV files that were compiled
+					  const FieldSlot* slots, uint32_t slot_count, uint32_t key_count,
+					  const uint32_t* ids, uint32_t id_count,
+					  const uint32_t* name_offsets, uint32_t field_count,
+					  const char* names
+		);
+};
+
+#endif
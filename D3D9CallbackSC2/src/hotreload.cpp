@@ -0,0 +1,125 @@
+#include "hotreload.h"
+#include "logger.h"
+#include <chrono>
+#include <unordered_map>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+HotReload::HotReload(const fs::path& hashmap_dir, const fs::path& textures_dir, unsigned interval)
+	: hashmap_watcher(hashmap_dir, ".csv", false), texture_watcher(textures_dir, ".png", true), interval(interval ? interval : 1),
+	  published(NULL), stopping(false)
+{
+	worker = thread(&HotReload::work, this);
+}
+
+HotReload::~HotReload()
+{
+	{
+		lock_guard<mutex> lock(stop_mutex);
+		stopping = true;
+	}
+	stop_cv.notify_all();
+	worker.join();
+
+	ReloadUpdate* update = published.exchange(NULL);
+	if (update) delete update->fieldmap;
+	delete update;
+}
+
+void HotReload::work()
+{
+	poll(true);																				// the entries the game started with
+	for (;;) {
+		{
+			unique_lock<mutex> lock(stop_mutex);
+			if (stop_cv.wait_for(lock, chrono::seconds(interval), [this] { return stopping; })) return;
+		}
+		poll(false);
+	}
+}
+
+void HotReload::changed_hashes(const entries_t& before, const entries_t& after, unordered_set<uint64_t>& hashes)
+{
+	// the fields of each hash in file order; a hash whose first field moved changes what first_field returns
+	unordered_map<uint64_t, vector<const string*>> fields;
+	for (size_t i = 0; i < before.size(); i++) fields[before[i].first].push_back(&before[i].second);
+
+	unordered_map<uint64_t, size_t> matched;												// fields of after that agree with before, per hash
+	for (size_t i = 0; i < after.size(); i++) {
+		uint64_t hash = after[i].first;
+		size_t& n = matched[hash];
+		unordered_map<uint64_t, vector<const string*>>::iterator iter = fields.find(hash);
+		if (iter == fields.end() || n >= iter->second.size() || *iter->second[n] != after[i].second) hashes.insert(hash);
+		n++;
+	}
+	for (unordered_map<uint64_t, vector<const string*>>::iterator iter = fields.begin(); iter != fields.end(); iter++) {
+		unordered_map<uint64_t, size_t>::iterator n = matched.find(iter->first);
+		if (n == matched.end() || n->second != iter->second.size()) hashes.insert(iter->first);		// removed, or fields dropped at the end
+	}
+}
+
+void HotReload::poll(bool first)
+{
+	vector<FileChange> changes;
+	hashmap_watcher.poll(changes);
+
+	ReloadUpdate* update = new ReloadUpdate();
+	for (size_t i = 0; i < changes.size(); i++) {
+		string key = file_key(changes[i].path);
+		map<string, entries_t>::iterator part = parts.find(key);
+		if (changes[i].type == FILE_REMOVED) {
+			if (part == parts.end()) continue;
+			changed_hashes(part->second, entries_t(), update->hashes);
+			parts.erase(part);
+			update->hashmaps.push_back(changes[i].path.string());
+			continue;
+		}
+
+		entries_t entries;
+		vector<string> errors;
+		bool well_formed = read_hashmap_csv(changes[i].path, entries, errors);
+		for (const string& error : errors) {
+			TBLOG(LOG_ERROR, LOGFILE_ERROR) << error << endl;		//Error reporting
+		}
+		if (!well_formed && !first) {
+			TBLOG(LOG_ERROR, LOGFILE_ERROR) << "Error: " << changes[i].path.string() << " not reloaded; keeping its previous entries." << endl;		//Error reporting
+			continue;
+		}
+		if (part != parts.end()) changed_hashes(part->second, entries, update->hashes);
+		else changed_hashes(entries_t(), entries, update->hashes);
+		parts[key].swap(entries);
+		update->hashmaps.push_back(changes[i].path.string());
+	}
+
+	changes.clear();
+	texture_watcher.poll(changes);
+	for (size_t i = 0; i < changes.size(); i++) update->files.insert(file_key(changes[i].path));
+
+	if (first || (update->hashmaps.empty() && update->files.empty())) {
+		delete update;
+		return;
+	}
+
+	if (!update->hashmaps.empty()) {
+		update->fieldmap = new FieldMap();
+		for (map<string, entries_t>::const_iterator part = parts.begin(); part != parts.end(); part++)
+			for (size_t i = 0; i < part->second.size(); i++) update->fieldmap->insert(part->second[i].first, part->second[i].second);
+		update->fieldmap->build();
+	}
+	publish(update);
+}
+
+void HotReload::publish(ReloadUpdate* update)
+{
+	ReloadUpdate* waiting = published.exchange(NULL, memory_order_acquire);				// only this thread publishes, so nothing is lost in between
+	if (waiting) {
+		update->hashes.insert(waiting->hashes.begin(), waiting->hashes.end());
+		update->files.insert(waiting->files.begin(), waiting->files.end());
+		update->hashmaps.insert(update->hashmaps.begin(), waiting->hashmaps.begin(), waiting->hashmaps.end());
+		if (update->fieldmap == NULL) update->fieldmap = waiting->fieldmap;				// else the newer map supersedes it
+		else delete waiting->fieldmap;
+		delete waiting;
+	}
+	published.store(update, memory_order_release);
+}
@@ -0,0 +1,91 @@
+#ifndef _HOTRELOAD_H
+#define _HOTRELOAD_H
+
+#include "cachemap.h"
+#include "filewatcher.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <boost/filesystem.hpp>
+
+/*
+	Hot reload (hot_reload = <seconds> in prefs.txt)
+
+	Lets a pack author edit a _hm.csv file or a replacement PNG and see the result without restarting the game. A
+	background thread polls tonberry\hashmap and the texture folder (see filewatcher.h) every interval seconds. A changed
+	hashmap file is parsed again on that thread, and only that file: the entries of every other file are kept from
+	their last parse, and a new FieldMap is built from all of them, in file name order as the folder lists them at
+	startup. A file that no longer parses keeps its previous entries.
+
+	The result is published as a ReloadUpdate through one atomic pointer, which the render thread takes at BeginScene
+	(see TexturePipeline::swap_fieldmap and invalidate). UnlockRect never touches the reloader, so it takes no lock and
+	reads the same map for the whole of an unlock; the old map is freed at the scene boundary, when no unlock is
+	reading it.
+
+	hashmap.idx is not rewritten while the game has it mapped; the next start finds it stale and compiles it again.
+*/
+
+struct ReloadUpdate
+{
+	FieldMap*						fieldmap;			// rebuilt map, or NULL if no hashmap file changed; owned by whoever takes the update
+	std::unordered_set<uint64_t>	hashes;				// hashes whose fields changed, were added, or were removed
+	std::unordered_set<std::string>	files;				// file_key of every replacement file added, modified, or removed
+	std::vector<std::string>		hashmaps;			// hashmap files parsed again, for the log
+
+	ReloadUpdate() : fieldmap(NULL) {}
+};
+
+class HotReload
+{
+private:
+	typedef std::vector<std::pair<uint64_t, std::string>> entries_t;		// hash :-> field, in file order
+
+	FileWatcher						hashmap_watcher;
+	FileWatcher						texture_watcher;
+	std::map<std::string, entries_t>	parts;							// file_key of each hashmap file :-> its entries
+	unsigned						interval;							// seconds between polls
+	std::atomic<ReloadUpdate*>		published;							// waiting for take(); NULL if none
+
+	std::thread						worker;
+	std::mutex						stop_mutex;
+	std::condition_variable			stop_cv;
+	bool							stopping;
+
+	void work();
+
+	/* changed_hashes: the hashes whose fields differ between two parses of one hashmap file
+	*/
+	static void changed_hashes(const entries_t& before,
+							   const entries_t& after,
+							   std::unordered_set<uint64_t>& hashes		// receives the hashes
+		);
+
+	/* poll: parses the hashmap files that changed and publishes what changed; the first poll only parses every file
+	*/
+	void poll(bool first);
+
+	/* publish: makes update the one take() returns, merging an update that was not taken yet into it
+	*/
+	void publish(ReloadUpdate* update);
+
+public:
+	HotReload(const boost::filesystem::path& hashmap_dir,	// the _hm.csv files
+			  const boost::filesystem::path& textures_dir,	// the replacement PNGs, in field folders
+			  unsigned interval								// seconds between polls (at least one)
+		);
+	~HotReload();
+
+	/* take: the changes found since the last take; render thread only
+	   returns: the update, owned by the caller, or NULL if nothing changed
+	*/
+	ReloadUpdate* take() { return published.exchange(NULL, std::memory_order_acquire); }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "instrument.h"
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+atomic<bool> Instrument::enabled(false);
+atomic<uint64_t> Instrument::counters[COUNTER_COUNT];
+
+static LatencyHistogram stages[STAGE_COUNT];
+static const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+void LatencyHistogram::snapshot(HistogramSnapshot& out) const
+{
+	out.counts.assign(HIST_BUCKETS, 0);
+	out.count = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		out.counts[i] = counts[i].load(memory_order_relaxed);
+		out.count += out.counts[i];												// consistent with the buckets even while threads record
+	}
+	out.sum = sum.load(memory_order_relaxed);
+	out.max = max.load(memory_order_relaxed);
+}
+
+void LatencyHistogram::reset()
+{
+	for (int i = 0; i < HIST_BUCKETS; i++) counts[i].store(0, memory_order_relaxed);
+	count.store(0, memory_order_relaxed);
+	sum.store(0, memory_order_relaxed);
+	max.store(0, memory_order_relaxed);
+}
+
+void Instrument::record(PipelineStage stage, uint64_t ns)
+{
+	stages[stage].record(ns);
+}
+
+void Instrument::snapshot(PipelineStage stage, HistogramSnapshot& out)
+{
+	stages[stage].snapshot(out);
+}
+
+bool Instrument::write_snapshot(const string& path)
+{
+	// write to a file of our own, then rename, so that a reader never sees half a snapshot
+	string temp_file = path + ".tmp";
+	FILE* file = fopen(temp_file.c_str(), "w");
+	if (file == NULL) return false;
+
+	long long uptime = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+	fprintf(file, "instrument,%u,%lld\n", INSTRUMENT_VERSION, uptime);
+
+	HistogramSnapshot hist;
+	for (int stage = 0; stage < STAGE_COUNT; stage++) {
+		stages[stage].snapshot(hist);
+		fprintf(file, "stage,%s,%llu,%llu,%llu,", stage_name(stage), (unsigned long long)hist.count, (unsigned long long)hist.sum, (unsigned long long)hist.max);
+		const char* separator = "";
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			if (hist.counts[i] == 0) continue;
+			fprintf(file, "%s%d:%llu", separator, i, (unsigned long long)hist.counts[i]);
+			separator = " ";
+		}
+		fprintf(file, "\n");
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		fprintf(file, "counter,%s,%llu\n", counter_name(i), (unsigned long long)counters[i].load(memory_order_relaxed));
+
+	bool ok = (ferror(file) == 0);
+	ok = (fclose(file) == 0) && ok;
+	boost::system::error_code ec;
+	if (ok) fs::rename(temp_file, path, ec);
+	if (!ok || ec) {
+		fs::remove(temp_file, ec);
+		return false;
+	}
+	return true;
+}
+
+void Instrument::reset()
+{
+	for (int stage = 0; stage < STAGE_COUNT; stage++) stages[stage].reset();
+	for (int i = 0; i < COUNTER_COUNT; i++) counters[i].store(0, memory_order_relaxed);
+}
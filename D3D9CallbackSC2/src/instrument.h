@@ -0,0 +1,206 @@
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+/*
+	Hot-path instrumentation
+
+	Each stage of the texture pipeline keeps a latency histogram, and the pipeline keeps a few counters; both are
+	plain atomics, so worker threads record into them without locks. A StageTimer around a stage costs one relaxed
+	load while instrumentation is off (instrument_interval=0).
+
+	Histograms are log-linear, as HDR histograms are: latencies below 2^HIST_SUB_BITS ns get a bucket each, and every
+	octave above is split into 2^HIST_SUB_BITS buckets, so a percentile is within 1/16 of the true value from 16 ns to
+	centuries, in under 8 KB per stage.
+
+	Instrument::write_snapshot writes the totals so far to a text file (tonberry\debug\instrument.csv):
+		instrument,<INSTRUMENT_VERSION>,<uptime ms>
+		stage,<name>,<count>,<sum ns>,<max ns>,<bucket>:<count> <bucket>:<count> ...		(non-empty buckets)
+		counter,<name>,<value>
+	which ConsoleTesting reads back with HistogramSnapshot to print p50/p99/max per stage.
+*/
+
+const uint32_t INSTRUMENT_VERSION = 1;
+
+enum PipelineStage
+{
+	STAGE_UNLOCK,				// GlobalContext::UnlockRect, all of it
+	STAGE_HASH,					// hashing the locked rect
+	STAGE_LOOKUP,				// fieldmap and cache lookups
+	STAGE_REQUEST,				// queueing a replacement (copying the in-game pixels it needs)
+	STAGE_DUMP,					// nomatch capture
+	STAGE_LOAD,					// a loader thread building a replacement (disk cache, decode, compose)
+	STAGE_DECODE,				// one PNG decode
+	STAGE_CREATE,				// CreateTexture of a replacement
+	STAGE_COPY,					// copying a staging image into the new texture
+	STAGE_SETTEXTURE,			// GlobalContext::SetTexture
+	STAGE_FUZZY,				// Omzy hash and nearest-hash search of a texture no hash matched
+	STAGE_COUNT
+};
+
+enum PipelineCounter
+{
+	COUNTER_HITS,				// textures whose replacement was in the cache
+	COUNTER_MISSES,				// textures that matched a field and had to be loaded
+	COUNTER_NOMATCH,			// textures without a replacement
+	COUNTER_EVICTIONS,			// replacements evicted from the cache
+	COUNTER_BYTES_LOADED,		// bytes of replacement textures created
+	COUNTER_FUZZY,				// textures matched by Omzy hash after no hash matched (counted in misses too)
+	COUNTER_COUNT
+};
+
+inline const char* stage_name(int stage)
+{
+	static const char* const names[STAGE_COUNT] = { "unlock", "hash", "lookup", "request", "dump", "load", "decode", "create", "copy", "settexture", "fuzzy" };
+	return (stage >= 0 && stage < STAGE_COUNT) ? names[stage] : "?";
+}
+
+inline const char* counter_name(int counter)
+{
+	static const char* const names[COUNTER_COUNT] = { "hits", "misses", "nomatch", "evictions", "bytes_loaded", "fuzzy" };
+	return (counter >= 0 && counter < COUNTER_COUNT) ? names[counter] : "?";
+}
+
+const int HIST_SUB_BITS = 4;
+const int HIST_SUB = 1 << HIST_SUB_BITS;
+const int HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) * HIST_SUB;
+
+/* hist_bucket: the bucket of a latency
+*/
+inline int hist_bucket(uint64_t ns)
+{
+	if (ns < (uint64_t)HIST_SUB) return (int)ns;
+	int octave = 63;
+	while ((ns >> octave) == 0) octave--;															// highest set bit; at least HIST_SUB_BITS
+	return (octave - HIST_SUB_BITS + 1) * HIST_SUB + (int)((ns >> (octave - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* hist_bucket_low: the smallest latency of a bucket
+*/
+inline uint64_t hist_bucket_low(int bucket)
+{
+	if (bucket < HIST_SUB) return (uint64_t)bucket;
+	int octave = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(HIST_SUB + bucket % HIST_SUB)) << (octave - HIST_SUB_BITS);
+}
+
+// a copy of a histogram, as kept in memory or read back from a snapshot file
+struct HistogramSnapshot
+{
+	uint64_t				count;
+	uint64_t				sum;		// ns
+	uint64_t				max;		// ns
+	std::vector<uint64_t>	counts;		// per bucket
+
+	HistogramSnapshot() : count(0), sum(0), max(0), counts(HIST_BUCKETS, 0) {}
+
+	double mean() const { return count ? (double)sum / count : 0.0; }
+
+	/* percentile: the latency q of all samples are at or below, to within a bucket (the midpoint is reported)
+	*/
+	uint64_t percentile(double q) const
+	{
+		if (count == 0) return 0;
+		uint64_t rank = (uint64_t)(q * count);
+		if (rank >= count) rank = count - 1;
+		uint64_t seen = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen > rank) {
+				uint64_t low = hist_bucket_low(i), high = (i + 1 < HIST_BUCKETS) ? hist_bucket_low(i + 1) : low;
+				uint64_t mid = low + (high - low) / 2;
+				return mid < max ? mid : max;
+			}
+		}
+		return max;
+	}
+};
+
+class LatencyHistogram
+{
+private:
+	std::atomic<uint64_t>	counts[HIST_BUCKETS];
+	std::atomic<uint64_t>	count;
+	std::atomic<uint64_t>	sum;
+	std::atomic<uint64_t>	max;
+
+public:
+	LatencyHistogram() { reset(); }
+
+	void record(uint64_t ns)
+	{
+		counts[hist_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t seen = max.load(std::memory_order_relaxed);
+		while (ns > seen && !max.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+	}
+
+	void snapshot(HistogramSnapshot& out) const;
+
+	void reset();
+};
+
+class Instrument
+{
+public:
+	static std::atomic<bool> enabled;
+
+	/* record: adds a latency to a stage
+	*/
+	static void record(PipelineStage stage, uint64_t ns);
+
+	static void add(PipelineCounter counter, uint64_t n = 1)
+	{
+		if (enabled.load(std::memory_order_relaxed)) counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	/* set: for counters another component keeps (e.g. TextureCacheStats::evictions)
+	*/
+	static void set(PipelineCounter counter, uint64_t value) { counters[counter].store(value, std::memory_order_relaxed); }
+
+	static void snapshot(PipelineStage stage, HistogramSnapshot& out);
+	static uint64_t get(PipelineCounter counter) { return counters[counter].load(std::memory_order_relaxed); }
+
+	/* write_snapshot: writes every stage and counter so far (see the format above), replacing the file
+	   returns: true if the file was written, else false
+	*/
+	static bool write_snapshot(const std::string& path);
+
+	static void reset();
+
+private:
+	static std::atomic<uint64_t> counters[COUNTER_COUNT];
+};
+
+// times the scope it is declared in (or up to stop()) into a stage
+class StageTimer
+{
+private:
+	PipelineStage							stage;
+	bool									active;
+	std::chrono::steady_clock::time_point	start;
+
+public:
+	StageTimer(PipelineStage stage) : stage(stage), active(Instrument::enabled.load(std::memory_order_relaxed))
+	{
+		if (active) start = std::chrono::steady_clock::now();
+	}
+
+	~StageTimer() { stop(); }
+
+	void stop()
+	{
+		if (!active) return;
+		active = false;
+		Instrument::record(stage, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+};
+
+#endif
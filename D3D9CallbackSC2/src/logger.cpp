@@ -0,0 +1,214 @@
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+using namespace std;
+
+// a single-producer single-consumer byte ring: records of a 4-byte header (file << 24 | length) and the text
+struct LogRing
+{
+	char			data[LOG_RING_SIZE];
+	atomic<size_t>	head;				// bytes ever written by the owning thread
+	atomic<size_t>	tail;				// bytes ever read by the writer
+	atomic<size_t>	dropped;
+
+	LogRing() : head(0), tail(0), dropped(0) {}
+
+	void copy_in(size_t pos, const void* src, size_t len)
+	{
+		size_t offset = pos & (LOG_RING_SIZE - 1);
+		size_t first = min(len, LOG_RING_SIZE - offset);
+		memcpy(data + offset, src, first);
+		memcpy(data, (const char*)src + first, len - first);
+	}
+
+	void copy_out(size_t pos, void* dest, size_t len) const
+	{
+		size_t offset = pos & (LOG_RING_SIZE - 1);
+		size_t first = min(len, LOG_RING_SIZE - offset);
+		memcpy(dest, data + offset, first);
+		memcpy((char*)dest + first, data, len - first);
+	}
+};
+
+const size_t LOG_RECORD_MAX = LOG_RING_SIZE / 4 - sizeof(uint32_t);	// longest text of one record
+const chrono::milliseconds LOG_WRITE_INTERVAL(5);
+
+atomic<int> Logger::level(LOG_INFO);
+
+static mutex				rings_mutex;
+static vector<LogRing*>		rings;								// every thread that ever logged; rings live as long as the process
+static thread_local LogRing* thread_ring = NULL;
+
+static mutex				writer_mutex;
+static condition_variable	writer_cv;
+static condition_variable	flushed_cv;
+static thread*				writer = NULL;						// never destroyed while it runs: a joinable thread destroyed at exit calls terminate
+static bool					running = false;
+static bool					stopping = false;
+static uint64_t				flush_requested = 0;
+static uint64_t				flush_done = 0;
+
+static mutex				files_mutex;
+static FILE*				files[LOGFILE_COUNT] = { NULL };
+
+static LogRing* get_ring()
+{
+	if (thread_ring == NULL) {
+		thread_ring = new LogRing();
+		lock_guard<mutex> lock(rings_mutex);
+		rings.push_back(thread_ring);
+	}
+	return thread_ring;
+}
+
+// queues one record; the only synchronization is the release of head
+static bool push(LogRing* ring, LogFile file, const char* text, size_t len)
+{
+	size_t head = ring->head.load(memory_order_relaxed);
+	size_t tail = ring->tail.load(memory_order_acquire);
+	if (LOG_RING_SIZE - (head - tail) < sizeof(uint32_t) + len) return false;
+
+	uint32_t header = ((uint32_t)file << 24) | (uint32_t)len;
+	ring->copy_in(head, &header, sizeof(header));
+	ring->copy_in(head + sizeof(header), text, len);
+	ring->head.store(head + sizeof(header) + len, memory_order_release);
+	return true;
+}
+
+// moves every record of a ring into the batch of its file
+static void drain(LogRing* ring, string* batches)
+{
+	size_t tail = ring->tail.load(memory_order_relaxed);
+	size_t head = ring->head.load(memory_order_acquire);
+	while (tail < head) {
+		uint32_t header;
+		ring->copy_out(tail, &header, sizeof(header));
+		size_t len = header & 0xFFFFFF;
+		string& batch = batches[header >> 24];
+		size_t start = batch.size();
+		batch.resize(start + len);
+		if (len > 0) ring->copy_out(tail + sizeof(header), &batch[start], len);
+		tail += sizeof(header) + len;
+	}
+	ring->tail.store(tail, memory_order_release);
+}
+
+static void write_pass()
+{
+	vector<LogRing*> snapshot;
+	{
+		lock_guard<mutex> lock(rings_mutex);
+		snapshot = rings;
+	}
+
+	string batches[LOGFILE_COUNT];
+	for (size_t i = 0; i < snapshot.size(); i++) drain(snapshot[i], batches);
+
+	lock_guard<mutex> lock(files_mutex);
+	for (int i = 0; i < LOGFILE_COUNT; i++) {
+		if (batches[i].empty() || files[i] == NULL) continue;
+		fwrite(batches[i].data(), 1, batches[i].size(), files[i]);
+		fflush(files[i]);
+	}
+}
+
+static void writer_main()
+{
+	unique_lock<mutex> lock(writer_mutex);
+	for (;;) {
+		writer_cv.wait_for(lock, LOG_WRITE_INTERVAL, [] { return stopping || flush_requested > flush_done; });
+		uint64_t ticket = flush_requested;											// everything queued before this flush() is in the rings now
+		bool last = stopping;
+
+		lock.unlock();
+		write_pass();
+		lock.lock();
+
+		flush_done = ticket;
+		flushed_cv.notify_all();
+		if (last) return;
+	}
+}
+
+bool Logger::open(LogFile file, const string& path, bool truncate)
+{
+	FILE* handle = fopen(path.c_str(), truncate ? "wb" : "ab");
+	{
+		lock_guard<mutex> lock(files_mutex);
+		if (files[file]) fclose(files[file]);
+		files[file] = handle;
+	}
+
+	lock_guard<mutex> lock(writer_mutex);
+	if (!running) {
+		running = true;
+		stopping = false;
+		writer = new thread(writer_main);
+	}
+	return handle != NULL;
+}
+
+bool Logger::write(LogFile file, const char* text, size_t len, bool wait)
+{
+	LogRing* ring = get_ring();
+	do {
+		size_t chunk = min(len, LOG_RECORD_MAX);
+		while (!push(ring, file, text, chunk)) {
+			if (!wait) {
+				ring->dropped++;
+				return false;
+			}
+			writer_cv.notify_one();
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		text += chunk;
+		len -= chunk;
+	} while (len > 0);
+	return true;
+}
+
+void Logger::flush()
+{
+	unique_lock<mutex> lock(writer_mutex);
+	if (!running) return;
+	uint64_t ticket = ++flush_requested;
+	writer_cv.notify_one();
+	flushed_cv.wait(lock, [ticket] { return flush_done >= ticket || !running; });
+}
+
+void Logger::stop()
+{
+	{
+		lock_guard<mutex> lock(writer_mutex);
+		if (!running) return;
+		stopping = true;
+	}
+	writer_cv.notify_one();
+	writer->join();
+	delete writer;
+	writer = NULL;
+
+	lock_guard<mutex> lock(writer_mutex);
+	running = false;
+	flushed_cv.notify_all();
+
+	lock_guard<mutex> files_lock(files_mutex);
+	for (int i = 0; i < LOGFILE_COUNT; i++) {
+		if (files[i]) fclose(files[i]);
+		files[i] = NULL;
+	}
+}
+
+size_t Logger::dropped()
+{
+	lock_guard<mutex> lock(rings_mutex);
+	size_t total = 0;
+	for (size_t i = 0; i < rings.size(); i++) total += rings[i]->dropped;
+	return total;
+}
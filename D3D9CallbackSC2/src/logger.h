@@ -0,0 +1,115 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <ostream>
+#include <streambuf>
+#include <atomic>
+
+/*
+	Asynchronous logger
+
+	Every thread that logs gets its own ring buffer; a log line is copied into it without locks or file I/O, and a
+	background writer drains the rings every few milliseconds into files it keeps open, one write per file per pass.
+	A full ring drops the line (and counts it) rather than stall the render thread.
+
+	TBLOG(level, file) << ... << endl;
+		level	LOG_ERROR, LOG_INFO, or LOG_DEBUG; a line above TONBERRY_LOG_MAX is compiled out, and a line above the
+				runtime level (Logger::set_level) costs one branch
+		file	LOGFILE_DEBUG, LOGFILE_NOMATCH, or LOGFILE_ERROR
+
+	Lines longer than LOG_LINE_MAX are truncated; Logger::write takes text of any length.
+*/
+
+enum LogLevel
+{
+	LOG_ERROR = 0,
+	LOG_INFO = 1,
+	LOG_DEBUG = 2
+};
+
+#ifndef TONBERRY_LOG_MAX
+#define TONBERRY_LOG_MAX 2				// most verbose level compiled in (see CompileOptions.h)
+#endif
+
+enum LogFile
+{
+	LOGFILE_DEBUG,
+	LOGFILE_NOMATCH,
+	LOGFILE_ERROR,
+	LOGFILE_COUNT
+};
+
+const size_t LOG_LINE_MAX = 1024;		// bytes of one TBLOG line
+const size_t LOG_RING_SIZE = 1 << 16;	// bytes of each thread's ring; a power of two
+
+class Logger
+{
+public:
+	static std::atomic<int> level;		// most verbose level written; lines above it are skipped
+
+	/* open: sets the file a log writes to and starts the writer if it is not running
+	   returns: true if the file was opened, else false
+	*/
+	static bool open(LogFile file,				// the log
+					 const std::string& path,	// its file
+					 bool truncate				// start the file over, else append to it
+		);
+
+	static void set_level(LogLevel new_level) { level.store(new_level, std::memory_order_relaxed); }
+
+	/* write: queues text for a log; text longer than a ring record is split
+	   returns: false if (part of) the text was dropped because the ring was full, else true
+	*/
+	static bool write(LogFile file,				// the log
+					  const char* text,			// bytes to append
+					  size_t len,
+					  bool wait = false			// wait for room instead of dropping (for long dumps off the render thread)
+		);
+
+	/* flush: blocks until everything queued so far is in the files
+	*/
+	static void flush();
+
+	/* stop: flushes, stops the writer, and closes the files
+	*/
+	static void stop();
+
+	/* dropped: lines dropped because a ring was full, since the start
+	*/
+	static size_t dropped();
+};
+
+// one log line, formatted on the stack and queued when it goes out of scope
+class LogLine : public std::ostream
+{
+private:
+	struct line_buf : public std::streambuf
+	{
+		char data[LOG_LINE_MAX];
+		line_buf() { setp(data, data + LOG_LINE_MAX); }		// overflow sets badbit, which truncates the line
+		size_t length() const { return pptr() - pbase(); }
+	};
+
+	line_buf	buf;
+	LogFile		file;
+
+public:
+	LogLine(LogFile file) : std::ostream(NULL), file(file) { rdbuf(&buf); }
+	~LogLine() { Logger::write(file, buf.data, buf.length()); }
+};
+
+// turns the stream a TBLOG line ends as into void, so both arms of the TBLOG conditional have one type;
+// & binds looser than <<, so the whole line is formatted first
+struct LogVoidify
+{
+	void operator&(std::ostream&) {}
+};
+
+// a conditional expression rather than an if/else, so a TBLOG under an unbraced if does not take its else
+#define TBLOG(log_level, log_file) \
+	!((log_level) <= TONBERRY_LOG_MAX && (log_level) <= Logger::level.load(std::memory_order_relaxed)) ? (void)0 : LogVoidify() & LogLine(log_file)
+
+#endif
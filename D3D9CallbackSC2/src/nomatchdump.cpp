@@ -0,0 +1,222 @@
+#include "nomatchdump.h"
+#include "logger.h"
+#include <string.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+static const char NOMATCHSET_MAGIC[4] = { 'T', 'B', 'N', 'S' };
+static const size_t NOMATCH_POOL_MAX = 8;											// staging images kept for reuse
+
+#pragma pack(push, 1)
+struct bmp_header_t
+{
+	char		type[2];			// "BM"
+	uint32_t	file_size;
+	uint32_t	reserved;
+	uint32_t	data_offset;
+	uint32_t	info_size;			// BITMAPINFOHEADER
+	int32_t		width;
+	int32_t		height;				// positive: rows bottom-up
+	uint16_t	planes;
+	uint16_t	bits;
+	uint32_t	compression;		// BI_RGB
+	uint32_t	data_size;
+	int32_t		x_ppm;
+	int32_t		y_ppm;
+	uint32_t	colors_used;
+	uint32_t	colors_important;
+};
+#pragma pack(pop)
+
+static inline NoMatchSetRecord make_record(uint64_t hash, NoMatchSide side)
+{
+	NoMatchSetRecord record;
+	record.hash = hash;
+	record.side = (uint8_t)side;
+	return record;
+}
+
+bool write_bmp(const string& path, const StagingImage& image)
+{
+	if (image.width == 0 || image.height == 0) return false;
+
+	bmp_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.type[0] = 'B';
+	header.type[1] = 'M';
+	header.data_offset = sizeof(header);
+	header.data_size = image.width * image.height * sizeof(uint32_t);
+	header.file_size = header.data_offset + header.data_size;
+	header.info_size = 40;
+	header.width = image.width;
+	header.height = image.height;
+	header.planes = 1;
+	header.bits = 32;
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (uint32_t y = image.height; ok && y-- > 0; )									// memory order b, g, r, a is BMP order already
+		ok = fwrite(&image.pixels[(size_t)y * image.width], sizeof(uint32_t), image.width, file) == image.width;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok) remove(path.c_str());
+	return ok;
+}
+
+NoMatchDumper::NoMatchDumper(const string& folder, const string& set_path, EncodeFunc encode, const string& extension, double rate, size_t max_queue_bytes)
+	: folder(folder), extension(extension), encode(encode), set_path(set_path), set_file(NULL), max_queue_bytes(max_queue_bytes), rate(rate), tokens(max(rate, 1.0)),
+	  refilled(chrono::steady_clock::now()), stopping(false)
+{
+	memset(&stats, 0, sizeof(stats));
+	load_set();
+	worker = thread(&NoMatchDumper::work, this);
+}
+
+NoMatchDumper::~NoMatchDumper()
+{
+	{
+		lock_guard<mutex> lock(dump_mutex);
+		stopping = true;
+	}
+	queue_cv.notify_all();
+	worker.join();
+
+	if (set_file) fclose(set_file);
+}
+
+void NoMatchDumper::load_set()
+{
+	vector<NoMatchSetRecord> records;
+	FILE* file = fopen(set_path.c_str(), "rb");
+	if (file) {
+		char magic[4];
+		uint32_t version = 0;
+		if (fread(magic, sizeof(magic), 1, file) == 1 && fread(&version, sizeof(version), 1, file) == 1 &&
+			memcmp(magic, NOMATCHSET_MAGIC, sizeof(magic)) == 0 && version == NOMATCHSET_VERSION) {
+			NoMatchSetRecord record;
+			while (fread(&record, sizeof(record), 1, file) == 1)						// a record cut short by a crash is dropped
+				if (record.side <= NOMATCH_RIGHT) records.push_back(record);
+		}
+		fclose(file);
+	}
+
+	sort(records.begin(), records.end(), [](const NoMatchSetRecord& a, const NoMatchSetRecord& b) {
+		return a.side != b.side ? a.side < b.side : a.hash < b.hash;
+	});
+	records.erase(unique(records.begin(), records.end(), [](const NoMatchSetRecord& a, const NoMatchSetRecord& b) {
+		return a.side == b.side && a.hash == b.hash;
+	}), records.end());
+	for (size_t i = 0; i < records.size(); i++) seen_sets[records[i].side].insert(records[i].hash);
+
+	// rewrite it compacted, then keep it open for appending
+	boost::system::error_code ec;
+	fs::path temp_file = fs::path(set_path).string() + ".tmp";
+	file = fopen(temp_file.string().c_str(), "wb");
+	if (file == NULL) return;
+	bool ok = fwrite(NOMATCHSET_MAGIC, sizeof(NOMATCHSET_MAGIC), 1, file) == 1 && fwrite(&NOMATCHSET_VERSION, sizeof(NOMATCHSET_VERSION), 1, file) == 1;
+	if (ok && !records.empty()) ok = fwrite(&records[0], sizeof(NoMatchSetRecord), records.size(), file) == records.size();
+	ok = (fclose(file) == 0) && ok;
+	if (ok) fs::rename(temp_file, set_path, ec);
+	if (!ok || ec) {
+		fs::remove(temp_file, ec);
+		return;
+	}
+	set_file = fopen(set_path.c_str(), "ab");
+}
+
+bool NoMatchDumper::take_token()
+{
+	if (rate <= 0) return true;
+
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	tokens = min(max(rate, 1.0), tokens + rate * chrono::duration<double>(now - refilled).count());		// a burst of at least one
+	refilled = now;
+	if (tokens < 1) return false;
+	tokens -= 1;
+	return true;
+}
+
+bool NoMatchDumper::seen(NoMatchSide side, uint64_t hash)
+{
+	lock_guard<mutex> lock(dump_mutex);
+	return seen_sets[side].count(hash) > 0;
+}
+
+bool NoMatchDumper::capture(const NoMatchDump& dump, const uint8_t* bits, size_t pitch, uint32_t x, uint32_t width, uint32_t height)
+{
+	size_t bytes = (size_t)width * height * sizeof(uint32_t);
+	job_t job;
+	{
+		lock_guard<mutex> lock(dump_mutex);
+		if (bytes == 0 || stats.queued_bytes + bytes > max_queue_bytes || !take_token()) {
+			stats.throttled++;
+			return false;
+		}
+		if (!pool.empty()) {
+			job.image = move(pool.back());
+			pool.pop_back();
+		}
+		stats.queued_bytes += bytes;
+		job.new_left = seen_sets[NOMATCH_LEFT].insert(dump.left).second;				// pending: not captured twice while it is queued
+		job.new_right = dump.has_right && seen_sets[NOMATCH_RIGHT].insert(dump.right).second;
+	}
+
+	// the copy is the only work done inside the game's unlock
+	job.dump = dump;
+	job.image.width = width;
+	job.image.height = height;
+	job.image.pixels.resize((size_t)width * height);
+	for (uint32_t y = 0; y < height; y++)
+		memcpy(&job.image.pixels[(size_t)y * width], bits + y * pitch + x * sizeof(uint32_t), width * sizeof(uint32_t));
+
+	{
+		lock_guard<mutex> lock(dump_mutex);
+		queue.push_back(move(job));
+		stats.captured++;
+	}
+	queue_cv.notify_one();
+	return true;
+}
+
+void NoMatchDumper::work()
+{
+	for (;;) {
+		job_t job;
+		{
+			unique_lock<mutex> lock(dump_mutex);
+			queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (stopping) return;
+			job = move(queue.front());
+			queue.pop_front();
+		}
+
+		bool saved = encode((fs::path(folder) / (job.dump.name + extension)).string(), job.image);
+		if (saved) TBLOG(LOG_DEBUG, LOGFILE_NOMATCH) << job.dump.log_line << endl;
+
+		lock_guard<mutex> lock(dump_mutex);
+		if (saved) {
+			NoMatchSetRecord records[2];
+			size_t count = 0;
+			if (job.new_left) records[count++] = make_record(job.dump.left, NOMATCH_LEFT);
+			if (job.new_right) records[count++] = make_record(job.dump.right, NOMATCH_RIGHT);
+			if (set_file && count > 0 && fwrite(records, sizeof(NoMatchSetRecord), count, set_file) == count) fflush(set_file);
+			stats.saved++;
+		} else {																		// only saved textures count as seen
+			if (job.new_left) seen_sets[NOMATCH_LEFT].erase(job.dump.left);
+			if (job.new_right) seen_sets[NOMATCH_RIGHT].erase(job.dump.right);
+			stats.failed++;
+		}
+		stats.queued_bytes -= job.image.pixels.size() * sizeof(uint32_t);
+		if (pool.size() < NOMATCH_POOL_MAX) pool.push_back(move(job.image));
+	}
+}
+
+NoMatchStats NoMatchDumper::get_stats()
+{
+	lock_guard<mutex> lock(dump_mutex);
+	stats.known = seen_sets[NOMATCH_LEFT].size() + seen_sets[NOMATCH_RIGHT].size();
+	return stats;
+}
@@ -0,0 +1,163 @@
+#ifndef _NOMATCHDUMP_H
+#define _NOMATCHDUMP_H
+
+#include "texloader.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/*
+	No-match texture dumper (tonberry\debug\nomatch)
+
+	In debug mode every texture without a replacement is saved once, so that it can be matched to a field later. The
+	render thread only copies the locked rect into a pooled staging image (see NoMatchDumper::capture); a worker
+	encodes and writes the file, then records its hashes and the nomatch.log line.
+
+	Which halves were saved is kept in a hash set file next to the folder, so a restart does not dump everything again:
+		char		magic[4];		// "TBNS"
+		uint32_t	version;		// NOMATCHSET_VERSION
+		NoMatchSetRecord records[];
+
+	Records are appended as files are saved and the set is sorted and compacted when it is opened. A hash is only
+	recorded once its file was written, so renaming the folder (e.g. to nomatch0) still disables dumping.
+
+	Captures are rate limited (a burst of rate, refilled at rate per second) and the queued staging images are capped
+	in bytes; a capture that does not fit is skipped and tried again the next time the texture is locked.
+*/
+
+const uint32_t NOMATCHSET_VERSION = 1;
+
+enum NoMatchSide
+{
+	NOMATCH_LEFT = 0,				// seen as the left half (or the whole of a narrow texture)
+	NOMATCH_RIGHT = 1				// seen as the right half
+};
+
+#pragma pack(push, 1)
+struct NoMatchSetRecord
+{
+	uint64_t	hash;
+	uint8_t		side;				// NoMatchSide
+};
+#pragma pack(pop)
+
+/* EncodeFunc: writes an image file; called from the worker thread, so it must not touch shared state
+   returns: true if the file was written, else false
+*/
+typedef bool (*EncodeFunc)(const std::string& path, const StagingImage& image);
+
+/* write_bmp: writes a 32-bit BMP, as D3DXSaveTextureToFile saves an A8R8G8B8 texture
+   returns: true if the file was written, else false
+*/
+bool write_bmp(const std::string& path,		// file to write
+			   const StagingImage& image		// pixels, rows top-down
+	);
+
+// one texture to save
+struct NoMatchDump
+{
+	std::string		name;			// file name in the folder, without extension
+	uint64_t		left;			// recorded in the NOMATCH_LEFT set once saved
+	uint64_t		right;			// recorded in the NOMATCH_RIGHT set once saved, if has_right
+	bool			has_right;
+	std::string		log_line;		// written to nomatch.log once saved
+
+	NoMatchDump() : left(0), right(0), has_right(false) {}
+};
+
+struct NoMatchStats
+{
+	size_t		captured;			// textures copied and queued
+	size_t		saved;
+	size_t		failed;				// encoder or file errors
+	size_t		throttled;			// captures skipped by the rate limit or the queue cap
+	size_t		known;				// hashes in the sets, queued ones included
+	size_t		queued_bytes;		// staging bytes waiting for the worker
+};
+
+class NoMatchDumper
+{
+private:
+	struct job_t
+	{
+		NoMatchDump		dump;
+		bool			new_left;		// whether capture added the hashes to the sets, so a failed save takes them out again
+		bool			new_right;
+		StagingImage	image;
+	};
+
+	typedef std::unordered_set<uint64_t> hash_set;
+
+	std::string									folder;
+	std::string									extension;
+	EncodeFunc									encode;
+	std::string									set_path;
+	FILE*										set_file;						// open for appending records
+
+	std::mutex									dump_mutex;
+	std::condition_variable						queue_cv;
+	std::deque<job_t>							queue;
+	std::vector<StagingImage>					pool;							// staging images to reuse
+	hash_set									seen_sets[2];					// NoMatchSide :-> hashes saved or queued
+	NoMatchStats								stats;
+	size_t										max_queue_bytes;
+	double										rate;							// captures per second
+	double										tokens;
+	std::chrono::steady_clock::time_point		refilled;
+	bool										stopping;
+	std::thread									worker;
+
+	/* load_set: reads the hash set file, then rewrites it sorted and without duplicates
+	*/
+	void load_set();
+
+	/* take_token: refills the rate limit and spends one capture from it
+	   PRECONDITION: dump_mutex is held
+	   returns: true if the capture may go ahead, else false
+	*/
+	bool take_token();
+
+	void work();
+
+public:
+	NoMatchDumper(const std::string& folder,		// where dumps are written; not created, so a missing folder disables dumping
+				  const std::string& set_path,		// the hash set file
+				  EncodeFunc encode,				// writes a dump
+				  const std::string& extension,		// of dump files, e.g. ".bmp"
+				  double rate,						// captures per second; 0 for no limit
+				  size_t max_queue_bytes			// most staging bytes waiting for the worker
+		);
+
+	/* ~NoMatchDumper: drops what is still queued (it was not recorded, so it is captured again next run)
+	*/
+	~NoMatchDumper();
+
+	/* seen: whether a hash was saved (this run or an earlier one) or is queued
+	*/
+	bool seen(NoMatchSide side,
+			  uint64_t hash
+		);
+
+	/* capture: copies a rectangle of a locked A8R8G8B8 texture and queues it to be saved
+	   returns: true if queued, false if throttled
+	*/
+	bool capture(const NoMatchDump& dump,		// what to save it as
+				 const uint8_t* bits,			// locked rect
+				 size_t pitch,					// bytes per row
+				 uint32_t x,					// rectangle to save
+				 uint32_t width,
+				 uint32_t height
+		);
+
+	NoMatchStats get_stats();
+};
+
+#endif
@@ -0,0 +1,440 @@
+#include "pipeline.h"
+#include "logger.h"
+#include "instrument.h"
+#include "murmur2stream.h"
+#include "omzyhash.h"
+#include "filewatcher.h"
+#include <string.h>
+#include <sstream>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+const size_t COORDS_LEN = 324;
+const HashCoord COORDS[COORDS_LEN] = { HashCoord(6, 7), HashCoord(14, 7), HashCoord(20, 7), HashCoord(26, 6), HashCoord(30, 7), HashCoord(38, 7), HashCoord(49, 6), HashCoord(52, 7), HashCoord(58, 6), HashCoord(70, 7), HashCoord(74, 7), HashCoord(82, 7), HashCoord(86, 7), HashCoord(98, 7), HashCoord(100, 7), HashCoord(108, 7), HashCoord(114, 7), HashCoord(122, 7), HashCoord(7, 13), HashCoord(14, 14), HashCoord(18, 14), HashCoord(26, 14), HashCoord(34, 14), HashCoord(42, 14), HashCoord(46, 14), HashCoord(56, 14), HashCoord(58, 14), HashCoord(70, 13), HashCoord(74, 14), HashCoord(82, 12), HashCoord(90, 12), HashCoord(98, 14), HashCoord(102, 13), HashCoord(108, 12), HashCoord(114, 14), HashCoord(122, 12), HashCoord(6, 17), HashCoord(14, 19), HashCoord(18, 20), HashCoord(26, 18), HashCoord(34, 21), HashCoord(40, 20), HashCoord(44, 21), HashCoord(54, 21), HashCoord(58, 18), HashCoord(70, 17), HashCoord(74, 20), HashCoord(82, 17), HashCoord(90, 18), HashCoord(94, 21), HashCoord(104, 20), HashCoord(108, 21), HashCoord(114, 21), HashCoord(122, 20), HashCoord(7, 27), HashCoord(14, 27), HashCoord(20, 28), HashCoord(26, 26), HashCoord(34, 26), HashCoord(40, 28), HashCoord(44, 25), HashCoord(54, 24), HashCoord(58, 26), HashCoord(70, 27), HashCoord(76, 27), HashCoord(82, 28), HashCoord(88, 26), HashCoord(94, 28), HashCoord(102, 25), HashCoord(108, 25), HashCoord(114, 28), HashCoord(122, 28), HashCoord(6, 35), HashCoord(12, 35), HashCoord(18, 30), HashCoord(24, 34), HashCoord(34, 30), HashCoord(40, 32), HashCoord(44, 31), HashCoord(52, 30), HashCoord(58, 30), HashCoord(66, 30), HashCoord(76, 31), HashCoord(82, 35), HashCoord(88, 30), HashCoord(93, 31), HashCoord(104, 34), HashCoord(108, 33), HashCoord(114, 30), HashCoord(121, 35), HashCoord(6, 41), HashCoord(14, 39), HashCoord(20, 40), HashCoord(24, 42), HashCoord(30, 39), HashCoord(40, 40), HashCoord(44, 37), HashCoord(54, 42), HashCoord(58, 38), HashCoord(70, 41), HashCoord(72, 38), HashCoord(82, 38), HashCoord(88, 40), HashCoord(94, 41), HashCoord(102, 37), HashCoord(108, 42), HashCoord(116, 41), HashCoord(122, 42), HashCoord(6, 44), HashCoord(14, 47), HashCoord(18, 44), HashCoord(24, 44), HashCoord(34, 46), HashCoord(40, 44), HashCoord(48, 44), HashCoord(54, 45), HashCoord(58, 44), HashCoord(70, 45), HashCoord(74, 44), HashCoord(84, 45), HashCoord(90, 44), HashCoord(93, 45), HashCoord(102, 45), HashCoord(108, 44), HashCoord(114, 44), HashCoord(121, 44), HashCoord(6, 53), HashCoord(14, 51), HashCoord(18, 52), HashCoord(25, 51), HashCoord(34, 54), HashCoord(40, 52), HashCoord(48, 51), HashCoord(52, 51), HashCoord(58, 54), HashCoord(70, 53), HashCoord(74, 51), HashCoord(82, 52), HashCoord(90, 51), HashCoord(94, 51), HashCoord(100, 51), HashCoord(108, 51), HashCoord(114, 52), HashCoord(121, 54), HashCoord(6, 62), HashCoord(12, 59), HashCoord(18, 60), HashCoord(24, 60), HashCoord(30, 59), HashCoord(40, 58), HashCoord(44, 59), HashCoord(56, 58), HashCoord(58, 58), HashCoord(70, 58), HashCoord(75, 58), HashCoord(84, 58), HashCoord(88, 58), HashCoord(98, 58), HashCoord(102, 58), HashCoord(108, 58), HashCoord(114, 58), HashCoord(121, 62), HashCoord(7, 70), HashCoord(12, 69), HashCoord(18, 70), HashCoord(26, 70), HashCoord(34, 70), HashCoord(40, 68), HashCoord(44, 70), HashCoord(52, 70), HashCoord(60, 69), HashCoord(70, 69), HashCoord(74, 68), HashCoord(82, 70), HashCoord(86, 69), HashCoord(94, 67), HashCoord(104, 70), HashCoord(108, 69), HashCoord(116, 67), HashCoord(122, 66), HashCoord(7, 77), HashCoord(14, 77), HashCoord(18, 76), HashCoord(26, 74), HashCoord(30, 75), HashCoord(40, 76), HashCoord(46, 77), HashCoord(52, 75), HashCoord(58, 76), HashCoord(70, 77), HashCoord(76, 75), HashCoord(84, 77), HashCoord(86, 77), HashCoord(98, 76), HashCoord(104, 74), HashCoord(108, 75), HashCoord(114, 76), HashCoord(121, 74), HashCoord(7, 79), HashCoord(14, 79), HashCoord(20, 79), HashCoord(25, 79), HashCoord(34, 84), HashCoord(40, 84), HashCoord(44, 79), HashCoord(54, 79), HashCoord(58, 79), HashCoord(70, 79), HashCoord(74, 84), HashCoord(82, 84), HashCoord(88, 80), HashCoord(98, 82), HashCoord(104, 84), HashCoord(112, 83), HashCoord(114, 84), HashCoord(121, 84), HashCoord(7, 87), HashCoord(14, 87), HashCoord(18, 86), HashCoord(26, 86), HashCoord(34, 86), HashCoord(40, 86), HashCoord(44, 87), HashCoord(51, 86), HashCoord(58, 86), HashCoord(70, 87), HashCoord(76, 87), HashCoord(82, 87), HashCoord(86, 87), HashCoord(98, 86), HashCoord(104, 86), HashCoord(108, 87), HashCoord(114, 86), HashCoord(122, 86), HashCoord(6, 97), HashCoord(13, 97), HashCoord(16, 98), HashCoord(24, 98), HashCoord(32, 98), HashCoord(40, 96), HashCoord(48, 98), HashCoord(52, 98), HashCoord(58, 96), HashCoord(70, 97), HashCoord(76, 98), HashCoord(80, 98), HashCoord(86, 97), HashCoord(96, 98), HashCoord(105, 98), HashCoord(110, 97), HashCoord(114, 98), HashCoord(121, 98), HashCoord(7, 101), HashCoord(14, 101), HashCoord(16, 102), HashCoord(24, 102), HashCoord(30, 101), HashCoord(38, 101), HashCoord(46, 101), HashCoord(52, 102), HashCoord(62, 101), HashCoord(68, 102), HashCoord(76, 102), HashCoord(84, 102), HashCoord(91, 105), HashCoord(94, 101), HashCoord(102, 101), HashCoord(107, 101), HashCoord(114, 101), HashCoord(121, 102), HashCoord(7, 107), HashCoord(13, 107), HashCoord(21, 108), HashCoord(23, 107), HashCoord(31, 107), HashCoord(41, 108), HashCoord(45, 107), HashCoord(51, 107), HashCoord(58, 112), HashCoord(69, 108), HashCoord(77, 107), HashCoord(84, 111), HashCoord(91, 107), HashCoord(93, 108), HashCoord(103, 107), HashCoord(107, 107), HashCoord(116, 112), HashCoord(121, 108), HashCoord(6, 116), HashCoord(14, 115), HashCoord(20, 116), HashCoord(25, 114), HashCoord(33, 114), HashCoord(40, 116), HashCoord(44, 116), HashCoord(52, 114), HashCoord(58, 114), HashCoord(70, 117), HashCoord(74, 116), HashCoord(84, 114), HashCoord(86, 115), HashCoord(93, 114), HashCoord(102, 115), HashCoord(110, 115), HashCoord(114, 114), HashCoord(122, 115), HashCoord(7, 123), HashCoord(14, 121), HashCoord(21, 121), HashCoord(26, 121), HashCoord(34, 121), HashCoord(42, 121), HashCoord(44, 121), HashCoord(52, 121), HashCoord(58, 121), HashCoord(69, 121), HashCoord(74, 121), HashCoord(82, 121), HashCoord(87, 121), HashCoord(93, 121), HashCoord(100, 121), HashCoord(107, 121), HashCoord(114, 121), HashCoord(122, 121) };
+
+const size_t SOURCES_PRUNE_MIN = 256;							// sources kept before they are first pruned
+
+// all three hashes in one pass over the locked rect, without allocating; the runtime takes only this hash of a texture, so a
+// SamplingPlan, whose gather pays off when several hashes share it, would only add a plan lookup per texture
+static inline uint64_t Murmur2_Combined(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height, uint64_t& hash_upper, uint64_t& hash_lower)
+{
+	return TextureHash::Murmur2::Murmur2_Hash_Texture(bits, pitch, sizeof(uint32_t), width, height, VRAM_DIM / 2, COORDS, COORDS_LEN, hash_upper, hash_lower);
+}
+
+uint64_t grid_hashes(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height, vector<uint64_t>& hashes)
+{
+	const uint32_t page = VRAM_DIM, half = VRAM_DIM / 2;
+	uint32_t columns = (width + page - 1) / page;
+	uint32_t rows = (height + half - 1) / half;
+	hashes.assign((size_t)columns * rows, 0);
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint32_t y = 0; y < height; y += page)
+		for (uint32_t x = 0; x < width; x += page) {
+			uint64_t hash_upper, hash_lower;
+			uint64_t hash_page = Murmur2_Combined(bits + y * pitch + x * sizeof(uint32_t), pitch, min(page, width - x), min(page, height - y), hash_upper, hash_lower);
+			size_t row = y / half, column = x / page;
+			hashes[row * columns + column] = hash_upper;
+			if (row + 1 < rows) hashes[(row + 1) * columns + column] = hash_lower;
+			hash = (hash ^ hash_page) * 1099511628211ULL;
+		}
+	hash = (hash ^ width) * 1099511628211ULL;							// the same pages in another layout are another texture
+	return (hash ^ height) * 1099511628211ULL;
+}
+
+// FNV-1a over the b, g, r bytes of every pixel of columns [x0, width), as FNV_Full hashes a cv::Mat; names \nomatch\ dumps
+static uint64_t FNV_Hash_Full(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height, uint32_t x0 = 0)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t* pixel = bits + y * pitch + x0 * sizeof(uint32_t);
+		for (uint32_t x = x0; x < width; x++, pixel += sizeof(uint32_t)) {
+			hash = (hash ^ pixel[0]) * 1099511628211ULL;
+			hash = (hash ^ pixel[1]) * 1099511628211ULL;
+			hash = (hash ^ pixel[2]) * 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+TexturePipeline::TexturePipeline(TextureCache* cache, FieldMap* fieldmap, TextureDevice* device, TextureLoader* loader, TileCache* tilecache, NoMatchDumper* nomatch,
+								 const FuzzyMap* fuzzymap, const PipelineConfig& config)
+	: cache(cache), fieldmap(fieldmap), device(device), loader(loader), tilecache(tilecache), nomatch(nomatch), fuzzymap(fuzzymap), config(config), generation(0),
+	  sources_limit(SOURCES_PRUNE_MIN)
+{
+}
+
+bool TexturePipeline::get_fields(uint64_t hash_combined, uint64_t hash_upper, uint64_t hash_lower, const char*& field_combined, const char*& field_upper, const char*& field_lower) const
+{
+	// search for hash_combined
+	if ((field_combined = fieldmap->first_field(hash_combined)) != NULL)			// a field matches whole texture: use this one
+		return true;
+
+	// hash_upper and hash_lower should never match the first file, because hash_combined would already have matched it;
+	// both are looked up, since a texture is composed from both halves
+	field_upper = fieldmap->first_field(hash_upper);
+	field_lower = fieldmap->first_field(hash_lower);
+	return field_upper != NULL || field_lower != NULL;
+}
+
+const char* TexturePipeline::fuzzy_field(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height) const
+{
+	if (fuzzymap == NULL || fuzzymap->size() == 0) return NULL;
+	StageTimer timer(STAGE_FUZZY);
+	uint64_t omzy = TextureHash::Omzy::Omzy_Hash_Texture(bits, pitch, sizeof(uint32_t), width, height);
+	int distance;
+	const char* field = fuzzymap->nearest(omzy, &distance);
+	if (field) TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "fuzzy (" << omzy << ") " << field << " within " << distance << " bits" << endl;
+	return field;
+}
+
+fs::path TexturePipeline::texture_path(const string& field) const
+{
+	return ((((config.textures_dir / field.substr(0, 2))) / field.substr(0, field.rfind("_"))) / (field + ".png"));
+}
+
+void TexturePipeline::submit_request(LoadRequest& request, const uint8_t* replaced_bits, size_t replaced_pitch)
+{
+	request.resize_factor = config.resize_factor;
+	request.generation = generation;
+
+	if (request.path_combined.empty()) {
+		// a tile without a replacement is filled from the in-game texture, which is only readable while it is locked
+		request.replaced.resize((size_t)request.replaced_width * request.replaced_height);
+		for (uint32_t y = 0; y < request.replaced_height; y++)
+			memcpy(&request.replaced[(size_t)y * request.replaced_width], replaced_bits + y * replaced_pitch, request.replaced_width * sizeof(uint32_t));
+	}
+
+	if (config.hot_reload) {
+		if (sources.size() >= sources_limit) {											// forget the replacements the cache evicted or dropped since
+			for (unordered_map<uint64_t, sources_t>::iterator iter = sources.begin(); iter != sources.end(); ) {
+				if (cache->contains(iter->first)) iter++;
+				else iter = sources.erase(iter);
+			}
+			sources_limit = max(SOURCES_PRUNE_MIN, 2 * sources.size());
+		}
+		sources_t& source = sources[request.hash];
+		source.combined = request.path_combined.empty() ? string() : file_key(request.path_combined);
+		source.tiles.clear();
+		for (size_t i = 0; i < request.tiles.size(); i++)
+			source.tiles.push_back(make_pair(request.tiles[i].hash, request.tiles[i].path.empty() ? string() : file_key(request.tiles[i].path)));
+	}
+
+	loader->request(request);
+}
+
+void TexturePipeline::request_newhandle(uint64_t hash, const uint8_t* replaced_bits, size_t replaced_pitch, uint32_t replaced_width, uint32_t replaced_height, const char* field_combined,
+										uint64_t hash_upper, const char* field_upper, uint64_t hash_lower, const char* field_lower)
+{
+	StageTimer timer(STAGE_REQUEST);
+	LoadRequest request;
+	request.hash = hash;
+	request.replaced_width = replaced_width;
+	request.replaced_height = replaced_height;
+
+	if (field_combined != NULL && *field_combined != 0)
+		request.path_combined = texture_path(field_combined).string();
+	else
+		add_half_tiles(request, VRAM_DIM / 2,
+					   hash_upper, (field_upper != NULL && *field_upper != 0) ? texture_path(field_upper).string() : string(),
+					   hash_lower, (field_lower != NULL && *field_lower != 0) ? texture_path(field_lower).string() : string());
+	submit_request(request, replaced_bits, replaced_pitch);
+}
+
+bool TexturePipeline::compose_grid(HANDLE handle, const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height, const char*& field_matched)
+{
+	field_matched = NULL;
+	vector<uint64_t> hashes;
+	StageTimer hash_timer(STAGE_HASH);
+	uint64_t hash_grid = grid_hashes(bits, pitch, width, height, hashes);
+	hash_timer.stop();
+
+	StageTimer lookup_timer(STAGE_LOOKUP);
+	if (cache->contains(hash_grid)) {											// composed for an earlier unlock of the same grid
+		lookup_timer.stop();
+		Instrument::add(COUNTER_HITS);
+		TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "use_grid (" << hash_grid << ")" << endl;
+		cache->insert(handle, hash_grid);
+		return true;
+	}
+
+	// tiles that have a replacement file, or were composed for another texture, are copied; the rest is upscaled from this one
+	vector<string> paths(hashes.size());
+	size_t matched = 0;
+	for (size_t i = 0; i < hashes.size(); i++) {
+		const char* field = fieldmap->first_field(hashes[i]);
+		if (field != NULL && *field != 0) {
+			paths[i] = texture_path(field).string();
+			if (field_matched == NULL) field_matched = field;
+		}
+		if (!paths[i].empty() || (tilecache != NULL && tilecache->contains(hashes[i]))) matched++;
+	}
+	lookup_timer.stop();
+	if (matched == 0) return false;
+
+	Instrument::add(COUNTER_MISSES);
+	TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "compose_grid (" << hash_grid << ") " << width << "x" << height << " from " << matched << " of " << hashes.size() << " tiles: queued." << endl;
+	StageTimer timer(STAGE_REQUEST);
+	LoadRequest request;
+	request.hash = hash_grid;
+	request.replaced_width = width;
+	request.replaced_height = height;
+	add_grid_tiles(request, VRAM_DIM, VRAM_DIM / 2, VRAM_DIM, hashes, paths);
+	submit_request(request, bits, pitch);
+	timer.stop();
+
+	cache->insert(handle, hash_grid, NULL);										// pending: the original texture is used until the load finishes
+	return true;
+}
+
+void TexturePipeline::prefetch_siblings(const char* field)
+{
+	fs::path folder = texture_path(field).parent_path();
+	if (folder == last_prefetch) return;
+	last_prefetch = folder;
+
+	loader->prefetch(folder.string());
+
+	PrefetchStats stats = loader->prefetch_stats();
+	TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "prefetch " << folder << " (so far: " << stats.decoded << " decoded, " << stats.hits << " hits, " << stats.wasted << " wasted, "
+		  << stats.skipped << " over budget, " << (stats.bytes >> 20) << " MB staged)" << endl;
+}
+
+void TexturePipeline::dump_nomatch(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height, uint64_t hash_combined, uint64_t hash_upper, uint64_t hash_lower)
+{
+	StageTimer timer(STAGE_DUMP);
+	long long time = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now().time_since_epoch()).count();
+	ostringstream sstream;
+	NoMatchDump dump;
+	if (width <= VRAM_DIM / 2) {								// save the whole image
+		uint64_t hash = FNV_Hash_Full(bits, pitch, width, height);
+		if (nomatch->seen(NOMATCH_LEFT, hash)) {
+			TBLOG(LOG_DEBUG, LOGFILE_NOMATCH) << time << "," << "SKIPPED" << hash << endl;
+			return;
+		}
+		dump.name = to_string(hash);
+		dump.left = hash;
+		sstream << time << "," << hash << "," << hash_combined << "," << hash_upper << "," << hash_lower;
+		dump.log_line = sstream.str();
+		nomatch->capture(dump, bits, pitch, 0, width, height);
+		return;
+	}
+
+	uint16_t save_option = 0;									// 0: save nothing; 1: save left-half only; 2: save whole image
+	uint64_t hash_left = FNV_Hash_Full(bits, pitch, VRAM_DIM / 2, height);
+	uint64_t hash_right = FNV_Hash_Full(bits, pitch, width, height, VRAM_DIM / 2);
+
+	if (!nomatch->seen(NOMATCH_LEFT, hash_left)) {				// If we've never seen this left-half before:
+		if (!nomatch->seen(NOMATCH_LEFT, hash_right))			//   If we've never seen this right-half on the left-half of an image: save the whole image
+			save_option = 2;
+		else													//   If we have seen this right-half on the left-half of an image: save only the left half
+			save_option = 1;
+	}
+
+	if (save_option < 2 &&
+		!nomatch->seen(NOMATCH_LEFT, hash_right) &&				// If we've never seen this right-half on either side of the image: save the whole image
+		!nomatch->seen(NOMATCH_RIGHT, hash_right))
+		save_option = 2;
+
+	if (save_option == 0) {
+		TBLOG(LOG_DEBUG, LOGFILE_NOMATCH) << time << "," << "SKIPPED" << hash_left << hash_right << endl;
+		return;
+	}
+
+	dump.name = to_string(hash_left) + "_" + (save_option == 2 ? to_string(hash_right) : string());
+	dump.left = hash_left;
+	dump.right = hash_right;
+	dump.has_right = true;
+	sstream << time << "," << dump.name << "," << hash_combined << "," << hash_upper << "," << hash_lower;
+	dump.log_line = sstream.str();
+	nomatch->capture(dump, bits, pitch, 0, save_option == 2 ? width : VRAM_DIM / 2, height);	// the left half is cut from the locked rect, not copied to a texture
+}
+
+void TexturePipeline::unlock(HANDLE handle, const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height)
+{
+	StageTimer timer(STAGE_UNLOCK);
+
+	bool handle_used = false;													// if false, handle will be erased from the TextureCache
+	if (bits != NULL) {
+		// get field matches using Murmur2 hash
+		uint64_t hash_combined = 0, hash_upper = 0, hash_lower = 0;
+		const char *field_combined = NULL, *field_upper = NULL, *field_lower = NULL;
+
+		// get hashes
+		StageTimer hash_timer(STAGE_HASH);
+		hash_combined = Murmur2_Combined(bits, pitch, width, height, hash_upper, hash_lower);
+		hash_timer.stop();
+
+		StageTimer lookup_timer(STAGE_LOOKUP);
+		bool use_combined = cache->contains(hash_combined);
+
+		if (use_combined) {														// there is an existing newhandle for hash_combined; use it!
+			lookup_timer.stop();
+			Instrument::add(COUNTER_HITS);
+			TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "use_combined (" << hash_combined << ")" << endl;
+			cache->insert(handle, hash_combined);
+			handle_used = true;
+		} else {
+			// look for matching fields
+			get_fields(hash_combined, hash_upper, hash_lower, field_combined, field_upper, field_lower);
+			bool create_combined = field_combined != NULL;
+
+			if (create_combined) {												// there is a matching field for hash_combined; create it!
+				lookup_timer.stop();
+				Instrument::add(COUNTER_MISSES);
+				TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "create_combined (" << hash_combined << ") from " << field_combined << ": queued." << endl;
+				request_newhandle(hash_combined, bits, pitch, width, height, field_combined);
+				cache->insert(handle, hash_combined, NULL);						// pending: the original texture is used until the load finishes
+				handle_used = true;
+			} else {
+				// halves that have a replacement file, or were composed for another texture, are copied; the rest is upscaled from this one.
+				// A texture wider or taller than a page is composed from a grid of tiles instead: its halves would span every page.
+				bool grid = width > VRAM_DIM || height > VRAM_DIM;
+				bool tile_upper = !grid && (field_upper != NULL || (tilecache != NULL && tilecache->contains(hash_upper)));
+				bool tile_lower = !grid && (field_lower != NULL || (tilecache != NULL && tilecache->contains(hash_lower)));
+				lookup_timer.stop();
+
+				if (grid) field_upper = field_lower = NULL;						// compose_grid looks them up with the rest of the grid, and returns its match in field_upper
+
+				if (tile_upper || tile_lower) {
+					Instrument::add(COUNTER_MISSES);
+					TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "compose (" << hash_combined << ") from upper (" << hash_upper << ") " << (field_upper ? field_upper : (tile_upper ? "tile" : "original"))
+						  << " and lower (" << hash_lower << ") " << (field_lower ? field_lower : (tile_lower ? "tile" : "original")) << ": queued." << endl;
+					request_newhandle(hash_combined, bits, pitch, width, height, NULL, hash_upper, field_upper, hash_lower, field_lower);
+					cache->insert(handle, hash_combined, NULL);
+					handle_used = true;
+				} else if (grid && compose_grid(handle, bits, pitch, width, height, field_upper)) {
+					handle_used = true;
+				} else if ((field_combined = fuzzy_field(bits, pitch, width, height)) != NULL) {	// no hash matched, but a pack texture is close: use it whole
+					Instrument::add(COUNTER_MISSES);
+					Instrument::add(COUNTER_FUZZY);
+					TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "create_fuzzy (" << hash_combined << ") from " << field_combined << ": queued." << endl;
+					request_newhandle(hash_combined, bits, pitch, width, height, field_combined);
+					cache->insert(handle, hash_combined, NULL);					// cached by its own hash, so the search runs once per texture
+					handle_used = true;
+				} else {														// NO MATCH
+					Instrument::add(COUNTER_NOMATCH);
+					if (nomatch != NULL && width > 0 && height > 0)				// queue it to be saved once
+						dump_nomatch(bits, pitch, width, height, hash_combined, hash_upper, hash_lower);
+				}
+			}
+
+			const char* field_matched = field_combined ? field_combined : (field_upper ? field_upper : field_lower);
+			if (field_matched) prefetch_siblings(field_matched);					// after the request, which goes first anyway
+		}
+	}
+
+	if (!handle_used) cache->erase(handle);
+}
+
+void* TexturePipeline::replacement(const HANDLE* handles, size_t count)
+{
+	StageTimer timer(STAGE_SETTEXTURE);
+	for (size_t i = 0; i < count; i++) {
+		void* newtexture;
+		if (handles[i] && (newtexture = cache->at(handles[i])) != NULL)		// NULL while the replacement is still loading
+			return newtexture;
+	}
+	return NULL;
+}
+
+void TexturePipeline::destroy(HANDLE handle)
+{
+	cache->destroy(handle);
+}
+
+size_t TexturePipeline::begin_scene()
+{
+	if (loader->pending() == 0) return 0;
+
+	vector<LoadResult> results;
+	loader->upload(config.uploads_per_scene, results);
+	for (size_t i = 0; i < results.size(); i++) {
+		Instrument::add(COUNTER_BYTES_LOADED, results[i].bytes);
+		unordered_map<uint64_t, superseded_t>::iterator stale = superseded.find(results[i].hash);
+		if (stale != superseded.end() && results[i].generation < stale->second.generation) {	// made from the files before a reload; a newer load may be pending
+			if (results[i].texture) device->release_texture(results[i].texture);
+			if (--stale->second.loads == 0) superseded.erase(stale);
+		} else if (results[i].texture == NULL)
+			cache->cancel(results[i].hash);												// could not be loaded: keep the original texture
+		else if (!cache->complete(results[i].hash, results[i].texture, results[i].bytes, results[i].cost))
+			device->release_texture(results[i].texture);								// evicted while it was loading
+	}
+
+	if (config.debug && !results.empty()) {
+		TextureCacheStats stats = cache->get_stats();
+		TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "texture cache: " << stats.entries << " textures, " << (stats.bytes_resident >> 20) << " MB resident, " << (stats.bytes_evicted >> 20)
+			  << " MB evicted (" << stats.evictions << " textures), hit ratio " << stats.hit_ratio() << " (" << stats.hits << " hits, " << stats.misses << " misses)" << endl
+			  << "handles: " << stats.handles << " mapped, " << stats.handles_destroyed << " destroyed, " << stats.handles_stale << " stale" << endl
+			  << "log: " << Logger::dropped() << " lines dropped" << endl;
+		if (config.hot_reload)
+			TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "hot reload: " << stats.invalidated << " textures invalidated" << endl;
+		if (tilecache) {
+			TileCacheStats tiles = tilecache->get_stats();
+			TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "tile cache: " << (tiles.bytes >> 20) << " MB, " << tiles.hits << " hits, " << tiles.misses << " misses, " << tiles.stores << " stored, " << tiles.evictions << " evicted" << endl;
+		}
+		if (nomatch) {
+			NoMatchStats dumps = nomatch->get_stats();
+			TBLOG(LOG_DEBUG, LOGFILE_DEBUG) << "nomatch: " << dumps.saved << " saved, " << dumps.failed << " failed, " << dumps.throttled << " throttled, "
+				<< (dumps.queued_bytes >> 10) << " KB queued" << endl;
+		}
+	}
+	return results.size();
+}
+
+FieldMap* TexturePipeline::swap_fieldmap(FieldMap* fieldmap)
+{
+	FieldMap* old = this->fieldmap;
+	this->fieldmap = fieldmap;
+	return old;
+}
+
+void TexturePipeline::supersede(uint64_t hash)
+{
+	if (!cache->pending(hash)) return;
+	superseded_t& stale = superseded[hash];											// a pending entry has one load in flight; the next is requested after this
+	stale.generation = generation;
+	stale.loads++;
+}
+
+size_t TexturePipeline::invalidate(const unordered_set<uint64_t>& hashes, const unordered_set<string>& files)
+{
+	generation++;
+	if (!files.empty()) {
+		loader->discard_prefetched();
+		last_prefetch.clear();																// the folder is prefetched again at its next match
+	}
+	if (tilecache)
+		for (unordered_set<uint64_t>::const_iterator hash = hashes.begin(); hash != hashes.end(); hash++) tilecache->erase(*hash);
+
+	size_t invalidated = 0;
+	for (unordered_map<uint64_t, sources_t>::iterator iter = sources.begin(); iter != sources.end(); ) {
+		const sources_t& source = iter->second;
+		bool changed = hashes.count(iter->first) || (!source.combined.empty() && files.count(source.combined));
+		for (size_t i = 0; i < source.tiles.size(); i++) {
+			const pair<uint64_t, string>& tile = source.tiles[i];
+			if ((tile.first && hashes.count(tile.first)) || (!tile.second.empty() && files.count(tile.second))) {
+				if (tilecache && tile.first) tilecache->erase(tile.first);
+				changed = true;
+			}
+		}
+		if (!changed) {
+			iter++;
+			continue;
+		}
+
+		supersede(iter->first);
+		if (cache->invalidate(iter->first)) invalidated++;
+		iter = sources.erase(iter);
+	}
+
+	// a hash that had no entry has none to drop: a texture it now matches is looked up again at its next unlock
+	for (unordered_set<uint64_t>::const_iterator hash = hashes.begin(); hash != hashes.end(); hash++) {
+		supersede(*hash);
+		if (cache->invalidate(*hash)) invalidated++;
+	}
+	return invalidated;
+}
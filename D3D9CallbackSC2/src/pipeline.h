@@ -0,0 +1,211 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "cachemap.h"
+#include "hashcoord.h"
+#include "texloader.h"
+#include "tilecache.h"
+#include "nomatchdump.h"
+#include "fuzzymap.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
+
+/*
+	Texture pipeline
+
+	What happens to a texture between the game unlocking it and drawing with it, without d3d9: GlobalContext locks
+	the texture and hands its bits to TexturePipeline::unlock, which hashes them, looks up the fields, queues the
+	replacement, and maps the handle in the TextureCache; SetTexture asks it for the replacement of a handle, and
+	BeginScene has it upload the replacements that finished loading.
+
+	The pipeline owns none of its parts. The DLL builds it from the D3D9TextureDevice and the prefs; the replay
+	harness (see trace.h) builds it from a SoftwareTextureDevice and feeds it a recorded trace.
+*/
+
+const int VRAM_DIM = 256;
+
+extern const size_t COORDS_LEN;
+extern const HashCoord COORDS[];						// the pixels Murmur2 hashes sample
+
+/* grid_hashes: hashes a texture wider or taller than a page as a grid of pages, each cut into an upper and a lower
+				tile as a page is; a tile hash is the upper or lower hash of its page, so a tile file is looked up
+				as the half of a page is
+   returns: the hash of the whole grid
+*/
+uint64_t grid_hashes(const uint8_t* bits,				// locked rect (A8R8G8B8)
+					 size_t pitch,
+					 uint32_t width,
+					 uint32_t height,
+					 std::vector<uint64_t>& hashes		// receives the hash of every VRAM_DIM x VRAM_DIM / 2 tile, row by row
+	);
+
+struct PipelineConfig
+{
+	float						resize_factor;			// texture upscale factor
+	boost::filesystem::path		textures_dir;			// replacement files: <textures_dir>\<first two letters>\<field up to the last '_'>\<field>.png
+	size_t						uploads_per_scene;		// most replacement textures created per BeginScene
+	bool						debug;					// log every match and the cache stats
+	bool						hot_reload;				// remember the files each replacement came from, so invalidate can find them
+
+	PipelineConfig() : resize_factor(4.0), textures_dir("textures"), uploads_per_scene(2), debug(false), hot_reload(false) {}
+};
+
+class TexturePipeline
+{
+private:
+	// what a replacement was made from; kept with hot_reload only
+	struct sources_t
+	{
+		std::string										combined;	// file_key of the whole replacement; empty if it was composed
+		std::vector<std::pair<uint64_t, std::string>>	tiles;		// hash and file_key (empty if none) of each tile it was composed from
+	};
+
+	// loads of a hash that were in flight when it was invalidated
+	struct superseded_t
+	{
+		unsigned	generation;		// generation of the last invalidate that found a load in flight; results older than it are stale
+		unsigned	loads;			// stale results still to come
+	};
+
+	TextureCache*				cache;
+	FieldMap*					fieldmap;
+	TextureDevice*				device;
+	TextureLoader*				loader;
+	TileCache*					tilecache;			// NULL if disabled
+	NoMatchDumper*				nomatch;			// NULL unless textures without a match are dumped
+	const FuzzyMap*				fuzzymap;			// NULL unless textures without a match are matched by Omzy hash
+	PipelineConfig				config;
+	boost::filesystem::path		last_prefetch;		// field folder prefetched most recently
+	unsigned					generation;			// counts invalidate calls; stamped on every request
+	std::unordered_map<uint64_t, superseded_t>	superseded;	// hash :-> its stale loads; dropped when the last one is released
+	std::unordered_map<uint64_t, sources_t>	sources;	// hash :-> what its replacement was made from; pruned of hashes the cache dropped
+	size_t						sources_limit;		// sources are pruned when they grow to this many
+
+	/* get_fields: looks up the fields of a texture; fields are views into the fieldmap, nothing is copied
+	   returns: true if any of the hashes has a field, else false
+	*/
+	bool get_fields(uint64_t hash_combined, uint64_t hash_upper, uint64_t hash_lower,
+					const char*& field_combined, const char*& field_upper, const char*& field_lower
+		) const;
+
+	/* fuzzy_field: the field of the pack texture whose Omzy hash is nearest to the texture's, for a texture no hash matched
+	   returns: the field, or NULL if there is no fuzzymap or no pack texture is close enough
+	*/
+	const char* fuzzy_field(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height) const;
+
+	/* supersede: marks the load in flight for hash, if there is one, as stale, before its cache entry is invalidated
+	*/
+	void supersede(uint64_t hash);
+
+	/* submit_request: queues a request whose hash, size, and path or tiles are set; a composed replacement gets the
+					   in-game texture to fill the tiles without a replacement
+	*/
+	void submit_request(LoadRequest& request,
+						const uint8_t* replaced_bits,	// locked rect of the in-game texture
+						size_t replaced_pitch
+		);
+
+	/* request_newhandle: queues a replacement for hash to be loaded in the background; the cache entry stays pending
+	   until begin_scene uploads it. Without field_combined, the replacement is composed from its upper and lower tiles.
+	*/
+	void request_newhandle(uint64_t hash,					// texture hash
+						   const uint8_t* replaced_bits,	// locked rect of the in-game texture
+						   size_t replaced_pitch,
+						   uint32_t replaced_width,
+						   uint32_t replaced_height,
+						   const char* field_combined,		// field of the whole texture, or NULL to compose it
+						   uint64_t hash_upper = 0,
+						   const char* field_upper = NULL,
+						   uint64_t hash_lower = 0,
+						   const char* field_lower = NULL
+		);
+
+	/* compose_grid: maps a texture wider or taller than a page (see grid_hashes) to a replacement composed from the
+					 tiles that have a replacement file or are in the TileCache
+	   returns: true if the handle was mapped, else false (no tile has a replacement)
+	*/
+	bool compose_grid(HANDLE handle,
+					  const uint8_t* bits,
+					  size_t pitch,
+					  uint32_t width,
+					  uint32_t height,
+					  const char*& field_matched		// receives the field of the first tile that has one, or NULL
+		);
+
+	/* prefetch_siblings: once one page of a field matches, the rest of its pages (<field>_<n>) usually follow within a
+	   few frames, so the whole field folder is decoded in the background
+	*/
+	void prefetch_siblings(const char* field);
+
+	/* dump_nomatch: queues a texture without a replacement to be saved; each half is saved once, across runs
+	*/
+	void dump_nomatch(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height,
+					  uint64_t hash_combined, uint64_t hash_upper, uint64_t hash_lower
+		);
+
+public:
+	TexturePipeline(TextureCache* cache,			// maps handles to replacements
+					FieldMap* fieldmap,				// maps hashes to fields
+					TextureDevice* device,			// releases loaded replacements the cache does not take
+					TextureLoader* loader,			// loads replacements
+					TileCache* tilecache,			// may be NULL
+					NoMatchDumper* nomatch,			// may be NULL
+					const FuzzyMap* fuzzymap,		// may be NULL
+					const PipelineConfig& config
+		);
+
+	/* texture_path: replacement file of a field
+	*/
+	boost::filesystem::path texture_path(const std::string& field) const;
+
+	/* unlock: handles a texture the game unlocked
+	*/
+	void unlock(HANDLE handle,			// the in-game texture
+				const uint8_t* bits,	// its locked rect (A8R8G8B8), or NULL if it is not one we replace (video, other formats)
+				size_t pitch,			// bytes per row
+				uint32_t width,
+				uint32_t height
+		);
+
+	/* replacement: the replacement of the first of handles that has one
+	   returns: the replacement texture, or NULL if none has one (or it is still loading)
+	*/
+	void* replacement(const HANDLE* handles,	// textures the game binds to one stage
+					  size_t count
+		);
+
+	/* destroy: forgets a texture the game released, so that a new texture at the same address does not draw its replacement
+	*/
+	void destroy(HANDLE handle);
+
+	/* begin_scene: uploads replacement textures that finished loading; a few per scene so that a burst of loads does not stall one frame
+	   returns: the number of results taken from the loader
+	*/
+	size_t begin_scene();
+
+	/* swap_fieldmap: makes unlock look hashes up in another map from the next unlock on; render thread only
+	   returns: the map it replaced; no unlock is reading it once swap_fieldmap returns
+	*/
+	FieldMap* swap_fieldmap(FieldMap* fieldmap	// the new map
+		);
+
+	/* invalidate: drops the replacements that were made from changed hashmap entries or files, and the tiles and
+				   prefetched images they were made from; the game's next unlock of those textures loads them again.
+				   Only replacements requested with config.hot_reload are found by their files.
+	   returns: the number of cache entries dropped
+	*/
+	size_t invalidate(const std::unordered_set<uint64_t>& hashes,	// hashes whose fields changed
+					  const std::unordered_set<std::string>& files	// file_key of every replacement file that changed
+		);
+
+	/* pending: number of replacements still loading
+	*/
+	size_t pending() { return loader->pending(); }
+};
+
+#endif
@@ -0,0 +1,373 @@
+#include "rowkernels.h"
+#include <string.h>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define ROWKERNELS_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ROWKERNELS_AVX2_TARGET												// MSVC emits AVX2 intrinsics without /arch:AVX2
+#else
+#include <cpuid.h>
+#define ROWKERNELS_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#else
+#define ROWKERNELS_X86 0
+#endif
+
+/**********************************
+*
+*	Scalar
+*
+**********************************/
+
+static inline uint32_t swizzle_pixel(uint32_t pixel)
+{
+	return (pixel & 0xFF00FF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+}
+
+static void swizzle_scalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	for (size_t x = 0; x < count; x++)
+		dst[x] = swizzle_pixel(src[x]);
+}
+
+static void expand_swizzle_scalar(uint32_t* dst, size_t dst_count, const uint32_t* src, unsigned factor)
+{
+	for (size_t x = 0; x < dst_count; x++)
+		dst[x] = swizzle_pixel(src[x / factor]);
+}
+
+static void clear_scalar(uint32_t* dst, size_t count, uint32_t value)
+{
+	for (size_t x = 0; x < count; x++)
+		dst[x] = value;
+}
+
+static const RowKernels SCALAR_KERNELS = { "scalar", swizzle_scalar, expand_swizzle_scalar, clear_scalar };
+
+#if ROWKERNELS_X86
+
+/**********************************
+*
+*	SSE2
+*
+**********************************/
+
+static inline __m128i swizzle_sse2(__m128i v)
+{
+	const __m128i keep = _mm_set1_epi32((int)0xFF00FF00);
+	const __m128i low = _mm_set1_epi32(0xFF);
+	return _mm_or_si128(_mm_and_si128(v, keep),
+		   _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+}
+
+static void swizzle_sse2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	size_t x = 0;
+	for (; x + 8 <= count; x += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + x + 4));
+		_mm_storeu_si128((__m128i*)(dst + x), swizzle_sse2(a));
+		_mm_storeu_si128((__m128i*)(dst + x + 4), swizzle_sse2(b));
+	}
+	for (; x < count; x++)
+		dst[x] = swizzle_pixel(src[x]);
+}
+
+static void expand_swizzle_sse2(uint32_t* dst, size_t dst_count, const uint32_t* src, unsigned factor)
+{
+	size_t x = 0;
+	const uint32_t* s = src;
+	if (factor == 1) {
+		swizzle_sse2(dst, src, dst_count);
+		return;
+	} else if (factor == 2) {
+		for (; x + 8 <= dst_count; x += 8, s += 4) {
+			__m128i v = swizzle_sse2(_mm_loadu_si128((const __m128i*)s));
+			_mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi32(v, v));
+			_mm_storeu_si128((__m128i*)(dst + x + 4), _mm_unpackhi_epi32(v, v));
+		}
+	} else if (factor == 4) {
+		for (; x + 16 <= dst_count; x += 16, s += 4) {
+			__m128i v = swizzle_sse2(_mm_loadu_si128((const __m128i*)s));
+			_mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi32(v, 0x00));
+			_mm_storeu_si128((__m128i*)(dst + x + 4), _mm_shuffle_epi32(v, 0x55));
+			_mm_storeu_si128((__m128i*)(dst + x + 8), _mm_shuffle_epi32(v, 0xAA));
+			_mm_storeu_si128((__m128i*)(dst + x + 12), _mm_shuffle_epi32(v, 0xFF));
+		}
+	} else {																	// any other factor: splat one source pixel at a time
+		for (; x + factor <= dst_count; s++) {
+			__m128i v = _mm_set1_epi32((int)swizzle_pixel(*s));
+			size_t end = x + factor;
+			for (; x + 4 <= end; x += 4)
+				_mm_storeu_si128((__m128i*)(dst + x), v);
+			for (; x < end; x++)
+				dst[x] = swizzle_pixel(*s);
+		}
+	}
+	for (; x < dst_count; x++)
+		dst[x] = swizzle_pixel(src[x / factor]);
+}
+
+static void clear_sse2(uint32_t* dst, size_t count, uint32_t value)
+{
+	size_t x = 0;
+	__m128i v = _mm_set1_epi32((int)value);
+	for (; x + 8 <= count; x += 8) {
+		_mm_storeu_si128((__m128i*)(dst + x), v);
+		_mm_storeu_si128((__m128i*)(dst + x + 4), v);
+	}
+	for (; x < count; x++)
+		dst[x] = value;
+}
+
+static const RowKernels SSE2_KERNELS = { "sse2", swizzle_sse2, expand_swizzle_sse2, clear_sse2 };
+
+/**********************************
+*
+*	AVX2
+*
+**********************************/
+
+ROWKERNELS_AVX2_TARGET static inline __m256i swizzle_avx2(__m256i v)
+{
+	const __m256i order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+										   2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	return _mm256_shuffle_epi8(v, order);
+}
+
+ROWKERNELS_AVX2_TARGET static void swizzle_avx2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+	size_t x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + x + 8));
+		_mm256_storeu_si256((__m256i*)(dst + x), swizzle_avx2(a));
+		_mm256_storeu_si256((__m256i*)(dst + x + 8), swizzle_avx2(b));
+	}
+	for (; x < count; x++)
+		dst[x] = swizzle_pixel(src[x]);
+}
+
+ROWKERNELS_AVX2_TARGET static void expand_swizzle_avx2(uint32_t* dst, size_t dst_count, const uint32_t* src, unsigned factor)
+{
+	size_t x = 0;
+	const uint32_t* s = src;
+	if (factor == 1) {
+		swizzle_avx2(dst, src, dst_count);
+		return;
+	} else if (factor == 2) {
+		const __m256i lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+		const __m256i hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+		for (; x + 16 <= dst_count; x += 16, s += 8) {
+			__m256i v = swizzle_avx2(_mm256_loadu_si256((const __m256i*)s));
+			_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permutevar8x32_epi32(v, lo));
+			_mm256_storeu_si256((__m256i*)(dst + x + 8), _mm256_permutevar8x32_epi32(v, hi));
+		}
+	} else if (factor == 4) {
+		const __m256i p0 = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+		const __m256i p1 = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+		const __m256i p2 = _mm256_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5);
+		const __m256i p3 = _mm256_setr_epi32(6, 6, 6, 6, 7, 7, 7, 7);
+		for (; x + 32 <= dst_count; x += 32, s += 8) {
+			__m256i v = swizzle_avx2(_mm256_loadu_si256((const __m256i*)s));
+			_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permutevar8x32_epi32(v, p0));
+			_mm256_storeu_si256((__m256i*)(dst + x + 8), _mm256_permutevar8x32_epi32(v, p1));
+			_mm256_storeu_si256((__m256i*)(dst + x + 16), _mm256_permutevar8x32_epi32(v, p2));
+			_mm256_storeu_si256((__m256i*)(dst + x + 24), _mm256_permutevar8x32_epi32(v, p3));
+		}
+	} else {
+		expand_swizzle_sse2(dst, dst_count, src, factor);
+		return;
+	}
+	expand_swizzle_sse2(dst + x, dst_count - x, s, factor);					// x is a multiple of factor, so the tail starts on s
+}
+
+ROWKERNELS_AVX2_TARGET static void clear_avx2(uint32_t* dst, size_t count, uint32_t value)
+{
+	size_t x = 0;
+	__m256i v = _mm256_set1_epi32((int)value);
+	for (; x + 16 <= count; x += 16) {
+		_mm256_storeu_si256((__m256i*)(dst + x), v);
+		_mm256_storeu_si256((__m256i*)(dst + x + 8), v);
+	}
+	for (; x < count; x++)
+		dst[x] = value;
+}
+
+static const RowKernels AVX2_KERNELS = { "avx2", swizzle_avx2, expand_swizzle_avx2, clear_avx2 };
+
+/**********************************
+*
+*	Feature detection
+*
+**********************************/
+
+static void cpuid(int info[4], int leaf, int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(info, leaf, subleaf);
+#else
+	unsigned a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	info[0] = (int)a; info[1] = (int)b; info[2] = (int)c; info[3] = (int)d;
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static bool has_sse2()
+{
+	int info[4];
+	cpuid(info, 1, 0);
+	return (info[3] & (1 << 26)) != 0;
+}
+
+static bool has_avx2()
+{
+	int info[4];
+	cpuid(info, 0, 0);
+	if (info[0] < 7) return false;
+
+	cpuid(info, 1, 0);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (xgetbv0() & 0x6) != 0x6) return false;				// the OS must save the ymm registers
+
+	cpuid(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+}
+
+#endif // ROWKERNELS_X86
+
+const RowKernels* row_kernels_at(RowKernelLevel level)
+{
+	switch (level) {
+	case ROWKERNELS_SCALAR:
+		return &SCALAR_KERNELS;
+#if ROWKERNELS_X86
+	case ROWKERNELS_SSE2:
+		return has_sse2() ? &SSE2_KERNELS : NULL;
+	case ROWKERNELS_AVX2:
+		return has_avx2() ? &AVX2_KERNELS : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static std::atomic<const RowKernels*> active_kernels(NULL);
+
+const RowKernels& row_kernels()
+{
+	const RowKernels* kernels = active_kernels.load();
+	if (kernels == NULL) {
+		kernels = row_kernels_at(ROWKERNELS_AVX2);
+		if (kernels == NULL) kernels = row_kernels_at(ROWKERNELS_SSE2);
+		if (kernels == NULL) kernels = &SCALAR_KERNELS;
+		active_kernels.store(kernels);
+	}
+	return *kernels;
+}
+
+bool select_row_kernels(RowKernelLevel level)
+{
+	const RowKernels* kernels = row_kernels_at(level);
+	if (kernels == NULL) return false;
+	active_kernels.store(kernels);
+	return true;
+}
+
+/**********************************
+*
+*	Validation
+*
+**********************************/
+
+static inline uint32_t next_random(uint32_t& state)
+{
+	state ^= state << 13;														// xorshift32
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+bool check_row_kernels(const char** failure)
+{
+	const size_t MAX_LEN = 1100;
+	const size_t GUARD = 16;													// pixels past the end that must stay untouched
+	const uint32_t GUARD_VALUE = 0xDEADBEEF;
+	const size_t lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 255, 256, 257, 1024, 1031 };
+
+	uint32_t state = 0x12345678;
+	std::vector<uint32_t> src(MAX_LEN * 8 + 4);
+	for (size_t i = 0; i < src.size(); i++) src[i] = next_random(state);
+
+	std::vector<uint32_t> expected(MAX_LEN * 8 + GUARD + 4), actual(expected.size());
+
+	for (int level = ROWKERNELS_SSE2; level <= ROWKERNELS_AVX2; level++) {
+		const RowKernels* kernels = row_kernels_at((RowKernelLevel)level);
+		if (kernels == NULL) continue;
+
+		for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+			size_t len = lengths[l];
+			for (size_t offset = 0; offset < 4; offset++) {						// unaligned starts
+				const uint32_t* s = &src[offset];
+				uint32_t* e = &expected[offset];
+				uint32_t* a = &actual[offset];
+
+				// swizzle
+				std::fill(expected.begin(), expected.end(), GUARD_VALUE);
+				std::fill(actual.begin(), actual.end(), GUARD_VALUE);
+				swizzle_scalar(e, s, len);
+				kernels->swizzle(a, s, len);
+				if (expected != actual) {
+					if (failure) *failure = kernels->name;
+					return false;
+				}
+
+				// clear
+				std::fill(expected.begin(), expected.end(), GUARD_VALUE);
+				std::fill(actual.begin(), actual.end(), GUARD_VALUE);
+				uint32_t value = next_random(state);
+				clear_scalar(e, len, value);
+				kernels->clear(a, len, value);
+				if (expected != actual) {
+					if (failure) *failure = kernels->name;
+					return false;
+				}
+
+				// expand_swizzle, including destination lengths that end mid-pixel
+				for (unsigned factor = 1; factor <= 8; factor++) {
+					size_t dst_lens[] = { len * factor, len * factor > 0 ? len * factor - 1 : 0, len * factor / 2 };
+					for (size_t d = 0; d < 3; d++) {
+						std::fill(expected.begin(), expected.end(), GUARD_VALUE);
+						std::fill(actual.begin(), actual.end(), GUARD_VALUE);
+						expand_swizzle_scalar(e, dst_lens[d], s, factor);
+						kernels->expand_swizzle(a, dst_lens[d], s, factor);
+						if (expected != actual) {
+							if (failure) *failure = kernels->name;
+							return false;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
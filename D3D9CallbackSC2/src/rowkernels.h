@@ -0,0 +1,61 @@
+#ifndef _ROWKERNELS_H
+#define _ROWKERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	Row kernels for composing replacement textures
+
+	Pixels are 32-bit. "Swizzle" swaps bytes 0 and 2 of every pixel, which turns r, g, b, a (RGBColor, PNG order)
+	into b, g, r, a (D3DFMT_A8R8G8B8) and back. Every implementation writes exactly what the scalar one writes.
+
+	row_kernels() picks the widest implementation the CPU supports (AVX2, SSE2, or scalar) on first use.
+*/
+
+struct RowKernels
+{
+	const char* name;
+
+	/* swizzle: dst[x] = swizzle(src[x]) for x < count; dst and src must not overlap
+	*/
+	void (*swizzle)(uint32_t* dst, const uint32_t* src, size_t count);
+
+	/* expand_swizzle: nearest-neighbour horizontal upscale by an integer factor,
+					   dst[x] = swizzle(src[x / factor]) for x < dst_count; dst_count <= src_count * factor
+	*/
+	void (*expand_swizzle)(uint32_t* dst, size_t dst_count, const uint32_t* src, unsigned factor);
+
+	/* clear: dst[x] = value for x < count
+	*/
+	void (*clear)(uint32_t* dst, size_t count, uint32_t value);
+};
+
+enum RowKernelLevel
+{
+	ROWKERNELS_SCALAR = 0,
+	ROWKERNELS_SSE2,
+	ROWKERNELS_AVX2,
+};
+
+/* row_kernels: the kernels compose_replacement uses
+*/
+const RowKernels& row_kernels();
+
+/* row_kernels_at: a specific implementation
+   returns: the kernels of that level, or NULL if the CPU does not support it
+*/
+const RowKernels* row_kernels_at(RowKernelLevel level);
+
+/* select_row_kernels: overrides the automatic choice (e.g. to fall back to scalar)
+   returns: true if the level is supported and now in use, else false
+*/
+bool select_row_kernels(RowKernelLevel level);
+
+/* check_row_kernels: runs every supported implementation against the scalar one on random rows of many lengths,
+					  factors, values, and alignments
+   returns: true if all outputs are bit-exact, else false (and failure names the first kernel that differed)
+*/
+bool check_row_kernels(const char** failure = NULL);
+
+#endif
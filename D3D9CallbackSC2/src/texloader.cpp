@@ -0,0 +1,432 @@
+#include "texloader.h"
+#include "diskcache.h"
+#include "rowkernels.h"
+#include "tilecache.h"
+#include "instrument.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+using namespace std;
+
+void* SoftwareTextureDevice::create_texture(const StagingImage& image)
+{
+	StagingImage* texture = new StagingImage(image);
+	created++;
+	bytes += texture->pixels.size() * sizeof(uint32_t);
+	return texture;
+}
+
+void SoftwareTextureDevice::release_texture(void* texture)
+{
+	StagingImage* image = (StagingImage*)texture;
+	if (image == NULL) return;
+	released++;
+	bytes -= image->pixels.size() * sizeof(uint32_t);
+	delete image;
+}
+
+StagingTier::StagingTier(size_t budget) : budget(budget)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool StagingTier::put(const string& path, unsigned batch, DecodedImage& image)
+{
+	size_t image_bytes = image.pixels.size() * sizeof(uint32_t);
+
+	lock_guard<mutex> lock(tier_mutex);
+	if (index.count(path) > 0) return true;
+
+	// make room from older batches only
+	while (stats.bytes + image_bytes > budget && !entries.empty() && entries.front().batch != batch) {
+		stats.bytes -= entries.front().image.pixels.size() * sizeof(uint32_t);
+		stats.wasted++;
+		index.erase(entries.front().path);
+		entries.pop_front();
+	}
+	if (stats.bytes + image_bytes > budget) {
+		stats.skipped++;
+		return false;
+	}
+
+	entry_t entry;
+	entry.path = path;
+	entry.batch = batch;
+	entry.image = move(image);
+	entries.push_back(move(entry));
+	index[path] = --entries.end();
+	stats.bytes += image_bytes;
+	stats.decoded++;
+	return true;
+}
+
+bool StagingTier::take(const string& path, DecodedImage& image)
+{
+	lock_guard<mutex> lock(tier_mutex);
+	unordered_map<string, entry_iter>::iterator iter = index.find(path);
+	if (iter == index.end()) return false;
+
+	stats.bytes -= iter->second->image.pixels.size() * sizeof(uint32_t);
+	stats.hits++;
+	image = move(iter->second->image);
+	entries.erase(iter->second);
+	index.erase(iter);
+	return true;
+}
+
+bool StagingTier::contains(const string& path)
+{
+	lock_guard<mutex> lock(tier_mutex);
+	return index.count(path) > 0;
+}
+
+void StagingTier::clear()
+{
+	lock_guard<mutex> lock(tier_mutex);
+	stats.wasted += entries.size();
+	stats.bytes = 0;
+	entries.clear();
+	index.clear();
+}
+
+void StagingTier::count(size_t folders, size_t skipped)
+{
+	lock_guard<mutex> lock(tier_mutex);
+	stats.folders += folders;
+	stats.skipped += skipped;
+}
+
+PrefetchStats StagingTier::get_stats()
+{
+	lock_guard<mutex> lock(tier_mutex);
+	return stats;
+}
+
+// RGBColor(b, g, r, a) of a pixel read as r, g, b, a
+static inline uint32_t swap_rb(uint32_t pixel)
+{
+	return (pixel & 0xFF00FF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+}
+
+// upscales columns x0 to x1 of one row of the replaced texture into the replacement
+static void upscale_row(const LoadRequest& request, int y, uint32_t* CurRow, int x0, int x1)
+{
+	int old_y = (int)request.replaced_height - 1 - (int)(y / request.resize_factor);
+	if (old_y < 0) return;
+	const uint32_t* OldRow = &request.replaced[(size_t)old_y * request.replaced_width];
+
+	unsigned factor = (unsigned)request.resize_factor;
+	if (factor >= 1 && (float)factor == request.resize_factor) {					// integer factor: old_x = x / factor exactly
+		int end = min(x1, (int)(request.replaced_width * factor));
+		if (end > x0) row_kernels().expand_swizzle(CurRow + x0, end - x0, OldRow + x0 / factor, factor);	// x0 is a tile edge, a multiple of factor
+		return;
+	}
+	for (int x = x0; x < x1; x++) {
+		int old_x = (int)(x / request.resize_factor);
+		if (old_x < (int)request.replaced_width) CurRow[x] = swap_rb(OldRow[old_x]);
+	}
+}
+
+// takes a prefetched image if there is one, else decodes the file
+static inline bool load_image(const string& path, DecodeFunc decode, StagingTier* tier, DecodedImage& image)
+{
+	if (tier != NULL && tier->take(path, image)) return true;
+	StageTimer timer(STAGE_DECODE);
+	return decode(path, image);
+}
+
+void add_half_tiles(LoadRequest& request, uint32_t half, uint64_t hash_upper, const string& path_upper, uint64_t hash_lower, const string& path_lower)
+{
+	TileSource upper = { hash_upper, path_upper, 0, 0, request.replaced_width, min(half, request.replaced_height), 0, 0 };
+	request.tiles.push_back(upper);
+	if (request.replaced_height > half) {
+		TileSource lower = { hash_lower, path_lower, 0, half, request.replaced_width, request.replaced_height - half, 0, half };
+		request.tiles.push_back(lower);
+	}
+}
+
+void add_grid_tiles(LoadRequest& request, uint32_t tile_width, uint32_t tile_height, uint32_t page_height, const vector<uint64_t>& hashes, const vector<string>& paths)
+{
+	size_t i = 0;
+	for (uint32_t y = 0; y < request.replaced_height; y += tile_height)
+		for (uint32_t x = 0; x < request.replaced_width; x += tile_width, i++) {
+			TileSource tile = { i < hashes.size() ? hashes[i] : 0, i < paths.size() ? paths[i] : string(), x, y,
+								min(tile_width, request.replaced_width - x), min(tile_height, request.replaced_height - y), 0, y % page_height };
+			request.tiles.push_back(tile);
+		}
+}
+
+// copies the part of a tile file that covers the tile: the tile's rectangle in its page if the file is a whole replacement page, else its top left
+static void blit_tile(const DecodedImage& bmp, StagingImage& image, int x0, int y0, int x1, int y1, int page_x, int page_y)
+{
+	const RowKernels& kernels = row_kernels();
+	int offset_x = ((int)bmp.width >= page_x + x1 - x0) ? page_x : 0;
+	int offset_y = ((int)bmp.height >= page_y + y1 - y0) ? page_y : 0;
+	int count = min(x1 - x0, (int)bmp.width - offset_x);
+	if (count <= 0) return;
+
+	for (int y = y0; y < y1; y++) {
+		int row = offset_y + (y1 - 1 - y);												// the file is decoded bottom-up: its rows run as the in-game rows do
+		if (row >= (int)bmp.height) continue;											// respect texture sizes
+		const uint32_t* BmpRow = &bmp.pixels[(size_t)row * bmp.width + offset_x];
+		kernels.swizzle(&image.pixels[(size_t)y * image.width + x0], BmpRow, count);
+	}
+}
+
+bool compose_replacement(const LoadRequest& request, DecodeFunc decode, StagingImage& image, StagingTier* tier, bool* exact, TileCache* tile_cache)
+{
+	bool use_combined = !request.path_combined.empty();
+	DecodedImage bmp_combined;
+
+	// load the replacement bitmap
+	if (use_combined && !load_image(request.path_combined, decode, tier, bmp_combined)) return false;	// file could not be loaded, so no texture can be created
+
+	int replacement_width = int(request.resize_factor * (float)request.replaced_width);
+	int replacement_height = int(request.resize_factor * (float)request.replaced_height);
+	if (replacement_width <= 0 || replacement_height <= 0) return false;
+
+	const RowKernels& kernels = row_kernels();
+	size_t pixels = (size_t)replacement_width * replacement_height;
+	bool fresh = image.pixels.empty();
+	image.width = replacement_width;
+	image.height = replacement_height;
+	image.pixels.resize(pixels);														// a new image is zero-filled as it is allocated
+	if (!fresh) kernels.clear(&image.pixels[0], pixels, 0);							// a reused one (a disk cache read that failed) still holds old pixels
+
+	if (use_combined) {
+		for (int y = 0; y < replacement_height; y++) {
+			int row = replacement_height - y - 1;										// must flip image
+			if (row >= (int)bmp_combined.height) continue;								// respect texture sizes
+			const uint32_t* BmpRow = &bmp_combined.pixels[(size_t)row * bmp_combined.width];
+			kernels.swizzle(&image.pixels[(size_t)y * replacement_width], BmpRow, min((size_t)replacement_width, (size_t)bmp_combined.width));
+		}
+		if (exact) *exact = true;
+		return true;
+	}
+
+	// compose tile by tile; the replacement is upside down, so the upper tile of a page is at the bottom
+	bool have_replaced = request.replaced.size() >= (size_t)request.replaced_width * request.replaced_height;
+	bool any = false, all = true;
+	for (size_t i = 0; i < request.tiles.size(); i++) {
+		const TileSource& tile = request.tiles[i];
+		int x0 = int(request.resize_factor * (float)tile.x);
+		int x1 = min(replacement_width, int(request.resize_factor * (float)(tile.x + tile.width)));
+		int y0 = max(0, replacement_height - int(request.resize_factor * (float)(tile.y + tile.height)));
+		int y1 = max(0, replacement_height - int(request.resize_factor * (float)tile.y));
+		if (x1 <= x0 || y1 <= y0) continue;
+		uint32_t* TileStart = &image.pixels[(size_t)y0 * replacement_width + x0];
+
+		if (tile_cache && tile.hash && tile_cache->get(tile.hash, x1 - x0, y1 - y0, TileStart, replacement_width)) {	// composed before: no decode
+			any = true;
+			continue;
+		}
+
+		DecodedImage bmp;
+		if (!tile.path.empty() && load_image(tile.path, decode, tier, bmp)) {
+			blit_tile(bmp, image, x0, y0, x1, y1, int(request.resize_factor * (float)tile.page_x), int(request.resize_factor * (float)tile.page_y));
+			if (tile_cache && tile.hash) tile_cache->put(tile.hash, x1 - x0, y1 - y0, TileStart, replacement_width);
+			any = true;
+		} else {
+			all = false;
+			for (int y = y0; y < y1; y++) {
+				if (have_replaced)															// use upscaled pixels from the replaced texture
+					upscale_row(request, y, &image.pixels[(size_t)y * replacement_width], x0, x1);
+				else																		// nothing to fill it with: transparent
+					kernels.clear(&image.pixels[(size_t)y * replacement_width + x0], x1 - x0, 0);
+			}
+		}
+	}
+	if (!any) return false;																// no tile has a replacement, so no texture can be created
+	if (exact) *exact = all;
+
+	return true;
+}
+
+TextureLoader::TextureLoader(TextureDevice* device, DecodeFunc decode, unsigned threads, size_t prefetch_budget, DiskCache* disk_cache, TileCache* tile_cache)
+	: device(device), decode(decode), disk_cache(disk_cache), tile_cache(tile_cache), batch(0), tier(prefetch_budget), busy(0), stopping(false), in_flight(0)
+{
+	if (threads == 0) threads = 1;
+	for (unsigned i = 0; i < threads; i++)
+		workers.push_back(thread(&TextureLoader::work, this));
+}
+
+TextureLoader::~TextureLoader()
+{
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_cv.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+	// nothing will upload what is still staged, so there is nothing to release either
+}
+
+void TextureLoader::work()
+{
+	for (;;) {
+		LoadRequest request;
+		prefetch_t file, folder;
+		{
+			unique_lock<mutex> lock(queue_mutex);
+			queue_cv.wait(lock, [this] { return stopping || !requests.empty() || !prefetch_files.empty() || !prefetch_folders.empty(); });
+			if (stopping) return;
+			if (!requests.empty()) {														// loads that were asked for always go first
+				request = move(requests.front());
+				requests.pop_front();
+			} else if (!prefetch_files.empty()) {
+				file = move(prefetch_files.front());
+				prefetch_files.pop_front();
+			} else {
+				folder = move(prefetch_folders.front());
+				prefetch_folders.pop_front();
+			}
+			busy++;
+		}
+
+		if (!folder.first.empty()) {
+			expand_folder(folder);
+		} else if (!file.first.empty()) {
+			prefetch_file(file);
+		} else {
+			staged_t result;
+			result.hash = request.hash;
+			result.generation = request.generation;
+			StageTimer timer(STAGE_LOAD);
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			bool exact = false;
+			bool loaded = disk_cache && disk_cache->load(request, result.image);		// composed on an earlier run
+			if (!loaded && (loaded = compose_replacement(request, decode, result.image, &tier, &exact, tile_cache)) && disk_cache && exact)
+				disk_cache->store(request, result.image);
+			if (!loaded)
+				result.image = StagingImage();											// report the failure with an empty image
+			result.cost = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			timer.stop();
+
+			lock_guard<mutex> lock(staged_mutex);
+			staged.push_back(move(result));
+		}
+
+		{
+			lock_guard<mutex> lock(queue_mutex);
+			if (folder.first.empty() && file.first.empty()) forget_paths(request);
+			busy--;
+			if (busy == 0 && requests.empty() && prefetch_files.empty() && prefetch_folders.empty()) idle_cv.notify_all();
+		}
+	}
+}
+
+void TextureLoader::expand_folder(const prefetch_t& folder)
+{
+	namespace fs = boost::filesystem;
+
+	vector<string> files;
+	boost::system::error_code ec;
+	fs::directory_iterator end_it;
+	for (fs::directory_iterator it(folder.first, ec); !ec && it != end_it; it.increment(ec))
+		if (fs::is_regular_file(it->status()) && boost::iequals(it->path().extension().string(), ".png"))
+			files.push_back(it->path().string());
+	sort(files.begin(), files.end());													// <field>_0, <field>_1, ... in the order they are likely needed
+
+	lock_guard<mutex> lock(queue_mutex);
+	if (folder.second != batch) return;													// a newer folder was queued meanwhile
+	for (size_t i = 0; i < files.size(); i++)
+		prefetch_files.push_back(prefetch_t(files[i], folder.second));
+	queue_cv.notify_all();
+}
+
+void TextureLoader::forget_paths(const LoadRequest& request)
+{
+	vector<const string*> paths(1, &request.path_combined);
+	for (size_t i = 0; i < request.tiles.size(); i++) paths.push_back(&request.tiles[i].path);
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (paths[i]->empty()) continue;
+		unordered_multiset<string>::iterator iter = requested_paths.find(*paths[i]);
+		if (iter != requested_paths.end()) requested_paths.erase(iter);
+	}
+}
+
+void TextureLoader::prefetch_file(const prefetch_t& file)
+{
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		if (requested_paths.count(file.first) > 0) return;								// a load is decoding it already
+	}
+	if (tier.contains(file.first)) return;
+	if (disk_cache && disk_cache->contains(file.first)) return;						// a load of it will not need the decode
+
+	DecodedImage image;
+	StageTimer timer(STAGE_DECODE);
+	if (!decode(file.first, image)) return;
+	timer.stop();
+
+	if (!tier.put(file.first, file.second, image)) {									// budget is full: stop prefetching this folder
+		lock_guard<mutex> lock(queue_mutex);
+		size_t before = prefetch_files.size();
+		prefetch_files.erase(remove_if(prefetch_files.begin(), prefetch_files.end(),
+			[&file](const prefetch_t& queued) { return queued.second == file.second; }), prefetch_files.end());
+		tier.count(0, before - prefetch_files.size());
+	}
+}
+
+void TextureLoader::prefetch(const string& folder)
+{
+	if (!tier.enabled()) return;
+
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		batch++;
+		prefetch_files.clear();															// the new folder replaces whatever is left of the old one
+		prefetch_folders.clear();
+		prefetch_folders.push_back(prefetch_t(folder, batch));
+	}
+	tier.count(1, 0);
+	queue_cv.notify_one();
+}
+
+void TextureLoader::request(LoadRequest& request)
+{
+	in_flight++;
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		if (!request.path_combined.empty()) requested_paths.insert(request.path_combined);
+		for (size_t i = 0; i < request.tiles.size(); i++)
+			if (!request.tiles[i].path.empty()) requested_paths.insert(request.tiles[i].path);
+		requests.push_back(move(request));
+	}
+	queue_cv.notify_one();
+}
+
+size_t TextureLoader::upload(size_t max_uploads, vector<LoadResult>& results)
+{
+	size_t uploaded = 0;
+	while (uploaded < max_uploads) {
+		staged_t item;
+		{
+			lock_guard<mutex> lock(staged_mutex);										// hold the lock only to pop; the upload happens outside it
+			if (staged.empty()) break;
+			item = move(staged.front());
+			staged.pop_front();
+		}
+
+		LoadResult result;
+		result.hash = item.hash;
+		result.texture = item.image.pixels.empty() ? NULL : device->create_texture(item.image);
+		result.bytes = result.texture ? device->texture_bytes(result.texture) : 0;
+		result.cost = item.cost;
+		result.generation = item.generation;
+		results.push_back(result);
+		in_flight--;
+		uploaded++;
+	}
+	return uploaded;
+}
+
+void TextureLoader::wait_idle()
+{
+	unique_lock<mutex> lock(queue_mutex);
+	idle_cv.wait(lock, [this] { return busy == 0 && requests.empty() && prefetch_files.empty() && prefetch_folders.empty(); });
+}
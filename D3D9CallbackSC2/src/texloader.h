@@ -0,0 +1,344 @@
+#ifndef _TEXLOADER_H
+#define _TEXLOADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/*
+	Replacement texture loader
+
+	Worker threads read and decode replacement PNGs and compose them into staging images laid out exactly like the
+	locked rect of the replacement texture. The render thread only creates textures from finished staging images
+	(see TextureLoader::upload), so a field transition no longer stalls the frame on file I/O and decoding.
+
+	Nothing here includes windows.h or d3d9: textures are created through a TextureDevice, and images are decoded
+	through a DecodeFunc, so the pipeline runs headless with SoftwareTextureDevice.
+*/
+
+// a decoded PNG: memory order r, g, b, a per pixel, rows bottom-up as Bitmap::LoadPNG leaves them
+struct DecodedImage
+{
+	uint32_t				width;
+	uint32_t				height;
+	std::vector<uint32_t>	pixels;
+
+	DecodedImage() : width(0), height(0) {}
+};
+
+/* DecodeFunc: decodes an image file; called from worker threads, so it must not touch shared state
+   returns: true if the image was decoded, else false
+*/
+typedef bool (*DecodeFunc)(const std::string& path, DecodedImage& image);
+
+// replacement pixels ready for upload: D3DFMT_A8R8G8B8 (memory order b, g, r, a), rows top-down, pitch = width * 4
+struct StagingImage
+{
+	uint32_t				width;
+	uint32_t				height;
+	std::vector<uint32_t>	pixels;
+
+	StagingImage() : width(0), height(0) {}
+};
+
+// creates and releases replacement textures; only ever called from the render thread
+class TextureDevice
+{
+public:
+	virtual ~TextureDevice() {}
+
+	/* create_texture: creates a texture the size of image and copies image into it
+	   returns: the texture handle, or NULL on failure
+	*/
+	virtual void* create_texture(const StagingImage& image	// pixels to upload
+		) = 0;
+
+	/* release_texture: releases a texture made by create_texture
+	*/
+	virtual void release_texture(void* texture	// handle from create_texture
+		) = 0;
+
+	/* texture_bytes: memory a texture made by create_texture holds, mip levels included
+	*/
+	virtual size_t texture_bytes(void* texture	// handle from create_texture
+		) = 0;
+};
+
+/* mip_chain_bytes: memory of a 32-bit texture with every mip level down to 1x1, as D3DUSAGE_AUTOGENMIPMAP creates it
+*/
+inline size_t mip_chain_bytes(uint32_t width, uint32_t height)
+{
+	size_t bytes = 0;
+	for (;;) {
+		bytes += (size_t)width * height * sizeof(uint32_t);
+		if (width <= 1 && height <= 1) return bytes;
+		width = (width > 1) ? width / 2 : 1;
+		height = (height > 1) ? height / 2 : 1;
+	}
+}
+
+// keeps textures in system memory; stands in for the d3d9 device when there is no device
+class SoftwareTextureDevice : public TextureDevice
+{
+private:
+	size_t	created;
+	size_t	released;
+	size_t	bytes;																	// bytes held by live textures
+
+public:
+	SoftwareTextureDevice() : created(0), released(0), bytes(0) {}
+
+	void* create_texture(const StagingImage& image);
+	void release_texture(void* texture);
+	size_t texture_bytes(void* texture) { return texture ? ((const StagingImage*)texture)->pixels.size() * sizeof(uint32_t) : 0; }
+
+	size_t textures_created() const { return created; }
+	size_t textures_released() const { return released; }
+	size_t bytes_live() const { return bytes; }
+
+	/* pixels: reads back a texture made by this device
+	*/
+	static const StagingImage* pixels(void* texture) { return (const StagingImage*)texture; }
+};
+
+// one tile of a replacement composed from parts: a rectangle of the in-game texture (rows top-down, as it is hashed)
+struct TileSource
+{
+	uint64_t		hash;				// TileCache key; 0 if the tile is not to be cached
+	std::string		path;				// replacement file for the tile; if empty, the tile comes from the TileCache or the in-game texture
+	uint32_t		x;					// rectangle in in-game pixels
+	uint32_t		y;
+	uint32_t		width;
+	uint32_t		height;
+	uint32_t		page_x;				// where the rectangle is in the page its file replaces, in in-game pixels
+	uint32_t		page_y;
+};
+
+// everything a worker needs to build one replacement texture
+struct LoadRequest
+{
+	uint64_t				hash;				// cache key the replacement is stored under
+	std::string				path_combined;		// replacement for the whole texture; if empty, tiles are used
+	std::vector<TileSource>	tiles;				// parts of the texture that have a replacement, or may have one in the TileCache
+	uint32_t				replaced_width;		// size of the in-game texture
+	uint32_t				replaced_height;
+	float					resize_factor;		// replacement size = replaced size * resize_factor
+	std::vector<uint32_t>	replaced;			// in-game pixels (pitch = replaced_width); fills a tile that has no replacement
+	unsigned				generation;			// passed through to the LoadResult, so the caller can tell a load it superseded
+
+	LoadRequest() : hash(0), replaced_width(0), replaced_height(0), resize_factor(1.0f), generation(0) {}
+};
+
+/* add_half_tiles: cuts a texture into the upper and lower tiles the combined hashes are taken of
+*/
+void add_half_tiles(LoadRequest& request,			// replaced_height must be set
+					uint32_t half,					// rows in the upper tile (VRAM_DIM / 2)
+					uint64_t hash_upper,			// hashes of the tiles
+					const std::string& path_upper,	// replacement files of the tiles; empty if there is none
+					uint64_t hash_lower,
+					const std::string& path_lower
+	);
+
+/* add_grid_tiles: cuts a texture into a grid of tiles, for pages wider or taller than the upper/lower layout
+*/
+void add_grid_tiles(LoadRequest& request,						// replaced_width and replaced_height must be set
+					uint32_t tile_width,						// size of a tile; the last column and row may be smaller
+					uint32_t tile_height,
+					uint32_t page_height,						// rows of the page a tile file replaces (a multiple of tile_height)
+					const std::vector<uint64_t>& hashes,		// hash of each tile, row by row; 0 for a tile not to be cached
+					const std::vector<std::string>& paths		// replacement file of each tile, row by row; empty if there is none
+	);
+
+struct LoadResult
+{
+	uint64_t	hash;
+	void*		texture;						// NULL if the replacement could not be loaded
+	size_t		bytes;							// TextureDevice::texture_bytes of texture
+	double		cost;							// seconds a worker spent loading the replacement (decoding, composing, or reading the disk cache)
+	unsigned	generation;						// LoadRequest::generation
+};
+
+class DiskCache;
+class TileCache;
+
+struct PrefetchStats
+{
+	size_t	folders;		// field folders queued for prefetch
+	size_t	decoded;		// files decoded ahead of time
+	size_t	hits;			// prefetched files later used by a load
+	size_t	wasted;			// prefetched files dropped before they were used
+	size_t	skipped;		// files not prefetched because the budget was full
+	size_t	bytes;			// bytes held by the staging tier
+};
+
+/*
+	StagingTier: decoded replacement files that were prefetched but not asked for yet, keyed by path
+
+	The tier never holds more than its byte budget. Making room evicts files of older prefetch batches first (oldest
+	first); a batch never evicts its own files, so the budget caps how deep one folder is prefetched.
+*/
+class StagingTier
+{
+private:
+	struct entry_t
+	{
+		std::string		path;
+		unsigned		batch;
+		DecodedImage	image;
+	};
+	typedef std::list<entry_t>::iterator entry_iter;
+
+	std::mutex									tier_mutex;
+	std::list<entry_t>							entries;						// oldest first
+	std::unordered_map<std::string, entry_iter>	index;
+	size_t										budget;
+	PrefetchStats								stats;
+
+public:
+	StagingTier(size_t budget	// most bytes of decoded pixels to hold
+		);
+
+	/* put: stores a prefetched image, evicting files of older batches to make room
+	   returns: true if the image was stored, else false (it did not fit; the batch should stop)
+	*/
+	bool put(const std::string& path,	// source file
+			 unsigned batch,			// prefetch batch the file belongs to
+			 DecodedImage& image		// moved into the tier
+		);
+
+	/* take: removes a prefetched image from the tier
+	   returns: true if path was in the tier, else false
+	*/
+	bool take(const std::string& path,	// source file
+			  DecodedImage& image		// receives the image
+		);
+
+	bool contains(const std::string& path);
+
+	/* clear: drops every prefetched image, because the files they were decoded from changed
+	*/
+	void clear();
+
+	bool enabled() const { return budget > 0; }
+
+	/* count: adds to the counters kept with the tier
+	*/
+	void count(size_t folders, size_t skipped);
+
+	PrefetchStats get_stats();
+};
+
+/* compose_replacement: decodes the files of a request and lays them out as the replacement texture
+   returns: true if at least one replacement file was decoded, else false
+*/
+bool compose_replacement(const LoadRequest& request,	// what to load
+						 DecodeFunc decode,				// image decoder
+						 StagingImage& image,			// the replacement pixels
+						 StagingTier* tier = NULL,		// prefetched images to use before decoding
+						 bool* exact = NULL,			// set to false if part of the image was filled from the in-game texture
+						 TileCache* tile_cache = NULL	// composed tiles to copy before decoding, and to store decoded tiles in
+	);
+
+class TextureLoader
+{
+private:
+	struct staged_t
+	{
+		uint64_t		hash;
+		StagingImage	image;															// empty if the load failed
+		double			cost;															// seconds the load took
+		unsigned		generation;														// of the request
+	};
+	typedef std::pair<std::string, unsigned> prefetch_t;						// file or folder, and its prefetch batch
+
+	TextureDevice*				device;
+	DecodeFunc					decode;
+	DiskCache*					disk_cache;
+	TileCache*					tile_cache;
+	std::vector<std::thread>	workers;
+
+	std::mutex					queue_mutex;
+	std::condition_variable		queue_cv;
+	std::condition_variable		idle_cv;
+	std::deque<LoadRequest>		requests;
+	std::deque<prefetch_t>		prefetch_folders;								// worked on only when there are no requests
+	std::deque<prefetch_t>		prefetch_files;
+	std::unordered_multiset<std::string>	requested_paths;					// files of queued and running requests; never prefetched
+	unsigned					batch;
+	StagingTier					tier;
+	size_t						busy;											// work taken by a worker but not yet finished
+	bool						stopping;
+
+	std::mutex					staged_mutex;
+	std::deque<staged_t>		staged;
+
+	std::atomic<size_t>			in_flight;										// requested but not yet uploaded
+
+	void work();
+
+	/* expand_folder: queues the image files of a prefetch folder
+	*/
+	void expand_folder(const prefetch_t& folder);
+
+	/* forget_paths: removes the files of a finished request from requested_paths
+	   PRECONDITION: queue_mutex is held
+	*/
+	void forget_paths(const LoadRequest& request);
+
+	/* prefetch_file: decodes one queued file into the staging tier
+	*/
+	void prefetch_file(const prefetch_t& file);
+
+public:
+	TextureLoader(TextureDevice* device,		// creates the textures; must outlive the loader
+				  DecodeFunc decode,			// decodes replacement files on the worker threads
+				  unsigned threads,				// number of worker threads (at least one is started)
+				  size_t prefetch_budget = 0,	// bytes of prefetched images to hold; 0 disables prefetch
+				  DiskCache* disk_cache = NULL,	// composed replacements kept across runs; must outlive the loader
+				  TileCache* tile_cache = NULL	// composed tiles of replacements; must outlive the loader
+		);
+	~TextureLoader();
+
+	/* request: queues a replacement to be loaded in the background
+	*/
+	void request(LoadRequest& request	// moved into the queue
+		);
+
+	/* upload: creates textures for staged replacements; render thread only
+	   returns: the number of results appended
+	*/
+	size_t upload(size_t max_uploads,				// most textures to create in this call, so a burst is spread over frames
+				  std::vector<LoadResult>& results	// finished loads; failed loads are reported with a NULL texture
+		);
+
+	/* prefetch: decodes every image in a folder ahead of time, as far as the prefetch budget allows;
+				 a newer folder takes priority over the rest of an older one
+	*/
+	void prefetch(const std::string& folder	// folder of replacement files
+		);
+
+	PrefetchStats prefetch_stats() { return tier.get_stats(); }
+
+	/* discard_prefetched: drops the images prefetched so far, because replacement files changed under them
+	*/
+	void discard_prefetched() { tier.clear(); }
+
+	/* pending: number of requests that have not been uploaded yet
+	*/
+	size_t pending() const { return in_flight; }
+
+	/* wait_idle: blocks until every queued request has been staged and every queued prefetch has finished
+	*/
+	void wait_idle();
+};
+
+#endif
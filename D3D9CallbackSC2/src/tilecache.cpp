@@ -0,0 +1,83 @@
+#include "tilecache.h"
+#include <string.h>
+
+using namespace std;
+
+TileCache::TileCache(size_t budget) : budget(budget)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool TileCache::get(uint64_t hash, uint32_t width, uint32_t height, uint32_t* dest, size_t dest_pitch)
+{
+	lock_guard<mutex> lock(cache_mutex);
+	unordered_map<uint64_t, entry_iter>::iterator iter = index.find(hash);
+	if (iter == index.end() || iter->second->width != width || iter->second->height != height) {	// another RESIZE_FACTOR, or a tile cut differently
+		stats.misses++;
+		return false;
+	}
+
+	entries.splice(entries.begin(), entries, iter->second);
+	const uint32_t* src = iter->second->pixels.empty() ? NULL : &iter->second->pixels[0];
+	for (uint32_t y = 0; y < height; y++)
+		memcpy(dest + y * dest_pitch, src + (size_t)y * width, width * sizeof(uint32_t));
+	stats.hits++;
+	return true;
+}
+
+void TileCache::put(uint64_t hash, uint32_t width, uint32_t height, const uint32_t* src, size_t src_pitch)
+{
+	size_t tile_bytes = (size_t)width * height * sizeof(uint32_t);
+	if (tile_bytes == 0 || tile_bytes > budget) return;
+
+	entry_t entry;
+	entry.hash = hash;
+	entry.width = width;
+	entry.height = height;
+	entry.pixels.resize((size_t)width * height);
+	for (uint32_t y = 0; y < height; y++)
+		memcpy(&entry.pixels[(size_t)y * width], src + y * src_pitch, width * sizeof(uint32_t));
+
+	lock_guard<mutex> lock(cache_mutex);
+	unordered_map<uint64_t, entry_iter>::iterator iter = index.find(hash);
+	if (iter != index.end()) {															// another thread composed it meanwhile, or at another size
+		stats.bytes -= iter->second->pixels.size() * sizeof(uint32_t);
+		entries.erase(iter->second);
+		index.erase(iter);
+	}
+
+	while (stats.bytes + tile_bytes > budget && !entries.empty()) {
+		stats.bytes -= entries.back().pixels.size() * sizeof(uint32_t);
+		stats.evictions++;
+		index.erase(entries.back().hash);
+		entries.pop_back();
+	}
+
+	entries.push_front(move(entry));
+	index[hash] = entries.begin();
+	stats.bytes += tile_bytes;
+	stats.stores++;
+}
+
+bool TileCache::erase(uint64_t hash)
+{
+	lock_guard<mutex> lock(cache_mutex);
+	unordered_map<uint64_t, entry_iter>::iterator iter = index.find(hash);
+	if (iter == index.end()) return false;
+	stats.bytes -= iter->second->pixels.size() * sizeof(uint32_t);
+	entries.erase(iter->second);
+	index.erase(iter);
+	return true;
+}
+
+bool TileCache::contains(uint64_t hash)
+{
+	lock_guard<mutex> lock(cache_mutex);
+	return index.count(hash) > 0;
+}
+
+TileCacheStats TileCache::get_stats()
+{
+	lock_guard<mutex> lock(cache_mutex);
+	return stats;
+}
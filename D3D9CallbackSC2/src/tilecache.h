@@ -0,0 +1,83 @@
+#ifndef _TILECACHE_H
+#define _TILECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+/*
+	Replacement tile cache
+
+	Holds the composed pixels of single tiles of replacement textures (a 128x128 half of a page at RESIZE_FACTOR, as
+	the upper and lower halves are hashed), keyed by the hash of the tile. When a texture matches on a tile that was
+	composed before, compose_replacement copies the tile rows from here instead of decoding its file again, so a new
+	combination of halves costs a memcpy per tile.
+
+	Pixels are kept exactly as they are in the staging image (A8R8G8B8, rows top-down). The cache never holds more
+	than its byte budget; the least recently used tiles go first. It is shared by the loader threads.
+*/
+
+struct TileCacheStats
+{
+	size_t		hits;
+	size_t		misses;
+	size_t		stores;
+	size_t		evictions;		// tiles dropped to stay within the budget
+	size_t		bytes;			// bytes of the tiles held
+};
+
+class TileCache
+{
+private:
+	struct entry_t
+	{
+		uint64_t				hash;
+		uint32_t				width;
+		uint32_t				height;
+		std::vector<uint32_t>	pixels;
+	};
+	typedef std::list<entry_t>::iterator entry_iter;
+
+	std::mutex									cache_mutex;
+	std::list<entry_t>							entries;						// most recent first
+	std::unordered_map<uint64_t, entry_iter>	index;
+	size_t										budget;
+	TileCacheStats								stats;
+
+public:
+	TileCache(size_t budget		// most bytes of tile pixels to hold
+		);
+
+	/* get: copies a tile into an image
+	   returns: true if hash is in the cache at this size, else false
+	*/
+	bool get(uint64_t hash,				// tile hash
+			 uint32_t width,			// size of the tile in the image
+			 uint32_t height,
+			 uint32_t* dest,			// first pixel of the tile in the image
+			 size_t dest_pitch			// pixels per row of the image
+		);
+
+	/* put: stores a tile from an image, evicting the least recently used tiles to make room
+	*/
+	void put(uint64_t hash,				// tile hash
+			 uint32_t width,			// size of the tile in the image
+			 uint32_t height,
+			 const uint32_t* src,		// first pixel of the tile in the image
+			 size_t src_pitch			// pixels per row of the image
+		);
+
+	/* erase: drops a tile whose replacement file or hashmap entry changed, so it is composed again
+	   returns: true if hash was in the cache, else false
+	*/
+	bool erase(uint64_t hash);
+
+	bool contains(uint64_t hash);
+
+	TileCacheStats get_stats();
+};
+
+#endif
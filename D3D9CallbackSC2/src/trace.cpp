@@ -0,0 +1,290 @@
+#include "trace.h"
+#include "murmur2stream.h"
+#include <string.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <thread>
+
+using namespace std;
+
+static const char TRACE_MAGIC[4] = { 'T', 'B', 'T', 'R' };
+static const size_t TRACE_BUFFER = 1 << 20;
+static const chrono::seconds DRAIN_TIMEOUT(30);										// a drain that makes no progress for this long gives up
+
+uint64_t trace_content_hash(const uint8_t* bits, size_t pitch, uint32_t width, uint32_t height)
+{
+	TextureHash::Murmur2::Murmur2State state((uint32_t)((size_t)width * height * sizeof(uint32_t)));
+	bool second = false;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t* row = bits + y * pitch;
+		for (uint32_t x = 0; x < width; x++, second = !second) {
+			uint32_t k;
+			memcpy(&k, row + x * sizeof(uint32_t), sizeof(k));
+			state.mix(k, second);
+		}
+	}
+	uint64_t hash = state.finish();
+	return hash ? hash : 1;																// 0 means no pixels
+}
+
+TraceWriter::TraceWriter(const string& path, uint64_t max_bytes) : buffer(TRACE_BUFFER), started(chrono::steady_clock::now()), bytes(0), max_bytes(max_bytes)
+{
+	file = fopen(path.c_str(), "wb");
+	if (file == NULL) return;
+	setvbuf(file, &buffer[0], _IOFBF, buffer.size());
+	if (fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file) != 1 || fwrite(&TRACE_VERSION, sizeof(TRACE_VERSION), 1, file) != 1) {
+		fclose(file);
+		file = NULL;
+		return;
+	}
+	bytes = sizeof(TRACE_MAGIC) + sizeof(TRACE_VERSION);
+}
+
+TraceWriter::~TraceWriter()
+{
+	if (file) fclose(file);
+}
+
+bool TraceWriter::begin(TraceKind kind, size_t body_bytes)
+{
+	if (file == NULL) return false;
+	if (max_bytes && bytes + sizeof(TraceRecordHeader) + body_bytes > max_bytes) {		// the trace so far stays whole
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+
+	TraceRecordHeader header;
+	header.kind = (uint8_t)kind;
+	header.time = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+	fwrite(&header, sizeof(header), 1, file);
+	bytes += sizeof(header) + body_bytes;
+	return true;
+}
+
+void TraceWriter::unlock(uint64_t handle, uint32_t width, uint32_t height, uint32_t format, uint32_t pool, const uint8_t* bits, size_t pitch)
+{
+	if (file == NULL) return;
+
+	TraceUnlock unlock;
+	unlock.handle = handle;
+	unlock.width = width;
+	unlock.height = height;
+	unlock.format = format;
+	unlock.pool = pool;
+	unlock.content = (bits != NULL && width > 0 && height > 0 && width <= TRACE_MAX_DIM && height <= TRACE_MAX_DIM) ? trace_content_hash(bits, pitch, width, height) : 0;
+
+	if (unlock.content != 0 && contents.count(unlock.content) == 0) {
+		size_t row_bytes = width * sizeof(uint32_t);
+		TracePixels pixels;
+		pixels.content = unlock.content;
+		pixels.width = width;
+		pixels.height = height;
+		if (!begin(TRACE_PIXELS, sizeof(pixels) + row_bytes * height)) return;
+		fwrite(&pixels, sizeof(pixels), 1, file);
+		for (uint32_t y = 0; y < height; y++)
+			fwrite(bits + y * pitch, row_bytes, 1, file);
+		contents.insert(unlock.content);
+	}
+
+	if (begin(TRACE_UNLOCK, sizeof(unlock))) fwrite(&unlock, sizeof(unlock), 1, file);
+}
+
+void TraceWriter::set_texture(uint32_t stage, const uint64_t* handles, uint32_t count)
+{
+	TraceSetTexture set;
+	set.stage = stage;
+	set.count = count;
+	if (!begin(TRACE_SETTEXTURE, sizeof(set) + count * sizeof(uint64_t))) return;
+	fwrite(&set, sizeof(set), 1, file);
+	if (count > 0) fwrite(handles, sizeof(uint64_t), count, file);
+}
+
+void TraceWriter::destroy(uint64_t handle)
+{
+	if (begin(TRACE_DESTROY, sizeof(handle))) fwrite(&handle, sizeof(handle), 1, file);
+}
+
+void TraceWriter::begin_scene()
+{
+	if (begin(TRACE_BEGINSCENE, 0)) fflush(file);										// the DLL is never unloaded cleanly: keep whole scenes on disk
+}
+
+// the locked rect of a TRACE_PIXELS record
+struct trace_pixels_t
+{
+	uint32_t				width;
+	uint32_t				height;
+	vector<uint32_t>		pixels;
+};
+
+bool replay_trace(const string& path, TexturePipeline& pipeline, const ReplayOptions& options, ReplayStats& stats, string& error)
+{
+	stats = ReplayStats();
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL) {
+		error = "could not open " + path;
+		return false;
+	}
+	char magic[4];
+	uint32_t version = 0;
+	if (fread(magic, sizeof(magic), 1, file) != 1 || fread(&version, sizeof(version), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+		fclose(file);
+		error = path + " is not a texture trace";
+		return false;
+	}
+	if (version != TRACE_VERSION) {
+		fclose(file);
+		error = path + " is trace version " + to_string(version) + ", not " + to_string(TRACE_VERSION);
+		return false;
+	}
+
+	// bytes not read yet: the sizes a record gives are checked against it before anything is allocated from them
+	boost::system::error_code ec;
+	uint64_t left = (uint64_t)boost::filesystem::file_size(path, ec);
+	left = (ec || left < sizeof(magic) + sizeof(version)) ? 0 : left - sizeof(magic) - sizeof(version);
+
+	unordered_map<uint64_t, trace_pixels_t> contents;
+	vector<LatencyHistogram> latency(TRACE_KINDS);
+	vector<uint64_t> handles64;
+	vector<HANDLE> handles;
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+	TraceRecordHeader header;
+	while (fread(&header, sizeof(header), 1, file) == 1) {
+		left -= min(left, (uint64_t)sizeof(header));
+		if (header.kind >= TRACE_KINDS) {
+			error = "unknown record kind " + to_string(header.kind);
+			stats.truncated = true;
+			break;
+		}
+		stats.trace_seconds = header.time / 1e9;
+		if (options.paced) this_thread::sleep_until(started + chrono::nanoseconds(header.time));
+
+		// read the whole record before timing it, so the pipeline is timed without file I/O
+		TracePixels pixels;
+		TraceUnlock unlock;
+		TraceSetTexture set;
+		uint64_t handle = 0;
+		bool whole = true;
+		switch (header.kind) {
+		case TRACE_PIXELS:
+			whole = fread(&pixels, sizeof(pixels), 1, file) == 1;
+			left -= min(left, (uint64_t)sizeof(pixels));
+			if (whole && (pixels.width > TRACE_MAX_DIM || pixels.height > TRACE_MAX_DIM || (uint64_t)pixels.width * pixels.height * sizeof(uint32_t) > left)) {
+				error = "corrupt pixels record (" + to_string(pixels.width) + "x" + to_string(pixels.height) + ")";
+				whole = false;
+			}
+			if (whole) {
+				trace_pixels_t& content = contents[pixels.content];
+				content.width = pixels.width;
+				content.height = pixels.height;
+				content.pixels.resize((size_t)pixels.width * pixels.height);
+				whole = content.pixels.empty() || fread(&content.pixels[0], sizeof(uint32_t), content.pixels.size(), file) == content.pixels.size();
+				left -= min(left, (uint64_t)content.pixels.size() * sizeof(uint32_t));
+				stats.pixels_bytes += content.pixels.size() * sizeof(uint32_t);
+			}
+			break;
+		case TRACE_UNLOCK:
+			whole = fread(&unlock, sizeof(unlock), 1, file) == 1;
+			left -= min(left, (uint64_t)sizeof(unlock));
+			break;
+		case TRACE_SETTEXTURE:
+			whole = fread(&set, sizeof(set), 1, file) == 1;
+			left -= min(left, (uint64_t)sizeof(set));
+			if (whole && (uint64_t)set.count * sizeof(uint64_t) > left) {
+				error = "corrupt settexture record (" + to_string(set.count) + " handles)";
+				whole = false;
+			}
+			if (whole) {
+				handles64.resize(set.count);
+				whole = set.count == 0 || fread(&handles64[0], sizeof(uint64_t), set.count, file) == set.count;
+				left -= min(left, (uint64_t)set.count * sizeof(uint64_t));
+				handles.resize(set.count);
+				for (uint32_t i = 0; i < set.count; i++) handles[i] = (HANDLE)(uintptr_t)handles64[i];
+			}
+			break;
+		case TRACE_DESTROY:
+			whole = fread(&handle, sizeof(handle), 1, file) == 1;
+			left -= min(left, (uint64_t)sizeof(handle));
+			break;
+		}
+		if (!whole) {
+			stats.truncated = true;
+			break;
+		}
+
+		if (header.kind == TRACE_PIXELS) {												// not an event of the game's
+			stats.events[TRACE_PIXELS]++;
+			continue;
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		switch (header.kind) {
+		case TRACE_UNLOCK: {
+			const trace_pixels_t* content = NULL;
+			if (unlock.content != 0) {
+				unordered_map<uint64_t, trace_pixels_t>::const_iterator found = contents.find(unlock.content);
+				if (found != contents.end()) content = &found->second;
+			}
+			if (content != NULL && !content->pixels.empty()) {
+				pipeline.unlock((HANDLE)(uintptr_t)unlock.handle, (const uint8_t*)&content->pixels[0], content->width * sizeof(uint32_t), content->width, content->height);
+				stats.bytes_hashed += content->pixels.size() * sizeof(uint32_t);
+			} else {
+				pipeline.unlock((HANDLE)(uintptr_t)unlock.handle, NULL, 0, unlock.width, unlock.height);
+			}
+			break;
+		}
+		case TRACE_SETTEXTURE:
+			if (!handles.empty() && pipeline.replacement(&handles[0], handles.size()) != NULL) stats.replaced++;
+			break;
+		case TRACE_DESTROY:
+			pipeline.destroy((HANDLE)(uintptr_t)handle);
+			break;
+		case TRACE_BEGINSCENE:
+			stats.uploads += pipeline.begin_scene();
+			break;
+		}
+		latency[header.kind].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+		stats.events[header.kind]++;
+	}
+	fclose(file);
+
+	// the game would have kept drawing scenes while the last loads finished
+	chrono::steady_clock::time_point progress = chrono::steady_clock::now();
+	while (options.drain && pipeline.pending() > 0 && chrono::steady_clock::now() - progress < DRAIN_TIMEOUT) {
+		size_t uploaded = pipeline.begin_scene();
+		stats.uploads += uploaded;
+		if (uploaded > 0) progress = chrono::steady_clock::now();
+		else this_thread::sleep_for(chrono::milliseconds(1));
+	}
+
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	for (int i = 0; i < TRACE_KINDS; i++) latency[i].snapshot(stats.latency[i]);
+	if (stats.truncated && error.empty()) error = "the trace ends inside a record";
+	return true;
+}
+
+void print_replay(FILE* out, const string& path, const ReplayStats& stats, bool paced, const TextureCacheStats& cache_stats)
+{
+	fprintf(out, "%s: %llu events over %.1f s recorded, replayed in %.3f s%s\n", path.c_str(), (unsigned long long)stats.total_events(), stats.trace_seconds,
+			stats.seconds, paced ? " (paced)" : "");
+	fprintf(out, "  %.0f events/s, %.1f MB/s of locked rects hashed (%llu MB, %llu MB distinct)\n", stats.total_events() / stats.seconds, (stats.bytes_hashed >> 20) / stats.seconds,
+			(unsigned long long)(stats.bytes_hashed >> 20), (unsigned long long)(stats.pixels_bytes >> 20));
+	fprintf(out, "  %llu replacements created, %llu SetTextures replaced\n", (unsigned long long)stats.uploads, (unsigned long long)stats.replaced);
+	fprintf(out, "  %-12s %10s %10s %10s %10s %10s\n", "event", "count", "mean us", "p50 us", "p99 us", "max us");
+	for (int kind = TRACE_UNLOCK; kind < TRACE_KINDS; kind++) {
+		const HistogramSnapshot& hist = stats.latency[kind];
+		fprintf(out, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", trace_kind_name(kind), (unsigned long long)hist.count, hist.mean() / 1000.0,
+				hist.percentile(0.5) / 1000.0, hist.percentile(0.99) / 1000.0, hist.max / 1000.0);
+	}
+	fprintf(out, "  %-12s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+	for (int stage = 0; stage < STAGE_COUNT; stage++) {
+		HistogramSnapshot hist;
+		Instrument::snapshot((PipelineStage)stage, hist);
+		fprintf(out, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", stage_name(stage), (unsigned long long)hist.count, hist.mean() / 1000.0,
+				hist.percentile(0.5) / 1000.0, hist.percentile(0.99) / 1000.0, hist.max / 1000.0);
+	}
+	fprintf(out, "  cache: %zu textures, %zu MB resident, hit ratio %.3f; %zu evictions\n", cache_stats.entries, cache_stats.bytes_resident >> 20, cache_stats.hit_ratio(),
+			cache_stats.evictions);
+}
@@ -0,0 +1,189 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "pipeline.h"
+#include "instrument.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <chrono>
+
+/*
+	Texture event traces (tonberry\debug\pipeline.trace)
+
+	With record_trace=yes the DLL records every UnlockRect, SetTexture, Destroy, and BeginScene the game reports, so a
+	hitch can be replayed away from the game (ConsoleTesting replay [pipeline.trace] [paced]). A trace is
+		char			magic[4];		// "TBTR"
+		uint32_t		version;		// TRACE_VERSION
+		TraceRecord		records[];
+	where each record is a TraceRecordHeader followed by the body its kind says:
+		TRACE_PIXELS		TracePixels, then width * height A8R8G8B8 pixels, rows top-down without padding
+		TRACE_UNLOCK		TraceUnlock
+		TRACE_SETTEXTURE	TraceSetTexture, then count uint64_t handles
+		TRACE_DESTROY		uint64_t handle
+		TRACE_BEGINSCENE	nothing
+
+	The locked rect of an unlock is stored once per content: TRACE_PIXELS is written the first time a content hash
+	(MurmurHash64B of the pixels) is seen, and every unlock refers to its pixels by that hash. The file is flushed at
+	every BeginScene; a trace cut short by a crash replays up to its last whole record.
+*/
+
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_MAX_DIM = 4096;		// widest and tallest locked rect a TRACE_PIXELS record holds; a larger one is recorded as not locked
+
+enum TraceKind
+{
+	TRACE_PIXELS = 0,
+	TRACE_UNLOCK = 1,
+	TRACE_SETTEXTURE = 2,
+	TRACE_DESTROY = 3,
+	TRACE_BEGINSCENE = 4,
+	TRACE_KINDS
+};
+
+inline const char* trace_kind_name(int kind)
+{
+	static const char* const names[TRACE_KINDS] = { "pixels", "unlock", "settexture", "destroy", "beginscene" };
+	return (kind >= 0 && kind < TRACE_KINDS) ? names[kind] : "?";
+}
+
+#pragma pack(push, 1)
+struct TraceRecordHeader
+{
+	uint8_t		kind;			// TraceKind
+	uint64_t	time;			// ns since recording started
+};
+
+struct TracePixels
+{
+	uint64_t	content;		// MurmurHash64B of the pixels
+	uint32_t	width;
+	uint32_t	height;
+};
+
+// D3DSURFACE_DESC, as far as GlobalContext::UnlockRect reads it
+struct TraceUnlock
+{
+	uint64_t	handle;
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	format;			// D3DFORMAT
+	uint32_t	pool;			// D3DPOOL
+	uint64_t	content;		// TracePixels of the locked rect, or 0 if the texture was not locked (video, other formats)
+};
+
+struct TraceSetTexture
+{
+	uint32_t	stage;
+	uint32_t	count;			// handles that follow
+};
+#pragma pack(pop)
+
+/* trace_content_hash: the content hash of a locked rect
+*/
+uint64_t trace_content_hash(const uint8_t* bits,	// locked rect, A8R8G8B8
+							size_t pitch,			// bytes per row
+							uint32_t width,
+							uint32_t height
+	);
+
+// records texture events; called from the render thread only
+class TraceWriter
+{
+private:
+	FILE*									file;
+	std::vector<char>						buffer;			// stdio buffer, so that most events are a memcpy
+	std::unordered_set<uint64_t>			contents;		// pixels written so far
+	std::chrono::steady_clock::time_point	started;
+	uint64_t								bytes;			// written so far
+	uint64_t								max_bytes;		// recording stops here; 0 for no limit
+
+	/* begin: writes a record header
+	   returns: true if the record fits under max_bytes, else false (and recording stops)
+	*/
+	bool begin(TraceKind kind, size_t body_bytes);
+
+public:
+	TraceWriter(const std::string& path,	// the trace file; overwritten
+				uint64_t max_bytes			// most bytes to record; 0 for no limit
+		);
+	~TraceWriter();
+
+	bool is_open() const { return file != NULL; }
+
+	/* unlock: records an UnlockRect, with its pixels the first time they are seen
+	*/
+	void unlock(uint64_t handle,
+				uint32_t width,
+				uint32_t height,
+				uint32_t format,
+				uint32_t pool,
+				const uint8_t* bits,		// the locked rect, or NULL if it was not locked
+				size_t pitch
+		);
+
+	void set_texture(uint32_t stage, const uint64_t* handles, uint32_t count);
+
+	void destroy(uint64_t handle);
+
+	void begin_scene();
+
+	uint64_t bytes_written() const { return bytes; }
+};
+
+struct ReplayOptions
+{
+	bool		paced;				// wait out the recorded time between events, so loads finish as they did in game
+	bool		drain;				// after the last event, run scenes until every replacement has loaded
+
+	ReplayOptions() : paced(false), drain(true) {}
+};
+
+struct ReplayStats
+{
+	uint64_t			events[TRACE_KINDS];
+	HistogramSnapshot	latency[TRACE_KINDS];		// ns per event, as the pipeline handled it
+	uint64_t			bytes_hashed;				// locked rect bytes handed to the pipeline
+	uint64_t			pixels_bytes;				// distinct pixel bytes in the trace
+	uint64_t			replaced;					// SetTextures that drew a replacement
+	uint64_t			uploads;					// replacements begin_scene took from the loader
+	double				seconds;					// wall time of the replay
+	double				trace_seconds;				// time the recording spans
+	bool				truncated;					// the trace ended inside a record
+
+	ReplayStats() : bytes_hashed(0), pixels_bytes(0), replaced(0), uploads(0), seconds(0), trace_seconds(0), truncated(false)
+	{
+		for (int i = 0; i < TRACE_KINDS; i++) events[i] = 0;
+	}
+
+	uint64_t total_events() const
+	{
+		uint64_t total = 0;
+		for (int i = TRACE_UNLOCK; i < TRACE_KINDS; i++) total += events[i];
+		return total;
+	}
+};
+
+/* replay_trace: feeds a recorded trace through a pipeline
+   returns: true if the trace was read, else false (error says why)
+*/
+bool replay_trace(const std::string& path,			// the trace file
+				  TexturePipeline& pipeline,		// built on a SoftwareTextureDevice
+				  const ReplayOptions& options,
+				  ReplayStats& stats,
+				  std::string& error
+	);
+
+/* print_replay: writes what replay_trace measured, the pipeline stages Instrument timed meanwhile, and the cache stats
+*/
+void print_replay(FILE* out,
+				  const std::string& path,				// the trace file
+				  const ReplayStats& stats,
+				  bool paced,
+				  const TextureCacheStats& cache_stats	// of the cache the pipeline replayed into
+	);
+
+#endif
@@ -0,0 +1,109 @@
+// tonberry_replay: replays a pipeline.trace recorded by the DLL (record_trace in prefs.txt) through TonberryCore, without a game,
+// d3d9, or Windows, and prints the throughput and per-event latency; the Linux counterpart of "ConsoleTesting replay"
+//
+//	tonberry_replay <pipeline.trace> <tonberry folder> <textures folder> [paced]
+
+#include "trace.h"
+#include "hashindex.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string/predicate.hpp>
+#ifdef TONBERRY_HAVE_PNG
+#include <png.h>
+#endif
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// decodes a replacement PNG as the DLL's decode_png leaves it: memory order r, g, b, a, rows bottom-up
+static bool decode_png(const string& path, DecodedImage& image)
+{
+#ifdef TONBERRY_HAVE_PNG
+	png_image png;
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&png, path.c_str())) return false;
+	png.format = PNG_FORMAT_RGBA;
+	if (png.width == 0 || png.height == 0) {
+		png_image_free(&png);
+		return false;
+	}
+
+	image.width = png.width;
+	image.height = png.height;
+	image.pixels.resize((size_t)png.width * png.height);
+	return png_image_finish_read(&png, NULL, &image.pixels[0], -(png_int_32)PNG_IMAGE_ROW_STRIDE(png), NULL) != 0;	// a negative stride stores the rows bottom-up
+#else
+	return false;																			// built without libpng: every replacement fails to load
+#endif
+}
+
+// maps hashmap.idx if it is up to date, else parses the _hm.csv files, as the DLL loads them; the index is not rewritten
+static bool load_fieldmap(const fs::path& tonberry, HashIndex& index, FieldMap& fieldmap)
+{
+	fs::path hashmap_dir(tonberry / "hashmap");
+	if (index.open(tonberry / "hashmap.idx", hashmap_stamp(hashmap_dir))) {
+		fieldmap.attach(&index);
+		return true;
+	}
+
+	boost::system::error_code ec;
+	fs::directory_iterator iter(hashmap_dir, ec), end;
+	if (ec) {
+		fprintf(stderr, "%s: %s\n", hashmap_dir.string().c_str(), ec.message().c_str());
+		return false;
+	}
+	for (; !ec && iter != end; iter.increment(ec)) {
+		boost::system::error_code file_ec;
+		if (!fs::is_regular_file(iter->path(), file_ec) || !boost::iequals(iter->path().extension().string(), ".csv")) continue;
+		vector<string> errors;
+		bool well_formed = read_hashmap_csv(iter->path(), fieldmap, errors);
+		for (size_t i = 0; i < errors.size(); i++) fprintf(stderr, "%s\n", errors[i].c_str());
+		if (!well_formed) return false;
+	}
+	fieldmap.build();
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <pipeline.trace> <tonberry folder> <textures folder> [paced]\n", argv[0]);
+		return 2;
+	}
+	fs::path trace_file(argv[1]), tonberry(argv[2]), textures(argv[3]);
+	bool paced = argc > 4 && strcmp(argv[4], "paced") == 0;
+
+	HashIndex index;
+	FieldMap fieldmap;
+	if (!load_fieldmap(tonberry, index, fieldmap)) return 1;
+#ifndef TONBERRY_HAVE_PNG
+	fprintf(stderr, "warning: built without libpng; no replacement loads, so only hashing, lookups, and the cache are measured\n");
+#endif
+
+	// the DLL's default prefs; no disk cache, so every replacement is decoded, as on a first run
+	SoftwareTextureDevice device;
+	TileCache tiles((size_t)128 << 20);
+	TextureLoader loader(&device, decode_png, 2, (size_t)64 << 20, NULL, &tiles);
+	TextureCache cache(&device, (size_t)512 << 20);
+	PipelineConfig config;
+	config.textures_dir = textures;
+	TexturePipeline pipeline(&cache, &fieldmap, &device, &loader, &tiles, NULL, NULL, config);
+
+	Instrument::reset();
+	Instrument::enabled = true;
+	ReplayOptions options;
+	options.paced = paced;
+	ReplayStats stats;
+	string error;
+	if (!replay_trace(trace_file.string(), pipeline, options, stats, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if (stats.truncated) fprintf(stderr, "warning: %s; replayed up to there.\n", error.c_str());
+
+	print_replay(stdout, trace_file.string(), stats, paced, cache.get_stats());
+	return 0;
+}